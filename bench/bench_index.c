@@ -0,0 +1,72 @@
+/* bench_index.c
+ * Measures the piece table's memory footprint and lookup speed for the index_t width it was built with.
+ * Built once per width by 'make bench' so the two can be compared side by side.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "filebuf.h"
+
+#define BENCH_EDITS 100000
+#define BENCH_LOOKUPS 5000000
+
+static double seconds_since(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+	struct FileBuf fb;
+	filebuf_init(&fb);
+	srand(1);
+
+	// build a fragmented table out of many small scattered edits
+	char text[] = "lorem ipsum\ndolor sit amet\n";
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_EDITS; i++) {
+		index_t index = fb.length == 0 ? 0 : (index_t) rand() % fb.length;
+		filebuf_insert(&fb, text, index, sizeof(text) - 1, 0, 0);
+	}
+	double insert_time = seconds_since(&start);
+
+	// random lookups by file index
+	index_t *indices = malloc(sizeof(index_t) * BENCH_LOOKUPS);
+	for (int i = 0; i < BENCH_LOOKUPS; i++) {
+		indices[i] = (index_t) rand() % fb.length;
+	}
+	unsigned long checksum = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_LOOKUPS; i++) {
+		checksum += filebuf_char_at(&fb, indices[i]);
+	}
+	double lookup_time = seconds_since(&start);
+
+	// random line lookups
+	index_t line_count = filebuf_line_count(&fb);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_LOOKUPS; i++) {
+		index_t offset;
+		filebuf_line_to_offset(&fb, indices[i] % line_count, &offset);
+		checksum += offset;
+	}
+	double line_time = seconds_since(&start);
+
+	printf("index_t: %d bits\n", INDEX_BITS);
+	printf("  sizeof(struct PieceTableEntry): %zu bytes\n", sizeof(struct PieceTableEntry));
+	printf("  sizeof(struct FileEvent):       %zu bytes\n", sizeof(struct FileEvent));
+	struct EntryPoolStats entry_stats;
+	filebuf_entry_stats(&fb, &entry_stats);
+	printf("  entries: %u, file length: %" PRI_INDEX ", entry memory: %zu bytes\n",
+		entry_stats.live_entries, fb.length, entry_stats.bytes);
+	printf("  %d inserts:      %8.2f ns/op\n", BENCH_EDITS, insert_time * 1e9 / BENCH_EDITS);
+	printf("  char lookups:      %8.2f ns/op\n", lookup_time * 1e9 / BENCH_LOOKUPS);
+	printf("  line lookups:      %8.2f ns/op\n", line_time * 1e9 / BENCH_LOOKUPS);
+	printf("  (checksum %lu)\n", checksum);
+
+	free(indices);
+	return 0;
+}
@@ -0,0 +1,730 @@
+/* check_search.c
+ * Checks the searches over a file buffer against a plain search of a flat copy of its text, on a piece table
+ * fragmented by many small scattered edits, so that occurrences are split across entries every which way.
+ * Replacing every occurrence is checked the same way, and regex searches against a backtracking matcher run on random patterns.
+ * Built and run by 'make check'. Exits with a failure status if any result differs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+#include "filebuf.h"
+#include "parallel_search.h"
+#include "regex.h"
+
+#define CHECK_EDITS 70000 // edits the checked table is built from, enough for its text to be split into several ranges
+#define CHECK_QUERIES 100
+#define CHECK_REPLACES 10
+#define HUGE_SPAN_LENGTH (1 << 20) // the near 4 GB text searched is made of spans this long, all of the same text
+#define PATTERN_NODES 512
+#define PATTERN_SIZE 1024
+#define PATTERN_CHILDREN 4
+
+enum pattern_types {
+	PATTERN_CLASS,
+	PATTERN_BOL,
+	PATTERN_EOL,
+	PATTERN_CONCAT, // the children one after the other
+	PATTERN_ALT, // the first of the children that leads to a match
+	PATTERN_REPEAT // the child between min and max times
+};
+
+struct PatternNode {
+	int type; // see pattern_types enum
+	const char *chars; // chars matched by a class
+	struct PatternNode *children[PATTERN_CHILDREN];
+	int count; // number of children
+	int min;
+	int max; // -1 for no limit
+	bool lazy;
+};
+
+// a random regex, both as the pattern string given to regex_compile() and as the tree the reference matcher walks
+struct Pattern {
+	char string[PATTERN_SIZE];
+	int length;
+	struct PatternNode nodes[PATTERN_NODES];
+	int node_count;
+};
+
+// what is left to match once a node has matched: the rest of a concatenation from child 'done',
+// or more of a repetition after 'done' times, then whatever follows that
+struct Continuation {
+	const struct PatternNode *node;
+	int done;
+	const struct Continuation *next;
+};
+
+// the flat text a reference match runs on. Chars before start_index and after end_index are still seen by ^ and $
+struct Reference {
+	const char *text;
+	index_t length;
+	index_t end_index;
+};
+
+static void random_string(char *string, int max_length);
+static char *build_text(struct FileBuf *fb);
+static char *copy_text(struct FileBuf *fb);
+static void reference_search(const char *flat, index_t start_index, index_t end_index, const char *string, struct SearchResults *results);
+static void compare(const char *name, const char *string, const struct SearchResults *results, const struct SearchResults *expected, bool first_only);
+static void check_parallel_search(struct FileBuf *fb, const char *flat);
+static void wait_for_task(struct SearchTask *task, struct SearchResults *results);
+static void check_search_task(struct FileBuf *fb, const char *flat);
+static void check_huge_search(void);
+static struct PatternNode *add_pattern_node(struct Pattern *pattern, int type);
+static void append_pattern(struct Pattern *pattern, const char *string);
+static struct PatternNode *random_class(struct Pattern *pattern);
+static struct PatternNode *random_repeat(struct Pattern *pattern, struct PatternNode *child);
+static struct PatternNode *random_item(struct Pattern *pattern, int depth);
+static struct PatternNode *random_sequence(struct Pattern *pattern, int depth);
+static struct PatternNode *random_alternation(struct Pattern *pattern, int depth);
+static void random_pattern(struct Pattern *pattern);
+static bool match_node(const struct Reference *ref, const struct PatternNode *node, index_t index, const struct Continuation *next, index_t *match_end);
+static bool match_rest(const struct Reference *ref, const struct PatternNode *node, int done, index_t index, const struct Continuation *next, index_t *match_end);
+static bool match_next(const struct Reference *ref, const struct Continuation *next, index_t index, index_t *match_end);
+static bool reference_index_of(const struct Reference *ref, const struct PatternNode *root, index_t start_index, struct FileBufRange *match);
+static bool reference_last_index_of(const struct Reference *ref, const struct PatternNode *root, index_t start_index, struct FileBufRange *match);
+static char *reference_replace(const char *flat, index_t length, const struct FileBufRange *ranges, index_t count, const char *replacement);
+static void compare_match(const char *name, const char *pattern, bool found, index_t index, index_t length, bool expected_found, const struct FileBufRange *expected);
+static void compare_replaced(const char *name, const char *pattern, struct FileBuf *fb, const char *flat, index_t count, const char *expected, index_t expected_count, uint32_t undoable_events);
+static void check_replace_all(struct FileBuf *fb, const char *flat);
+static void check_regex_search(struct FileBuf *fb, const char *flat);
+static void check_regex_replace(struct FileBuf *fb, const char *flat);
+
+static uint32_t failures;
+
+/* Returns a random string of up to max_length chars, from an alphabet small enough that most strings occur. */
+static void random_string(char *string, int max_length) {
+	static const char alphabet[] = "ab\nc";
+	const int length = 1 + rand() % max_length;
+	for (int i = 0; i < length; i++) {
+		string[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+	}
+	string[length] = '\0';
+}
+
+/* Builds the file buffer's text out of many small edits at random places, and returns a flat copy of it. */
+static char *build_text(struct FileBuf *fb) {
+	char text[81];
+	for (int i = 0; i < CHECK_EDITS; i++) {
+		random_string(text, 80);
+		const index_t index = fb->length == 0 ? 0 : (index_t) rand() % fb->length;
+		const index_t removed = rand() % 4 == 0 && index < fb->length ? 1 : 0;
+		filebuf_insert(fb, text, index, strlen(text), 0, removed);
+	}
+	return copy_text(fb);
+}
+
+/* Returns a flat copy of the file buffer's text. */
+static char *copy_text(struct FileBuf *fb) {
+	char *flat = malloc(fb->length + 1);
+	struct FileBufCursor cursor;
+	filebuf_cursor_init(&cursor, fb, 0);
+	index_t copied = 0;
+	index_t length;
+	const char *span;
+	while ((span = filebuf_cursor_next_span(&cursor, &length)) != NULL) {
+		memcpy(flat + copied, span, length);
+		copied += length;
+	}
+	flat[copied] = '\0';
+	return flat;
+}
+
+/* Finds every occurrence of the string wholly within start_index to end_index of the flat text, the slow way. */
+static void reference_search(const char *flat, index_t start_index, index_t end_index, const char *string, struct SearchResults *results) {
+	const index_t string_length = strlen(string);
+	for (index_t i = start_index; i + string_length <= end_index; i++) {
+		if (memcmp(flat + i, string, string_length) != 0) continue;
+		if (results->count == results->size) {
+			results->size = results->size == 0 ? 64 : results->size * 2;
+			results->indices = realloc(results->indices, sizeof(index_t) * results->size);
+		}
+		results->indices[results->count] = i;
+		results->count++;
+	}
+}
+
+/* Counts a failure if the results differ from the expected ones (of which only the first, if first_only). */
+static void compare(const char *name, const char *string, const struct SearchResults *results, const struct SearchResults *expected, bool first_only) {
+	const index_t expected_count = first_only && expected->count > 1 ? 1 : expected->count;
+	bool same = results->count == expected_count;
+	for (index_t i = 0; same && i < expected_count; i++) {
+		same = results->indices[i] == expected->indices[i];
+	}
+	if (!same) {
+		printf("  %s: '%s' found %" PRI_INDEX " occurrences, expected %" PRI_INDEX "\n", name, string, results->count, expected_count);
+		failures++;
+	}
+}
+
+/* Checks filebuf_search_parallel() over random ranges, for both modes. */
+static void check_parallel_search(struct FileBuf *fb, const char *flat) {
+	char string[8];
+	for (int i = 0; i < CHECK_QUERIES; i++) {
+		random_string(string, 7);
+		index_t start_index = (index_t) rand() % fb->length;
+		index_t end_index = (index_t) rand() % (fb->length + 1);
+		if (i % 4 == 0) {
+			start_index = 0;
+			end_index = fb->length; // across every range
+		} else if (end_index < start_index) {
+			const index_t swapped = start_index;
+			start_index = end_index;
+			end_index = swapped;
+		}
+
+		struct SearchResults expected;
+		struct SearchResults results;
+		search_results_init(&expected);
+		search_results_init(&results);
+		reference_search(flat, start_index, end_index, string, &expected);
+		if (!filebuf_search_parallel(fb, start_index, end_index, string, SEARCH_ALL, NULL, &results)) {
+			printf("  search_parallel: '%s' didn't complete\n", string);
+			failures++;
+		}
+		compare("search_parallel (all)", string, &results, &expected, false);
+		search_results_free(&results);
+		filebuf_search_parallel(fb, start_index, end_index, string, SEARCH_FIRST, NULL, &results);
+		compare("search_parallel (first)", string, &results, &expected, true);
+		search_results_free(&results);
+		search_results_free(&expected);
+	}
+}
+
+/* Waits for the task's search to be done and takes its results. */
+static void wait_for_task(struct SearchTask *task, struct SearchResults *results) {
+	struct pollfd wake = {.fd = search_task_wake_fd(task), .events = POLLIN};
+	while (!search_task_take_results(task, results)) {
+		poll(&wake, 1, -1);
+	}
+}
+
+/* Checks searching in the background: that starting a search cancels the one running, that a search sees the text as
+ * it was when started however it is edited meanwhile, and that a cancelled search stops early.
+ */
+static void check_search_task(struct FileBuf *fb, const char *flat) {
+	struct SearchTask task;
+	search_task_init(&task);
+	struct SearchResults expected;
+	struct SearchResults results;
+	search_results_init(&expected);
+	search_results_init(&results);
+
+	// each search cancels the last, so only the last one's results are ever taken
+	char string[8];
+	for (int i = 0; i < 20; i++) {
+		random_string(string, 3);
+		if (!search_task_start(&task, fb, 0, fb->length, string, SEARCH_ALL)) {
+			printf("  search_task: couldn't start\n");
+			failures++;
+			return;
+		}
+	}
+	reference_search(flat, 0, fb->length, string, &expected);
+	wait_for_task(&task, &results);
+	compare("search_task (restarted)", string, &results, &expected, false);
+	search_results_free(&results);
+
+	// edits made while it runs aren't seen by it
+	search_task_start(&task, fb, 0, fb->length, string, SEARCH_ALL);
+	for (int i = 0; i < 1000; i++) {
+		filebuf_insert(fb, string, (index_t) rand() % fb->length, strlen(string), 0, 1);
+	}
+	wait_for_task(&task, &results);
+	compare("search_task (edited meanwhile)", string, &results, &expected, false);
+	search_results_free(&results);
+	search_results_free(&expected);
+
+	// stopping drops whatever it found
+	search_task_start(&task, fb, 0, fb->length, "a", SEARCH_ALL);
+	search_task_stop(&task);
+	if (search_task_wake_fd(&task) != -1 || search_task_take_results(&task, &results)) {
+		printf("  search_task: still running once stopped\n");
+		failures++;
+	}
+	search_task_free(&task);
+
+	// a search cancelled before it starts finds nothing, and says it didn't complete
+	struct SearchCancel cancel;
+	search_cancel_init(&cancel);
+	search_cancel(&cancel);
+	if (filebuf_search_parallel(fb, 0, fb->length, "a", SEARCH_ALL, &cancel, &results) || results.count > 0) {
+		printf("  search_parallel: ran on once cancelled\n");
+		failures++;
+	}
+	search_results_free(&results);
+}
+
+/* Checks searching a snapshot of nearly 4 GB of text, the most a 32 bit index_t allows, where cutting it into ranges
+ * must not wrap around. The snapshot's spans all reference the same text, so it takes no more memory than one of them:
+ * "edle", then the string at needle_index, and "ne" at the end, so it is also found across each pair of spans.
+ */
+static void check_huge_search(void) {
+	static const char string[] = "needle";
+	const index_t needle_index = 1000;
+	char *text = malloc(HUGE_SPAN_LENGTH);
+	memset(text, 'x', HUGE_SPAN_LENGTH);
+	memcpy(text, "edle", 4);
+	memcpy(text + needle_index, string, 6);
+	memcpy(text + HUGE_SPAN_LENGTH - 2, "ne", 2);
+
+	struct FileBufSnapshot snapshot;
+	snapshot.span_count = (uint32_t) (((uint64_t) UINT32_MAX + 1) / HUGE_SPAN_LENGTH);
+	snapshot.spans = malloc(sizeof(struct FileBufSpan) * snapshot.span_count);
+	snapshot.length = 0;
+	for (uint32_t i = 0; i < snapshot.span_count; i++) {
+		snapshot.spans[i].text = text;
+		snapshot.spans[i].length = HUGE_SPAN_LENGTH;
+		snapshot.length += HUGE_SPAN_LENGTH;
+	}
+	snapshot.spans[snapshot.span_count - 1].length--; // so its length still fits, cutting off the "ne" at the end
+	snapshot.length--;
+	snapshot.table = NULL;
+
+	struct SearchResults expected;
+	search_results_init(&expected);
+	expected.size = 2 * snapshot.span_count;
+	expected.indices = malloc(sizeof(index_t) * expected.size);
+	for (uint32_t i = 0; i < snapshot.span_count; i++) {
+		const index_t span_start = (index_t) i * HUGE_SPAN_LENGTH;
+		expected.indices[expected.count++] = span_start + needle_index;
+		if (i < snapshot.span_count - 1) {
+			expected.indices[expected.count++] = span_start + HUGE_SPAN_LENGTH - 2;
+		}
+	}
+
+	struct SearchResults results;
+	search_results_init(&results);
+	search_snapshot(&snapshot, 0, snapshot.length, string, SEARCH_ALL, NULL, &results);
+	compare("search_snapshot (4 GB, all)", string, &results, &expected, false);
+	search_results_free(&results);
+	search_snapshot(&snapshot, 0, snapshot.length, string, SEARCH_FIRST, NULL, &results);
+	compare("search_snapshot (4 GB, first)", string, &results, &expected, true);
+	search_results_free(&results);
+
+	search_results_free(&expected);
+	free(snapshot.spans);
+	free(text);
+}
+
+/* Returns a new node of the pattern's tree, with no children yet. */
+static struct PatternNode *add_pattern_node(struct Pattern *pattern, int type) {
+	struct PatternNode *node = &pattern->nodes[pattern->node_count];
+	pattern->node_count++;
+	memset(node, 0, sizeof(struct PatternNode));
+	node->type = type;
+	return node;
+}
+
+/* Appends to the pattern string. */
+static void append_pattern(struct Pattern *pattern, const char *string) {
+	const int length = strlen(string);
+	memcpy(pattern->string + pattern->length, string, length + 1);
+	pattern->length += length;
+}
+
+/* Returns a random char class. None of them matches every char of the text, which keeps the runs a repetition of one
+ * can match short, and so the reference matcher's recursion shallow.
+ */
+static struct PatternNode *random_class(struct Pattern *pattern) {
+	static const char *const classes[][2] = {
+		{"a", "a"}, {"b", "b"}, {"c", "c"}, {"\\n", "\n"}, {".", "abc"}, {"[ab]", "ab"}, {"[^b]", "ac\n"},
+		{"[a\\n]", "a\n"}, {"[b-c]", "bc"}, {"\\s", "\n"}, {"\\w", "abc"}, {"\\x62", "b"}
+	};
+	const int chosen = rand() % (sizeof(classes) / sizeof(classes[0]));
+	append_pattern(pattern, classes[chosen][0]);
+	struct PatternNode *node = add_pattern_node(pattern, PATTERN_CLASS);
+	node->chars = classes[chosen][1];
+	return node;
+}
+
+/* Appends a random repetition operator, and returns the node repeating the child with it. */
+static struct PatternNode *random_repeat(struct Pattern *pattern, struct PatternNode *child) {
+	struct PatternNode *node = add_pattern_node(pattern, PATTERN_REPEAT);
+	node->children[0] = child;
+	node->count = 1;
+	node->min = rand() % 3;
+	node->max = node->min + rand() % 3;
+	char operator[16];
+	switch (rand() % 6) {
+	case 0:
+		node->min = 0;
+		node->max = -1;
+		strcpy(operator, "*");
+		break;
+	case 1:
+		node->min = 1;
+		node->max = -1;
+		strcpy(operator, "+");
+		break;
+	case 2:
+		node->min = 0;
+		node->max = 1;
+		strcpy(operator, "?");
+		break;
+	case 3:
+		node->max = node->min;
+		sprintf(operator, "{%d}", node->min);
+		break;
+	case 4:
+		node->max = -1;
+		sprintf(operator, "{%d,}", node->min);
+		break;
+	default:
+		sprintf(operator, "{%d,%d}", node->min, node->max);
+		break;
+	}
+	append_pattern(pattern, operator);
+	node->lazy = rand() % 3 == 0;
+	if (node->lazy) {
+		append_pattern(pattern, "?");
+	}
+	return node;
+}
+
+/* Appends a random anchor, class or group, possibly repeated.
+ * What is repeated can't match empty (so the reference matcher can't loop) and has no alternation.
+ */
+static struct PatternNode *random_item(struct Pattern *pattern, int depth) {
+	const int kind = rand() % 10;
+	if (kind == 0) {
+		const bool bol = rand() % 2 == 0;
+		append_pattern(pattern, bol ? "^" : "$");
+		return add_pattern_node(pattern, bol ? PATTERN_BOL : PATTERN_EOL);
+	}
+	if (kind <= 2) {
+		append_pattern(pattern, rand() % 2 == 0 ? "(" : "(?:");
+		if (depth == 0 && rand() % 2 == 0) {
+			struct PatternNode *node = random_alternation(pattern, depth + 1);
+			append_pattern(pattern, ")");
+			return node;
+		}
+		struct PatternNode *node = add_pattern_node(pattern, PATTERN_CONCAT);
+		node->count = 1 + rand() % 3;
+		for (int i = 0; i < node->count; i++) {
+			node->children[i] = random_class(pattern);
+		}
+		append_pattern(pattern, ")");
+		return random_repeat(pattern, node);
+	}
+	struct PatternNode *node = random_class(pattern);
+	return rand() % 3 == 0 ? random_repeat(pattern, node) : node;
+}
+
+/* Appends a random concatenation of items. */
+static struct PatternNode *random_sequence(struct Pattern *pattern, int depth) {
+	struct PatternNode *node = add_pattern_node(pattern, PATTERN_CONCAT);
+	node->count = 1 + rand() % PATTERN_CHILDREN;
+	for (int i = 0; i < node->count; i++) {
+		node->children[i] = random_item(pattern, depth);
+	}
+	return node;
+}
+
+/* Appends a random alternation of one or two sequences. */
+static struct PatternNode *random_alternation(struct Pattern *pattern, int depth) {
+	struct PatternNode *node = add_pattern_node(pattern, PATTERN_ALT);
+	node->count = rand() % 3 == 0 ? 2 : 1;
+	for (int i = 0; i < node->count; i++) {
+		if (i > 0) {
+			append_pattern(pattern, "|");
+		}
+		node->children[i] = random_sequence(pattern, depth);
+	}
+	return node;
+}
+
+/* Makes a random pattern, its root being nodes[0]. */
+static void random_pattern(struct Pattern *pattern) {
+	pattern->length = 0;
+	pattern->node_count = 0;
+	random_alternation(pattern, 0);
+}
+
+/* Matches the node at the index, then what follows it. Alternatives are tried in order of priority, and the first
+ * that leads to a match wins, which is what leftmost-first means.
+ * match_end - set to where the whole match ends.
+ */
+static bool match_node(const struct Reference *ref, const struct PatternNode *node, index_t index, const struct Continuation *next, index_t *match_end) {
+	switch (node->type) {
+	case PATTERN_CLASS:
+		return index < ref->end_index && strchr(node->chars, ref->text[index]) != NULL && match_next(ref, next, index + 1, match_end);
+	case PATTERN_BOL:
+		return (index == 0 || ref->text[index - 1] == '\n') && match_next(ref, next, index, match_end);
+	case PATTERN_EOL:
+		return (index == ref->length || ref->text[index] == '\n') && match_next(ref, next, index, match_end);
+	case PATTERN_ALT:
+		for (int i = 0; i < node->count; i++) {
+			if (match_node(ref, node->children[i], index, next, match_end)) return true;
+		}
+		return false;
+	default:
+		return match_rest(ref, node, 0, index, next, match_end);
+	}
+}
+
+/* Matches the rest of a concatenation from its child 'done', or more of a repetition after 'done' times. */
+static bool match_rest(const struct Reference *ref, const struct PatternNode *node, int done, index_t index, const struct Continuation *next, index_t *match_end) {
+	const struct Continuation rest = {.node = node, .done = done + 1, .next = next};
+	if (node->type == PATTERN_CONCAT) {
+		if (done == node->count) return match_next(ref, next, index, match_end);
+		return match_node(ref, node->children[done], index, &rest, match_end);
+	}
+
+	const bool more = node->max < 0 || done < node->max;
+	const bool enough = done >= node->min;
+	if (node->lazy) {
+		if (enough && match_next(ref, next, index, match_end)) return true;
+		return more && match_node(ref, node->children[0], index, &rest, match_end);
+	}
+	if (more && match_node(ref, node->children[0], index, &rest, match_end)) return true;
+	return enough && match_next(ref, next, index, match_end);
+}
+
+/* Matches what follows, or ends the match if nothing does. */
+static bool match_next(const struct Reference *ref, const struct Continuation *next, index_t index, index_t *match_end) {
+	if (next == NULL) {
+		*match_end = index;
+		return true;
+	}
+	return match_rest(ref, next->node, next->done, index, next->next, match_end);
+}
+
+/* Finds the match starting first between start_index and the reference's end_index, the slow way. */
+static bool reference_index_of(const struct Reference *ref, const struct PatternNode *root, index_t start_index, struct FileBufRange *match) {
+	index_t match_end;
+	for (index_t i = start_index; i <= ref->end_index; i++) {
+		if (match_node(ref, root, i, NULL, &match_end)) {
+			match->index = i;
+			match->length = match_end - i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Finds the match starting last between start_index and the reference's end_index, the slow way. */
+static bool reference_last_index_of(const struct Reference *ref, const struct PatternNode *root, index_t start_index, struct FileBufRange *match) {
+	index_t match_end;
+	for (index_t i = ref->end_index + 1; i-- > start_index;) {
+		if (match_node(ref, root, i, NULL, &match_end)) {
+			match->index = i;
+			match->length = match_end - i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Returns a copy of the flat text with the ranges, which are in order and don't overlap, replaced. */
+static char *reference_replace(const char *flat, index_t length, const struct FileBufRange *ranges, index_t count, const char *replacement) {
+	const index_t replacement_length = strlen(replacement);
+	char *replaced = malloc(length + (size_t) count * replacement_length + 1);
+	index_t copied = 0;
+	index_t index = 0;
+	for (index_t i = 0; i < count; i++) {
+		memcpy(replaced + copied, flat + index, ranges[i].index - index);
+		copied += ranges[i].index - index;
+		memcpy(replaced + copied, replacement, replacement_length);
+		copied += replacement_length;
+		index = ranges[i].index + ranges[i].length;
+	}
+	memcpy(replaced + copied, flat + index, length - index);
+	replaced[copied + length - index] = '\0';
+	return replaced;
+}
+
+/* Counts a failure if the match found differs from the expected one. */
+static void compare_match(const char *name, const char *pattern, bool found, index_t index, index_t length, bool expected_found, const struct FileBufRange *expected) {
+	if (found != expected_found || found && (index != expected->index || length != expected->length)) {
+		printf("  %s: '%s' found ", name, pattern);
+		if (found) {
+			printf("%" PRI_INDEX " (length %" PRI_INDEX "), expected ", index, length);
+		} else {
+			printf("nothing, expected ");
+		}
+		if (expected_found) {
+			printf("%" PRI_INDEX " (length %" PRI_INDEX ")\n", expected->index, expected->length);
+		} else {
+			printf("nothing\n");
+		}
+		failures++;
+	}
+}
+
+/* Counts a failure if replacing didn't give the expected text and count, or if undoing it doesn't give back the flat text.
+ * undoable_events - as there were before replacing
+ */
+static void compare_replaced(const char *name, const char *pattern, struct FileBuf *fb, const char *flat, index_t count, const char *expected, index_t expected_count, uint32_t undoable_events) {
+	char *replaced = copy_text(fb);
+	if (count != expected_count || strcmp(replaced, expected) != 0) {
+		printf("  %s: '%s' replaced %" PRI_INDEX " matches, expected %" PRI_INDEX "%s\n", name, pattern, count, expected_count,
+			strcmp(replaced, expected) != 0 ? ", and the text differs" : "");
+		failures++;
+	}
+	free(replaced);
+
+	// the whole replacement is a single change, and none at all if it left the text as is (empty matches replaced with nothing)
+	struct FileBufHistoryStats stats;
+	filebuf_history_stats(fb, &stats);
+	if (stats.undoable_events > undoable_events + 1) {
+		printf("  %s: '%s' made %" PRIu32 " changes\n", name, pattern, stats.undoable_events - undoable_events);
+		failures++;
+	}
+	if (stats.undoable_events > undoable_events) {
+		filebuf_undo(fb, NULL);
+	}
+	char *undone = copy_text(fb);
+	if (strcmp(undone, flat) != 0) {
+		printf("  %s: '%s' isn't undone\n", name, pattern);
+		failures++;
+	}
+	free(undone);
+}
+
+/* Checks filebuf_replace_all() for random strings, against every occurrence found left to right without overlapping. */
+static void check_replace_all(struct FileBuf *fb, const char *flat) {
+	char string[8];
+	for (int i = 0; i < CHECK_REPLACES; i++) {
+		random_string(string, 4);
+		char replacement[4] = "";
+		if (i % 2 == 0) {
+			random_string(replacement, 3);
+		}
+
+		struct SearchResults occurrences;
+		search_results_init(&occurrences);
+		reference_search(flat, 0, fb->length, string, &occurrences);
+		const index_t string_length = strlen(string);
+		struct FileBufRange *ranges = malloc(sizeof(struct FileBufRange) * (occurrences.count == 0 ? 1 : occurrences.count));
+		index_t expected_count = 0;
+		for (index_t j = 0; j < occurrences.count; j++) {
+			if (expected_count > 0 && occurrences.indices[j] < ranges[expected_count - 1].index + string_length) continue; // overlaps the last one
+			ranges[expected_count].index = occurrences.indices[j];
+			ranges[expected_count].length = string_length;
+			expected_count++;
+		}
+		char *expected = reference_replace(flat, fb->length, ranges, expected_count, replacement);
+		free(ranges);
+		search_results_free(&occurrences);
+
+		struct FileBufHistoryStats stats;
+		filebuf_history_stats(fb, &stats);
+		const index_t count = filebuf_replace_all(fb, string, replacement);
+		compare_replaced("replace_all", string, fb, flat, count, expected, expected_count, stats.undoable_events);
+		free(expected);
+	}
+}
+
+/* Checks regex_index_of() and regex_last_index_of() over random ranges, for random patterns. */
+static void check_regex_search(struct FileBuf *fb, const char *flat) {
+	static struct Pattern pattern;
+	for (int i = 0; i < CHECK_QUERIES; i++) {
+		random_pattern(&pattern);
+		struct Regex re;
+		if (!regex_compile(&re, pattern.string)) {
+			printf("  regex_compile: '%s' didn't compile\n", pattern.string);
+			failures++;
+			continue;
+		}
+
+		index_t start_index = (index_t) rand() % fb->length;
+		index_t end_index = (index_t) rand() % (fb->length + 1);
+		if (i % 4 == 0) {
+			start_index = 0;
+			end_index = fb->length;
+		} else if (end_index < start_index) {
+			const index_t swapped = start_index;
+			start_index = end_index;
+			end_index = swapped;
+		}
+		const struct Reference ref = {.text = flat, .length = fb->length, .end_index = end_index};
+
+		struct FileBufRange expected;
+		index_t index = 0;
+		index_t length = 0;
+		bool expected_found = reference_index_of(&ref, &pattern.nodes[0], start_index, &expected);
+		bool found = regex_index_of(&re, fb, start_index, end_index, &index, &length);
+		compare_match("regex_index_of", pattern.string, found, index, length, expected_found, &expected);
+
+		expected_found = reference_last_index_of(&ref, &pattern.nodes[0], start_index, &expected);
+		found = regex_last_index_of(&re, fb, start_index, end_index, &index, &length);
+		compare_match("regex_last_index_of", pattern.string, found, index, length, expected_found, &expected);
+		regex_free(&re);
+	}
+}
+
+/* Checks regex_replace_all() for random patterns, finding the matches to replace the way it is documented to. */
+static void check_regex_replace(struct FileBuf *fb, const char *flat) {
+	static struct Pattern pattern;
+	const struct Reference ref = {.text = flat, .length = fb->length, .end_index = fb->length};
+	for (int i = 0; i < CHECK_REPLACES; i++) {
+		random_pattern(&pattern);
+		struct Regex re;
+		if (!regex_compile(&re, pattern.string)) {
+			printf("  regex_compile: '%s' didn't compile\n", pattern.string);
+			failures++;
+			continue;
+		}
+		char replacement[4] = "";
+		if (i % 2 == 0) {
+			random_string(replacement, 3);
+		}
+
+		struct FileBufRange *ranges = NULL;
+		index_t expected_count = 0;
+		index_t size = 0;
+		index_t index = 0;
+		struct FileBufRange match;
+		while (index <= ref.length && reference_index_of(&ref, &pattern.nodes[0], index, &match)) {
+			if (expected_count == size) {
+				size = size == 0 ? 64 : size * 2;
+				ranges = realloc(ranges, sizeof(struct FileBufRange) * size);
+			}
+			ranges[expected_count] = match;
+			expected_count++;
+			index = match.index + match.length;
+			if (match.length == 0) {
+				if (index == ref.length) break;
+				index++; // an empty match is followed by the next char
+			}
+		}
+		char *expected = reference_replace(flat, ref.length, ranges, expected_count, replacement);
+		free(ranges);
+
+		struct FileBufHistoryStats stats;
+		filebuf_history_stats(fb, &stats);
+		const index_t count = regex_replace_all(&re, fb, replacement);
+		compare_replaced("regex_replace_all", pattern.string, fb, flat, count, expected, expected_count, stats.undoable_events);
+		free(expected);
+		regex_free(&re);
+	}
+}
+
+int main() {
+	struct FileBuf fb;
+	filebuf_init(&fb);
+	srand(1);
+	char *flat = build_text(&fb);
+	struct EntryPoolStats stats;
+	filebuf_entry_stats(&fb, &stats);
+	printf("checking searches over %" PRI_INDEX " chars in %" PRIu32 " entries\n", fb.length, stats.live_entries);
+
+	check_parallel_search(&fb, flat);
+	check_replace_all(&fb, flat);
+	check_regex_search(&fb, flat);
+	check_regex_replace(&fb, flat);
+	check_search_task(&fb, flat); // edits the text, so last
+	free(flat);
+	check_huge_search();
+
+	if (failures > 0) {
+		printf("%" PRIu32 " checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("all passed\n");
+	return EXIT_SUCCESS;
+}
@@ -8,6 +8,13 @@
 #ifndef __CONFIG_H__
 #define __CONFIG_H__
 
-#define ARCH_BITS 64	// change to 32 if compiling for 32 bit architecture system
+// width of index_t, the type used for every position and length within a file.
+// 32 keeps the piece table compact but limits files to 4 GB; build with 64 (e.g. make INDEX_BITS=64) for larger files.
+#ifndef INDEX_BITS
+#define INDEX_BITS 32
+#endif
+
+#define TAB_WIDTH 4 // columns between tab stops
+#define WRAP_LINES true // whether windows start out wrapping lines wider than them onto the rows below, rather than scrolling sideways
 
 #endif
@@ -5,27 +5,94 @@
  * author: Andrew Klinge
  */
 
+#define _GNU_SOURCE // copy_file_range()
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/stat.h>
 #include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
+#include <errno.h>
 
 #include "filebuf.h"
+#include "search.h"
 #include "config.h"
+#include "os.h"
+#include "utf8.h"
 
 #define INIT_BUF_SIZE 8192 // don't go much smaller than this
+#define DEFAULT_HISTORY_BUDGET (64 << 20) // bytes
+#define DEFRAG_COPY_SIZE (64 << 10) // max chars copied at once while compacting, so time slices stay short
+#define CURSOR_MAX_STEPS 16 // entries a cursor seek steps through before looking the index up from the root instead
+#define COPY_RANGE_MIN_SIZE (64 << 10) // origin ranges at least this long are copied file to file by the kernel when saving
+#define SCAN_BLOCK_SIZE (64 << 10) // the file read in is validated and indexed a block at a time, so it's read from memory once
+
+// entries being built in file order, linked as a list only until they are made into a tree
+struct EntryList {
+	struct PieceTableEntry *first;
+	struct PieceTableEntry *last;
+	uint32_t count;
+};
 
 static struct FileEvent *next_event(struct FileBuf *fb);
 static struct PieceTableEntry *next_entry(struct PieceTable *table);
 
 static void delete_entry(struct PieceTable *table, struct PieceTableEntry *entry);
-static void filebuf_defragment(struct FileBuf *fb);
+static void delete_tree(struct PieceTable *table, struct PieceTableEntry *root);
+static void remove_entry(struct PieceTable *table, struct PieceTableEntry *entry);
 static void erase_redo_history(struct FileBuf *fb);
+static void trim_history(struct FileBuf *fb);
+static struct PieceTableEntry *detach_range(struct PieceTable *table, index_t index, index_t length);
+static void attach_tree(struct PieceTable *table, index_t index, struct PieceTableEntry *tree);
+static void new_modify_chunk(struct PieceTable *table);
+static void free_modify_chunk(struct PieceTable *table, uint32_t slot);
+static void free_unreferenced_chunks(struct PieceTable *table);
+static index_t append_modify_text(struct PieceTable *table, const char *text, index_t length);
+static void release_modify_text(struct PieceTable *table, index_t start, index_t length);
+static void stream_claim(struct PieceTable *table, struct FileBufStream *stream, index_t start, index_t length, index_t newlines);
+static void stream_append(struct PieceTable *table, struct FileBufStream *stream, const char *text, index_t length);
+static struct PieceTableEntry *new_modify_tree(struct PieceTable *table, const char *text, index_t length);
+static void insert_tree(struct FileBuf *fb, struct PieceTableEntry *inserted, index_t index, index_t length, index_t removed_length);
+static void append_new_entry(struct PieceTable *table, struct EntryList *list, bool buf_id, index_t start, index_t length, index_t newlines);
+static void append_text_entries(struct PieceTable *table, struct EntryList *list, const char *text, index_t length);
+static bool edits_valid(struct FileBuf *fb, const struct FileBufEdit *edits, index_t count, bool *changed);
+static void edit_span(struct FileBuf *fb, int event_id, const struct FileBufEdit *edits, index_t count);
+static void apply_change(struct FileBuf *fb, const char *text, index_t index, index_t length, index_t removed_length);
+static void record_change(struct FileBuf *fb, index_t index, index_t removed_length, index_t added_length);
+static void copy_text(struct FileBuf *fb, index_t file_index, index_t length, char *dest);
+static void journal_undo_redo(struct FileBuf *fb, uint32_t type, struct FileEvent *event, uint32_t event_index);
+static bool replay_replace(struct FileBuf *fb, const struct JournalRecord *record, const char *text);
+static bool replay_batch(struct FileBuf *fb, const struct JournalRecord *record, const char *text);
+static bool replay_record(void *arg, const struct JournalRecord *record, const char *text);
+static void cursor_lookup(struct FileBufCursor *cursor);
+
+static void line_index_init(struct LineIndex *lines);
+static void line_index_append(struct LineIndex *lines, const char *buf, index_t buf_index, index_t length);
+static void scan_origin(struct PieceTable *table);
+static index_t line_index_lower_bound(struct LineIndex *lines, index_t buf_index);
+static struct LineIndex *lines_of(struct PieceTable *table, bool buf_id, index_t start, index_t *offset);
+static index_t count_newlines(struct PieceTable *table, bool buf_id, index_t start, index_t length);
+
+static inline void update_entry(struct PieceTableEntry *entry);
+static void update_ancestors(struct PieceTableEntry *entry);
+static struct PieceTableEntry *tree_merge(struct PieceTableEntry *left, struct PieceTableEntry *right);
+static void tree_split(struct PieceTable *table, struct PieceTableEntry *root, index_t split_index, struct PieceTableEntry **left, struct PieceTableEntry **right);
+static struct PieceTableEntry *tree_first(struct PieceTableEntry *root);
+static struct PieceTableEntry *tree_last(struct PieceTableEntry *root);
+static struct PieceTableEntry *tree_build(struct PieceTableEntry *first, uint32_t count);
+static void update_tree(struct PieceTableEntry *root);
+static struct PieceTableEntry *split_entry(struct PieceTable *table, struct PieceTableEntry *entry, index_t relative_split_index);
 
-static inline void link_entry_before(struct PieceTableEntry *ref, struct PieceTableEntry *entry);
 static inline void link_entry_after(struct PieceTableEntry *ref, struct PieceTableEntry *entry);
-static inline void unlink_entry(struct PieceTableEntry *entry);
+
+static void defrag_reset(struct Defrag *defrag);
+static bool defrag_coalesce(struct FileBuf *fb, uint64_t deadline);
+static bool defrag_compact(struct FileBuf *fb, uint64_t deadline);
+static void defrag_gather(struct PieceTable *table, struct Defrag *defrag, struct PieceTableEntry *root);
 
 /* Initializes the file buffer to empty. 
  * Should be called before using a new file buffer elsewhere.
@@ -36,20 +103,122 @@ void filebuf_init(struct FileBuf *fb) {
 	fb->history_index = 0;
 	fb->history_size = INIT_BUF_SIZE;
 	fb->history = malloc(sizeof(struct FileEvent) * fb->history_size);
+	fb->history_entries = 0;
+	fb->history_text_length = 0;
+	fb->history_budget = DEFAULT_HISTORY_BUDGET;
+	fb->journal_base = 0;
+	journal_init(&fb->journal);
+	fb->watcher_count = 0;
 	fb->length = 0;
 
 	struct PieceTable table;
 	table.origin_buf = NULL;
 	table.origin_buf_size = 0;
-	table.modify_buf = malloc(sizeof(char) * INIT_BUF_SIZE);
-	table.modify_buf_size = INIT_BUF_SIZE;
-	table.modify_buf_count = 0;
-	table.entries_count = 0;
-	table.entries_size = INIT_BUF_SIZE;
-	table.entries = malloc(sizeof(struct PieceTableEntry) * table.entries_size);
-	table.free_entries = NULL;
+	table.origin_buf_mapped = false;
+	table.origin_utf8 = true;
+	table.origin_fd = -1;
+	table.modify_chunks = NULL;
+	table.modify_slots = 0;
+	table.modify_tail = 0;
+	table.entry_pool.chunks = NULL;
+	table.entry_pool.free_entries = NULL;
+	table.entry_pool.chunk_count = 0;
+	table.entry_pool.chunk_used = ENTRY_CHUNK_SIZE; // so the first chunk is allocated on first use
+	table.entry_pool.live_count = 0;
+	table.entry_pool.free_count = 0;
+	line_index_init(&table.origin_lines);
+	table.root = NULL;
 	table.first_entry = NULL;
+	table.priority_seed = 2463534242;
+	table.generation = 0;
+	table.snapshots = 0;
+	table.unfreed_chunks = false;
 	fb->table = table;
+
+	fb->defrag.entries = NULL;
+	fb->defrag.starts = NULL;
+	fb->defrag.generation = 0;
+	fb->defrag.phase = DEFRAG_PHASE_DONE; // nothing to do for an empty table
+}
+
+/* Initializes the line index to empty. */
+static void line_index_init(struct LineIndex *lines) {
+	lines->count = 0;
+	lines->size = INIT_BUF_SIZE;
+	lines->offsets = malloc(sizeof(index_t) * lines->size);
+}
+
+/* Records the new-lines found in buf between buf_index and buf_index + length.
+ * Must be called in order of increasing buf_index, since the index stays sorted by only appending.
+ */
+static void line_index_append(struct LineIndex *lines, const char *buf, index_t buf_index, index_t length) {
+	const char *at = buf + buf_index;
+	const char *end = at + length;
+	while ((at = memchr(at, '\n', end - at)) != NULL) {
+		if (lines->count == lines->size) {
+			lines->size *= 2;
+			lines->offsets = realloc(lines->offsets, sizeof(index_t) * lines->size);
+		}
+		lines->offsets[lines->count] = at - buf;
+		lines->count++;
+		at++;
+	}
+}
+
+/* Indexes the new-lines of the origin buffer and checks whether it is valid UTF-8, in a single pass over it:
+ * each block is validated while still in cache from being indexed. Blocks end before a continuation byte,
+ * so no char is cut in two (one cut off anyway is invalid either way).
+ */
+static void scan_origin(struct PieceTable *table) {
+	const char *buf = table->origin_buf;
+	const index_t length = table->origin_buf_size;
+	table->origin_utf8 = true;
+	index_t block_start = 0;
+	while (block_start < length) {
+		index_t block_end = length - block_start > SCAN_BLOCK_SIZE ? block_start + SCAN_BLOCK_SIZE : length;
+		for (int i = 1; i < UTF8_MAX_LENGTH && block_end < length && (buf[block_end] & 0xC0) == 0x80; i++) {
+			block_end--;
+		}
+		line_index_append(&table->origin_lines, buf, block_start, block_end - block_start);
+		if (table->origin_utf8) {
+			table->origin_utf8 = utf8_validate(buf + block_start, block_end - block_start);
+		}
+		block_start = block_end;
+	}
+}
+
+/* Returns the position within the line index of the first new-line at or after buf_index. */
+static index_t line_index_lower_bound(struct LineIndex *lines, index_t buf_index) {
+	index_t low = 0;
+	index_t high = lines->count;
+	while (low < high) {
+		index_t mid = low + (high - low) / 2;
+		if (lines->offsets[mid] < buf_index) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/* Returns the line index covering the text at the start index within a buffer,
+ * and sets offset to where that text is within the line index (the chunk's own index for modify text).
+ */
+static struct LineIndex *lines_of(struct PieceTable *table, bool buf_id, index_t start, index_t *offset) {
+	if (buf_id == BUF_ID_ORIGIN) {
+		*offset = start;
+		return &table->origin_lines;
+	}
+	*offset = start & (MODIFY_CHUNK_SIZE - 1);
+	return &table->modify_chunks[start >> MODIFY_CHUNK_BITS]->lines;
+}
+
+/* Returns the number of new-lines within the given range of a buffer in O(log n). */
+static index_t count_newlines(struct PieceTable *table, bool buf_id, index_t start, index_t length) {
+	index_t offset;
+	struct LineIndex *lines = lines_of(table, buf_id, start, &offset);
+	return line_index_lower_bound(lines, offset + length) - line_index_lower_bound(lines, offset);
 }
 
 /* Gets the next memory location for a new event in the given file buffer. */
@@ -67,56 +236,114 @@ static struct FileEvent *next_event(struct FileBuf *fb) {
 	return event;
 }
 
-/* Gets the next memory location for a new entry in the given table.
- * WARNING: memory is not cleared, so make sure to fully initialize.
+/* Gets the next memory location for a new entry in the given table, reusing a freed entry if there is one. O(1).
+ * Entries never move once allocated. The entry is given a fresh tree priority and no links; everything else must still be initialized.
  */
 static struct PieceTableEntry *next_entry(struct PieceTable *table) {
-	if (table->free_entries != NULL) {
-		struct PieceTableEntry *entry = table->free_entries;
-		table->free_entries = entry->next;
-		return entry;
+	struct EntryPool *pool = &table->entry_pool; // alias
+	struct PieceTableEntry *entry;
+	if (pool->free_entries != NULL) {
+		entry = pool->free_entries;
+		pool->free_entries = entry->next;
+		pool->free_count--;
+	} else {
+		if (pool->chunk_used == ENTRY_CHUNK_SIZE) {
+			// cache line aligned (aligned_alloc() requires the size to be a multiple of the alignment)
+			struct EntryChunk *chunk = aligned_alloc(64, (sizeof(struct EntryChunk) + 63) & ~(size_t) 63);
+			if (chunk == NULL) {
+				fprintf(stderr, "Out of memory for piece table entries!\n");
+				exit(EXIT_FAILURE);
+			}
+			chunk->next = pool->chunks;
+			pool->chunks = chunk;
+			pool->chunk_count++;
+			pool->chunk_used = 0;
+		}
+		entry = &pool->chunks->entries[pool->chunk_used];
+		pool->chunk_used++;
 	}
+	pool->live_count++;
 
-	if (table->entries_count == table->entries_size) {
-		table->entries_size *= 2;
-		table->entries = realloc(table->entries, sizeof(struct PieceTableEntry) * table->entries_size);
-	}
+	// xorshift32
+	uint32_t x = table->priority_seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	table->priority_seed = x;
 
-	struct PieceTableEntry *entry = &table->entries[table->entries_count];
-	table->entries_count++;
+	entry->priority = x;
+	entry->prev = NULL;
+	entry->next = NULL;
+	entry->parent = NULL;
+	entry->left = NULL;
+	entry->right = NULL;
 	return entry;
 }
 
-/* Marks the memory within the table used by the entry as free and unlinks it from the piece table.
- * entry - MUST be a pointer to memory within table->entries
+/* Marks the memory within the table used by the entry as free for reuse. O(1).
+ * The entry must already have been removed from the tree and linked list.
+ * entry - MUST have come from next_entry() on the same table
  */
 static void delete_entry(struct PieceTable *table, struct PieceTableEntry *entry) {
-	unlink_entry(entry);
-	entry->next = NULL;
-	if (table->free_entries == NULL) {
-		table->free_entries = entry;
-		entry->prev = NULL;
-	} else {
-		table->free_entries->next = entry;
-		entry->prev = table->free_entries;
-		table->free_entries = entry;
+	struct EntryPool *pool = &table->entry_pool; // alias
+	entry->next = pool->free_entries;
+	pool->free_entries = entry;
+	pool->free_count++;
+	pool->live_count--;
+}
+
+/* Fills in the stats with the current memory usage of the table's entries. */
+void filebuf_entry_stats(struct FileBuf *fb, struct EntryPoolStats *stats) {
+	struct EntryPool *pool = &fb->table.entry_pool; // alias
+	stats->bytes = pool->chunk_count * ((sizeof(struct EntryChunk) + 63) & ~(size_t) 63);
+	stats->live_entries = pool->live_count;
+	stats->free_entries = pool->free_count;
+	stats->chunks = pool->chunk_count;
+}
+
+/* Marks every entry in the detached subtree as free, along with the modify text they reference. */
+static void delete_tree(struct PieceTable *table, struct PieceTableEntry *root) {
+	if (root == NULL) return;
+	delete_tree(table, root->left);
+	delete_tree(table, root->right);
+	if (root->buf_id == BUF_ID_MODIFY) {
+		release_modify_text(table, root->start, root->length);
 	}
+	delete_entry(table, root);
 }
 
-/* Inserts the entry (2nd arg) into the linked list of entries before the reference entry (1st arg). 
- * Entry cannot already be in the list, call unlink_entry() first before re-inserting.
+/* Unlinks the entry from the tree and the list, then frees it. Takes O(log n) for n entries.
+ * Does not free the text it references, which is assumed to have been handed to another entry.
  */
-static inline void link_entry_before(struct PieceTableEntry *ref, struct PieceTableEntry *entry) {
-	if (ref->prev != NULL) {
-		ref->prev->next = entry;
+static void remove_entry(struct PieceTable *table, struct PieceTableEntry *entry) {
+	// its children take its place
+	struct PieceTableEntry *parent = entry->parent;
+	struct PieceTableEntry *replacement = tree_merge(entry->left, entry->right);
+	if (replacement != NULL) {
+		replacement->parent = parent;
+	}
+	if (parent == NULL) {
+		table->root = replacement;
+	} else if (parent->left == entry) {
+		parent->left = replacement;
+	} else {
+		parent->right = replacement;
+	}
+	update_ancestors(parent);
+
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		table->first_entry = entry->next;
+	}
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
 	}
-	entry->prev = ref->prev;
-	ref->prev = entry;
-	entry->next = ref;
+	delete_entry(table, entry);
 }
 
 /* Inserts the entry (2nd arg) into the linked list of entries after the reference entry (1st arg).
- * Entry cannot already be in the list, call unlink_entry() first before re-inserting.
+ * Entry cannot already be in the list.
  */
 static inline void link_entry_after(struct PieceTableEntry *ref, struct PieceTableEntry *entry) {
 	if (ref->next != NULL) {
@@ -127,37 +354,219 @@ static inline void link_entry_after(struct PieceTableEntry *ref, struct PieceTab
 	entry->prev = ref;
 }
 
-/* Removes the entry from the linked list of entries. */
-static inline void unlink_entry(struct PieceTableEntry *entry) {
-	if (entry->next != NULL) {
-		entry->next->prev = entry->prev;
+/* Recomputes the entry's subtree length, new-line count and entry count from its children and claims them as its own.
+ * Must be called on every entry whose children or length changed, bottom-up.
+ */
+static inline void update_entry(struct PieceTableEntry *entry) {
+	entry->subtree_length = entry->length;
+	entry->subtree_newlines = entry->newlines;
+	entry->subtree_entries = 1;
+	if (entry->left != NULL) {
+		entry->subtree_length += entry->left->subtree_length;
+		entry->subtree_newlines += entry->left->subtree_newlines;
+		entry->subtree_entries += entry->left->subtree_entries;
+		entry->left->parent = entry;
+	}
+	if (entry->right != NULL) {
+		entry->subtree_length += entry->right->subtree_length;
+		entry->subtree_newlines += entry->right->subtree_newlines;
+		entry->subtree_entries += entry->right->subtree_entries;
+		entry->right->parent = entry;
+	}
+}
+
+/* Updates the entry and each of its ancestors up to the root (see update_entry()). */
+static void update_ancestors(struct PieceTableEntry *entry) {
+	for (; entry != NULL; entry = entry->parent) {
+		update_entry(entry);
+	}
+}
+
+/* Joins two trees where every entry of left comes before every entry of right in the file.
+ * Returns the root of the joined tree. Does not touch the linked list.
+ */
+static struct PieceTableEntry *tree_merge(struct PieceTableEntry *left, struct PieceTableEntry *right) {
+	if (left == NULL) return right;
+	if (right == NULL) return left;
+
+	if (left->priority >= right->priority) {
+		left->right = tree_merge(left->right, right);
+		update_entry(left);
+		left->parent = NULL;
+		return left;
+	} else {
+		right->left = tree_merge(left, right->left);
+		update_entry(right);
+		right->parent = NULL;
+		return right;
+	}
+}
+
+/* Splits the tree so that 'left' holds the first split_index characters and 'right' holds the rest.
+ * An entry straddling split_index is itself split in two (see split_entry()).
+ * Does not touch the linked list, other than linking in any entry created by splitting.
+ */
+static void tree_split(struct PieceTable *table, struct PieceTableEntry *root, index_t split_index, struct PieceTableEntry **left, struct PieceTableEntry **right) {
+	if (root == NULL) {
+		*left = NULL;
+		*right = NULL;
+		return;
+	}
+
+	index_t left_length = root->left == NULL ? 0 : root->left->subtree_length;
+	if (split_index <= left_length) {
+		tree_split(table, root->left, split_index, left, &root->left);
+		update_entry(root);
+		root->parent = NULL;
+		*right = root;
+	} else if (split_index >= left_length + root->length) {
+		tree_split(table, root->right, split_index - left_length - root->length, &root->right, right);
+		update_entry(root);
+		root->parent = NULL;
+		*left = root;
+	} else {
+		// split point is inside this entry: it keeps the left side and its left subtree
+		struct PieceTableEntry *right_entry = split_entry(table, root, split_index - left_length);
+		right_entry->right = root->right;
+		root->right = NULL;
+		update_entry(right_entry);
+		update_entry(root);
+		right_entry->parent = NULL;
+		root->parent = NULL;
+		*left = root;
+		*right = right_entry;
+	}
+}
+
+/* Returns the entry closest to the start of the file within the tree, or NULL if empty. */
+static struct PieceTableEntry *tree_first(struct PieceTableEntry *root) {
+	if (root == NULL) return NULL;
+	while (root->left != NULL) {
+		root = root->left;
+	}
+	return root;
+}
+
+/* Returns the entry closest to the end of the file within the tree, or NULL if empty. */
+static struct PieceTableEntry *tree_last(struct PieceTableEntry *root) {
+	if (root == NULL) return NULL;
+	while (root->right != NULL) {
+		root = root->right;
 	}
-	entry->prev->next = entry->next;
+	return root;
 }
 
-/* Attempts to compact memory used by the file buffer, merging entries where possible and removing
- * any redundancies and unnecessary memory usages.
+/* Builds a tree out of the count entries linked in file order from first, in O(count). Returns its root.
+ * Each entry is hung off the right spine of the tree built so far, below the last spine entry of higher priority
+ * (so every entry is pushed onto and popped off the spine at most once), then the whole tree is updated bottom-up.
  */
-static void filebuf_defragment(struct FileBuf *fb) {
-	// TODO
-	// detect and merge consecutive modify_buf entries (originally from splitting an entry in two)
+static struct PieceTableEntry *tree_build(struct PieceTableEntry *first, uint32_t count) {
+	struct PieceTableEntry *root = NULL;
+	struct PieceTableEntry *last = NULL; // bottom of the right spine
+	struct PieceTableEntry *entry = first;
+	for (uint32_t i = 0; i < count; i++, entry = entry->next) {
+		struct PieceTableEntry *below = NULL; // spine entries of lower priority become its left subtree
+		struct PieceTableEntry *above = last;
+		while (above != NULL && above->priority < entry->priority) {
+			below = above;
+			above = above->parent;
+		}
+		entry->left = below;
+		entry->right = NULL;
+		entry->parent = above;
+		if (below != NULL) {
+			below->parent = entry;
+		}
+		if (above == NULL) {
+			root = entry;
+		} else {
+			above->right = entry;
+		}
+		last = entry;
+	}
+	update_tree(root);
+	return root;
+}
+
+/* Updates every entry of the tree bottom-up (see update_entry()). */
+static void update_tree(struct PieceTableEntry *root) {
+	if (root == NULL) return;
+	update_tree(root->left);
+	update_tree(root->right);
+	update_entry(root);
+}
+
+/* Returns the number of entries in the (possibly empty) tree. */
+static inline uint32_t tree_entry_count(struct PieceTableEntry *root) {
+	return root == NULL ? 0 : root->subtree_entries;
+}
+
+/* Returns the number of chars in the (possibly empty) tree. */
+static inline index_t tree_length(struct PieceTableEntry *root) {
+	return root == NULL ? 0 : root->subtree_length;
 }
 
 /* Erases all current redo history. */
 static void erase_redo_history(struct FileBuf *fb) {
 	if (fb->history_index >= fb->history_count) return; // nothing to erase
 
-	for (int i = fb->history_index; i < fb->history_count - 1; i++) {
-		delete_entry(&fb->table, fb->history[i].entry);
+	// undone events hold the only references to the entries they had added
+	for (uint32_t i = fb->history_index; i < fb->history_count; i++) {
+		struct FileEvent *event = &fb->history[i];
+		fb->history_entries -= tree_entry_count(event->added);
+		fb->history_text_length -= tree_length(event->added) - event->shared_length;
+		delete_tree(&fb->table, event->added);
 	}
-	delete_entry(&fb->table, fb->history[fb->history_count - 1].entry);
 	fb->history_count = fb->history_index;
+	if (fb->journal_base > fb->history_count) {
+		fb->journal_base = fb->history_count;
+	}
+}
+
+/* Returns the memory currently held by history, in bytes. */
+static inline size_t history_bytes(struct FileBuf *fb) {
+	return sizeof(struct FileEvent) * fb->history_count
+		+ sizeof(struct PieceTableEntry) * fb->history_entries
+		+ fb->history_text_length;
+}
+
+/* Drops the oldest undoable events until history fits within its memory budget. */
+static void trim_history(struct FileBuf *fb) {
+	uint32_t trim_count = 0;
+	while (trim_count < fb->history_index && history_bytes(fb) > fb->history_budget) {
+		struct FileEvent *event = &fb->history[trim_count];
+		fb->history_entries -= tree_entry_count(event->removed);
+		fb->history_text_length -= tree_length(event->removed) - event->shared_length;
+		delete_tree(&fb->table, event->removed);
+		trim_count++;
+	}
+	if (trim_count == 0) return;
+
+	memmove(fb->history, fb->history + trim_count, sizeof(struct FileEvent) * (fb->history_count - trim_count));
+	fb->history_count -= trim_count;
+	fb->history_index -= trim_count;
+	fb->journal_base = fb->journal_base > trim_count ? fb->journal_base - trim_count : 0;
+}
+
+/* Sets the max number of bytes that undo/redo history may hold onto, dropping the oldest events if already over it. */
+void filebuf_set_history_budget(struct FileBuf *fb, size_t budget) {
+	fb->history_budget = budget;
+	trim_history(fb);
+	fb->table.generation++;
+}
 
-	// clean up entries that may be fragmented unnecessarily due to undos
-	filebuf_defragment(fb);
+/* Fills in the stats with the current memory usage of undo/redo history. */
+void filebuf_history_stats(struct FileBuf *fb, struct FileBufHistoryStats *stats) {
+	stats->bytes = history_bytes(fb);
+	stats->text_length = fb->history_text_length;
+	stats->entries = fb->history_entries;
+	stats->events = fb->history_count;
+	stats->undoable_events = fb->history_index;
+	stats->redoable_events = fb->history_count - fb->history_index;
 }
 
 /* Retrieves the piece table entry at the given actual character index in the file.
+ * Walks down the tree, so takes O(log n) for n entries.
  * Returns NULL if the table is empty or the index is invalid.
  *
  * file_index - must be a valid index within the file (i.e. 0 <= file_index < file length)
@@ -166,346 +575,1732 @@ static void erase_redo_history(struct FileBuf *fb) {
 struct PieceTableEntry *filebuf_entry_at(struct FileBuf *fb, index_t file_index, index_t *relative_index) {
 	if (file_index >= fb->length) return NULL;
 
-	struct PieceTableEntry *at = fb->table.first_entry;
-	index_t i = 0;
+	struct PieceTableEntry *at = fb->table.root;
 	while (at != NULL) {
-		index_t new_i = i + at->length;
-		if (new_i >= file_index) {
+		index_t left_length = at->left == NULL ? 0 : at->left->subtree_length;
+		if (file_index < left_length) {
+			at = at->left;
+		} else if (file_index < left_length + at->length) {
 			if (relative_index != NULL) {
-				*relative_index = file_index - i;
+				*relative_index = file_index - left_length;
 			}
 			return at;
+		} else {
+			file_index -= left_length + at->length;
+			at = at->right;
 		}
-		i = new_i;
-		at = at->next;
 	}
 	return NULL;
 }
 
-/* Splits the entry into two at the given index within the entry. 
- * Returns the new second entry that resulted from the split.
+/* Splits the entry into two at the given index within the entry and links the new one after it in the list.
+ * Returns the new second entry that resulted from the split. Neither entry's tree links are updated.
  */
-static struct PieceTableEntry *split_entry(struct FileBuf *fb, struct PieceTableEntry *entry, index_t relative_split_index) {
-	struct PieceTableEntry *right_entry = next_entry(&fb->table);
-	right_entry->start = relative_split_index;
-	right_entry->length = entry->length - (relative_split_index - entry->start);
+static struct PieceTableEntry *split_entry(struct PieceTable *table, struct PieceTableEntry *entry, index_t relative_split_index) {
+	struct PieceTableEntry *right_entry = next_entry(table);
+	right_entry->start = entry->start + relative_split_index;
+	right_entry->length = entry->length - relative_split_index;
 	right_entry->buf_id = entry->buf_id;
-	right_entry->saved_to_file = false;
+	right_entry->priority = entry->priority;
 	link_entry_after(entry, right_entry);
 
 	// make entry the left side of the split
-	entry->length = relative_split_index - entry->start;
+	entry->length = relative_split_index;
+	entry->newlines = count_newlines(table, entry->buf_id, entry->start, entry->length);
+	right_entry->newlines = count_newlines(table, right_entry->buf_id, right_entry->start, right_entry->length);
 	return right_entry;
 }
 
-/* Modifies the piece table by inserting a new entry (or by modifying existing ones).
- *
- * inserted_text - a buffer containing the text to be inserted into the file at insert_index
- * insert_index - index in the file where the user began editing
- * insert_length - number of characters in inserted_text. may be zero if delete-indices are non-zero
- * delete_before_length - number of characters before the insert_index that were deleted (via backspace)
- * delete_after_length - number of characters after the insert_index that were deleted (via delete)
- */
-// TODO add undo capability. permanently deletes text currently
-void filebuf_insert(struct FileBuf *fb, char *inserted_text, index_t insert_index, index_t insert_length, index_t delete_before_length, index_t delete_after_length) {
-	// add text to modify_buf
-	struct PieceTable *table = &fb->table; // alias
-	const index_t insert_buf_index = table->modify_buf_count;
-	table->modify_buf_count += insert_length;
-	if (table->modify_buf_count >= table->modify_buf_size) {
-		table->modify_buf_size = table->modify_buf_count * 2;
-		table->modify_buf = realloc(table->modify_buf, sizeof(char) * table->modify_buf_size);
+/* Allocates an empty modify chunk in the first free slot and makes it the one new text is appended to. */
+static void new_modify_chunk(struct PieceTable *table) {
+	uint32_t slot = 0;
+	while (slot < table->modify_slots && table->modify_chunks[slot] != NULL) {
+		slot++;
 	}
-	for (index_t i = 0; i < insert_length; i++) {
-		table->modify_buf[insert_buf_index + i] = inserted_text[i];
+	if (slot == table->modify_slots) {
+		// every slot's chars must be addressable by an index_t
+		const uint64_t addressable_slots = ((uint64_t) (index_t) -1 >> MODIFY_CHUNK_BITS) + 1;
+		const uint32_t max_slots = addressable_slots < UINT32_MAX ? addressable_slots : UINT32_MAX;
+		if (slot == max_slots) {
+			fprintf(stderr, "Out of room for inserted text!\n");
+			exit(EXIT_FAILURE);
+		}
+		table->modify_slots = slot == 0 ? 8 : slot * 2;
+		if (table->modify_slots > max_slots || table->modify_slots < slot) {
+			table->modify_slots = max_slots;
+		}
+		table->modify_chunks = realloc(table->modify_chunks, sizeof(struct ModifyChunk *) * table->modify_slots);
+		for (uint32_t i = slot; i < table->modify_slots; i++) {
+			table->modify_chunks[i] = NULL;
+		}
 	}
 
-	// add change to history
-	struct FileEvent *event = next_event(fb);
-	event->insert_length = insert_length;
-	event->delete_before_length = delete_before_length;
-	event->delete_after_length = delete_after_length;
+	struct ModifyChunk *chunk = malloc(sizeof(struct ModifyChunk));
+	void *text = mmap(NULL, MODIFY_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == NULL || text == MAP_FAILED) {
+		fprintf(stderr, "Out of memory for inserted text!\n");
+		exit(EXIT_FAILURE);
+	}
+	chunk->text = text;
+	line_index_init(&chunk->lines);
+	chunk->count = 0;
+	chunk->referenced = 0;
+	table->modify_chunks[slot] = chunk;
+	table->modify_tail = slot;
+}
 
-	// add change to piece table
-	struct PieceTableEntry *entry = next_entry(&fb->table);
-	entry->buf_id = BUF_ID_MODIFY;
-	entry->start = insert_buf_index;
-	entry->length = insert_length;
-	entry->saved_to_file = false;
-	event->entry = entry;
+/* Frees the modify chunk in the slot, unmapping its text so the memory goes back to the OS. */
+static void free_modify_chunk(struct PieceTable *table, uint32_t slot) {
+	struct ModifyChunk *chunk = table->modify_chunks[slot]; // alias
+	munmap(chunk->text, MODIFY_CHUNK_SIZE);
+	free(chunk->lines.offsets);
+	free(chunk);
+	table->modify_chunks[slot] = NULL;
+}
 
-	index_t relative_index;
-	struct PieceTableEntry *at = filebuf_entry_at(fb, insert_index, &relative_index);
-	if (at == NULL) {
-		fb->table.first_entry = entry;
-		goto label_end_insert;
+/* Frees every modify chunk nothing references anymore (other than the tail chunk), unless a snapshot may still be
+ * reading from them, in which case they are left to be freed once no snapshot is held (see filebuf_defragment_step()).
+ */
+static void free_unreferenced_chunks(struct PieceTable *table) {
+	if (atomic_load(&table->snapshots) > 0) {
+		table->unfreed_chunks = true;
+		return;
+	}
+	for (uint32_t slot = 0; slot < table->modify_slots; slot++) {
+		if (table->modify_chunks[slot] != NULL && slot != table->modify_tail && table->modify_chunks[slot]->referenced == 0) {
+			free_modify_chunk(table, slot);
+		}
 	}
+	table->unfreed_chunks = false;
+}
+
+/* Returns the number of chars that can still be appended to the tail modify chunk (0 if there is none yet). */
+static inline index_t modify_tail_space(struct PieceTable *table) {
+	if (table->modify_slots == 0) return 0;
+	return MODIFY_CHUNK_SIZE - table->modify_chunks[table->modify_tail]->count;
+}
 
-	if (delete_before_length > 0) {
-		index_t relative_deletion_start;
-		index_t index = insert_index - delete_before_length;
-		struct PieceTableEntry *deletion_end_entry = filebuf_entry_at(fb, index, &relative_deletion_start);
+/* Copies the text onto the end of the tail modify chunk and indexes its new-lines. Returns where it starts.
+ * Does not count it as referenced.
+ * length - at most modify_tail_space()
+ */
+static index_t append_modify_text(struct PieceTable *table, const char *text, index_t length) {
+	struct ModifyChunk *chunk = table->modify_chunks[table->modify_tail]; // alias
+	memcpy(chunk->text + chunk->count, text, length);
+	line_index_append(&chunk->lines, chunk->text, chunk->count, length);
+	const index_t start = ((index_t) table->modify_tail << MODIFY_CHUNK_BITS) + chunk->count;
+	chunk->count += length;
+	return start;
+}
 
-		// perform delete, deleting from index all the way to insert_index
-		struct PieceTableEntry *current;
-		if (relative_deletion_start == deletion_end_entry->start) {
-			current = deletion_end_entry;
+/* Drops the reference an entry held to length chars of modify text at start.
+ * Their chunk is freed as soon as nothing references it anymore, unless new text is still being appended to it
+ * or a snapshot may still be reading it.
+ */
+static void release_modify_text(struct PieceTable *table, index_t start, index_t length) {
+	const uint32_t slot = start >> MODIFY_CHUNK_BITS;
+	struct ModifyChunk *chunk = table->modify_chunks[slot]; // alias
+	chunk->referenced -= length;
+	if (chunk->referenced == 0 && slot != table->modify_tail) {
+		if (atomic_load(&table->snapshots) > 0) {
+			table->unfreed_chunks = true;
 		} else {
-			// save left side of split, delete right side
-			current = split_entry(fb, deletion_end_entry, relative_deletion_start);
+			free_modify_chunk(table, slot);
 		}
-		while (index < insert_index) {
-			index += current->length;
-			current = current->next;
-			delete_entry(&fb->table, current->prev);
-		}
-		at = current->prev;
-	} else if (relative_index == at->start) {
-		at = at->prev;
-	} else {
-		split_entry(fb, at, relative_index);
 	}
+}
+
+/* Counts the length chars at start, just appended to the tail modify chunk, as the next part of the stream's text.
+ * They extend the stream's last entry when they directly follow its text, and become a new entry otherwise.
+ */
+static void stream_claim(struct PieceTable *table, struct FileBufStream *stream, index_t start, index_t length, index_t newlines) {
+	table->modify_chunks[start >> MODIFY_CHUNK_BITS]->referenced += length;
+	stream->length += length;
+
+	struct PieceTableEntry *last = stream->last; // alias
+	if (last != NULL && last->start + last->length == start && last->start >> MODIFY_CHUNK_BITS == start >> MODIFY_CHUNK_BITS) {
+		last->length += length;
+		last->newlines += newlines;
+		update_ancestors(last);
+		return;
+	}
+
+	struct PieceTableEntry *entry = next_entry(table);
+	entry->buf_id = BUF_ID_MODIFY;
+	entry->start = start;
+	entry->length = length;
+	entry->newlines = newlines;
+	update_entry(entry);
+	if (last != NULL) {
+		last->next = entry;
+		entry->prev = last;
+	}
+	stream->tree = tree_merge(stream->tree, entry);
+	stream->last = entry;
+}
 
-	if (delete_after_length > 0) {
-		index_t relative_deletion_end;
-		index_t index = insert_index + delete_after_length;
-		struct PieceTableEntry *deletion_end_entry = filebuf_entry_at(fb, index, &relative_deletion_end);
-		
-		// perform delete, deleting from entry at insert_index all the way to index
-		struct PieceTableEntry *current = at;
-		if (relative_deletion_end != deletion_end_entry->start) {
-			// delete left side of split, save right side
-			split_entry(fb, deletion_end_entry, relative_deletion_end);
+/* Appends the text to the modify chunks as the next part of the stream's text.
+ * Text is never copied again once appended: whatever doesn't fit in the tail chunk continues in a new chunk.
+ */
+static void stream_append(struct PieceTable *table, struct FileBufStream *stream, const char *text, index_t length) {
+	while (length > 0) {
+		index_t span_length = modify_tail_space(table);
+		if (span_length == 0) {
+			new_modify_chunk(table);
+			span_length = MODIFY_CHUNK_SIZE;
 		}
-		while (index > insert_index) {
-			index -= current->length;
-			current = current->prev;
-			delete_entry(&fb->table, current->next);
+		if (span_length > length) {
+			span_length = length;
 		}
-	}
 
-	if (at == NULL) {
-		link_entry_before(fb->table.first_entry, entry);
-		fb->table.first_entry = entry;
-	} else {
-		link_entry_after(at, entry);
+		struct ModifyChunk *chunk = table->modify_chunks[table->modify_tail]; // alias
+		const index_t first_newline = chunk->lines.count;
+		const index_t start = append_modify_text(table, text, span_length);
+		stream_claim(table, stream, start, span_length, chunk->lines.count - first_newline);
+		text += span_length;
+		length -= span_length;
 	}
+}
 
-label_end_insert:
-	fb->length = fb->length - (delete_before_length + delete_after_length) + insert_length;
-	erase_redo_history(fb);
+/* Appends the text to the modify chunks and returns a new detached tree of entries for it, or NULL if length is 0.
+ * Takes O(length) plus O(log k) per entry for k entries (one per chunk the text is spread over).
+ */
+static struct PieceTableEntry *new_modify_tree(struct PieceTable *table, const char *text, index_t length) {
+	struct FileBufStream stream = {NULL, NULL, 0, 0};
+	stream_append(table, &stream, text, length);
+	return stream.tree;
 }
 
-/* Undoes the last performed action on the file. */
-void filebuf_undo(struct FileBuf *fb) { // FIXME this doesn't work at all currently
-	if (fb->history_index == 0) return;
-	fb->history_index--;
+/* Copies the length chars of the file starting at the file index into dest. */
+static void copy_text(struct FileBuf *fb, index_t file_index, index_t length, char *dest) {
+	index_t relative_index = 0;
+	struct PieceTableEntry *at = filebuf_entry_at(fb, file_index, &relative_index);
+	while (length > 0 && at != NULL) {
+		index_t span_length = at->length - relative_index;
+		if (span_length > length) {
+			span_length = length;
+		}
+		memcpy(dest, filebuf_get_text(fb, at) + relative_index, span_length);
+		dest += span_length;
+		length -= span_length;
+		relative_index = 0;
+		at = at->next;
+	}
+}
 
-	struct FileEvent *undone_event = &fb->history[fb->history_index];
+/* Removes the given range of the file from the table, returning its entries as a detached tree (NULL if length is 0). */
+static struct PieceTableEntry *detach_range(struct PieceTable *table, index_t index, index_t length) {
+	if (length == 0) return NULL;
 
-	// TODO update fb->length
-	// TODO update entry->saved_to_file
-}
+	struct PieceTableEntry *left, *middle, *right;
+	tree_split(table, table->root, index, &left, &right);
+	tree_split(table, right, length, &middle, &right);
 
-/* Redoes the last undone performed action on the file. */
-void filebuf_redo(struct FileBuf *fb) {
-	if (fb->history_index >= fb->history_count) return;
-	fb->history_index++;
-	// TODO update fb->length
-	// TODO update entry->saved_to_file
+	// relink the list across the cut
+	struct PieceTableEntry *before = tree_last(left);
+	struct PieceTableEntry *after = tree_first(right);
+	if (before != NULL) {
+		before->next = after;
+	}
+	if (after != NULL) {
+		after->prev = before;
+	}
+
+	table->root = tree_merge(left, right);
+	table->first_entry = tree_first(table->root);
+	return middle;
 }
 
-/* Returns the character buffer that the given entry uses. */
-char *filebuf_get_buffer(struct FileBuf *fb, struct PieceTableEntry *entry) {
-	if (entry->buf_id == BUF_ID_ORIGIN) {
-		return fb->table.origin_buf;
-	} else if (entry->buf_id == BUF_ID_MODIFY) {
-		return fb->table.modify_buf;
+/* Inserts a detached tree of entries (e.g. from detach_range()) into the table at the file index. */
+static void attach_tree(struct PieceTable *table, index_t index, struct PieceTableEntry *tree) {
+	if (tree == NULL) return;
+
+	struct PieceTableEntry *left, *right;
+	tree_split(table, table->root, index, &left, &right);
+
+	// link the tree's own list in between
+	struct PieceTableEntry *before = tree_last(left);
+	struct PieceTableEntry *after = tree_first(right);
+	struct PieceTableEntry *first = tree_first(tree);
+	struct PieceTableEntry *last = tree_last(tree);
+	first->prev = before;
+	if (before != NULL) {
+		before->next = first;
+	}
+	last->next = after;
+	if (after != NULL) {
+		after->prev = last;
 	}
 
-	fprintf(stderr, "char buffer ID %i is invalid!\n", entry->buf_id);
-	exit(EXIT_FAILURE);
+	table->root = tree_merge(tree_merge(left, tree), right);
+	table->first_entry = tree_first(table->root);
 }
 
-/* Returns a pointer to the beginning of the entry's text in the file.
- * WARNING: entry texts are NOT separated by null terms! You must bound the text by the entry's length!
+/* Replaces the removed_length chars at the file index with a detached tree of new entries holding length chars,
+ * recording it in history as a single event and journaling it. Takes O(log n) for n entries, plus O(k) for the k new entries.
  */
-char *filebuf_get_text(struct FileBuf *fb, struct PieceTableEntry *entry) {
-	char *buf = filebuf_get_buffer(fb, entry);
-	return buf + entry->start;
+static void insert_tree(struct FileBuf *fb, struct PieceTableEntry *inserted, index_t index, index_t length, index_t removed_length) {
+	struct PieceTable *table = &fb->table; // alias
+
+	// add change to history
+	erase_redo_history(fb);
+	struct FileEvent *event = next_event(fb);
+	event->index = index;
+	event->removed_length = removed_length;
+	event->added_length = length;
+	event->shared_length = 0;
+	event->added = NULL;
+	if (length == 0) {
+		event->id = FILE_EVENT_DELETE;
+	} else if (removed_length == 0) {
+		event->id = FILE_EVENT_ADD;
+	} else {
+		event->id = FILE_EVENT_DELETE_THEN_ADD;
+	}
+
+	// add change to piece table
+	struct PieceTableEntry *first = tree_first(inserted);
+	const uint32_t count = tree_entry_count(inserted);
+	event->removed = detach_range(table, index, removed_length);
+	fb->history_entries += tree_entry_count(event->removed);
+	fb->history_text_length += removed_length;
+	attach_tree(table, index, inserted);
+
+	fb->length = fb->length - removed_length + length;
+	record_change(fb, index, removed_length, length);
+	trim_history(fb);
+	table->generation++;
+
+	// journal the text straight from the entries holding it
+	struct iovec *iovecs = malloc(sizeof(struct iovec) * (count + 1));
+	struct PieceTableEntry *entry = first;
+	for (uint32_t i = 0; i < count; i++, entry = entry->next) {
+		iovecs[i].iov_base = (void *) filebuf_get_text(fb, entry);
+		iovecs[i].iov_len = entry->length;
+	}
+	journal_append(&fb->journal, JOURNAL_RECORD_INSERT, index, removed_length, iovecs, count);
+	free(iovecs);
 }
 
-/* fseek() from <stdio.h> but with index_t offset instead of long offset. 
- * reference - must be either SEEK_CUR or SEEK_END
+/* Modifies the piece table by inserting a new entry (or by modifying existing ones).
+ * The characters from insert_index - delete_before_length up to insert_index + delete_after_length
+ * are replaced by inserted_text. Takes O(log n) for n entries, plus O(insert_length) to copy the text,
+ * so text of any size is inserted as a single change.
+ * The change is recorded in history, erasing any redo history.
+ *
+ * inserted_text - a buffer containing the text to be inserted into the file at insert_index
+ * insert_index - index in the file where the user began editing
+ * insert_length - number of characters in inserted_text. may be zero if delete-indices are non-zero
+ * delete_before_length - number of characters before the insert_index that were deleted (via backspace)
+ * delete_after_length - number of characters after the insert_index that were deleted (via delete)
  */
-static inline void fseeku(FILE *stream, index_t offset, int reference) {
-	#if ARCH_BITS == 32
-		if (offset > LONG_MAX) {
-			fseek(stream, LONG_MAX, reference);
-			fseek(stream, (long) (offset - LONG_MAX), reference);
-		} else {
-			fseek(stream, (long) offset, reference);
-		}
-	#elif ARCH_BITS == 64
-		fseek(stream, offset, reference);
-	#else
-		#error ARCH_BITS bit architecture is not supported!
-	#endif
+void filebuf_insert(struct FileBuf *fb, char *inserted_text, index_t insert_index, index_t insert_length, index_t delete_before_length, index_t delete_after_length) {
+	if (insert_index > fb->length) {
+		insert_index = fb->length;
+	}
+	if (delete_before_length > insert_index) {
+		delete_before_length = insert_index;
+	}
+	if (delete_after_length > fb->length - insert_index) {
+		delete_after_length = fb->length - insert_index;
+	}
+	const index_t delete_length = delete_before_length + delete_after_length;
+	if (insert_length == 0 && delete_length == 0) return; // nothing changed
+
+	struct PieceTableEntry *inserted = new_modify_tree(&fb->table, inserted_text, insert_length);
+	insert_tree(fb, inserted, insert_index - delete_before_length, insert_length, delete_length);
 }
 
-/* Returns the character at the index in the file, or, value 0 if unable to get a character.
- * NOTE: this should not be used for iterating over the file buffer to access each character in succession and the like.
- * Doing so would be incredibly inefficient. Instead, iterate over the piece table linked list.
+/* Starts streaming text into the file buffer at the file index, for inserting text that isn't all in memory at once
+ * (e.g. a large paste as it arrives). The text is given with filebuf_stream_write() and filebuf_stream_read(),
+ * going straight into the modify chunks, and is only inserted into the file by filebuf_stream_end().
+ * The file buffer must not be edited in the meantime.
  */
-char filebuf_char_at(struct FileBuf *fb, index_t file_index) {
-	if (file_index >= fb->length) return 0;
-
-	index_t relative_index;
-	struct PieceTableEntry *at = filebuf_entry_at(fb, file_index, &relative_index);
-	if (at == NULL) return (char) 0;
+void filebuf_stream_begin(struct FileBuf *fb, struct FileBufStream *stream, index_t insert_index) {
+	stream->tree = NULL;
+	stream->last = NULL;
+	stream->index = insert_index > fb->length ? fb->length : insert_index;
+	stream->length = 0;
+}
 
-	char *text = filebuf_get_text(fb, at);
-	return text[relative_index];
+/* Adds the text onto the end of the stream's text. */
+void filebuf_stream_write(struct FileBuf *fb, struct FileBufStream *stream, const char *text, index_t length) {
+	stream_append(&fb->table, stream, text, length);
 }
 
-/* Sets 'result_index' to the file index of the first occurrence of the given character sequence,
- * search constrained between start_index (inclusive) and end_index (exclusive).
- * string - must be a valid, null-terminated string.
- * Returns whether successful. False if no occurrence found (or invalid range or empty matching string).
+/* Reads everything up to the end of the file descriptor onto the end of the stream's text,
+ * directly into the modify chunks, so the text is never copied in between.
+ * Stops early if the file would no longer fit within an index_t.
+ * Returns whether successful. On a read error, whatever was read before it is kept.
  */
-bool filebuf_index_of(struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, index_t *result_index) {
-	if (end_index <= start_index || string[0] == '\0' || start_index >= fb->length) return false;
-
-	index_t string_match_index = 0; // current position we have matched up to in the string
-	index_t relative_index; // within current entry
-	struct PieceTableEntry *at = filebuf_entry_at(fb, start_index, &relative_index);
-	char *text = filebuf_get_text(fb, at);
-	for (index_t i = start_index; i < end_index; i++) {
-		if (string[string_match_index] == '\0') {
-			*result_index = i;
-			return true;
+bool filebuf_stream_read(struct FileBuf *fb, struct FileBufStream *stream, int fd) {
+	struct PieceTable *table = &fb->table; // alias
+	while (1) {
+		index_t space = modify_tail_space(table);
+		if (space == 0) {
+			new_modify_chunk(table);
+			space = MODIFY_CHUNK_SIZE;
 		}
-		if (relative_index >= at->length) {
-			if (at->next == NULL) return false;
-
-			relative_index = 0;
-			at = at->next;
-			text = filebuf_get_text(fb, at);
+		const index_t room = (index_t) -1 - fb->length - stream->length; // chars the file can still grow by
+		if (room == 0) return false;
+		if (space > room) {
+			space = room;
 		}
-		if (text[relative_index] == string[string_match_index]) {
-			string_match_index++;
-		} else {
-			string_match_index = 0;
+
+		struct ModifyChunk *chunk = table->modify_chunks[table->modify_tail]; // alias
+		const ssize_t read_count = read(fd, chunk->text + chunk->count, space);
+		if (read_count == 0) return true;
+		if (read_count < 0) {
+			if (errno == EINTR) continue;
+			return false;
 		}
-		relative_index++;
+
+		const index_t first_newline = chunk->lines.count;
+		line_index_append(&chunk->lines, chunk->text, chunk->count, read_count);
+		const index_t start = ((index_t) table->modify_tail << MODIFY_CHUNK_BITS) + chunk->count;
+		chunk->count += read_count;
+		stream_claim(table, stream, start, read_count, chunk->lines.count - first_newline);
 	}
-	return false;
 }
 
-/* Sets 'result_index' to the file index of the last occurrence of the given character sequence,
- * search constrained between start_index (inclusive) and end_index (exclusive). Will not modify it if fails.
- * string - must be a valid, null-terminated string.
- * Returns whether successful. False if no occurrence found (or invalid range or empty matching string).
+/* Inserts all of the stream's text into the file as a single change (see filebuf_insert()). */
+void filebuf_stream_end(struct FileBuf *fb, struct FileBufStream *stream) {
+	if (stream->length == 0) return;
+	insert_tree(fb, stream->tree, stream->index, stream->length, 0);
+	stream->tree = NULL;
+	stream->last = NULL;
+}
+
+/* Inserts everything read from the file descriptor up to its end into the file at the file index, as a single change.
+ * The text is read directly into the modify chunks, so this is one O(n) read no matter how much there is.
+ * inserted_length - set to the number of chars inserted. if NULL, is ignored.
+ * Returns whether successful. On a read error, whatever was read before it is still inserted.
  */
-bool filebuf_last_index_of(struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, index_t *result_index) {
-	if (end_index <= start_index || string[0] == '\0') return false;
-	if (end_index - 1 >= fb->length) {
-		end_index = fb->length;
+bool filebuf_insert_fd(struct FileBuf *fb, int fd, index_t insert_index, index_t *inserted_length) {
+	struct FileBufStream stream;
+	filebuf_stream_begin(fb, &stream, insert_index);
+	const bool success = filebuf_stream_read(fb, &stream, fd);
+	filebuf_stream_end(fb, &stream);
+	if (inserted_length != NULL) {
+		*inserted_length = stream.length;
 	}
+	return success;
+}
 
-	const int string_length = strlen(string);
-	index_t string_match_index = string_length - 1; // current position we have matched up to in the string
-	index_t relative_index; // within current entry
-	struct PieceTableEntry *at = filebuf_entry_at(fb, end_index - 1, &relative_index);
-	char *text = filebuf_get_text(fb, at);
-	for (index_t i = end_index - 1; i >= start_index; i--) {
-		if (text[relative_index] == string[string_match_index]) {
-			if (string_match_index == 0) {
-				*result_index = i;
-				return true;
-			} else {
-				string_match_index--;
-			}
-		} else {
-			string_match_index = string_length - 1;
-		}
-		if (relative_index == 0) {
-			if (at->prev == NULL) return false;
+/* Adds a new entry referencing length chars of the buffer at start onto the end of a list of entries being built.
+ * newlines - the number of new-lines within those chars
+ */
+static void append_new_entry(struct PieceTable *table, struct EntryList *list, bool buf_id, index_t start, index_t length, index_t newlines) {
+	struct PieceTableEntry *entry = next_entry(table);
+	entry->buf_id = buf_id;
+	entry->start = start;
+	entry->length = length;
+	entry->newlines = newlines;
+	if (buf_id == BUF_ID_MODIFY) {
+		table->modify_chunks[start >> MODIFY_CHUNK_BITS]->referenced += length;
+	}
 
-			at = at->prev;
-			relative_index = at->length - 1;
-			text = filebuf_get_text(fb, at);
-		} else {
-			relative_index--;
-		}
+	if (list->last == NULL) {
+		list->first = entry;
+	} else {
+		list->last->next = entry;
+		entry->prev = list->last;
 	}
-	return false;
+	list->last = entry;
+	list->count++;
 }
 
-/* Attempts to write the buffer to file at the filebuf's path.
- * Returns whether successful.
+/* Appends the text to the modify chunks, adding entries for it onto the end of a list of entries being built
+ * (one per chunk the text is spread over).
  */
-bool filebuf_write(struct FileBuf *fb) {
-	FILE *file = fopen(fb->path, "r+"); // update file rather than rewriting it entirely on every save
-	bool write_all = false;
-	if (file == NULL) {
-		file = fopen(fb->path, "w"); // file doesn't exist or err? overwrite it
-		write_all = true;
-		if (file == NULL) return false;
-	}
-	
-	struct PieceTableEntry *at = fb->table.first_entry;
-	while (at != NULL) {
-		if (write_all || !at->saved_to_file) {
-			char *text = filebuf_get_text(fb, at);
-			for (index_t i = 0; i < at->length; i++) {
-				fputc(text[i], file);
-			}
-			at->saved_to_file = true;
+static void append_text_entries(struct PieceTable *table, struct EntryList *list, const char *text, index_t length) {
+	while (length > 0) {
+		index_t span_length = modify_tail_space(table);
+		if (span_length == 0) {
+			new_modify_chunk(table);
+			span_length = MODIFY_CHUNK_SIZE;
 		}
-		fseeku(file, at->length, SEEK_CUR);
-		at = at->next;
+		if (span_length > length) {
+			span_length = length;
+		}
+
+		struct ModifyChunk *chunk = table->modify_chunks[table->modify_tail]; // alias
+		const index_t first_newline = chunk->lines.count;
+		const index_t start = append_modify_text(table, text, span_length);
+		append_new_entry(table, list, BUF_ID_MODIFY, start, span_length, chunk->lines.count - first_newline);
+		text += span_length;
+		length -= span_length;
+	}
+}
+
+/* Returns whether the edits are sorted by index, don't overlap, are within the file, and leave it no larger than an index_t can address.
+ * changed - set to whether the edits would change anything at all
+ */
+static bool edits_valid(struct FileBuf *fb, const struct FileBufEdit *edits, index_t count, bool *changed) {
+	index_t edit_end = 0;
+	index_t room = (index_t) -1 - fb->length; // chars the file can still grow by
+	*changed = false;
+	for (index_t i = 0; i < count; i++) {
+		if (edits[i].index < edit_end || edits[i].index > fb->length || edits[i].removed_length > fb->length - edits[i].index) return false;
+		edit_end = edits[i].index + edits[i].removed_length;
+		room += edits[i].removed_length;
+		if (edits[i].length > room) return false;
+		room -= edits[i].length;
+		*changed = *changed || edits[i].removed_length > 0 || edits[i].length > 0;
 	}
-	fclose(file);
 	return true;
 }
 
-/* Attempts to load the entire file at the path into the buffer.
- * fb - should be an empty, initialized FileBuf
- * FIXME: reads entire file into memory (not good for large files e.g. 1GB). should have a limit and read in parts of the file at a time as needed.
- * Returns whether successful.
+/* Makes all of the edits (already validated by edits_valid()) as a single change recorded in history.
+ * The entries spanned by the edits are walked once, building new entries that reference the unchanged text between edits
+ * where it already is, followed by those for each edit's text. So this takes O(p + k) for the p entries spanned and k edits
+ * (plus a new-line count lookup for each entry only partly kept, and copying the text), rather than a separate O(log n)
+ * lookup and history event per edit. Edits in a row with the same text share a single copy of it.
+ * event_id - see file_event_ids enum
  */
-bool filebuf_read(struct FileBuf *fb, char *path) {
-	FILE *file = fopen(path, "r");
-	if (file == NULL) return false;
-	fb->path = path;
+static void edit_span(struct FileBuf *fb, int event_id, const struct FileBufEdit *edits, index_t count) {
+	struct PieceTable *table = &fb->table; // alias
+	const index_t span_index = edits[0].index;
+	const index_t span_end = edits[count - 1].index + edits[count - 1].removed_length;
+	const index_t span_length = span_end - span_index;
 
-	struct stat filestat;
-	fstat(fileno(file), &filestat);
-	fb->table.origin_buf_size = filestat.st_size * 2;
-	fb->table.origin_buf = malloc(sizeof(char) * fb->table.origin_buf_size);
-	char c;
-	int count = 0;
-	while ((c = getchar()) != EOF) {
-		fb->table.origin_buf[count] = c;
+	struct PieceTableEntry *removed = detach_range(table, span_index, span_length);
+	struct PieceTableEntry *at = tree_first(removed);
+	index_t at_index = span_index; // file index of at's text
+	index_t kept_index = span_index; // unchanged text from here up to the next edit is still to be kept
+	index_t removed_total = 0;
+	index_t added_total = 0;
+	struct EntryList added = {NULL, NULL, 0};
+	struct PieceTableEntry *text_first = NULL; // first of the entries holding the text of the last edit that copied its own
+	uint32_t text_entries = 0;
+	for (index_t i = 0; i <= count; i++) {
+		const index_t kept_end = i < count ? edits[i].index : span_end;
+		while (kept_index < kept_end) {
+			while (at_index + at->length <= kept_index) {
+				at_index += at->length;
+				at = at->next;
+			}
+			const index_t relative_index = kept_index - at_index;
+			index_t length = at->length - relative_index;
+			if (length > kept_end - kept_index) {
+				length = kept_end - kept_index;
+			}
+			const index_t newlines = length == at->length ? at->newlines : count_newlines(table, at->buf_id, at->start + relative_index, length);
+			append_new_entry(table, &added, at->buf_id, at->start + relative_index, length, newlines);
+			kept_index += length;
+		}
+		if (i == count) break;
+
+		const struct FileBufEdit *edit = &edits[i]; // alias
+		if (i > 0 && edit->text == edits[i - 1].text && edit->length == edits[i - 1].length) {
+			// reference the copy made for the edits before instead of copying the same text again
+			struct PieceTableEntry *piece = text_first;
+			for (uint32_t j = 0; j < text_entries; j++, piece = piece->next) {
+				append_new_entry(table, &added, BUF_ID_MODIFY, piece->start, piece->length, piece->newlines);
+			}
+		} else {
+			struct PieceTableEntry *before = added.last;
+			const uint32_t entries_before = added.count;
+			append_text_entries(table, &added, edit->text, edit->length);
+			text_first = before == NULL ? added.first : before->next;
+			text_entries = added.count - entries_before;
+		}
+		kept_index = edit->index + edit->removed_length;
+		removed_total += edit->removed_length;
+		added_total += edit->length;
+	}
+	struct PieceTableEntry *added_tree = tree_build(added.first, added.count);
+
+	// add change to history
+	erase_redo_history(fb);
+	struct FileEvent *event = next_event(fb);
+	event->id = event_id;
+	event->index = span_index;
+	event->removed_length = span_length;
+	event->added_length = span_length - removed_total + added_total;
+	event->shared_length = span_length - removed_total;
+	event->removed = removed;
+	event->added = NULL;
+	fb->history_entries += tree_entry_count(removed);
+	fb->history_text_length += removed_total;
+	attach_tree(table, span_index, added_tree);
+
+	fb->length = fb->length - removed_total + added_total;
+	record_change(fb, span_index, event->removed_length, event->added_length);
+	trim_history(fb);
+	table->generation++;
+}
+
+/* Makes a batch of edits, each replacing some chars of the file with some text (or just inserting or deleting),
+ * all at once as a single change recorded in history. The edits are made in one pass over the entries they span
+ * (see edit_span()), so editing at many places at once (e.g. with many cursors) costs about as much as one large edit.
+ * edits - sorted by index, not overlapping (though several may insert at the same index, in order), and within the file.
+ *         their indices are those from before any of the edits are made: the text after each edit shifts by the
+ *         lengths added and removed by the edits before it, which is left for the caller to apply to its own indices
+ * Returns whether successful. False if the edits are invalid or the result would be too large, in which case nothing is changed.
+ */
+bool filebuf_edit_batch(struct FileBuf *fb, const struct FileBufEdit *edits, index_t count) {
+	bool changed;
+	if (!edits_valid(fb, edits, count, &changed)) return false;
+	if (!changed) return true;
+
+	edit_span(fb, FILE_EVENT_BATCH, edits, count);
+
+	// journal each edit's text only once, even when shared by edits in a row
+	uint64_t *journaled_edits = malloc(sizeof(uint64_t) * 4 * count);
+	struct iovec *iovecs = malloc(sizeof(struct iovec) * (count + 1));
+	int iovec_count = 1;
+	uint64_t text_offset = 0;
+	for (index_t i = 0; i < count; i++) {
+		if (i == 0 || edits[i].text != edits[i - 1].text || edits[i].length != edits[i - 1].length) {
+			if (i > 0) {
+				text_offset += edits[i - 1].length;
+			}
+			iovecs[iovec_count].iov_base = (void *) edits[i].text;
+			iovecs[iovec_count].iov_len = edits[i].length;
+			iovec_count++;
+		}
+		journaled_edits[4 * i] = edits[i].index;
+		journaled_edits[4 * i + 1] = edits[i].removed_length;
+		journaled_edits[4 * i + 2] = edits[i].length;
+		journaled_edits[4 * i + 3] = text_offset;
+	}
+	iovecs[0].iov_base = journaled_edits;
+	iovecs[0].iov_len = sizeof(uint64_t) * 4 * count;
+	journal_append(&fb->journal, JOURNAL_RECORD_BATCH, count, 0, iovecs, iovec_count);
+	free(iovecs);
+	free(journaled_edits);
+	return true;
+}
+
+/* Replaces each of the ranges of the file with the same replacement text, all as a single change recorded in history.
+ * Made as a batch of edits (see filebuf_edit_batch()) that all reference one copy of the replacement text.
+ * ranges - sorted by index, not overlapping, and within the file
+ * Returns whether successful. False if the ranges are invalid or the result would be too large, in which case nothing is changed.
+ */
+bool filebuf_replace_ranges(struct FileBuf *fb, const struct FileBufRange *ranges, index_t count, const char *replacement, index_t replacement_length) {
+	struct FileBufEdit *edits = malloc(sizeof(struct FileBufEdit) * count);
+	for (index_t i = 0; i < count; i++) {
+		edits[i].text = replacement;
+		edits[i].index = ranges[i].index;
+		edits[i].removed_length = ranges[i].length;
+		edits[i].length = replacement_length;
+	}
+	bool changed;
+	const bool valid = edits_valid(fb, edits, count, &changed);
+	if (valid && changed) {
+		edit_span(fb, FILE_EVENT_REPLACE, edits, count);
+
+		// journal the ranges rather than the text they leave as is
+		uint64_t *journaled_ranges = malloc(sizeof(uint64_t) * 2 * count);
+		for (index_t i = 0; i < count; i++) {
+			journaled_ranges[2 * i] = ranges[i].index;
+			journaled_ranges[2 * i + 1] = ranges[i].length;
+		}
+		struct iovec iovecs[2] = {{(void *) replacement, replacement_length}, {journaled_ranges, sizeof(uint64_t) * 2 * count}};
+		journal_append(&fb->journal, JOURNAL_RECORD_REPLACE, count, replacement_length, iovecs, 2);
+		free(journaled_ranges);
+	}
+	free(edits);
+	return valid;
+}
+
+/* Replaces the length chars at the file index with the text, like filebuf_insert(), but without recording it in history. */
+static void apply_change(struct FileBuf *fb, const char *text, index_t index, index_t length, index_t removed_length) {
+	struct PieceTable *table = &fb->table; // alias
+	struct PieceTableEntry *inserted = new_modify_tree(table, text, length);
+	delete_tree(table, detach_range(table, index, removed_length));
+	attach_tree(table, index, inserted);
+	fb->length = fb->length - removed_length + length;
+	record_change(fb, index, removed_length, length);
+	table->generation++;
+}
+
+/* Merges a change of the removed_length chars at the file index into added_length chars into the range of text
+ * changed since the changes were last taken, for each of the changes watched.
+ */
+static void record_change(struct FileBuf *fb, index_t index, index_t removed_length, index_t added_length) {
+	for (uint32_t i = 0; i < fb->watcher_count; i++) {
+		struct FileBufChange *change = fb->watchers[i]; // alias
+		if (!change->changed) {
+			change->index = index;
+			change->removed_length = removed_length;
+			change->added_length = added_length;
+			change->changed = true;
+			continue;
+		}
+
+		// the range covering both, in the text from before this change
+		const index_t start = index < change->index ? index : change->index;
+		const index_t end = index + removed_length > change->index + change->added_length ? index + removed_length : change->index + change->added_length;
+		change->removed_length = end - start - change->added_length + change->removed_length;
+		change->added_length = end - start - removed_length + added_length;
+		change->index = start;
+	}
+}
+
+/* Takes a snapshot of the file buffer's text as it is now, which another thread can read from while the file buffer
+ * carries on being edited: text in a piece table is never written to once added, only referenced by other entries or
+ * freed, and none is freed while any snapshot is held. It has to be released (see filebuf_snapshot_release()).
+ * O(entries), as only where each entry's text is gets copied.
+ */
+void filebuf_snapshot(struct FileBuf *fb, struct FileBufSnapshot *snapshot) {
+	struct PieceTable *table = &fb->table; // alias
+	const uint32_t count = table->root == NULL ? 0 : table->root->subtree_entries;
+	snapshot->spans = malloc(sizeof(struct FileBufSpan) * (count == 0 ? 1 : count));
+	snapshot->span_count = 0;
+	snapshot->length = fb->length;
+	snapshot->table = table;
+	for (struct PieceTableEntry *entry = table->first_entry; entry != NULL; entry = entry->next) {
+		snapshot->spans[snapshot->span_count].text = filebuf_get_text(fb, entry);
+		snapshot->spans[snapshot->span_count].length = entry->length;
+		snapshot->span_count++;
+	}
+	atomic_fetch_add(&table->snapshots, 1);
+}
+
+/* Lets go of the text the snapshot references, so it can be freed once the file buffer no longer needs it.
+ * Can be called from any thread.
+ */
+void filebuf_snapshot_release(struct FileBufSnapshot *snapshot) {
+	free(snapshot->spans);
+	snapshot->spans = NULL;
+	snapshot->span_count = 0;
+	atomic_fetch_sub(&snapshot->table->snapshots, 1);
+}
+
+/* Records every edit made to the file buffer from now on into the change (merged into a single range, see
+ * FileBufChange) until it is unwatched, for keeping whatever is kept about the text up to date with it.
+ * At most FILEBUF_WATCHERS_MAX changes are watched at once. Returns false if there is no room for another.
+ */
+bool filebuf_watch_changes(struct FileBuf *fb, struct FileBufChange *watched) {
+	watched->changed = false;
+	if (fb->watcher_count == FILEBUF_WATCHERS_MAX) return false;
+	fb->watchers[fb->watcher_count] = watched;
+	fb->watcher_count++;
+	return true;
+}
+
+/* Stops recording edits into the change (see filebuf_watch_changes()). */
+void filebuf_unwatch_changes(struct FileBuf *fb, struct FileBufChange *watched) {
+	for (uint32_t i = 0; i < fb->watcher_count; i++) {
+		if (fb->watchers[i] == watched) {
+			fb->watcher_count--;
+			fb->watchers[i] = fb->watchers[fb->watcher_count];
+			return;
+		}
+	}
+}
+
+/* Takes the range of text changed since this was last called on the watched change, if anything changed (see
+ * filebuf_watch_changes()). Returns whether anything changed.
+ */
+bool filebuf_take_change(struct FileBufChange *watched, struct FileBufChange *change) {
+	*change = *watched;
+	watched->changed = false;
+	return change->changed;
+}
+
+/* Finds the lines a change taken from the file buffer (see filebuf_take_change()) spans: from first to last in the text
+ * now, and from first to old_last in the text before it. Lines after those only moved, by last - old_last.
+ * old_line_count - lines in the file before the change
+ */
+void filebuf_change_lines(struct FileBuf *fb, const struct FileBufChange *change, index_t old_line_count, index_t *first, index_t *last, index_t *old_last) {
+	*first = filebuf_offset_to_line(fb, change->index);
+	*last = filebuf_offset_to_line(fb, change->index + change->added_length);
+	*old_last = (index_t) ((uint64_t) *last + old_line_count - filebuf_line_count(fb));
+}
+
+/* Journals an undo or redo that just changed the file. Events from before the journal began aren't in the journal,
+ * so they can't be undone or redone when replaying it. For those the resulting text is journaled instead.
+ */
+static void journal_undo_redo(struct FileBuf *fb, uint32_t type, struct FileEvent *event, uint32_t event_index) {
+	if (event_index >= fb->journal_base) {
+		journal_append(&fb->journal, type, 0, 0, NULL, 0);
+		return;
+	}
+
+	const bool undo = type == JOURNAL_RECORD_UNDO;
+	const index_t length = undo ? event->removed_length : event->added_length;
+	char *text = malloc(sizeof(char) * length);
+	copy_text(fb, event->index, length, text);
+	struct iovec iovec = {text, length};
+	journal_append(&fb->journal, JOURNAL_RECORD_CHANGE, event->index, undo ? event->added_length : event->removed_length, &iovec, 1);
+	free(text);
+}
+
+/* Undoes the last performed action on the file.
+ * changed_index - set to the file index where the file changed. if NULL, is ignored.
+ * Returns whether there was anything to undo.
+ */
+bool filebuf_undo(struct FileBuf *fb, index_t *changed_index) {
+	if (fb->history_index == 0) return false;
+	fb->history_index--;
+
+	// swap the added entries back out for the removed ones
+	struct FileEvent *event = &fb->history[fb->history_index];
+	event->added = detach_range(&fb->table, event->index, event->added_length);
+	fb->history_entries += tree_entry_count(event->added) - tree_entry_count(event->removed); // before the removed tree is merged in
+	fb->history_text_length += event->added_length - event->removed_length;
+	attach_tree(&fb->table, event->index, event->removed);
+	event->removed = NULL;
+
+	fb->length = fb->length - event->added_length + event->removed_length;
+	record_change(fb, event->index, event->added_length, event->removed_length);
+	fb->table.generation++;
+	journal_undo_redo(fb, JOURNAL_RECORD_UNDO, event, fb->history_index);
+	if (changed_index != NULL) {
+		*changed_index = event->index;
+	}
+	return true;
+}
+
+/* Redoes the last undone performed action on the file.
+ * changed_index - set to the file index where the file changed. if NULL, is ignored.
+ * Returns whether there was anything to redo.
+ */
+bool filebuf_redo(struct FileBuf *fb, index_t *changed_index) {
+	if (fb->history_index >= fb->history_count) return false;
+
+	// swap the removed entries back out for the added ones
+	struct FileEvent *event = &fb->history[fb->history_index];
+	event->removed = detach_range(&fb->table, event->index, event->removed_length);
+	fb->history_entries += tree_entry_count(event->removed) - tree_entry_count(event->added); // before the added tree is merged in
+	fb->history_text_length += event->removed_length - event->added_length;
+	attach_tree(&fb->table, event->index, event->added);
+	event->added = NULL;
+
+	fb->length = fb->length - event->removed_length + event->added_length;
+	record_change(fb, event->index, event->removed_length, event->added_length);
+	fb->table.generation++;
+	journal_undo_redo(fb, JOURNAL_RECORD_REDO, event, fb->history_index);
+	fb->history_index++;
+	if (changed_index != NULL) {
+		*changed_index = event->index;
+	}
+	return true;
+}
+
+/* Throws away any progress of the defragmentation pass and starts it over from the beginning. */
+static void defrag_reset(struct Defrag *defrag) {
+	free(defrag->entries);
+	free(defrag->starts);
+	defrag->entries = NULL;
+	defrag->starts = NULL;
+	defrag->coalesce_index = 0;
+	defrag->compacted = false;
+	defrag->phase = DEFRAG_PHASE_COALESCE;
+}
+
+/* Returns whether the next entry's text directly follows the entry's text in memory, so the two could be one entry. */
+static inline bool text_contiguous(struct PieceTableEntry *entry, struct PieceTableEntry *next) {
+	if (next->buf_id != entry->buf_id || entry->start + entry->length != next->start) return false;
+	// the end of one modify chunk is followed by the start of the next slot's chunk in index, but not in memory
+	return entry->buf_id == BUF_ID_ORIGIN || entry->start >> MODIFY_CHUNK_BITS == next->start >> MODIFY_CHUNK_BITS;
+}
+
+/* Merges each entry with the next one while their text is contiguous within the same buffer, and drops empty entries,
+ * walking the file from defrag.coalesce_index. Returns whether the end of the file was reached before the deadline.
+ */
+static bool defrag_coalesce(struct FileBuf *fb, uint64_t deadline) {
+	struct PieceTable *table = &fb->table; // alias
+	struct Defrag *defrag = &fb->defrag; // alias
+	index_t relative_index = 0;
+	struct PieceTableEntry *entry = filebuf_entry_at(fb, defrag->coalesce_index, &relative_index);
+	defrag->coalesce_index -= relative_index; // start of entry
+
+	for (uint32_t work = 1; entry != NULL; work++) {
+		if (work % 64 == 0 && os_now_us() >= deadline) return false;
+
+		struct PieceTableEntry *next = entry->next;
+		if (entry->length == 0) {
+			remove_entry(table, entry);
+			table->generation++;
+			entry = next;
+		} else if (next != NULL && text_contiguous(entry, next)) {
+			entry->length += next->length;
+			entry->newlines += next->newlines;
+			remove_entry(table, next);
+			update_ancestors(entry);
+			table->generation++;
+		} else {
+			defrag->coalesce_index += entry->length;
+			entry = next;
+		}
+	}
+	return true;
+}
+
+/* Returns whether the modify chunk in the slot is worth compacting: at least half of it is dead text,
+ * and it is not the tail chunk (which is still being appended to).
+ */
+static inline bool modify_chunk_sparse(struct PieceTable *table, uint32_t slot) {
+	struct ModifyChunk *chunk = table->modify_chunks[slot]; // alias
+	return chunk != NULL && slot != table->modify_tail && chunk->referenced <= chunk->count / 2;
+}
+
+/* Adds every entry within the tree whose text is in a sparse modify chunk to the defragmentation pass's list of entries to move. */
+static void defrag_gather(struct PieceTable *table, struct Defrag *defrag, struct PieceTableEntry *root) {
+	if (root == NULL) return;
+	defrag_gather(table, defrag, root->left);
+	if (root->buf_id == BUF_ID_MODIFY && modify_chunk_sparse(table, root->start >> MODIFY_CHUNK_BITS)) {
+		defrag->entries[defrag->entries_count] = root;
+		defrag->entries_count++;
+	}
+	defrag_gather(table, defrag, root->right);
+}
+
+/* Moves the text still referenced out of every sparse modify chunk (see modify_chunk_sparse()) onto the tail chunk,
+ * then remaps each entry to its moved text and frees the chunks that are left unreferenced.
+ * Moving at most half of a chunk to free all of it keeps compaction at amortized O(1) per inserted char.
+ * Live entries are moved in file order, which makes neighbouring inserts contiguous for the next coalescing pass.
+ * Returns whether compaction is done (or not needed) rather than stopped at the deadline.
+ */
+static bool defrag_compact(struct FileBuf *fb, uint64_t deadline) {
+	struct PieceTable *table = &fb->table; // alias
+	struct Defrag *defrag = &fb->defrag; // alias
+
+	if (defrag->entries == NULL) {
+		uint32_t slot = 0;
+		while (slot < table->modify_slots && !modify_chunk_sparse(table, slot)) {
+			slot++;
+		}
+		if (slot == table->modify_slots) return true; // not worth it yet
+
+		// gather every entry that references a sparse chunk: those in the table and those held by history
+		defrag->entries = malloc(sizeof(struct PieceTableEntry *) * table->entry_pool.live_count);
+		defrag->starts = malloc(sizeof(index_t) * table->entry_pool.live_count);
+		defrag->entries_count = 0;
+		for (struct PieceTableEntry *entry = table->first_entry; entry != NULL; entry = entry->next) {
+			if (entry->buf_id == BUF_ID_MODIFY && modify_chunk_sparse(table, entry->start >> MODIFY_CHUNK_BITS)) {
+				defrag->entries[defrag->entries_count] = entry;
+				defrag->entries_count++;
+			}
+		}
+		for (uint32_t i = 0; i < fb->history_count; i++) {
+			defrag_gather(table, defrag, fb->history[i].removed);
+			defrag_gather(table, defrag, fb->history[i].added);
+		}
+		defrag->entries_done = 0;
+		defrag->entry_copied = 0;
+	}
+
+	// copy text a bounded amount at a time. each entry's text is kept within a single chunk
+	while (defrag->entries_done < defrag->entries_count) {
+		if (os_now_us() >= deadline) return false;
+
+		struct PieceTableEntry *entry = defrag->entries[defrag->entries_done];
+		if (defrag->entry_copied == 0) {
+			if (modify_tail_space(table) < entry->length) {
+				new_modify_chunk(table);
+			}
+			defrag->starts[defrag->entries_done] = ((index_t) table->modify_tail << MODIFY_CHUNK_BITS)
+				+ table->modify_chunks[table->modify_tail]->count;
+		}
+		index_t length = entry->length - defrag->entry_copied;
+		if (length > DEFRAG_COPY_SIZE) {
+			length = DEFRAG_COPY_SIZE;
+		}
+		append_modify_text(table, filebuf_get_text(fb, entry) + defrag->entry_copied, length);
+		defrag->entry_copied += length;
+		if (defrag->entry_copied == entry->length) {
+			defrag->entries_done++;
+			defrag->entry_copied = 0;
+		}
+	}
+
+	// remap the entries to their moved text, which releases all of the sparse chunks
+	for (uint32_t i = 0; i < defrag->entries_count; i++) {
+		struct PieceTableEntry *entry = defrag->entries[i]; // alias
+		table->modify_chunks[defrag->starts[i] >> MODIFY_CHUNK_BITS]->referenced += entry->length;
+		release_modify_text(table, entry->start, entry->length);
+		entry->start = defrag->starts[i];
+	}
+	free_unreferenced_chunks(table); // e.g. text moved by a pass that was restarted before finishing
+	table->generation++;
+	free(defrag->entries);
+	free(defrag->starts);
+	defrag->entries = NULL;
+	defrag->starts = NULL;
+	defrag->compacted = true;
+	return true;
+}
+
+/* Does up to about budget_us microseconds of work towards defragmenting the file buffer, e.g. while the user is idle:
+ * entries with contiguous text are merged back together, and modify chunks holding mostly dead text
+ * (referenced by neither the table nor history) are compacted and freed. Progress is kept between calls, and restarted if the file buffer was changed in between.
+ * Returns whether there is still work left to do.
+ */
+bool filebuf_defragment_step(struct FileBuf *fb, uint32_t budget_us) {
+	struct Defrag *defrag = &fb->defrag; // alias
+	if (fb->table.unfreed_chunks) {
+		free_unreferenced_chunks(&fb->table); // kept for snapshots, which may have been released since
+	}
+	if (defrag->generation != fb->table.generation) {
+		defrag_reset(defrag);
+	}
+
+	const uint64_t deadline = os_now_us() + budget_us;
+	bool finished_phase = true;
+	while (finished_phase && defrag->phase != DEFRAG_PHASE_DONE) {
+		if (defrag->phase == DEFRAG_PHASE_COALESCE) {
+			finished_phase = defrag_coalesce(fb, deadline);
+			if (finished_phase) {
+				defrag->phase = defrag->compacted ? DEFRAG_PHASE_DONE : DEFRAG_PHASE_COMPACT;
+			}
+		} else {
+			finished_phase = defrag_compact(fb, deadline);
+			if (finished_phase) {
+				// compacting made neighbouring inserts contiguous, so coalesce once more
+				defrag->phase = defrag->compacted ? DEFRAG_PHASE_COALESCE : DEFRAG_PHASE_DONE;
+				defrag->coalesce_index = 0;
+			}
+		}
+	}
+
+	defrag->generation = fb->table.generation; // changes made by this pass don't invalidate it
+	return defrag->phase != DEFRAG_PHASE_DONE;
+}
+
+/* Fully defragments the file buffer at once (see filebuf_defragment_step()). */
+void filebuf_defragment(struct FileBuf *fb) {
+	while (filebuf_defragment_step(fb, UINT32_MAX));
+}
+
+/* Returns a pointer to the beginning of the entry's text in the file.
+ * WARNING: entry texts are NOT separated by null terms! You must bound the text by the entry's length!
+ */
+const char *filebuf_get_text(struct FileBuf *fb, struct PieceTableEntry *entry) {
+	if (entry->buf_id == BUF_ID_ORIGIN) {
+		return fb->table.origin_buf + entry->start;
+	}
+	return fb->table.modify_chunks[entry->start >> MODIFY_CHUNK_BITS]->text + (entry->start & (MODIFY_CHUNK_SIZE - 1));
+}
+
+/* Initializes the cursor to the file index within the file buffer. The file buffer is not accessed until the cursor is used. */
+void filebuf_cursor_init(struct FileBufCursor *cursor, struct FileBuf *fb, index_t file_index) {
+	cursor->fb = fb;
+	cursor->entry = NULL;
+	cursor->entry_start = 0;
+	cursor->index = file_index;
+	cursor->generation = 0;
+}
+
+/* Looks up the entry at the cursor's index from the root of the table in O(log n), clamping the index to the file. */
+static void cursor_lookup(struct FileBufCursor *cursor) {
+	struct FileBuf *fb = cursor->fb; // alias
+	if (cursor->index > fb->length) {
+		cursor->index = fb->length;
+	}
+	cursor->generation = fb->table.generation;
+
+	index_t relative_index = 0;
+	cursor->entry = filebuf_entry_at(fb, cursor->index, &relative_index);
+	if (cursor->entry == NULL) {
+		// at the end of the file
+		cursor->entry = tree_last(fb->table.root);
+		relative_index = cursor->entry == NULL ? 0 : cursor->entry->length;
+	}
+	cursor->entry_start = cursor->index - relative_index;
+}
+
+/* Looks the cursor's entry up again if the file buffer changed since it was last looked up. */
+static inline void cursor_validate(struct FileBufCursor *cursor) {
+	if (cursor->entry == NULL || cursor->generation != cursor->fb->table.generation) {
+		cursor_lookup(cursor);
+	}
+}
+
+/* Moves the cursor to the file index (clamped to the end of the file).
+ * Steps through neighbouring entries when the index is near, so takes O(1) for nearby indices and O(log n) at worst.
+ */
+void filebuf_cursor_seek(struct FileBufCursor *cursor, index_t file_index) {
+	if (file_index > cursor->fb->length) {
+		file_index = cursor->fb->length;
+	}
+	if (cursor->entry == NULL || cursor->generation != cursor->fb->table.generation) {
+		cursor->index = file_index;
+		cursor_lookup(cursor);
+		return;
+	}
+
+	struct PieceTableEntry *entry = cursor->entry;
+	index_t entry_start = cursor->entry_start;
+	for (int steps = 0; steps < CURSOR_MAX_STEPS; steps++) {
+		if (file_index < entry_start) {
+			entry = entry->prev;
+			entry_start -= entry->length;
+		} else if (file_index >= entry_start + entry->length && entry->next != NULL) {
+			entry_start += entry->length;
+			entry = entry->next;
+		} else {
+			cursor->entry = entry;
+			cursor->entry_start = entry_start;
+			cursor->index = file_index;
+			return;
+		}
+	}
+
+	// too far away to step to
+	cursor->index = file_index;
+	cursor_lookup(cursor);
+}
+
+/* Returns the char at the cursor without moving it, or FILEBUF_EOF if at the end of the file. */
+int filebuf_cursor_peek(struct FileBufCursor *cursor) {
+	cursor_validate(cursor);
+	struct PieceTableEntry *entry = cursor->entry; // alias
+	if (entry == NULL || cursor->index == cursor->entry_start + entry->length) return FILEBUF_EOF;
+	return (unsigned char) filebuf_get_text(cursor->fb, entry)[cursor->index - cursor->entry_start];
+}
+
+/* Returns the char at the cursor and moves the cursor past it, or returns FILEBUF_EOF if at the end of the file. O(1). */
+int filebuf_cursor_next(struct FileBufCursor *cursor) {
+	cursor_validate(cursor);
+	struct PieceTableEntry *entry = cursor->entry; // alias
+	if (entry == NULL || cursor->index == cursor->entry_start + entry->length) return FILEBUF_EOF;
+
+	const char c = filebuf_get_text(cursor->fb, entry)[cursor->index - cursor->entry_start];
+	cursor->index++;
+	if (cursor->index == cursor->entry_start + entry->length && entry->next != NULL) {
+		cursor->entry_start += entry->length;
+		cursor->entry = entry->next;
+	}
+	return (unsigned char) c;
+}
+
+/* Moves the cursor back one char and returns that char, or returns FILEBUF_EOF if at the start of the file. O(1). */
+int filebuf_cursor_prev(struct FileBufCursor *cursor) {
+	cursor_validate(cursor);
+	if (cursor->entry == NULL) return FILEBUF_EOF;
+	if (cursor->index == cursor->entry_start) {
+		if (cursor->entry->prev == NULL) return FILEBUF_EOF;
+		cursor->entry = cursor->entry->prev;
+		cursor->entry_start -= cursor->entry->length;
+	}
+
+	cursor->index--;
+	return (unsigned char) filebuf_get_text(cursor->fb, cursor->entry)[cursor->index - cursor->entry_start];
+}
+
+/* Returns the text from the cursor to the end of its entry, storing its length in 'length', and moves the cursor past it.
+ * Returns NULL if at the end of the file. The text is only valid until the file buffer is changed.
+ */
+const char *filebuf_cursor_next_span(struct FileBufCursor *cursor, index_t *length) {
+	cursor_validate(cursor);
+	struct PieceTableEntry *entry = cursor->entry; // alias
+	if (entry == NULL || cursor->index == cursor->entry_start + entry->length) {
+		*length = 0;
+		return NULL;
+	}
+
+	const char *span = filebuf_get_text(cursor->fb, entry) + (cursor->index - cursor->entry_start);
+	*length = cursor->entry_start + entry->length - cursor->index;
+	cursor->index += *length;
+	if (entry->next != NULL) {
+		cursor->entry_start += entry->length;
+		cursor->entry = entry->next;
+	}
+	return span;
+}
+
+/* Returns the text from the start of the entry before the cursor up to the cursor, storing its length in 'length',
+ * and moves the cursor back to the start of it. Returns NULL if at the start of the file.
+ * The text is only valid until the file buffer is changed.
+ */
+const char *filebuf_cursor_prev_span(struct FileBufCursor *cursor, index_t *length) {
+	cursor_validate(cursor);
+	if (cursor->entry == NULL || (cursor->index == cursor->entry_start && cursor->entry->prev == NULL)) {
+		*length = 0;
+		return NULL;
+	}
+	if (cursor->index == cursor->entry_start) {
+		cursor->entry = cursor->entry->prev;
+		cursor->entry_start -= cursor->entry->length;
+	}
+
+	*length = cursor->index - cursor->entry_start;
+	cursor->index = cursor->entry_start;
+	return filebuf_get_text(cursor->fb, cursor->entry);
+}
+
+/* Returns the character at the index in the file, or, value 0 if unable to get a character.
+ * NOTE: this should not be used for iterating over the file buffer to access each character in succession and the like.
+ * Doing so would be incredibly inefficient. Instead, use a FileBufCursor.
+ */
+char filebuf_char_at(struct FileBuf *fb, index_t file_index) {
+	if (file_index >= fb->length) return 0;
+
+	index_t relative_index;
+	struct PieceTableEntry *at = filebuf_entry_at(fb, file_index, &relative_index);
+	if (at == NULL) return (char) 0;
+
+	const char *text = filebuf_get_text(fb, at);
+	return text[relative_index];
+}
+
+/* Returns the number of lines in the file. An empty file, or one not ending in a new-line, still counts its last line. */
+index_t filebuf_line_count(struct FileBuf *fb) {
+	if (fb->table.root == NULL) return 1;
+	return fb->table.root->subtree_newlines + 1;
+}
+
+/* Sets 'result_index' to the file index of the first character of the given (zero-based) line.
+ * Walks down the tree by new-line counts, so takes O(log n).
+ * Returns whether successful. False if the file does not have that many lines.
+ */
+bool filebuf_line_to_offset(struct FileBuf *fb, index_t line, index_t *result_index) {
+	if (line == 0) {
+		*result_index = 0;
+		return true;
+	}
+	if (line >= filebuf_line_count(fb)) return false;
+
+	// find the line-th new-line; the line starts right after it
+	index_t file_index = 0;
+	struct PieceTableEntry *at = fb->table.root;
+	while (at != NULL) {
+		index_t left_newlines = at->left == NULL ? 0 : at->left->subtree_newlines;
+		index_t left_length = at->left == NULL ? 0 : at->left->subtree_length;
+		if (line <= left_newlines) {
+			at = at->left;
+		} else if (line <= left_newlines + at->newlines) {
+			index_t offset;
+			struct LineIndex *lines = lines_of(&fb->table, at->buf_id, at->start, &offset);
+			index_t first = line_index_lower_bound(lines, offset);
+			index_t newline_index = lines->offsets[first + (line - left_newlines) - 1];
+			*result_index = file_index + left_length + (newline_index - offset) + 1;
+			return true;
+		} else {
+			line -= left_newlines + at->newlines;
+			file_index += left_length + at->length;
+			at = at->right;
+		}
+	}
+	return false;
+}
+
+/* Returns the (zero-based) line that the character at the file index is on, in O(log n).
+ * Indices past the end of the file are on the last line.
+ */
+index_t filebuf_offset_to_line(struct FileBuf *fb, index_t file_index) {
+	index_t line = 0;
+	struct PieceTableEntry *at = fb->table.root;
+	while (at != NULL) {
+		index_t left_length = at->left == NULL ? 0 : at->left->subtree_length;
+		index_t left_newlines = at->left == NULL ? 0 : at->left->subtree_newlines;
+		if (file_index < left_length) {
+			at = at->left;
+		} else if (file_index < left_length + at->length) {
+			return line + left_newlines + count_newlines(&fb->table, at->buf_id, at->start, file_index - left_length);
+		} else {
+			line += left_newlines + at->newlines;
+			file_index -= left_length + at->length;
+			at = at->right;
+		}
+	}
+	return line;
+}
+
+/* Returns whether the file's text starting at the relative index within the entry matches the whole pattern,
+ * continuing into following entries as needed. The match must also end before end_index.
+ * file_index - the file index corresponding to the relative index within the entry
+ */
+static bool matches_at(struct FileBuf *fb, struct PieceTableEntry *entry, index_t relative_index, index_t file_index, index_t end_index, const char *pattern, index_t pattern_length) {
+	if (end_index - file_index < pattern_length) return false;
+
+	while (pattern_length > 0) {
+		if (relative_index >= entry->length) {
+			entry = entry->next;
+			relative_index = 0;
+			if (entry == NULL) return false;
+		}
+		index_t compare_length = entry->length - relative_index;
+		if (compare_length > pattern_length) {
+			compare_length = pattern_length;
+		}
+		if (memcmp(filebuf_get_text(fb, entry) + relative_index, pattern, compare_length) != 0) return false;
+		pattern += compare_length;
+		pattern_length -= compare_length;
+		relative_index += compare_length;
+	}
+	return true;
+}
+
+/* Sets 'result_index' to the file index of the first occurrence of the given character sequence,
+ * search constrained between start_index (inclusive) and end_index (exclusive), i.e. the whole occurrence must be within that range.
+ * Each entry's text is searched as a whole (see search.h); occurrences split between entries are checked at each entry boundary.
+ * string - must be a valid, null-terminated string.
+ * Returns whether successful. False if no occurrence found (or invalid range or empty matching string).
+ */
+bool filebuf_index_of(struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, index_t *result_index) {
+	if (end_index > fb->length) {
+		end_index = fb->length;
+	}
+	if (end_index <= start_index || string[0] == '\0') return false;
+
+	if (string[0] == '\n' && string[1] == '\0') {
+		// new-lines are already indexed, so the next one is simply the end of the current line
+		index_t next_line_start;
+		if (!filebuf_line_to_offset(fb, filebuf_offset_to_line(fb, start_index) + 1, &next_line_start)) return false;
+		if (next_line_start > end_index) return false;
+		*result_index = next_line_start - 1;
+		return true;
+	}
+
+	const index_t string_length = strlen(string);
+	index_t relative_index; // within current entry
+	struct PieceTableEntry *at = filebuf_entry_at(fb, start_index, &relative_index);
+	index_t file_index = start_index; // file index of at's text + relative_index
+	while (at != NULL && file_index < end_index) {
+		const char *text = filebuf_get_text(fb, at) + relative_index;
+		index_t span_length = at->length - relative_index;
+		if (span_length > end_index - file_index) {
+			span_length = end_index - file_index;
+		}
+
+		// occurrences fully within this entry
+		const char *found = search_find(text, span_length, string, string_length);
+		if (found != NULL) {
+			*result_index = file_index + (found - text);
+			return true;
+		}
+
+		// occurrences starting near the end of this entry and continuing into the next ones
+		index_t i = span_length < string_length ? 0 : span_length - string_length + 1;
+		for (; i < span_length; i++) {
+			if (text[i] == string[0] && matches_at(fb, at, relative_index + i, file_index + i, end_index, string, string_length)) {
+				*result_index = file_index + i;
+				return true;
+			}
+		}
+
+		file_index += span_length;
+		relative_index = 0;
+		at = at->next;
+	}
+	return false;
+}
+
+/* Sets 'result_index' to the file index of the last occurrence of the given character sequence,
+ * search constrained between start_index (inclusive) and end_index (exclusive), i.e. the whole occurrence must be within that range.
+ * Will not modify it if fails.
+ * string - must be a valid, null-terminated string.
+ * Returns whether successful. False if no occurrence found (or invalid range or empty matching string).
+ */
+bool filebuf_last_index_of(struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, index_t *result_index) {
+	if (end_index > fb->length) {
+		end_index = fb->length;
+	}
+	if (end_index <= start_index || string[0] == '\0') return false;
+
+	if (string[0] == '\n' && string[1] == '\0') {
+		// new-lines are already indexed, so the previous one is simply the one ending the previous line
+		index_t line = filebuf_offset_to_line(fb, end_index - 1);
+		if (filebuf_char_at(fb, end_index - 1) == '\n') {
+			*result_index = end_index - 1;
+			return true;
+		}
+		index_t line_start;
+		if (line == 0) return false;
+		filebuf_line_to_offset(fb, line, &line_start);
+		if (line_start - 1 < start_index) return false;
+		*result_index = line_start - 1;
+		return true;
+	}
+
+	const index_t string_length = strlen(string);
+	index_t relative_index;
+	struct PieceTableEntry *at = filebuf_entry_at(fb, end_index - 1, &relative_index);
+	index_t span_end = end_index; // file index just past the part of at being searched
+	while (at != NULL && span_end > start_index) {
+		index_t span_length = relative_index + 1; // from the start of at to span_end
+		if (span_length > span_end - start_index) {
+			span_length = span_end - start_index;
+		}
+		const index_t span_start = span_end - span_length;
+		const char *text = filebuf_get_text(fb, at) + (relative_index + 1 - span_length);
+
+		// occurrences starting near the end of this entry and continuing into the next ones
+		index_t i = span_length;
+		index_t lowest = span_length < string_length ? 0 : span_length - string_length + 1;
+		while (i > lowest) {
+			i--;
+			if (text[i] == string[0] && matches_at(fb, at, relative_index + 1 - span_length + i, span_start + i, end_index, string, string_length)) {
+				*result_index = span_start + i;
+				return true;
+			}
+		}
+
+		// occurrences fully within this entry
+		const char *found = search_find_last(text, span_length, string, string_length);
+		if (found != NULL) {
+			*result_index = span_start + (found - text);
+			return true;
+		}
+
+		span_end = span_start;
+		at = at->prev;
+		if (at != NULL) {
+			relative_index = at->length - 1;
+		}
+	}
+	return false;
+}
+
+/* Replaces every occurrence of the string in the file with the replacement, as a single change (see filebuf_replace_ranges()).
+ * Occurrences are found from left to right without overlapping, in a single pass over the file.
+ * string - must be a valid, non-empty, null-terminated string.
+ * replacement - must be a valid, null-terminated string.
+ * Returns the number of occurrences replaced.
+ */
+index_t filebuf_replace_all(struct FileBuf *fb, const char *string, const char *replacement) {
+	const index_t string_length = strlen(string);
+	struct FileBufRange *ranges = NULL;
+	index_t count = 0;
+	index_t size = 0;
+	index_t index = 0;
+	index_t found_index;
+	while (filebuf_index_of(fb, index, fb->length, string, &found_index)) {
+		if (count == size) {
+			size = size == 0 ? INIT_BUF_SIZE : size * 2;
+			ranges = realloc(ranges, sizeof(struct FileBufRange) * size);
+		}
+		ranges[count].index = found_index;
+		ranges[count].length = string_length;
 		count++;
+		index = found_index + string_length;
+	}
+
+	if (count > 0 && !filebuf_replace_ranges(fb, ranges, count, replacement, strlen(replacement))) {
+		count = 0;
+	}
+	free(ranges);
+	return count;
+}
+
+/* Copies the range of the input file to the end of the output file within the kernel, without passing it through user space.
+ * Uses copy_file_range() (which may share extents on filesystems like btrfs or XFS), falling back to sendfile().
+ * Returns whether successful. If not, the output may have been partially written and should be rewound before writing it another way.
+ */
+static bool copy_range(int out_fd, int in_fd, off_t offset, size_t length) {
+	while (length > 0) {
+		ssize_t copied = copy_file_range(in_fd, &offset, out_fd, NULL, length, 0);
+		if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+			copied = sendfile(out_fd, in_fd, &offset, length);
+		}
+		if (copied < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		if (copied == 0) return false; // input file shrank
+		length -= copied;
+	}
+	return true;
+}
+
+/* Syncs the directory containing the path to disk, so that changes to its entries (e.g. renames) are durable. */
+static void sync_parent_dir(const char *path) {
+	const size_t path_length = strlen(path);
+	char dir_path[path_length + 2];
+	memcpy(dir_path, path, path_length + 1);
+	char *slash = strrchr(dir_path, '/');
+	if (slash == NULL) {
+		strcpy(dir_path, ".");
+	} else if (slash == dir_path) {
+		dir_path[1] = '\0'; // root
+	} else {
+		*slash = '\0';
+	}
+
+	int fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) return;
+	fsync(fd);
+	close(fd);
+}
+
+/* Attempts to write the buffer to file at the filebuf's path.
+ * The file is written in full to a temporary file next to it, which is then synced to disk and renamed over it,
+ * so the file is never left partially written. Each entry is written as a single iovec, and long unchanged
+ * ranges of the original file are copied by the kernel directly (see copy_range()).
+ * If the path is a symlink, the file it points to is the one replaced, keeping its permissions and (as far as allowed) owner.
+ * Returns whether successful.
+ */
+bool filebuf_write(struct FileBuf *fb) {
+	if (fb->path == NULL) return false;
+
+	// replace the file a symlink points to rather than the symlink itself. a new file has nothing to resolve
+	char *resolved_path = realpath(fb->path, NULL);
+	const char *file_path = resolved_path != NULL ? resolved_path : fb->path;
+
+	// same directory, so that the rename is atomic
+	const size_t path_length = strlen(file_path);
+	char temp_path[path_length + sizeof(".XXXXXX")];
+	memcpy(temp_path, file_path, path_length);
+	memcpy(temp_path + path_length, ".XXXXXX", sizeof(".XXXXXX"));
+	int fd = mkstemp(temp_path);
+	if (fd == -1) {
+		free(resolved_path);
+		return false;
+	}
+
+	// keep the permissions and owner of the file being replaced (mkstemp() only allows the one saving it)
+	struct stat filestat;
+	mode_t mode;
+	if (stat(file_path, &filestat) == 0) {
+		mode = filestat.st_mode & 07777;
+		if (fchown(fd, filestat.st_uid, filestat.st_gid) == -1 && fchown(fd, -1, filestat.st_gid) == -1) {
+			// only root may give a file away, so it is left owned by whoever saved it (and by their group, if not a member of its own)
+		}
+	} else {
+		mode_t mask = umask(0);
+		umask(mask);
+		mode = 0666 & ~mask;
+	}
+	if (fchmod(fd, mode) == -1) goto __filebuf_write_fail__; // after fchown(), which may clear setuid and setgid
+
+	struct iovec iovecs[IOV_MAX];
+	int iovec_count = 0;
+	off_t written = 0;
+	for (struct PieceTableEntry *at = fb->table.first_entry; at != NULL; at = at->next) {
+		if (at->buf_id == BUF_ID_ORIGIN && fb->table.origin_fd != -1 && at->length >= COPY_RANGE_MIN_SIZE) {
+			if (!os_write_iovecs(fd, iovecs, iovec_count)) goto __filebuf_write_fail__;
+			iovec_count = 0;
+			if (!copy_range(fd, fb->table.origin_fd, at->start, at->length)) {
+				// fall back to writing it from memory
+				if (lseek(fd, written, SEEK_SET) == -1 || ftruncate(fd, written) == -1) goto __filebuf_write_fail__;
+				struct iovec iovec = {(void *) filebuf_get_text(fb, at), at->length};
+				if (!os_write_iovecs(fd, &iovec, 1)) goto __filebuf_write_fail__;
+			}
+		} else {
+			if (iovec_count == IOV_MAX) {
+				if (!os_write_iovecs(fd, iovecs, iovec_count)) goto __filebuf_write_fail__;
+				iovec_count = 0;
+			}
+			iovecs[iovec_count].iov_base = (void *) filebuf_get_text(fb, at);
+			iovecs[iovec_count].iov_len = at->length;
+			iovec_count++;
+		}
+		written += at->length;
+	}
+	if (!os_write_iovecs(fd, iovecs, iovec_count)) goto __filebuf_write_fail__;
+
+	if (fsync(fd) == -1) goto __filebuf_write_fail__;
+	if (close(fd) == -1) {
+		unlink(temp_path);
+		free(resolved_path);
+		return false;
 	}
+	if (rename(temp_path, file_path) == -1) {
+		unlink(temp_path);
+		free(resolved_path);
+		return false;
+	}
+
+	sync_parent_dir(file_path); // make the rename itself durable
+	free(resolved_path);
+
+	// everything journaled so far is in the file now
+	journal_reset(&fb->journal, fb->path);
+	fb->journal_base = fb->history_count;
+	return true;
 
-	struct PieceTableEntry *first_entry = next_entry(&fb->table);
-	first_entry->prev = NULL;
-	first_entry->next = NULL;
-	first_entry->start = 0;
-	first_entry->length = count;
-	first_entry->buf_id = BUF_ID_ORIGIN;
-	first_entry->saved_to_file = true;
+__filebuf_write_fail__:
+	close(fd);
+	unlink(temp_path);
+	free(resolved_path);
+	return false;
+}
+
+/* Reads everything remaining in the file descriptor into a new heap buffer, for files that cannot be mapped (pipes, devices, etc.).
+ * size_hint - expected number of bytes, or 0 if unknown
+ * Returns the buffer (NULL on failure) and stores the number of bytes read in 'length'.
+ */
+static char *read_all(int fd, size_t size_hint, index_t *length) {
+	size_t size = size_hint > 0 ? size_hint + 1 : INIT_BUF_SIZE; // +1 so EOF is seen without growing
+	size_t count = 0;
+	char *buf = malloc(sizeof(char) * size);
+	if (buf == NULL) return NULL;
+
+	while (1) {
+		if (count == size) {
+			size *= 2;
+			char *grown = realloc(buf, sizeof(char) * size);
+			if (grown == NULL) break;
+			buf = grown;
+		}
+		ssize_t read_count = read(fd, buf + count, size - count);
+		if (read_count == 0) {
+			*length = count;
+			return buf;
+		}
+		if (read_count < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		count += read_count;
+		if (count > (index_t) -1) break; // too large to index
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Attempts to load the file at the path into the buffer.
+ * Regular files are memory mapped read-only instead of copied into memory. The whole file is still read once while opening,
+ * to index its new-lines and check that it is valid UTF-8 (see scan_origin()): only the copy is avoided.
+ * fb - should be an empty, initialized FileBuf
+ * Returns whether successful.
+ */
+bool filebuf_read(struct FileBuf *fb, char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return false;
+
+	struct stat filestat;
+	if (fstat(fd, &filestat) == -1 || filestat.st_size > (index_t) -1) {
+		close(fd);
+		return false;
+	}
+
+	index_t count = 0;
+	if (S_ISREG(filestat.st_mode) && filestat.st_size > 0) {
+		void *map = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			// the whole file is about to be scanned once (see scan_origin())
+			madvise(map, filestat.st_size, MADV_SEQUENTIAL);
+			madvise(map, filestat.st_size, MADV_WILLNEED);
+			fb->table.origin_buf = map;
+			fb->table.origin_buf_mapped = true;
+			count = filestat.st_size;
+		}
+	}
+	if (fb->table.origin_buf == NULL) {
+		// not mappable, so fall back to reading it in bulk
+		char *buf = read_all(fd, S_ISREG(filestat.st_mode) ? filestat.st_size : 0, &count);
+		if (buf == NULL) {
+			close(fd);
+			return false;
+		}
+		fb->table.origin_buf = buf;
+	}
+	if (fb->table.origin_buf_mapped) {
+		fb->table.origin_fd = fd; // kept open for copying unchanged ranges when saving
+	} else {
+		close(fd);
+	}
+	fb->path = path;
+	fb->table.origin_buf_size = count;
+
+	scan_origin(&fb->table);
+	if (fb->table.origin_buf_mapped) {
+		// from here on access follows the viewport rather than the file order
+		madvise((void *) fb->table.origin_buf, count, MADV_NORMAL);
+	}
+
+	struct PieceTableEntry *first_entry = NULL;
+	if (count > 0) {
+		first_entry = next_entry(&fb->table);
+		first_entry->start = 0;
+		first_entry->length = count;
+		first_entry->newlines = fb->table.origin_lines.count;
+		first_entry->buf_id = BUF_ID_ORIGIN;
+		update_entry(first_entry);
+	}
 
 	fb->length = count;
-	fb->table.free_entries = NULL;
+	fb->table.root = first_entry;
 	fb->table.first_entry = first_entry;
-	fclose(file);
+	record_change(fb, 0, 0, count);
+	fb->table.generation++;
 	return true;
 }
 
+/* Applies a replace record replayed from the journal (see JOURNAL_RECORD_REPLACE). Returns whether it was valid. */
+static bool replay_replace(struct FileBuf *fb, const struct JournalRecord *record, const char *text) {
+	const uint64_t count = record->index;
+	const uint64_t replacement_length = record->removed_length;
+	if (replacement_length > record->text_length || replacement_length > (index_t) -1 || count > (index_t) -1) return false;
+	if ((record->text_length - replacement_length) / (sizeof(uint64_t) * 2) != count
+			|| (record->text_length - replacement_length) % (sizeof(uint64_t) * 2) != 0) return false;
+
+	struct FileBufRange *ranges = malloc(sizeof(struct FileBufRange) * count);
+	const char *at = text + replacement_length;
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t range[2]; // not aligned within the record
+		memcpy(range, at, sizeof(range));
+		at += sizeof(range);
+		if (range[0] > (index_t) -1 || range[1] > (index_t) -1) {
+			free(ranges);
+			return false;
+		}
+		ranges[i].index = range[0];
+		ranges[i].length = range[1];
+	}
+	const bool valid = filebuf_replace_ranges(fb, ranges, count, text, replacement_length);
+	free(ranges);
+	return valid;
+}
+
+/* Applies a batch record replayed from the journal (see JOURNAL_RECORD_BATCH). Returns whether it was valid. */
+static bool replay_batch(struct FileBuf *fb, const struct JournalRecord *record, const char *text) {
+	const uint64_t count = record->index;
+	if (count > (index_t) -1 || count > record->text_length / (sizeof(uint64_t) * 4)) return false;
+	const char *texts = text + count * sizeof(uint64_t) * 4; // the edits' texts follow their headers
+	const uint64_t texts_length = record->text_length - count * sizeof(uint64_t) * 4;
+
+	struct FileBufEdit *edits = malloc(sizeof(struct FileBufEdit) * count);
+	const char *at = text;
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t edit[4]; // not aligned within the record
+		memcpy(edit, at, sizeof(edit));
+		at += sizeof(edit);
+		if (edit[0] > (index_t) -1 || edit[1] > (index_t) -1 || edit[2] > (index_t) -1
+				|| edit[3] > texts_length || edit[2] > texts_length - edit[3]) {
+			free(edits);
+			return false;
+		}
+		edits[i].index = edit[0];
+		edits[i].removed_length = edit[1];
+		edits[i].length = edit[2];
+		edits[i].text = texts + edit[3]; // edits sharing text again share the same pointer, as when they were made
+	}
+	const bool valid = filebuf_edit_batch(fb, edits, count);
+	free(edits);
+	return valid;
+}
+
+/* Applies a record replayed from the journal (see filebuf_open_journal()). Returns whether it was valid. */
+static bool replay_record(void *arg, const struct JournalRecord *record, const char *text) {
+	struct FileBuf *fb = arg;
+	if (record->type == JOURNAL_RECORD_REPLACE) return replay_replace(fb, record, text);
+	if (record->type == JOURNAL_RECORD_BATCH) return replay_batch(fb, record, text);
+	if (record->index > fb->length || record->removed_length > fb->length - record->index) return false;
+	if (record->text_length > (index_t) -1 - (fb->length - record->removed_length)) return false;
+
+	switch (record->type) {
+	case JOURNAL_RECORD_INSERT:
+		filebuf_insert(fb, (char *) text, record->index, record->text_length, 0, record->removed_length);
+		return true;
+	case JOURNAL_RECORD_UNDO:
+		return filebuf_undo(fb, NULL);
+	case JOURNAL_RECORD_REDO:
+		return filebuf_redo(fb, NULL);
+	case JOURNAL_RECORD_CHANGE:
+		apply_change(fb, text, record->index, record->text_length, record->removed_length);
+		return true;
+	}
+	return false;
+}
+
+/* Starts journaling every edit to the file buffer (see journal.h), so they can be recovered if the editor crashes
+ * before they are saved. Any edits recovered from an earlier crash are replayed first, restoring their history too.
+ * Should be called right after filebuf_read() (or with an empty buffer, if the file does not exist).
+ * Returns the number of edits recovered.
+ */
+uint32_t filebuf_open_journal(struct FileBuf *fb) {
+	if (fb->path == NULL) return 0;
+	return journal_open(&fb->journal, fb->path, replay_record, fb);
+}
+
 /* For debugging; prints out the piece table in a readable fashion. */
 void filebuf_print(struct FileBuf *fb) {
 	printf("\n-----------------------\n"
@@ -513,7 +2308,7 @@ void filebuf_print(struct FileBuf *fb) {
 		   "-----------------------\n");
 	struct PieceTableEntry *at = fb->table.first_entry;
 	while (at != NULL) {
-		printf("| %i  | %u  | %u  |\n", (int) at->buf_id, at->start, at->length);
+		printf("| %i  | %" PRI_INDEX "  | %" PRI_INDEX "  |\n", (int) at->buf_id, at->start, at->length);
 		at = at->next;
 	}
 }
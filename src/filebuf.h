@@ -11,8 +11,24 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 
+#include "config.h"
+#include "journal.h"
+
+#if INDEX_BITS == 32
 typedef uint32_t index_t; // must be an unsigned integer type
+#define PRI_INDEX PRIu32 // printf format for index_t
+#elif INDEX_BITS == 64
+typedef uint64_t index_t;
+#define PRI_INDEX PRIu64
+#else
+#error INDEX_BITS must be 32 or 64!
+#endif
+
+#define FILEBUF_EOF (-1) // returned when reading past either end of a file buffer
+#define FILEBUF_WATCHERS_MAX 4 // changes a file buffer's edits can be recorded into at once (see filebuf_watch_changes())
 
 #define BUF_ID_ORIGIN false
 #define BUF_ID_MODIFY true
@@ -21,38 +37,190 @@ enum file_event_ids {
 	FILE_EVENT_DELETE,
 	FILE_EVENT_DELETE_THEN_ADD,
 	FILE_EVENT_ADD,
-	FILE_EVENT_APPEND
+	FILE_EVENT_APPEND,
+	FILE_EVENT_REPLACE, // several ranges replaced at once (see filebuf_replace_ranges())
+	FILE_EVENT_BATCH // several edits made at once (see filebuf_edit_batch())
 };
 
+// entries are kept both in a linked list (file order) and in a balanced binary tree (treap) keyed by file position,
+// so that neighbours are O(1) away and any file index is O(log n) away
 struct PieceTableEntry {
 	struct PieceTableEntry *prev; // prior entry in table (closer to start of file)
 	struct PieceTableEntry *next; // following entry in table (closer to end of file)
-	index_t start; // starting index in respective buffer identified by buf_id
+	struct PieceTableEntry *parent; // parent node in the tree. NULL if root (or not in the tree)
+	struct PieceTableEntry *left; // subtree of entries before this one in the file
+	struct PieceTableEntry *right; // subtree of entries after this one in the file
+	index_t start; // starting index in respective buffer identified by buf_id. for modify text, slot << MODIFY_CHUNK_BITS | index within the chunk
 	index_t length; // length in characters
+	index_t subtree_length; // length of this entry plus the lengths of all entries in its left and right subtrees
+	index_t newlines; // number of new-line chars in this entry's text
+	index_t subtree_newlines; // newlines of this entry plus those of all entries in its left and right subtrees
+	uint32_t subtree_entries; // number of entries in this subtree, including this one
+	uint32_t priority; // random heap priority that keeps the tree balanced. never lower than that of any child
 	bool buf_id; // see definitions BUF_ID_*
-	bool saved_to_file; // whether this entry was written to file. used to avoid rewriting already saved data
+};
+
+// sorted indices of every new-line char within one of the piece table's buffers
+struct LineIndex {
+	index_t *offsets;
+	index_t count;
+	index_t size;
+};
+
+#define ENTRY_CHUNK_SIZE 512 // entries per chunk of an EntryPool
+
+// a fixed block of entries. never moved or resized, so pointers to its entries stay valid
+struct EntryChunk {
+	struct PieceTableEntry entries[ENTRY_CHUNK_SIZE]; // first, so they start on the chunk's cache line alignment
+	struct EntryChunk *next; // chunk allocated before this one
+};
+
+// allocator for a table's entries, handing them out of chunks in O(1) and taking them back onto a free list in O(1)
+struct EntryPool {
+	struct EntryChunk *chunks; // newest first. fresh entries are handed out from the newest chunk in order
+	struct PieceTableEntry *free_entries; // entries freed for reuse, linked through 'next'
+	uint32_t chunk_count;
+	uint32_t chunk_used; // entries handed out from the newest chunk so far
+	uint32_t live_count; // entries currently allocated
+	uint32_t free_count; // entries on the free list
+};
+
+// memory used for entries
+struct EntryPoolStats {
+	size_t bytes; // all chunks
+	uint32_t live_entries;
+	uint32_t free_entries;
+	uint32_t chunks;
+};
+
+#define MODIFY_CHUNK_BITS 20
+#define MODIFY_CHUNK_SIZE ((index_t) 1 << MODIFY_CHUNK_BITS) // chars per chunk of modify text
+
+// a fixed block of text added by edits. never moved or resized, so appending never copies earlier text
+struct ModifyChunk {
+	char *text; // MODIFY_CHUNK_SIZE chars, memory mapped so that freeing the chunk returns its memory to the OS
+	struct LineIndex lines; // new-lines within text
+	index_t count; // chars appended so far
+	index_t referenced; // chars referenced by entries in the table or history. the rest is dead
 };
 
 struct PieceTable {
-	char *origin_buf;
-	char *modify_buf;
+	const char *origin_buf; // original file contents. read-only, usually memory mapped directly from the file
+	struct ModifyChunk **modify_chunks; // text added by edits, by slot. NULL slots are free
+	struct LineIndex origin_lines; // new-lines within origin_buf
+	struct PieceTableEntry *root; // root of the tree of entries
 	struct PieceTableEntry *first_entry; // entry at the top of the table
-	struct PieceTableEntry *entries; // memory for each entry. not guaranteed to be in any order
-	struct PieceTableEntry *free_entries; // pointer to head of linked list of memory in entries that has been marked freed
+	struct EntryPool entry_pool; // memory for every entry
+	uint32_t modify_slots; // length of modify_chunks
+	uint32_t modify_tail; // slot of the chunk that new text is appended to
+	index_t origin_buf_size;
+	bool origin_buf_mapped; // whether origin_buf is a memory mapping (munmap) rather than heap memory (free)
+	bool origin_utf8; // whether origin_buf is valid UTF-8, checked while it is scanned for new-lines
+	int origin_fd; // the file origin_buf is mapped from, kept open for copying from when saving. -1 if none
+	uint32_t priority_seed; // state of the generator for entry priorities
+	uint32_t generation; // incremented whenever entries are changed, added or freed
+	atomic_uint snapshots; // snapshots of the text not yet released. while there are any, no modify chunk is freed
+	bool unfreed_chunks; // whether modify chunks nothing references were kept for snapshots, to be freed once they're released
+};
+
+enum defrag_phases {
+	DEFRAG_PHASE_COALESCE, // merging neighbouring entries whose text is contiguous
+	DEFRAG_PHASE_COMPACT, // moving the text still referenced out of mostly dead modify chunks, so they can be freed
+	DEFRAG_PHASE_DONE
+};
+
+// progress of an incremental defragmentation pass, which is restarted whenever the table changes (see filebuf_defragment_step())
+struct Defrag {
+	struct PieceTableEntry **entries; // entries referencing mostly dead modify chunks, in the order their text is moved
+	index_t *starts; // start of each of those entries' moved text
+	uint32_t generation; // table generation the pass is up to date with
 	uint32_t entries_count;
-	uint32_t entries_size;
-	uint32_t modify_buf_count;
-	uint32_t modify_buf_size;
-	uint32_t origin_buf_size;
+	uint32_t entries_done; // entries whose text has been fully moved
+	index_t entry_copied; // chars of the next entry's text moved so far
+	index_t coalesce_index; // file index where coalescing continues
+	bool compacted; // whether modify chunks were already compacted during this pass
+	int phase; // see defrag_phases enum
 };
 
-// an action performed in modifying the piece table, stored in history for undo/redo
+// an action performed in modifying the piece table, stored in history for undo/redo.
+// whichever side of the change is not currently in the table is kept as a detached tree of entries,
+// so undoing or redoing is just swapping one tree for the other (O(log n) no matter how large the change was)
 struct FileEvent {
-	struct PieceTableEntry *entry; // entry modified or created during event
+	struct PieceTableEntry *removed; // entries removed by the event. held here while the event is done, NULL while undone
+	struct PieceTableEntry *added; // entries added by the event. held here while the event is undone, NULL while done
 	int id; // see file_event_ids enum
-	index_t insert_length;
-	index_t delete_before_length;
-	index_t delete_after_length;
+	index_t index; // file index where the change happened
+	index_t removed_length; // number of chars removed
+	index_t added_length; // number of chars added
+	index_t shared_length; // chars referenced by both the removed and added entries (e.g. text a replace left as is), which history doesn't hold on its own
+};
+
+// memory held onto by undo/redo history
+struct FileBufHistoryStats {
+	size_t bytes; // events, entries held by them, and the text those entries reference
+	index_t text_length; // chars of text referenced only by history
+	uint32_t entries; // entries held only by history
+	uint32_t events;
+	uint32_t undoable_events;
+	uint32_t redoable_events;
+};
+
+// a position within a file buffer that remembers the entry it is in, so that reading or moving nearby is O(1)
+// instead of a lookup from the root of the table. still usable after the file buffer changes (it is looked up again then)
+struct FileBufCursor {
+	struct FileBuf *fb;
+	struct PieceTableEntry *entry; // entry containing the char at index (last entry if at the end of the file). NULL until looked up
+	index_t entry_start; // file index of the entry's first char
+	index_t index; // file index of the position. reading forward begins with the char at this index
+	uint32_t generation; // table generation that entry was looked up in
+};
+
+// a range of chars within a file
+struct FileBufRange {
+	index_t index;
+	index_t length;
+};
+
+// one of a batch of edits (see filebuf_edit_batch()): the removed_length chars at index are replaced by text
+struct FileBufEdit {
+	const char *text; // length chars. edits in a row with the same text (pointer and length) share a single copy of it
+	index_t index; // file index from before any of the batch's edits are made
+	index_t removed_length;
+	index_t length;
+};
+
+// text being inserted into a file buffer as it arrives (see filebuf_stream_begin()). it is written straight into
+// the modify chunks, then inserted all at once as a single change
+struct FileBufStream {
+	struct PieceTableEntry *tree; // detached tree of entries holding the text streamed so far
+	struct PieceTableEntry *last; // last of those entries, which more text is added onto when contiguous with it
+	index_t index; // file index the text is inserted at
+	index_t length; // chars streamed so far
+};
+
+// the part of a file buffer's text changed since the changes were last taken (see filebuf_take_change()).
+// any number of edits are merged into the one range covering all of them. each thing kept up to date with the text
+// (e.g. its syntax highlighting) watches its own, so each takes the changes in its own time
+struct FileBufChange {
+	index_t index; // file index where the changed text starts
+	index_t removed_length; // chars the changed text took up before the edits
+	index_t added_length; // chars it takes up now
+	bool changed; // whether anything changed at all
+};
+
+// a contiguous part of a snapshot's text
+struct FileBufSpan {
+	const char *text;
+	index_t length;
+};
+
+// a file buffer's text as it was at one point, which another thread can read while the file buffer carries on being
+// edited (see filebuf_snapshot()). the text itself isn't copied, only where its parts are, as they are never written to
+struct FileBufSnapshot {
+	struct FileBufSpan *spans; // in the order they make up the text
+	uint32_t span_count;
+	index_t length; // in chars
+	struct PieceTable *table; // the text is from. its text is kept until the snapshot is released
 };
 
 // a file buffer for editing a single file
@@ -63,24 +231,63 @@ struct FileBuf {
 	uint32_t history_size;
 	uint32_t history_count;
 	uint32_t history_index; // where to modify history
+	uint32_t history_entries; // entries held by events (see FileEvent)
+	index_t history_text_length; // chars referenced by entries held by events
+	size_t history_budget; // max bytes of memory for history to hold onto. oldest events are dropped to stay within it
+	struct Defrag defrag;
+	struct Journal journal;
+	struct FileBufChange *watchers[FILEBUF_WATCHERS_MAX]; // every edit is recorded into each (see filebuf_watch_changes())
+	uint32_t watcher_count;
+	uint32_t journal_base; // number of events at the start of history that are from before the journal began
 	index_t length; // file length in chars
 };
 
 void filebuf_init(struct FileBuf *fb);
-void filebuf_undo(struct FileBuf *fb);
-void filebuf_redo(struct FileBuf *fb);
+bool filebuf_undo(struct FileBuf *fb, index_t *changed_index);
+bool filebuf_redo(struct FileBuf *fb, index_t *changed_index);
+void filebuf_set_history_budget(struct FileBuf *fb, size_t budget);
+void filebuf_history_stats(struct FileBuf *fb, struct FileBufHistoryStats *stats);
+void filebuf_entry_stats(struct FileBuf *fb, struct EntryPoolStats *stats);
+void filebuf_defragment(struct FileBuf *fb);
+bool filebuf_defragment_step(struct FileBuf *fb, uint32_t budget_us);
 void filebuf_insert(struct FileBuf *fb, char *inserted_text, index_t insert_index, index_t insert_length, index_t delete_before_length, index_t delete_after_length);
+void filebuf_stream_begin(struct FileBuf *fb, struct FileBufStream *stream, index_t insert_index);
+void filebuf_stream_write(struct FileBuf *fb, struct FileBufStream *stream, const char *text, index_t length);
+bool filebuf_stream_read(struct FileBuf *fb, struct FileBufStream *stream, int fd);
+void filebuf_stream_end(struct FileBuf *fb, struct FileBufStream *stream);
+bool filebuf_insert_fd(struct FileBuf *fb, int fd, index_t insert_index, index_t *inserted_length);
+bool filebuf_edit_batch(struct FileBuf *fb, const struct FileBufEdit *edits, index_t count);
+bool filebuf_replace_ranges(struct FileBuf *fb, const struct FileBufRange *ranges, index_t count, const char *replacement, index_t replacement_length);
+void filebuf_snapshot(struct FileBuf *fb, struct FileBufSnapshot *snapshot);
+void filebuf_snapshot_release(struct FileBufSnapshot *snapshot);
+bool filebuf_watch_changes(struct FileBuf *fb, struct FileBufChange *watched);
+void filebuf_unwatch_changes(struct FileBuf *fb, struct FileBufChange *watched);
+bool filebuf_take_change(struct FileBufChange *watched, struct FileBufChange *change);
+void filebuf_change_lines(struct FileBuf *fb, const struct FileBufChange *change, index_t old_line_count, index_t *first, index_t *last, index_t *old_last);
 
-char *filebuf_get_buffer(struct FileBuf *fb, struct PieceTableEntry *entry);
-char *filebuf_get_text(struct FileBuf *fb, struct PieceTableEntry *entry);
+const char *filebuf_get_text(struct FileBuf *fb, struct PieceTableEntry *entry);
 
 struct PieceTableEntry *filebuf_entry_at(struct FileBuf *fb, index_t file_index, index_t *relative_index);
 
 char filebuf_char_at(struct FileBuf *fb, index_t file_index);
 
+void filebuf_cursor_init(struct FileBufCursor *cursor, struct FileBuf *fb, index_t file_index);
+void filebuf_cursor_seek(struct FileBufCursor *cursor, index_t file_index);
+int filebuf_cursor_peek(struct FileBufCursor *cursor);
+int filebuf_cursor_next(struct FileBufCursor *cursor);
+int filebuf_cursor_prev(struct FileBufCursor *cursor);
+const char *filebuf_cursor_next_span(struct FileBufCursor *cursor, index_t *length);
+const char *filebuf_cursor_prev_span(struct FileBufCursor *cursor, index_t *length);
+
+index_t filebuf_line_count(struct FileBuf *fb);
+bool filebuf_line_to_offset(struct FileBuf *fb, index_t line, index_t *result_index);
+index_t filebuf_offset_to_line(struct FileBuf *fb, index_t file_index);
+
 bool filebuf_index_of(struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, index_t *result_index);
 bool filebuf_last_index_of(struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, index_t *result_index);
+index_t filebuf_replace_all(struct FileBuf *fb, const char *string, const char *replacement);
 bool filebuf_write(struct FileBuf *buf);
 bool filebuf_read(struct FileBuf *buf, char *path);
+uint32_t filebuf_open_journal(struct FileBuf *fb);
 
 #endif
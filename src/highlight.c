@@ -0,0 +1,934 @@
+/* highlight.c
+ * Syntax highlighting of a file buffer's text, lexed a line at a time with the state at the start of each line cached.
+ *
+ * Lines are only lexed when a line after them is drawn, so opening a file lexes no more than the lines on screen.
+ * Edits are taken from the file buffer (see filebuf_watch_changes()) as a range of changed text: the cached states of the
+ * lines after it move along with them, and lexing picks up from the first changed line, stopping at the first line past
+ * the change that ends in the state cached for the line after it, since every line from there on lexes the same as before.
+ *
+ * Lexing far enough through a large file would hold up input, so the input thread only lexes for about a frame at once.
+ * The rest is left to a worker thread, which lexes a snapshot of the text (see filebuf_snapshot()) and hands the states
+ * back through an atomic pointer the input thread swaps out when woken. Whenever the text changes, the worker's job is
+ * dropped, and the next lookup posts a new one from wherever the states are known up to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "highlight.h"
+#include "os.h"
+
+static void take_change(struct Highlight *hl);
+static void reserve_states(struct Highlight *hl, index_t count);
+static bool lex_lines(struct Highlight *hl, index_t until, uint64_t deadline);
+static bool post_job(struct Highlight *hl, index_t line);
+static void merge_results(struct Highlight *hl);
+static void free_results(struct HighlightResults *results);
+static bool start_worker(struct HighlightWorker *worker);
+static void stop_worker(struct HighlightWorker *worker);
+static void *work(void *arg);
+static void run_job(struct HighlightWorker *worker, struct HighlightJob *job);
+static void publish(struct HighlightWorker *worker, struct HighlightResults *results);
+static void read_from_cursor(struct HighlightLexer *lexer, struct FileBuf *fb, index_t file_index);
+static void read_from_snapshot(struct HighlightLexer *lexer, const struct FileBufSnapshot *snapshot, index_t file_index);
+static void start_line(struct HighlightLexer *lexer, const struct Language *language, uint8_t state);
+static bool next_line(struct HighlightLexer *lexer);
+static uint8_t lex_to_line_end(struct HighlightLexer *lexer);
+static void advance(struct HighlightLexer *lexer, index_t count);
+static void skip_line(struct HighlightLexer *lexer);
+static int read_char(struct HighlightLexer *lexer);
+static bool next_span(struct HighlightLexer *lexer);
+static bool lexer_matches(struct HighlightLexer *lexer, const char *delimiter);
+static void lex_block_comment(struct HighlightLexer *lexer);
+static void lex_string(struct HighlightLexer *lexer);
+static uint8_t lex_word(struct HighlightLexer *lexer);
+static inline bool is_word_char(int c);
+static uint8_t word_color(const struct Language *language, const char *word, size_t length);
+
+// words sorted in strcmp() order, as they are binary searched
+static const struct HighlightWord c_words[] = {
+	{"NULL", HIGHLIGHT_COLOR_KEYWORD},
+	{"auto", HIGHLIGHT_COLOR_KEYWORD},
+	{"bool", HIGHLIGHT_COLOR_TYPE},
+	{"break", HIGHLIGHT_COLOR_KEYWORD},
+	{"case", HIGHLIGHT_COLOR_KEYWORD},
+	{"char", HIGHLIGHT_COLOR_TYPE},
+	{"const", HIGHLIGHT_COLOR_KEYWORD},
+	{"continue", HIGHLIGHT_COLOR_KEYWORD},
+	{"default", HIGHLIGHT_COLOR_KEYWORD},
+	{"do", HIGHLIGHT_COLOR_KEYWORD},
+	{"double", HIGHLIGHT_COLOR_TYPE},
+	{"else", HIGHLIGHT_COLOR_KEYWORD},
+	{"enum", HIGHLIGHT_COLOR_KEYWORD},
+	{"extern", HIGHLIGHT_COLOR_KEYWORD},
+	{"false", HIGHLIGHT_COLOR_KEYWORD},
+	{"float", HIGHLIGHT_COLOR_TYPE},
+	{"for", HIGHLIGHT_COLOR_KEYWORD},
+	{"goto", HIGHLIGHT_COLOR_KEYWORD},
+	{"if", HIGHLIGHT_COLOR_KEYWORD},
+	{"inline", HIGHLIGHT_COLOR_KEYWORD},
+	{"int", HIGHLIGHT_COLOR_TYPE},
+	{"int16_t", HIGHLIGHT_COLOR_TYPE},
+	{"int32_t", HIGHLIGHT_COLOR_TYPE},
+	{"int64_t", HIGHLIGHT_COLOR_TYPE},
+	{"int8_t", HIGHLIGHT_COLOR_TYPE},
+	{"long", HIGHLIGHT_COLOR_TYPE},
+	{"register", HIGHLIGHT_COLOR_KEYWORD},
+	{"restrict", HIGHLIGHT_COLOR_KEYWORD},
+	{"return", HIGHLIGHT_COLOR_KEYWORD},
+	{"short", HIGHLIGHT_COLOR_TYPE},
+	{"signed", HIGHLIGHT_COLOR_TYPE},
+	{"size_t", HIGHLIGHT_COLOR_TYPE},
+	{"sizeof", HIGHLIGHT_COLOR_KEYWORD},
+	{"ssize_t", HIGHLIGHT_COLOR_TYPE},
+	{"static", HIGHLIGHT_COLOR_KEYWORD},
+	{"struct", HIGHLIGHT_COLOR_KEYWORD},
+	{"switch", HIGHLIGHT_COLOR_KEYWORD},
+	{"true", HIGHLIGHT_COLOR_KEYWORD},
+	{"typedef", HIGHLIGHT_COLOR_KEYWORD},
+	{"uint16_t", HIGHLIGHT_COLOR_TYPE},
+	{"uint32_t", HIGHLIGHT_COLOR_TYPE},
+	{"uint64_t", HIGHLIGHT_COLOR_TYPE},
+	{"uint8_t", HIGHLIGHT_COLOR_TYPE},
+	{"union", HIGHLIGHT_COLOR_KEYWORD},
+	{"unsigned", HIGHLIGHT_COLOR_TYPE},
+	{"void", HIGHLIGHT_COLOR_TYPE},
+	{"volatile", HIGHLIGHT_COLOR_KEYWORD},
+	{"while", HIGHLIGHT_COLOR_KEYWORD},
+};
+
+static const struct HighlightWord python_words[] = {
+	{"False", HIGHLIGHT_COLOR_KEYWORD},
+	{"None", HIGHLIGHT_COLOR_KEYWORD},
+	{"True", HIGHLIGHT_COLOR_KEYWORD},
+	{"and", HIGHLIGHT_COLOR_KEYWORD},
+	{"as", HIGHLIGHT_COLOR_KEYWORD},
+	{"assert", HIGHLIGHT_COLOR_KEYWORD},
+	{"async", HIGHLIGHT_COLOR_KEYWORD},
+	{"await", HIGHLIGHT_COLOR_KEYWORD},
+	{"bool", HIGHLIGHT_COLOR_TYPE},
+	{"break", HIGHLIGHT_COLOR_KEYWORD},
+	{"bytes", HIGHLIGHT_COLOR_TYPE},
+	{"class", HIGHLIGHT_COLOR_KEYWORD},
+	{"continue", HIGHLIGHT_COLOR_KEYWORD},
+	{"def", HIGHLIGHT_COLOR_KEYWORD},
+	{"del", HIGHLIGHT_COLOR_KEYWORD},
+	{"dict", HIGHLIGHT_COLOR_TYPE},
+	{"elif", HIGHLIGHT_COLOR_KEYWORD},
+	{"else", HIGHLIGHT_COLOR_KEYWORD},
+	{"except", HIGHLIGHT_COLOR_KEYWORD},
+	{"finally", HIGHLIGHT_COLOR_KEYWORD},
+	{"float", HIGHLIGHT_COLOR_TYPE},
+	{"for", HIGHLIGHT_COLOR_KEYWORD},
+	{"from", HIGHLIGHT_COLOR_KEYWORD},
+	{"global", HIGHLIGHT_COLOR_KEYWORD},
+	{"if", HIGHLIGHT_COLOR_KEYWORD},
+	{"import", HIGHLIGHT_COLOR_KEYWORD},
+	{"in", HIGHLIGHT_COLOR_KEYWORD},
+	{"int", HIGHLIGHT_COLOR_TYPE},
+	{"is", HIGHLIGHT_COLOR_KEYWORD},
+	{"lambda", HIGHLIGHT_COLOR_KEYWORD},
+	{"list", HIGHLIGHT_COLOR_TYPE},
+	{"nonlocal", HIGHLIGHT_COLOR_KEYWORD},
+	{"not", HIGHLIGHT_COLOR_KEYWORD},
+	{"object", HIGHLIGHT_COLOR_TYPE},
+	{"or", HIGHLIGHT_COLOR_KEYWORD},
+	{"pass", HIGHLIGHT_COLOR_KEYWORD},
+	{"raise", HIGHLIGHT_COLOR_KEYWORD},
+	{"return", HIGHLIGHT_COLOR_KEYWORD},
+	{"self", HIGHLIGHT_COLOR_KEYWORD},
+	{"set", HIGHLIGHT_COLOR_TYPE},
+	{"str", HIGHLIGHT_COLOR_TYPE},
+	{"try", HIGHLIGHT_COLOR_KEYWORD},
+	{"tuple", HIGHLIGHT_COLOR_TYPE},
+	{"while", HIGHLIGHT_COLOR_KEYWORD},
+	{"with", HIGHLIGHT_COLOR_KEYWORD},
+	{"yield", HIGHLIGHT_COLOR_KEYWORD},
+};
+
+static const struct HighlightWord shell_words[] = {
+	{"case", HIGHLIGHT_COLOR_KEYWORD},
+	{"do", HIGHLIGHT_COLOR_KEYWORD},
+	{"done", HIGHLIGHT_COLOR_KEYWORD},
+	{"elif", HIGHLIGHT_COLOR_KEYWORD},
+	{"else", HIGHLIGHT_COLOR_KEYWORD},
+	{"esac", HIGHLIGHT_COLOR_KEYWORD},
+	{"export", HIGHLIGHT_COLOR_KEYWORD},
+	{"fi", HIGHLIGHT_COLOR_KEYWORD},
+	{"for", HIGHLIGHT_COLOR_KEYWORD},
+	{"function", HIGHLIGHT_COLOR_KEYWORD},
+	{"if", HIGHLIGHT_COLOR_KEYWORD},
+	{"in", HIGHLIGHT_COLOR_KEYWORD},
+	{"local", HIGHLIGHT_COLOR_KEYWORD},
+	{"read", HIGHLIGHT_COLOR_KEYWORD},
+	{"return", HIGHLIGHT_COLOR_KEYWORD},
+	{"select", HIGHLIGHT_COLOR_KEYWORD},
+	{"shift", HIGHLIGHT_COLOR_KEYWORD},
+	{"then", HIGHLIGHT_COLOR_KEYWORD},
+	{"until", HIGHLIGHT_COLOR_KEYWORD},
+	{"while", HIGHLIGHT_COLOR_KEYWORD},
+};
+
+static const char *const c_extensions[] = {".c", ".h", ".cc", ".cpp", ".hpp", NULL};
+static const char *const python_extensions[] = {".py", NULL};
+static const char *const shell_extensions[] = {".sh", ".bash", NULL};
+
+static const struct Language languages[] = {
+	{
+		.name = "C",
+		.extensions = c_extensions,
+		.words = c_words,
+		.word_count = sizeof(c_words) / sizeof(c_words[0]),
+		.line_comment = "//",
+		.block_comment_start = "/*",
+		.block_comment_end = "*/",
+		.quotes = "\"'",
+		.preprocessor = true
+	},
+	{
+		.name = "Python",
+		.extensions = python_extensions,
+		.words = python_words,
+		.word_count = sizeof(python_words) / sizeof(python_words[0]),
+		.line_comment = "#",
+		.quotes = "\"'",
+		.long_strings = true
+	},
+	{
+		.name = "Shell",
+		.extensions = shell_extensions,
+		.words = shell_words,
+		.word_count = sizeof(shell_words) / sizeof(shell_words[0]),
+		.line_comment = "#",
+		.quotes = "\"'`",
+		.strings_span_lines = true
+	}
+};
+
+void highlight_init(struct Highlight *hl, struct FileBuf *fb) {
+	hl->fb = fb;
+	hl->language = NULL;
+	hl->states = NULL;
+	hl->state_size = 0;
+	hl->line_count = 0;
+	hl->known = 0;
+	hl->resume = 0;
+	hl->lexed = 0;
+	hl->overran = false;
+	hl->guessed = (index_t) -1;
+	hl->job_version = 0;
+	hl->job_posted = false;
+	if (!filebuf_watch_changes(fb, &hl->change)) {
+		fprintf(stderr, "Out of room for watching the file's edits!\n"); // the cached states would never be brought up to date
+		exit(EXIT_FAILURE);
+	}
+
+	struct HighlightWorker *worker = &hl->worker; // alias
+	atomic_init(&worker->results, NULL);
+	atomic_init(&worker->version, 0);
+	atomic_init(&worker->view_end, 0);
+	worker->wake_fds[0] = -1;
+	worker->wake_fds[1] = -1;
+	worker->job_pending = false;
+	worker->started = false;
+	worker->failed = false;
+	worker->stopping = false;
+}
+
+void highlight_free(struct Highlight *hl) {
+	stop_worker(&hl->worker);
+	filebuf_unwatch_changes(hl->fb, &hl->change);
+	free(hl->states);
+	hl->states = NULL;
+	hl->state_size = 0;
+	hl->language = NULL;
+}
+
+/* Returns the language of the file at the path, going by the ending of its name. NULL if there is none. */
+const struct Language *highlight_language_for_path(const char *path) {
+	if (path == NULL) return NULL;
+	const size_t path_length = strlen(path);
+	for (uint32_t i = 0; i < sizeof(languages) / sizeof(languages[0]); i++) {
+		for (const char *const *extension = languages[i].extensions; *extension != NULL; extension++) {
+			const size_t length = strlen(*extension);
+			if (path_length > length && strcmp(path + path_length - length, *extension) == 0) return &languages[i];
+		}
+	}
+	return NULL;
+}
+
+/* Highlights the file buffer's text as the language (NULL for none), dropping whatever was lexed before. */
+void highlight_set_language(struct Highlight *hl, const struct Language *language) {
+	struct FileBufChange change;
+	filebuf_take_change(&hl->change, &change); // lexed from scratch anyway
+	atomic_fetch_add(&hl->worker.version, 1);
+	hl->overran = false;
+	hl->language = language;
+	hl->line_count = filebuf_line_count(hl->fb);
+	reserve_states(hl, 1);
+	hl->states[0] = HIGHLIGHT_STATE_NORMAL;
+	hl->known = 1;
+	hl->resume = 1;
+	hl->lexed = 1;
+}
+
+/* Returns the state the lexer is in at the start of the (zero-based) line, lexing the lines before it that
+ * aren't up to date. The line must be within the file.
+ * Only about a frame's worth of lines are lexed here after each change. Any further lines are left to the worker, and until it
+ * has lexed up to the line its state is guessed at from what was cached before (see highlight_take_results()).
+ * Whatever is left of the file after the line is lexed by the worker in the meantime, so it's known by the time it's shown.
+ */
+uint8_t highlight_line_state(struct Highlight *hl, index_t line) {
+	take_change(hl);
+	if (hl->language == NULL) return HIGHLIGHT_STATE_NORMAL;
+	merge_results(hl);
+
+	if (hl->known <= line && !hl->overran) {
+		hl->overran = !lex_lines(hl, line + 1, os_now_us() + HIGHLIGHT_FRAME_US); // once, rather than for every line drawn
+	}
+	if (hl->known < hl->line_count && !post_job(hl, line)) {
+		lex_lines(hl, line + 1, UINT64_MAX); // no worker to leave it to
+	}
+	if (hl->known <= line) {
+		if (line < hl->guessed) {
+			hl->guessed = line;
+		}
+		return line < hl->lexed ? hl->states[line] : HIGHLIGHT_STATE_NORMAL; // as lexed before the last edits, if it was
+	}
+	return hl->states[line];
+}
+
+/* Takes whatever the worker has lexed since this was last called, once the wake fd is readable (see highlight_wake_fd()).
+ * Returns whether states that were guessed at when the text was last drawn are now known, so it should be drawn again.
+ */
+bool highlight_take_results(struct Highlight *hl) {
+	if (!hl->worker.started) return false;
+	char wakes[64];
+	while (read(hl->worker.wake_fds[0], wakes, sizeof(wakes)) > 0);
+
+	merge_results(hl);
+	if (hl->guessed >= hl->known) return false;
+	hl->guessed = (index_t) -1; // drawing again guesses at whichever still aren't known
+	return true;
+}
+
+/* Returns the fd that becomes readable when the worker has lexed lines (see highlight_take_results()), for polling
+ * along with input. -1 if the worker isn't running.
+ */
+int highlight_wake_fd(struct Highlight *hl) {
+	return hl->worker.started ? hl->worker.wake_fds[0] : -1;
+}
+
+/* Brings the cached states up to date with the text changed since the last change was taken from the file buffer. */
+static void take_change(struct Highlight *hl) {
+	struct FileBufChange change;
+	if (!filebuf_take_change(&hl->change, &change)) return;
+	atomic_fetch_add(&hl->worker.version, 1); // whatever the worker is lexing is out of date
+	hl->overran = false;
+	const index_t old_line_count = hl->line_count;
+	hl->line_count = filebuf_line_count(hl->fb);
+	if (hl->language == NULL) return;
+
+	index_t first, last, old_last;
+	filebuf_change_lines(hl->fb, &change, old_line_count, &first, &last, &old_last);
+	if (hl->lexed > old_last + 1) {
+		// lines after the change were lexed, so their states move along with them, to be checked against once the
+		// lines up to them are lexed again
+		const index_t lexed = hl->lexed - (old_last + 1) + (last + 1);
+		reserve_states(hl, lexed);
+		memmove(hl->states + last + 1, hl->states + old_last + 1, sizeof(uint8_t) * (hl->lexed - (old_last + 1)));
+		if (hl->known < hl->lexed && hl->resume > old_last) {
+			hl->resume = hl->resume - (old_last + 1) + (last + 1); // the lines up to it are still to be lexed again, wherever they moved
+		} else {
+			hl->resume = last + 1;
+		}
+		hl->lexed = lexed;
+	} else {
+		if (hl->lexed > first + 1) {
+			hl->lexed = first + 1;
+		}
+		hl->resume = hl->lexed;
+	}
+	if (hl->known > first + 1) {
+		hl->known = first + 1; // the text before the changed line's start is as it was, so its state is too
+	}
+}
+
+/* Makes room for the states of count lines. */
+static void reserve_states(struct Highlight *hl, index_t count) {
+	if (count <= hl->state_size) return;
+	index_t size = hl->state_size == 0 ? 1024 : hl->state_size;
+	while (size < count) {
+		size *= 2;
+	}
+	hl->states = realloc(hl->states, sizeof(uint8_t) * size);
+	hl->state_size = size;
+}
+
+/* Lexes the lines on from the last one known, until the states of the lines up to 'until' are known or the deadline
+ * (in os_now_us() time) passes. Returns false if the deadline passed first.
+ */
+static bool lex_lines(struct Highlight *hl, index_t until, uint64_t deadline) {
+	struct HighlightLexer lexer;
+	bool started = false; // whether the lexer is at the start of the line before the first one not known
+	uint32_t lines = 0;
+	while (hl->known < until) {
+		if (++lines % HIGHLIGHT_CHECK_LINES == 0 && os_now_us() >= deadline) return false;
+		if (!started) {
+			index_t line_start;
+			filebuf_line_to_offset(hl->fb, hl->known - 1, &line_start);
+			read_from_cursor(&lexer, hl->fb, line_start);
+			start_line(&lexer, hl->language, hl->states[hl->known - 1]);
+			started = true;
+		}
+
+		const uint8_t state = lex_to_line_end(&lexer);
+		if (hl->known >= hl->resume && hl->known < hl->lexed && hl->states[hl->known] == state) {
+			hl->known = hl->lexed; // back in step with what was lexed before the change, so the rest lex the same
+			started = false;
+			continue;
+		}
+		if (hl->known == hl->lexed) {
+			reserve_states(hl, hl->lexed + 1);
+			hl->lexed++;
+		}
+		hl->states[hl->known] = state;
+		hl->known++;
+		if (hl->resume < hl->known) {
+			hl->resume = hl->known; // the state cached for the next line was lexed from the one just replaced
+		}
+		next_line(&lexer);
+	}
+	return true;
+}
+
+/* Leaves the lines from the last one known to the end of the file to the worker, starting it if it isn't yet,
+ * unless it's already lexing them. The (zero-based) line is one wanted soon, so the lines up to it are handed over
+ * as soon as they're lexed. Returns false if there is no worker to lex them.
+ */
+static bool post_job(struct Highlight *hl, index_t line) {
+	struct HighlightWorker *worker = &hl->worker; // alias
+	if (!worker->started && (worker->failed || !start_worker(worker))) return false;
+	if (line >= hl->known) {
+		atomic_store(&worker->view_end, line + HIGHLIGHT_VIEW_LINES);
+	}
+	const uint32_t version = atomic_load(&worker->version);
+	if (hl->job_posted && hl->job_version == version) return true;
+
+	struct HighlightJob job;
+	filebuf_snapshot(hl->fb, &job.snapshot);
+	job.language = hl->language;
+	job.from_line = hl->known - 1;
+	job.from_state = hl->states[job.from_line];
+	filebuf_line_to_offset(hl->fb, job.from_line, &job.from_index);
+	job.version = version;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->job_pending) {
+		filebuf_snapshot_release(&worker->job.snapshot); // never started, and no longer wanted
+	}
+	worker->job = job;
+	worker->job_pending = true;
+	pthread_cond_signal(&worker->job_ready);
+	pthread_mutex_unlock(&worker->lock);
+	hl->job_posted = true;
+	hl->job_version = version;
+	return true;
+}
+
+/* Adds the states the worker has handed over to those cached, if they follow on from the ones known and were lexed
+ * from the text as it is now.
+ */
+static void merge_results(struct Highlight *hl) {
+	if (!hl->worker.started) return;
+	struct HighlightResults *results = atomic_exchange(&hl->worker.results, NULL);
+	if (results == NULL) return;
+	const index_t end = results->first_line + results->count;
+	if (results->version == atomic_load(&hl->worker.version) && results->first_line <= hl->known && end > hl->known) {
+		reserve_states(hl, end);
+		memcpy(hl->states + results->first_line, results->states, sizeof(uint8_t) * results->count);
+		hl->known = end;
+		if (hl->lexed < end) {
+			hl->lexed = end;
+		}
+		if (hl->resume < end) {
+			hl->resume = end;
+		}
+	}
+	free_results(results);
+}
+
+static void free_results(struct HighlightResults *results) {
+	if (results == NULL) return;
+	free(results->states);
+	free(results);
+}
+
+/* Starts the worker's thread, and the pipe it wakes the input thread through. Returns whether it could be. */
+static bool start_worker(struct HighlightWorker *worker) {
+	if (pipe(worker->wake_fds) != 0) {
+		worker->failed = true;
+		return false;
+	}
+	fcntl(worker->wake_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(worker->wake_fds[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->job_ready, NULL);
+	worker->job_pending = false;
+	worker->stopping = false;
+
+	// signals are left to the input thread, whose poll() their handlers wake
+	sigset_t all_signals;
+	sigset_t signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &signals);
+	const bool created = pthread_create(&worker->thread, NULL, &work, worker) == 0;
+	pthread_sigmask(SIG_SETMASK, &signals, NULL);
+	if (!created) {
+		pthread_cond_destroy(&worker->job_ready);
+		pthread_mutex_destroy(&worker->lock);
+		close(worker->wake_fds[0]);
+		close(worker->wake_fds[1]);
+		worker->failed = true;
+		return false;
+	}
+	worker->started = true;
+	return true;
+}
+
+/* Stops the worker's thread if it was started, dropping whatever it was lexing. */
+static void stop_worker(struct HighlightWorker *worker) {
+	if (!worker->started) return;
+	atomic_fetch_add(&worker->version, 1); // so the job being run stops
+	pthread_mutex_lock(&worker->lock);
+	worker->stopping = true;
+	pthread_cond_signal(&worker->job_ready);
+	pthread_mutex_unlock(&worker->lock);
+	pthread_join(worker->thread, NULL);
+
+	if (worker->job_pending) {
+		filebuf_snapshot_release(&worker->job.snapshot);
+		worker->job_pending = false;
+	}
+	free_results(atomic_exchange(&worker->results, NULL));
+	pthread_cond_destroy(&worker->job_ready);
+	pthread_mutex_destroy(&worker->lock);
+	close(worker->wake_fds[0]);
+	close(worker->wake_fds[1]);
+	worker->wake_fds[0] = -1;
+	worker->wake_fds[1] = -1;
+	worker->started = false;
+}
+
+/* The worker's thread: runs each job posted, until the worker is stopped. */
+static void *work(void *arg) {
+	struct HighlightWorker *worker = arg;
+	setpriority(PRIO_PROCESS, 0, HIGHLIGHT_WORKER_NICE); // (just this thread's, on Linux) so it never holds up input
+	pthread_mutex_lock(&worker->lock);
+	while (!worker->stopping) {
+		if (!worker->job_pending) {
+			pthread_cond_wait(&worker->job_ready, &worker->lock);
+			continue;
+		}
+		struct HighlightJob job = worker->job;
+		worker->job_pending = false;
+		pthread_mutex_unlock(&worker->lock);
+		run_job(worker, &job);
+		filebuf_snapshot_release(&job.snapshot);
+		pthread_mutex_lock(&worker->lock);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+/* Lexes the job's snapshot from its first line to the end, handing the states lexed over to the input thread as soon as
+ * the lines wanted soon are lexed (see HighlightWorker.view_end), and every HIGHLIGHT_PUBLISH_LINES lines otherwise.
+ * Stops as soon as the text changes, as the job is then out of date.
+ */
+static void run_job(struct HighlightWorker *worker, struct HighlightJob *job) {
+	struct HighlightLexer lexer;
+	read_from_snapshot(&lexer, &job->snapshot, job->from_index);
+	start_line(&lexer, job->language, job->from_state);
+	struct HighlightResults *results = NULL; // lexed since last handed over
+	index_t size = 0; // of results' states
+	index_t line = job->from_line;
+	index_t publish_line = line + HIGHLIGHT_PUBLISH_LINES; // results are handed over once the state of this line is lexed
+	index_t view_end = atomic_load(&worker->view_end);
+	if (view_end > line && view_end < publish_line) {
+		publish_line = view_end;
+	}
+
+	while (1) {
+		const uint8_t state = lex_to_line_end(&lexer);
+		if (!next_line(&lexer)) break; // the last line, so there is no line after it for the state to be of
+		line++;
+		if (results == NULL) {
+			results = malloc(sizeof(struct HighlightResults));
+			results->states = NULL;
+			results->first_line = line;
+			results->count = 0;
+			results->version = job->version;
+			size = 0;
+		}
+		if (results->count == size) {
+			size = size == 0 ? 1024 : size * 2;
+			results->states = realloc(results->states, sizeof(uint8_t) * size);
+		}
+		results->states[results->count] = state;
+		results->count++;
+
+		if (line % HIGHLIGHT_CHECK_LINES == 0) {
+			if (atomic_load(&worker->version) != job->version) {
+				free_results(results);
+				return;
+			}
+			view_end = atomic_load(&worker->view_end);
+			if (view_end > line && view_end < publish_line) {
+				publish_line = view_end;
+			}
+		}
+		if (line >= publish_line) {
+			publish(worker, results);
+			results = NULL;
+			publish_line = line + HIGHLIGHT_PUBLISH_LINES;
+		}
+	}
+	if (results != NULL) {
+		publish(worker, results);
+	}
+}
+
+/* Hands the results over to the input thread, along with any it hasn't taken yet, and wakes it to take them. */
+static void publish(struct HighlightWorker *worker, struct HighlightResults *results) {
+	struct HighlightResults *untaken = atomic_exchange(&worker->results, NULL);
+	if (untaken != NULL && untaken->version == results->version && untaken->first_line + untaken->count == results->first_line) {
+		untaken->states = realloc(untaken->states, sizeof(uint8_t) * (untaken->count + results->count));
+		memcpy(untaken->states + untaken->count, results->states, sizeof(uint8_t) * results->count);
+		untaken->count += results->count;
+		free_results(results);
+		results = untaken;
+	} else {
+		free_results(untaken); // from a job no longer wanted
+	}
+	atomic_store(&worker->results, results);
+
+	const char wake = 0;
+	if (write(worker->wake_fds[1], &wake, 1) < 0) return; // only if the pipe is full, so the input thread will wake anyway
+}
+
+/* Starts the lexer at the line starting at the file index, in the state cached for the line. */
+void highlight_lexer_init(struct HighlightLexer *lexer, struct Highlight *hl, index_t file_index) {
+	const index_t line = filebuf_offset_to_line(hl->fb, file_index);
+	const uint8_t state = highlight_line_state(hl, line);
+	index_t line_start;
+	filebuf_line_to_offset(hl->fb, line, &line_start);
+	read_from_cursor(lexer, hl->fb, line_start);
+	start_line(lexer, hl->language, state);
+}
+
+/* Has the lexer read the file buffer's text from the file index on. */
+static void read_from_cursor(struct HighlightLexer *lexer, struct FileBuf *fb, index_t file_index) {
+	filebuf_cursor_init(&lexer->cursor, fb, file_index);
+	lexer->snapshot = NULL;
+	lexer->text = NULL;
+	lexer->text_length = 0;
+	lexer->index = file_index;
+}
+
+/* Has the lexer read the snapshot's text from the file index on. */
+static void read_from_snapshot(struct HighlightLexer *lexer, const struct FileBufSnapshot *snapshot, index_t file_index) {
+	lexer->snapshot = snapshot;
+	lexer->index = file_index;
+	lexer->span = 0;
+	while (lexer->span < snapshot->span_count && file_index >= snapshot->spans[lexer->span].length) {
+		file_index -= snapshot->spans[lexer->span].length;
+		lexer->span++;
+	}
+	lexer->text = NULL;
+	lexer->text_length = 0;
+	if (lexer->span < snapshot->span_count) {
+		lexer->text = snapshot->spans[lexer->span].text + file_index;
+		lexer->text_length = snapshot->spans[lexer->span].length - file_index;
+		lexer->span++;
+	}
+}
+
+/* Starts lexing a line in the language, in the state given, from where the lexer reads next (the start of the line). */
+static void start_line(struct HighlightLexer *lexer, const struct Language *language, uint8_t state) {
+	lexer->language = language;
+	lexer->state = state;
+	lexer->line_start = true;
+	lexer->line_ended = false;
+	lexer->newline = false;
+	for (int i = 0; i < HIGHLIGHT_LOOKAHEAD; i++) {
+		lexer->ahead[i] = read_char(lexer);
+	}
+}
+
+/* Moves the lexer from the end of the line it lexed to the start of the next, which starts in the state the line ended in.
+ * Returns false if there is no next line.
+ */
+static bool next_line(struct HighlightLexer *lexer) {
+	if (!lexer->newline) return false;
+	lexer->index++; // the new-line char
+	start_line(lexer, lexer->language, lexer->state);
+	return true;
+}
+
+/* Lexes the rest of the line. Returns the state at its end, which the next line starts in. */
+static uint8_t lex_to_line_end(struct HighlightLexer *lexer) {
+	// a string that carries on only with a backslash ends with an empty line too, so that is lexed as well
+	do {
+		highlight_lexer_next(lexer);
+	} while (!highlight_lexer_at_end(lexer));
+	return lexer->state;
+}
+
+/* Lexes the next token of the line. Returns its color: it is the text from where the lexer was up to where it is now
+ * (see HighlightLexer.index). Nothing is lexed at the end of the line.
+ */
+uint8_t highlight_lexer_next(struct HighlightLexer *lexer) {
+	const struct Language *language = lexer->language; // alias
+	if (language == NULL) {
+		skip_line(lexer);
+		return HIGHLIGHT_COLOR_DEFAULT;
+	}
+	if (lexer->state == HIGHLIGHT_STATE_BLOCK_COMMENT) {
+		lex_block_comment(lexer);
+		return HIGHLIGHT_COLOR_COMMENT;
+	}
+	if (lexer->state != HIGHLIGHT_STATE_NORMAL) {
+		lex_string(lexer);
+		return HIGHLIGHT_COLOR_STRING;
+	}
+
+	const int c = lexer->ahead[0];
+	if (c == FILEBUF_EOF) return HIGHLIGHT_COLOR_DEFAULT;
+	if (c == ' ' || c == '\t') {
+		advance(lexer, 1); // blanks don't end line_start
+		return HIGHLIGHT_COLOR_DEFAULT;
+	}
+	const bool line_start = lexer->line_start;
+	lexer->line_start = false;
+
+	if (language->block_comment_start != NULL && lexer_matches(lexer, language->block_comment_start)) {
+		advance(lexer, strlen(language->block_comment_start));
+		lexer->state = HIGHLIGHT_STATE_BLOCK_COMMENT;
+		lex_block_comment(lexer);
+		return HIGHLIGHT_COLOR_COMMENT;
+	}
+	if (language->line_comment != NULL && lexer_matches(lexer, language->line_comment)) {
+		skip_line(lexer);
+		return HIGHLIGHT_COLOR_COMMENT;
+	}
+	if (language->preprocessor && line_start && c == '#') {
+		// the directive's name, after any blanks
+		advance(lexer, 1);
+		while (lexer->ahead[0] == ' ' || lexer->ahead[0] == '\t') {
+			advance(lexer, 1);
+		}
+		lex_word(lexer);
+		return HIGHLIGHT_COLOR_PREPROCESSOR;
+	}
+	if (strchr(language->quotes, c) != NULL) {
+		if (language->long_strings && lexer->ahead[1] == c && lexer->ahead[2] == c) {
+			advance(lexer, 3);
+			lexer->state = c | HIGHLIGHT_STATE_LONG;
+		} else {
+			advance(lexer, 1);
+			lexer->state = c;
+		}
+		lex_string(lexer);
+		return HIGHLIGHT_COLOR_STRING;
+	}
+	if (c >= '0' && c <= '9') {
+		// along with any fraction, suffix, hex digits, etc.
+		while (is_word_char(lexer->ahead[0]) || lexer->ahead[0] == '.') {
+			advance(lexer, 1);
+		}
+		return HIGHLIGHT_COLOR_NUMBER;
+	}
+	if (is_word_char(c)) return lex_word(lexer);
+	advance(lexer, 1);
+	return HIGHLIGHT_COLOR_DEFAULT;
+}
+
+/* Returns whether the lexer has lexed the whole line. */
+bool highlight_lexer_at_end(struct HighlightLexer *lexer) {
+	return lexer->ahead[0] == FILEBUF_EOF;
+}
+
+/* Moves the lexer count chars along the line, reading the chars that come into view. */
+static void advance(struct HighlightLexer *lexer, index_t count) {
+	lexer->index += count;
+	int from = 0; // the first of the chars ahead to be read
+	if (count < HIGHLIGHT_LOOKAHEAD) {
+		from = HIGHLIGHT_LOOKAHEAD - count;
+		memmove(lexer->ahead, lexer->ahead + count, sizeof(int) * from);
+	} else {
+		for (index_t i = HIGHLIGHT_LOOKAHEAD; i < count; i++) {
+			read_char(lexer); // skipped straight past, along with all that were ahead
+		}
+	}
+	for (int i = from; i < HIGHLIGHT_LOOKAHEAD; i++) {
+		lexer->ahead[i] = read_char(lexer);
+	}
+}
+
+/* Moves the lexer to the end of the line, skipping whatever is left of it. */
+static void skip_line(struct HighlightLexer *lexer) {
+	for (int i = 0; i < HIGHLIGHT_LOOKAHEAD && lexer->ahead[i] != FILEBUF_EOF; i++) {
+		lexer->index++;
+	}
+	while (!lexer->line_ended) {
+		if (lexer->text_length == 0) {
+			if (!next_span(lexer)) {
+				lexer->line_ended = true;
+				lexer->newline = false;
+			}
+			continue;
+		}
+		const char *newline = memchr(lexer->text, '\n', lexer->text_length);
+		const index_t length = newline == NULL ? lexer->text_length : (index_t) (newline - lexer->text);
+		lexer->index += length;
+		lexer->text += length;
+		lexer->text_length -= length;
+		if (newline != NULL) {
+			lexer->text++;
+			lexer->text_length--;
+			lexer->line_ended = true;
+			lexer->newline = true;
+		}
+	}
+	for (int i = 0; i < HIGHLIGHT_LOOKAHEAD; i++) {
+		lexer->ahead[i] = FILEBUF_EOF;
+	}
+}
+
+/* Reads the next char of the line, or FILEBUF_EOF once the line has ended. */
+static int read_char(struct HighlightLexer *lexer) {
+	if (lexer->line_ended) return FILEBUF_EOF;
+	while (lexer->text_length == 0) {
+		if (!next_span(lexer)) {
+			lexer->line_ended = true;
+			lexer->newline = false;
+			return FILEBUF_EOF;
+		}
+	}
+	const char c = *lexer->text;
+	lexer->text++;
+	lexer->text_length--;
+	if (c == '\n') {
+		lexer->line_ended = true;
+		lexer->newline = true;
+		return FILEBUF_EOF;
+	}
+	return (unsigned char) c;
+}
+
+/* Moves the lexer on to the next span of the text it reads. Returns false at the end of the text. */
+static bool next_span(struct HighlightLexer *lexer) {
+	if (lexer->snapshot == NULL) {
+		lexer->text = filebuf_cursor_next_span(&lexer->cursor, &lexer->text_length);
+		return lexer->text != NULL;
+	}
+	if (lexer->span == lexer->snapshot->span_count) return false;
+	lexer->text = lexer->snapshot->spans[lexer->span].text;
+	lexer->text_length = lexer->snapshot->spans[lexer->span].length;
+	lexer->span++;
+	return true;
+}
+
+/* Returns whether the chars ahead of the lexer are the delimiter (shorter than HIGHLIGHT_LOOKAHEAD). */
+static bool lexer_matches(struct HighlightLexer *lexer, const char *delimiter) {
+	for (int i = 0; delimiter[i] != '\0'; i++) {
+		if (lexer->ahead[i] != (unsigned char) delimiter[i]) return false;
+	}
+	return true;
+}
+
+/* Lexes a block comment up to and including its end, or up to the end of the line if it carries on past it. */
+static void lex_block_comment(struct HighlightLexer *lexer) {
+	const char *comment_end = lexer->language->block_comment_end; // alias
+	while (lexer->ahead[0] != FILEBUF_EOF) {
+		if (lexer->ahead[0] == (unsigned char) comment_end[0] && lexer_matches(lexer, comment_end)) {
+			advance(lexer, strlen(comment_end));
+			lexer->state = HIGHLIGHT_STATE_NORMAL;
+			return;
+		}
+		advance(lexer, 1);
+	}
+}
+
+/* Lexes a string (whose quote the lexer's state is) up to and including its closing quote, or up to the end of the line
+ * if it carries on past it.
+ */
+static void lex_string(struct HighlightLexer *lexer) {
+	const int quote = lexer->state & ~HIGHLIGHT_STATE_LONG;
+	const bool long_string = (lexer->state & HIGHLIGHT_STATE_LONG) != 0;
+	while (lexer->ahead[0] != FILEBUF_EOF) {
+		const int c = lexer->ahead[0];
+		if (c == '\\') {
+			if (lexer->ahead[1] == FILEBUF_EOF) {
+				advance(lexer, 1); // escapes the new-line, so the string carries on
+				return;
+			}
+			advance(lexer, 2);
+			continue;
+		}
+		if (c == quote && (!long_string || lexer->ahead[1] == quote && lexer->ahead[2] == quote)) {
+			advance(lexer, long_string ? 3 : 1);
+			lexer->state = HIGHLIGHT_STATE_NORMAL;
+			return;
+		}
+		advance(lexer, 1);
+	}
+	if (!long_string && !lexer->language->strings_span_lines) {
+		lexer->state = HIGHLIGHT_STATE_NORMAL; // never closed, so it ends with the line
+	}
+}
+
+/* Lexes a word (letters, digits, underscores and any non-ASCII chars). Returns its color in the lexer's language. */
+static uint8_t lex_word(struct HighlightLexer *lexer) {
+	char word[HIGHLIGHT_WORD_MAX];
+	size_t length = 0;
+	while (is_word_char(lexer->ahead[0])) {
+		if (length < HIGHLIGHT_WORD_MAX) {
+			word[length] = lexer->ahead[0];
+		}
+		length++;
+		advance(lexer, 1);
+	}
+	if (length > HIGHLIGHT_WORD_MAX) return HIGHLIGHT_COLOR_DEFAULT; // longer than any of the language's words
+	return word_color(lexer->language, word, length);
+}
+
+static inline bool is_word_char(int c) {
+	return c >= '0' && c <= '9' || (c | 0x20) >= 'a' && (c | 0x20) <= 'z' || c == '_' || c >= 0x80;
+}
+
+/* Returns the color of the word (length chars) in the language, from the language's words. */
+static uint8_t word_color(const struct Language *language, const char *word, size_t length) {
+	uint32_t low = 0;
+	uint32_t high = language->word_count;
+	while (low < high) {
+		const uint32_t mid = low + (high - low) / 2;
+		const char *candidate = language->words[mid].word; // alias
+		int order = strncmp(word, candidate, length);
+		if (order == 0 && candidate[length] != '\0') {
+			order = -1; // the word is the start of the candidate, so sorts before it
+		}
+		if (order == 0) return language->words[mid].color;
+		if (order < 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return HIGHLIGHT_COLOR_DEFAULT;
+}
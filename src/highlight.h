@@ -0,0 +1,147 @@
+/* highlight.h
+ * Syntax highlighting: the color of each part of a file's text, by what it is (a keyword, a string, a comment...).
+ * Each language is a table describing its syntax, which a lexer steps through a token at a time. The state the lexer is
+ * in at the start of each line is cached, so coloring a line only lexes that line, and after an edit lines are only
+ * lexed again from the first one changed until one ends in the same state as was cached for the line after it.
+ * Lines that would take longer than a frame to lex are lexed by a worker thread instead, over a snapshot of the text,
+ * so the input thread never waits on lexing however large the file is.
+ */
+
+#ifndef __HIGHLIGHT_H__
+#define __HIGHLIGHT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "filebuf.h"
+
+#define HIGHLIGHT_LOOKAHEAD 4 // chars the lexer sees ahead of where it is. must be more than the longest delimiter
+#define HIGHLIGHT_WORD_MAX 16 // longest word looked up in a language's words
+#define HIGHLIGHT_FRAME_US 2000 // time lines are lexed for on the input thread at once, before leaving the rest to the worker
+#define HIGHLIGHT_CHECK_LINES 64 // lines lexed between looking at the time (or, on the worker, whether its job is still wanted)
+#define HIGHLIGHT_VIEW_LINES 256 // lines past the one looked up that are wanted soon, as they may be on screen
+#define HIGHLIGHT_WORKER_NICE 19 // niceness of the worker's thread, lowest priority, since it only runs ahead of what's shown
+#define HIGHLIGHT_PUBLISH_LINES (1 << 16) // lines the worker lexes between handing what it has lexed to the input thread
+
+// colors text is drawn in (SGR codes, see SCREEN_COLOR_DEFAULT)
+#define HIGHLIGHT_COLOR_DEFAULT 0
+#define HIGHLIGHT_COLOR_KEYWORD 35
+#define HIGHLIGHT_COLOR_TYPE 36
+#define HIGHLIGHT_COLOR_STRING 32
+#define HIGHLIGHT_COLOR_NUMBER 31
+#define HIGHLIGHT_COLOR_COMMENT 34
+#define HIGHLIGHT_COLOR_PREPROCESSOR 33
+
+// what the lexer is within at the start of a line. within a string it is the string's quote char instead,
+// with HIGHLIGHT_STATE_LONG set if its quotes are tripled
+enum highlight_states {
+	HIGHLIGHT_STATE_NORMAL,
+	HIGHLIGHT_STATE_BLOCK_COMMENT
+};
+#define HIGHLIGHT_STATE_LONG 0x80
+
+// a word a language colors (e.g. a keyword or the name of a type)
+struct HighlightWord {
+	const char *word;
+	uint8_t color;
+};
+
+// the syntax of a language, as far as coloring it goes
+struct Language {
+	const char *name;
+	const char *const *extensions; // endings of the names of files in the language (e.g. ".c"), NULL terminated
+	const struct HighlightWord *words; // sorted (in strcmp() order), so they are binary searched
+	uint32_t word_count;
+	const char *line_comment; // starts a comment up to the end of the line. NULL if none
+	const char *block_comment_start; // starts a comment up to block_comment_end, across lines. NULL if none
+	const char *block_comment_end;
+	const char *quotes; // chars that start and end strings. a backslash escapes the char after it within them
+	bool long_strings; // whether a tripled quote starts a string up to the same tripled quote, across lines
+	bool strings_span_lines; // whether any string carries on across lines. otherwise only with a backslash before the new-line
+	bool preprocessor; // whether a '#' at the start of a line (after any blanks) begins a directive
+};
+
+// steps through the text of a line a token at a time
+struct HighlightLexer {
+	struct FileBufCursor cursor; // the text is read from, unless it is read from a snapshot
+	const struct FileBufSnapshot *snapshot; // the text is read from instead, if not NULL
+	uint32_t span; // next of the snapshot's spans to be read
+	const char *text; // rest of the span being read, just past the chars in ahead
+	index_t text_length;
+	const struct Language *language; // NULL if not highlighted, in which case the line is a single token
+	index_t index; // file index of the next char (ahead[0])
+	int ahead[HIGHLIGHT_LOOKAHEAD]; // the next chars. FILEBUF_EOF from the end of the line on
+	bool line_ended; // whether the end of the line was read (as FILEBUF_EOF in ahead)
+	bool newline; // whether the line ended with a new-line char, rather than the end of the text
+	bool line_start; // whether nothing but blanks came before in the line
+	uint8_t state; // see highlight_states enum
+};
+
+// states of lines lexed by the worker, handed to the input thread
+struct HighlightResults {
+	uint8_t *states; // state at the start of each line from first_line on
+	index_t first_line;
+	index_t count;
+	uint32_t version; // of the text they were lexed from (see HighlightWorker.version)
+};
+
+// lexing a snapshot of the text on the worker, from a line whose state is known to the end of the text
+struct HighlightJob {
+	struct FileBufSnapshot snapshot;
+	const struct Language *language;
+	index_t from_index; // file index of the start of from_line
+	index_t from_line;
+	uint32_t version;
+	uint8_t from_state;
+};
+
+// a thread lexing the text in the background, one job at a time. only ever started when first needed
+struct HighlightWorker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready;
+	struct HighlightJob job; // next job, if job_pending
+	_Atomic(struct HighlightResults *) results; // lexed but not yet taken by the input thread. NULL if none
+	atomic_uint version; // incremented by the input thread whenever the text changes. jobs for older versions are dropped
+	_Atomic index_t view_end; // line up to which lines are wanted soon, so are handed over as soon as they are lexed
+	int wake_fds[2]; // pipe written to whenever results are handed over, for the input thread to poll (see highlight_wake_fd())
+	bool job_pending;
+	bool started;
+	bool failed; // whether the thread couldn't be started, in which case everything is lexed on the input thread
+	bool stopping;
+};
+
+// the highlighting of a file buffer's text, with the state at the start of each line lexed so far
+struct Highlight {
+	struct FileBuf *fb;
+	struct FileBufChange change; // edits to the text since the cached states were last brought up to date with it
+	const struct Language *language; // NULL if the file isn't highlighted
+	uint8_t *states; // state at the start of each line, for the first 'lexed' lines
+	index_t state_size;
+	index_t line_count; // lines in the file as of the last change taken from it
+	index_t known; // lines from the start of the file whose states are up to date
+	index_t resume; // lines from known up to here are still to be lexed again. the states from here up to lexed were each
+	index_t lexed; // lexed from the one before, so are up to date once a line before them ends in the state cached for the next
+	bool overran; // whether lexing on the input thread ran out of time since the text last changed, leaving the rest to the worker
+	index_t guessed; // first line whose state was guessed at, not yet known, since the text was last drawn. (index_t) -1 if none
+	struct HighlightWorker worker;
+	uint32_t job_version; // version of the text the last job was posted for
+	bool job_posted;
+};
+
+void highlight_init(struct Highlight *hl, struct FileBuf *fb);
+void highlight_free(struct Highlight *hl);
+const struct Language *highlight_language_for_path(const char *path);
+void highlight_set_language(struct Highlight *hl, const struct Language *language);
+uint8_t highlight_line_state(struct Highlight *hl, index_t line);
+bool highlight_take_results(struct Highlight *hl);
+int highlight_wake_fd(struct Highlight *hl);
+
+void highlight_lexer_init(struct HighlightLexer *lexer, struct Highlight *hl, index_t file_index);
+uint8_t highlight_lexer_next(struct HighlightLexer *lexer);
+bool highlight_lexer_at_end(struct HighlightLexer *lexer);
+
+#endif
@@ -0,0 +1,237 @@
+/* journal.c
+ * Append-only log of every edit made to a file since it was last saved, for crash recovery.
+ *
+ * The journal of "dir/name" is "dir/.name.journal". It starts with a header identifying the version of the file
+ * its records apply to, followed by the records themselves (see JournalRecord). It only exists while there are
+ * unsaved edits: it is created by the first edit and deleted once the file is saved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "journal.h"
+#include "os.h"
+
+#define JOURNAL_MAGIC "DEJRNL01" // also the format version
+
+struct JournalHeader {
+	char magic[8];
+	struct JournalOrigin origin;
+};
+
+static char *journal_path(const char *file_path);
+static void get_origin(const char *file_path, struct JournalOrigin *origin);
+static uint32_t record_checksum(const struct JournalRecord *record, const struct iovec *text, int text_count);
+static bool create_file(struct Journal *journal);
+
+/* Initializes the journal to not journaling anything. */
+void journal_init(struct Journal *journal) {
+	journal->path = NULL;
+	journal->fd = -1;
+	journal->unsynced = false;
+	journal->replaying = false;
+}
+
+/* Syncs and closes the journal, leaving its file in place for recovery if it has any records. */
+void journal_free(struct Journal *journal) {
+	journal_sync(journal);
+	if (journal->fd != -1) {
+		close(journal->fd);
+	}
+	free(journal->path);
+	journal_init(journal);
+}
+
+/* Returns the path of the journal for the file at the path, in a new heap buffer. */
+static char *journal_path(const char *file_path) {
+	const char *name = strrchr(file_path, '/');
+	name = name == NULL ? file_path : name + 1;
+	const size_t dir_length = name - file_path;
+	const size_t name_length = strlen(name);
+
+	char *path = malloc(dir_length + 1 + name_length + sizeof(".journal"));
+	memcpy(path, file_path, dir_length);
+	path[dir_length] = '.';
+	memcpy(path + dir_length + 1, name, name_length);
+	memcpy(path + dir_length + 1 + name_length, ".journal", sizeof(".journal"));
+	return path;
+}
+
+/* Identifies the current version of the file at the path. All zero if there is no such file. */
+static void get_origin(const char *file_path, struct JournalOrigin *origin) {
+	memset(origin, 0, sizeof(struct JournalOrigin));
+	struct stat filestat;
+	if (stat(file_path, &filestat) == -1) return;
+	origin->device = filestat.st_dev;
+	origin->inode = filestat.st_ino;
+	origin->size = filestat.st_size;
+	origin->mtime_ns = (uint64_t) filestat.st_mtim.tv_sec * 1000000000 + filestat.st_mtim.tv_nsec;
+}
+
+/* Returns the FNV-1a hash of the record's header (with its checksum as 0) and text, which is given in pieces. */
+static uint32_t record_checksum(const struct JournalRecord *record, const struct iovec *text, int text_count) {
+	struct JournalRecord header = *record;
+	header.checksum = 0;
+
+	uint32_t hash = 2166136261;
+	const unsigned char *bytes = (const unsigned char *) &header;
+	for (size_t i = 0; i < sizeof(struct JournalRecord); i++) {
+		hash = (hash ^ bytes[i]) * 16777619;
+	}
+	for (int piece = 0; piece < text_count; piece++) {
+		bytes = text[piece].iov_base;
+		for (size_t i = 0; i < text[piece].iov_len; i++) {
+			hash = (hash ^ bytes[i]) * 16777619;
+		}
+	}
+	return hash;
+}
+
+/* Starts the journal to be journaling edits made to the file at the path, first replaying any edits recovered
+ * from an existing journal for it by calling apply() on each record in order.
+ * The existing journal is only replayed if the file is still the same version it was written against, and only up to
+ * its first incomplete or corrupted record (e.g. one cut short by a crash). Whatever is not replayed is discarded.
+ * Returns the number of records replayed.
+ */
+uint32_t journal_open(struct Journal *journal, const char *file_path, journal_apply_fn apply, void *arg) {
+	journal->path = journal_path(file_path);
+	get_origin(file_path, &journal->origin);
+
+	int fd = open(journal->path, O_RDWR | O_APPEND);
+	if (fd == -1) return 0; // nothing to recover. created once the first edit is made
+
+	struct stat filestat;
+	uint32_t replayed_count = 0;
+	off_t valid_length = 0; // end of the last record replayed
+	if (fstat(fd, &filestat) == 0 && filestat.st_size >= (off_t) sizeof(struct JournalHeader)) {
+		const size_t length = filestat.st_size;
+		const char *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			struct JournalHeader header;
+			memcpy(&header, map, sizeof(struct JournalHeader));
+			if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0
+					&& memcmp(&header.origin, &journal->origin, sizeof(struct JournalOrigin)) == 0) {
+				valid_length = sizeof(struct JournalHeader);
+				journal->replaying = true;
+				while (length - valid_length >= sizeof(struct JournalRecord)) {
+					struct JournalRecord record; // records are not aligned within the file
+					memcpy(&record, map + valid_length, sizeof(struct JournalRecord));
+					if (record.text_length > length - valid_length - sizeof(struct JournalRecord)) break;
+					const char *text = map + valid_length + sizeof(struct JournalRecord);
+					const struct iovec text_iovec = {(void *) text, record.text_length};
+					if (record_checksum(&record, &text_iovec, 1) != record.checksum) break;
+					if (!apply(arg, &record, text)) break;
+
+					valid_length += sizeof(struct JournalRecord) + record.text_length;
+					replayed_count++;
+				}
+				journal->replaying = false;
+			}
+			munmap((void *) map, length);
+		}
+	}
+
+	if (valid_length == 0) {
+		// written against some other version of the file, so its edits no longer apply
+		close(fd);
+		unlink(journal->path);
+		return 0;
+	}
+	if (valid_length < filestat.st_size) {
+		ftruncate(fd, valid_length); // so new records follow the last good one
+	}
+	journal->fd = fd;
+	return replayed_count;
+}
+
+/* Creates the journal's file, containing only the header. Returns whether successful. */
+static bool create_file(struct Journal *journal) {
+	journal->fd = open(journal->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (journal->fd == -1) return false;
+
+	struct JournalHeader header;
+	memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+	header.origin = journal->origin;
+	struct iovec iovec = {&header, sizeof(struct JournalHeader)};
+	if (!os_write_iovecs(journal->fd, &iovec, 1)) {
+		close(journal->fd);
+		unlink(journal->path);
+		journal->fd = -1;
+		return false;
+	}
+	return true;
+}
+
+/* Appends a record of an edit to the journal, creating the journal's file if it does not exist yet.
+ * The record's text is given in text_count pieces (e.g. straight from wherever the edit keeps it), which are written
+ * one after another. Costs a single write of the record, which is not synced to disk until journal_sync().
+ * Journaling is best effort: if the record can't be written, the edit simply won't be recoverable.
+ */
+void journal_append(struct Journal *journal, uint32_t type, uint64_t index, uint64_t removed_length, const struct iovec *text, int text_count) {
+	if (journal->path == NULL || journal->replaying) return;
+	if (journal->fd == -1 && !create_file(journal)) return;
+
+	struct JournalRecord record;
+	record.type = type;
+	record.index = index;
+	record.removed_length = removed_length;
+	record.text_length = 0;
+	for (int i = 0; i < text_count; i++) {
+		record.text_length += text[i].iov_len;
+	}
+	record.checksum = record_checksum(&record, text, text_count);
+
+	const off_t end = lseek(journal->fd, 0, SEEK_END);
+	struct iovec *iovecs = malloc(sizeof(struct iovec) * (text_count + 1));
+	iovecs[0].iov_base = &record;
+	iovecs[0].iov_len = sizeof(struct JournalRecord);
+	if (text_count > 0) {
+		memcpy(iovecs + 1, text, sizeof(struct iovec) * text_count);
+	}
+	const bool written = os_write_iovecs(journal->fd, iovecs, text_count + 1);
+	free(iovecs);
+	if (!written) {
+		ftruncate(journal->fd, end); // don't leave a partial record for later ones to follow
+		return;
+	}
+
+	if (!journal->unsynced) {
+		journal->unsynced = true;
+		journal->unsynced_since_us = os_now_us();
+	}
+}
+
+/* Discards every record, since the file at the path was just saved with all of them, and deletes the journal's file. */
+void journal_reset(struct Journal *journal, const char *file_path) {
+	if (journal->path == NULL) return;
+
+	get_origin(file_path, &journal->origin); // later records apply to the newly saved version
+	if (journal->fd != -1) {
+		close(journal->fd);
+		unlink(journal->path);
+		journal->fd = -1;
+	}
+	journal->unsynced = false;
+}
+
+/* Returns the number of milliseconds until journal_sync() should be called (0 if it is due already),
+ * or -1 if there is nothing to sync. Suitable as a poll() timeout.
+ */
+int journal_sync_timeout(struct Journal *journal) {
+	if (!journal->unsynced) return -1;
+
+	const uint64_t elapsed_ms = (os_now_us() - journal->unsynced_since_us) / 1000;
+	return elapsed_ms >= JOURNAL_SYNC_INTERVAL_MS ? 0 : JOURNAL_SYNC_INTERVAL_MS - elapsed_ms;
+}
+
+/* Forces every record written so far to disk. */
+void journal_sync(struct Journal *journal) {
+	if (!journal->unsynced) return;
+	fdatasync(journal->fd);
+	journal->unsynced = false;
+}
@@ -0,0 +1,65 @@
+/* journal.h
+ * Append-only log of every edit made to a file since it was last saved, kept next to the file,
+ * so that unsaved edits can be recovered after a crash by replaying them onto the file.
+ *
+ * Each edit is written as soon as it is made, as one record costing O(edit size), never O(file size).
+ * Records are only forced to disk (fdatasync) every JOURNAL_SYNC_INTERVAL_MS at most, so that many edits
+ * share the cost of a single sync (group commit). A crash can lose at most that much time of edits.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define JOURNAL_SYNC_INTERVAL_MS 1000
+
+enum journal_record_types {
+	JOURNAL_RECORD_INSERT, // text replaced removed_length chars at index, recorded in history
+	JOURNAL_RECORD_UNDO, // the last edit made since the journal began was undone
+	JOURNAL_RECORD_REDO, // the last undone edit made since the journal began was redone
+	JOURNAL_RECORD_CHANGE, // text replaced removed_length chars at index, without being recorded in history
+	JOURNAL_RECORD_REPLACE, // index ranges each replaced by the same text, in history as one change. text is that (removed_length chars), then each range as uint64_t index and length
+	JOURNAL_RECORD_BATCH // index edits made at once, in history as one change. text is each edit as uint64_t index, removed length, length and offset of its text, then the texts
+};
+
+// the file a journal's records apply to. the journal is discarded if the file no longer matches
+struct JournalOrigin {
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	uint64_t mtime_ns;
+};
+
+// header of each record in the journal file, followed by text_length chars of text
+struct JournalRecord {
+	uint32_t type; // see journal_record_types enum
+	uint32_t checksum; // of the header (with this as 0) and the text, so torn records at the end are detected
+	uint64_t index;
+	uint64_t removed_length;
+	uint64_t text_length;
+};
+
+struct Journal {
+	char *path; // NULL if not journaling
+	int fd; // -1 until the first record is written
+	struct JournalOrigin origin;
+	uint64_t unsynced_since_us; // when the oldest record not yet synced to disk was written
+	bool unsynced; // whether any records were written but not synced to disk yet
+	bool replaying; // while set, no records are written (the edits being made come from the journal itself)
+};
+
+// applies a replayed record to whatever is being journaled. returns false to stop replaying at the record
+typedef bool (*journal_apply_fn)(void *arg, const struct JournalRecord *record, const char *text);
+
+void journal_init(struct Journal *journal);
+void journal_free(struct Journal *journal);
+uint32_t journal_open(struct Journal *journal, const char *file_path, journal_apply_fn apply, void *arg);
+void journal_append(struct Journal *journal, uint32_t type, uint64_t index, uint64_t removed_length, const struct iovec *text, int text_count);
+void journal_reset(struct Journal *journal, const char *file_path);
+int journal_sync_timeout(struct Journal *journal);
+void journal_sync(struct Journal *journal);
+
+#endif
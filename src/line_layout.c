@@ -0,0 +1,248 @@
+/* line_layout.c
+ * Display columns of the chars within lines of a file buffer, cached per line.
+ *
+ * A line is measured once (see utf8_measure()) the first time a column within it is needed, and a checkpoint of the
+ * column is kept every LINE_LAYOUT_INTERVAL chars along it, so that finding the column of any index (or the index at
+ * any column) only measures again from the nearest checkpoint. The cache is dropped whenever the table changes.
+ */
+
+#include <stdlib.h>
+
+#include "line_layout.h"
+#include "utf8.h"
+
+static struct LineLayoutEntry *find_line(struct LineLayout *layout, index_t file_index);
+static void measure_line(struct LineLayout *layout, struct LineLayoutEntry *line, index_t file_index);
+static void add_checkpoint(struct LineLayoutEntry *line, index_t index, size_t column);
+static struct LayoutCheckpoint nearest_checkpoint(struct LineLayoutEntry *line, index_t file_index, size_t column);
+static size_t decode_at(struct FileBufCursor *cursor, index_t end, uint32_t *codepoint);
+
+void line_layout_init(struct LineLayout *layout, struct FileBuf *fb) {
+	layout->fb = fb;
+	layout->next_replaced = 0;
+	for (uint32_t i = 0; i < LINE_LAYOUT_LINES; i++) {
+		layout->lines[i].checkpoints = NULL;
+		layout->lines[i].checkpoint_count = 0;
+		layout->lines[i].checkpoint_size = 0;
+		layout->lines[i].valid = false;
+	}
+}
+
+void line_layout_free(struct LineLayout *layout) {
+	for (uint32_t i = 0; i < LINE_LAYOUT_LINES; i++) {
+		free(layout->lines[i].checkpoints);
+		layout->lines[i].checkpoints = NULL;
+		layout->lines[i].checkpoint_size = 0;
+		layout->lines[i].valid = false;
+	}
+}
+
+/* Returns the layout of the line containing the file index (its new-line char belongs to it too),
+ * measuring the line in place of the least recently measured one if it isn't cached.
+ */
+static struct LineLayoutEntry *find_line(struct LineLayout *layout, index_t file_index) {
+	for (uint32_t i = 0; i < LINE_LAYOUT_LINES; i++) {
+		struct LineLayoutEntry *line = &layout->lines[i]; // alias
+		if (line->valid && line->generation == layout->fb->table.generation && line->start <= file_index && file_index <= line->end) {
+			return line;
+		}
+	}
+
+	struct LineLayoutEntry *line = &layout->lines[layout->next_replaced]; // alias
+	layout->next_replaced = (layout->next_replaced + 1) % LINE_LAYOUT_LINES;
+	measure_line(layout, line, file_index);
+	return line;
+}
+
+/* Measures the whole line containing the file index into the entry. */
+static void measure_line(struct LineLayout *layout, struct LineLayoutEntry *line, index_t file_index) {
+	struct FileBuf *fb = layout->fb; // alias
+	const index_t line_number = filebuf_offset_to_line(fb, file_index);
+	filebuf_line_to_offset(fb, line_number, &line->start);
+	if (filebuf_line_to_offset(fb, line_number + 1, &line->end)) {
+		line->end--; // the new-line char ending the line
+	} else {
+		line->end = fb->length; // last line of file
+	}
+	line->generation = fb->table.generation;
+	line->checkpoint_count = 0;
+	line->valid = true;
+
+	// measured an interval at a time, checkpointing wherever an interval doesn't end partway through a char
+	struct Utf8Measure measure;
+	utf8_measure_init(&measure, 0);
+	struct FileBufCursor cursor;
+	filebuf_cursor_init(&cursor, fb, line->start);
+	index_t index = line->start;
+	index_t next_checkpoint = line->start + LINE_LAYOUT_INTERVAL;
+	index_t span_length;
+	const char *span;
+	while (index < line->end && (span = filebuf_cursor_next_span(&cursor, &span_length)) != NULL) {
+		if (span_length > line->end - index) {
+			span_length = line->end - index;
+		}
+		while (span_length > 0) {
+			index_t length = next_checkpoint - index;
+			if (length > span_length) {
+				length = span_length;
+			}
+			utf8_measure(&measure, span, length);
+			span += length;
+			span_length -= length;
+			index += length;
+			if (index == next_checkpoint) {
+				if (measure.partial_length == 0) {
+					add_checkpoint(line, index, measure.column);
+				}
+				next_checkpoint += LINE_LAYOUT_INTERVAL;
+			}
+		}
+	}
+	line->columns = utf8_measure_finish(&measure);
+	line->plain = measure.plain;
+	if (line->plain) {
+		line->checkpoint_count = 0; // columns are just distances from the start
+	}
+}
+
+static void add_checkpoint(struct LineLayoutEntry *line, index_t index, size_t column) {
+	if (line->checkpoint_count == line->checkpoint_size) {
+		line->checkpoint_size = line->checkpoint_size == 0 ? 16 : line->checkpoint_size * 2;
+		line->checkpoints = realloc(line->checkpoints, sizeof(struct LayoutCheckpoint) * line->checkpoint_size);
+	}
+	line->checkpoints[line->checkpoint_count].index = index;
+	line->checkpoints[line->checkpoint_count].column = column;
+	line->checkpoint_count++;
+}
+
+/* Returns the last checkpoint in the line at or before both the file index and the column
+ * (the line's start if there is none).
+ */
+static struct LayoutCheckpoint nearest_checkpoint(struct LineLayoutEntry *line, index_t file_index, size_t column) {
+	// binary search for the first checkpoint past either. checkpoints are in order of both index and column
+	uint32_t low = 0;
+	uint32_t high = line->checkpoint_count;
+	while (low < high) {
+		const uint32_t mid = low + (high - low) / 2;
+		if (line->checkpoints[mid].index <= file_index && line->checkpoints[mid].column <= column) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low == 0) {
+		return (struct LayoutCheckpoint) {.index = line->start, .column = 0};
+	}
+	return line->checkpoints[low - 1];
+}
+
+/* Returns the (zero-based) display column where the char at the file index starts within its line.
+ * An index partway through a char is at the column of that char.
+ */
+size_t line_layout_column(struct LineLayout *layout, index_t file_index) {
+	struct LineLayoutEntry *line = find_line(layout, file_index);
+	if (line->plain) return file_index - line->start;
+	if (file_index == line->end) return line->columns;
+
+	const struct LayoutCheckpoint checkpoint = nearest_checkpoint(line, file_index, SIZE_MAX);
+	struct Utf8Measure measure;
+	utf8_measure_init(&measure, checkpoint.column);
+	struct FileBufCursor cursor;
+	filebuf_cursor_init(&cursor, layout->fb, checkpoint.index);
+	index_t remaining = file_index - checkpoint.index;
+	index_t span_length;
+	const char *span;
+	while (remaining > 0 && (span = filebuf_cursor_next_span(&cursor, &span_length)) != NULL) {
+		if (span_length > remaining) {
+			span_length = remaining;
+		}
+		utf8_measure(&measure, span, span_length);
+		remaining -= span_length;
+	}
+	if (measure.partial_length > 0) {
+		// the start of a char was cut off by the index: either the index is partway through it,
+		// or it is never finished, in which case each of its bytes is a char of its own
+		filebuf_cursor_seek(&cursor, file_index - measure.partial_length);
+		uint32_t codepoint;
+		decode_at(&cursor, line->end, &codepoint);
+		if (cursor.index <= file_index) return measure.column + measure.partial_length;
+	}
+	return measure.column;
+}
+
+/* Returns the file index of the char at the (zero-based) display column within the line containing line_index.
+ * A column partway through a wide char (or tab) gives the index of that char, and a column past the end of the line
+ * gives the index of its end (its new-line char or the end of the file).
+ */
+index_t line_layout_index_at(struct LineLayout *layout, index_t line_index, size_t column) {
+	struct LineLayoutEntry *line = find_line(layout, line_index);
+	if (column >= line->columns) return line->end;
+	if (line->plain) return line->start + column;
+
+	const struct LayoutCheckpoint checkpoint = nearest_checkpoint(line, line->end, column);
+	struct FileBufCursor cursor;
+	filebuf_cursor_init(&cursor, layout->fb, checkpoint.index);
+	size_t at_column = checkpoint.column;
+	while (cursor.index < line->end) {
+		const index_t char_index = cursor.index;
+		uint32_t codepoint;
+		decode_at(&cursor, line->end, &codepoint);
+		at_column = utf8_next_column(codepoint, at_column);
+		if (at_column > column) return char_index;
+	}
+	return line->end;
+}
+
+/* Returns the index just past the char at the file index (a code point, or a single byte that isn't valid UTF-8).
+ * Returns the file's length if at the end of the file.
+ */
+index_t line_layout_next_char(struct LineLayout *layout, index_t file_index) {
+	if (file_index >= layout->fb->length) return layout->fb->length;
+	struct FileBufCursor cursor;
+	filebuf_cursor_init(&cursor, layout->fb, file_index);
+	uint32_t codepoint;
+	decode_at(&cursor, layout->fb->length, &codepoint);
+	return cursor.index;
+}
+
+/* Returns the index of the char before the file index, the counterpart of line_layout_next_char().
+ * Returns 0 if at the start of the file.
+ */
+index_t line_layout_prev_char(struct LineLayout *layout, index_t file_index) {
+	if (file_index == 0) return 0;
+	struct FileBufCursor cursor;
+	filebuf_cursor_init(&cursor, layout->fb, file_index);
+
+	// back over continuation bytes to what may be the char's first byte, then check it really ends at the file index
+	index_t start = file_index;
+	for (int i = 0; i < UTF8_MAX_LENGTH && start > 0; i++) {
+		const int c = filebuf_cursor_prev(&cursor);
+		start--;
+		if ((c & 0xC0) != 0x80) break;
+	}
+	uint32_t codepoint;
+	if (decode_at(&cursor, file_index, &codepoint) == file_index - start) return start;
+	return file_index - 1;
+}
+
+/* Decodes the char at the cursor, reading no further than end, and moves the cursor past it.
+ * Returns its length in bytes. Bytes that aren't valid UTF-8 (including a char cut off by end) are a char each,
+ * decoded as UTF8_REPLACEMENT.
+ */
+static size_t decode_at(struct FileBufCursor *cursor, index_t end, uint32_t *codepoint) {
+	char text[UTF8_MAX_LENGTH];
+	size_t length = 0;
+	while (length < UTF8_MAX_LENGTH && cursor->index < end) {
+		text[length] = filebuf_cursor_next(cursor);
+		length++;
+	}
+	size_t char_length = utf8_decode(text, length, codepoint);
+	if (char_length == 0) {
+		char_length = 1;
+		*codepoint = UTF8_REPLACEMENT;
+	}
+	for (size_t i = char_length; i < length; i++) {
+		filebuf_cursor_prev(cursor); // give back what was read past the char
+	}
+	return char_length;
+}
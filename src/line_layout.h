@@ -0,0 +1,52 @@
+/* line_layout.h
+ * Display columns of the chars within lines of a file buffer, cached per line so that moving the cursor
+ * and drawing around it doesn't measure the line again each time.
+ */
+
+#ifndef __LINE_LAYOUT_H__
+#define __LINE_LAYOUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "filebuf.h"
+
+#define LINE_LAYOUT_LINES 4 // lines whose layout is cached at once
+#define LINE_LAYOUT_INTERVAL 256 // chars between checkpoints within a line, bounding how much is measured again per lookup
+
+// display column where a char starts
+struct LayoutCheckpoint {
+	index_t index; // file index of the char
+	size_t column;
+};
+
+// layout of a single line. plain lines (only ASCII, no tabs) need nothing more than their bounds, since
+// each char takes exactly one column. others keep a checkpoint every LINE_LAYOUT_INTERVAL chars or so
+struct LineLayoutEntry {
+	struct LayoutCheckpoint *checkpoints; // in file order, the first at the second interval (the line's start is column 0)
+	uint32_t checkpoint_count;
+	uint32_t checkpoint_size;
+	index_t start; // file index of the line's first char
+	index_t end; // file index of the line's new-line char, or the end of the file
+	size_t columns; // display width of the whole line
+	uint32_t generation; // table generation the line was measured in
+	bool valid; // whether the entry holds a line at all
+	bool plain;
+};
+
+// the layouts of the lines most recently looked up in a file buffer
+struct LineLayout {
+	struct FileBuf *fb;
+	struct LineLayoutEntry lines[LINE_LAYOUT_LINES];
+	uint32_t next_replaced; // entry the next line measured replaces, in turn
+};
+
+void line_layout_init(struct LineLayout *layout, struct FileBuf *fb);
+void line_layout_free(struct LineLayout *layout);
+size_t line_layout_column(struct LineLayout *layout, index_t file_index);
+index_t line_layout_index_at(struct LineLayout *layout, index_t line_index, size_t column);
+index_t line_layout_next_char(struct LineLayout *layout, index_t file_index);
+index_t line_layout_prev_char(struct LineLayout *layout, index_t file_index);
+
+#endif
@@ -5,24 +5,512 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "window.h"
 #include "terminal.h"
+#include "screen.h"
 #include "filebuf.h"
 #include "string_builder.h"
+#include "utf8.h"
+#include "parallel_search.h"
+#include "os.h"
 
-static void interrupt_handler(int sig) {
-	signal(sig, SIG_IGN);
-	printf("Are you sure you want to quit? [y/n] ");
-	char c = getchar();
+#define IDLE_SLICE_US 2000 // max time spent on background work before checking for input again
+#define RESIZE_SETTLE_US 30000 // time without another resize before the window is fitted to the terminal's new size
+#define RESIZE_WAIT_US 100000 // max time a burst of resizes is waited on to settle, so a long drag is still followed
+#define READ_AHEAD_SIZE (64 << 10) // bytes read from stdin at once while reading a paste
+#define KEY_PASTE (-2) // read by read_key() when a bracketed paste starts. its text is then read by read_paste()
+#define KEY_PAGE_UP (-3)
+#define KEY_PAGE_DOWN (-4)
+#define KEY_HIGHLIGHTED (-5) // read by read_key() when lines drawn with guessed highlighting have since been lexed
+#define KEY_RESIZED (-6) // read by read_key() once the terminal was resized (see settle_resizes())
+#define KEY_INTERRUPTED (-7) // read by read_key() after Ctrl-C, which asks whether to quit (see confirm_quit())
+#define KEY_SEARCHED (-8) // read by read_key() once the search started from the search prompt is done (see start_search())
+#define SEARCH_QUERY_SIZE 256 // longest query that can be typed at the search prompt, plus its null-terminator
+#define KEY_CTRL(c) ((c) & 0x1F) // the char typed for a letter while holding control
+
+// input read from stdin before it was needed (e.g. keys typed right after a paste, read along with its end)
+static char read_ahead[READ_AHEAD_SIZE];
+static size_t read_ahead_start;
+static size_t read_ahead_end;
+
+// pipe written to whenever a signal is handled, for read_char() to poll along with input
+static int signal_fds[2] = {-1, -1};
+static volatile sig_atomic_t resized; // whether the terminal was resized since the window was last fitted to it
+static volatile sig_atomic_t interrupted; // whether Ctrl-C was pressed since it was last asked whether to quit
+
+static struct SearchTask search_task; // searching for the query typed at the search prompt, in the background
+
+/* Only notes which signal came, as nothing else is safe to do within a handler (the screen's frame may be partway
+ * through being built, for one). The main loop sees to it once read_char() wakes (see read_key()).
+ */
+static void signal_handler(int sig) {
+	const int saved_errno = errno;
+	if (sig == SIGWINCH) {
+		resized = 1;
+	} else {
+		interrupted = 1;
+	}
+	if (write(signal_fds[1], "", 1) < 0) {
+		// only if the pipe is full, so read_char() will wake anyway
+	}
+	errno = saved_errno;
+}
+
+/* Moves the editor to the file index, scrolling the window to it (and redrawing it) if it is outside of the window.
+ * Returns whether the window scrolled.
+ */
+static bool jump_to(struct Window *window, index_t file_index) {
+	window->editor.file_index = file_index;
+	window->editor.cursor_line = filebuf_offset_to_line(&window->filebuf, file_index) + 1;
+	window->editor.cursor_column = line_layout_column(&window->editor.layout, file_index) + 1;
+	window_keep_column(window);
+	if (!window_scroll_to_cursor(window)) return false;
+	window_draw(window, window->top_line);
+	return true;
+}
+
+/* Moves the editor to the file index like jump_to(), and redraws everything in the window from the line
+ * of the changed index down, since an undo, redo or paste may have changed any amount of text after it.
+ */
+static void jump_to_change(struct Window *window, index_t changed_index, index_t file_index) {
+	if (!jump_to(window, file_index)) {
+		window_draw(window, filebuf_offset_to_line(&window->filebuf, changed_index));
+	}
+}
+
+/* Moves the editor to the char at the display column it was last moved to (see Editor.cursor_column_jump) on the row
+ * of the (zero-based) line, or to the last char of the row if it is shorter.
+ */
+static void jump_to_row(struct Window *window, index_t line, index_t row) {
+	struct Editor *editor = &window->editor; // alias
+	index_t line_start;
+	filebuf_line_to_offset(&window->filebuf, line, &line_start);
+	editor->file_index = window_index_in_row(window, line_start, line, row, editor->cursor_column_jump - 1);
+	editor->cursor_line = line + 1;
+	editor->cursor_column = line_layout_column(&editor->layout, editor->file_index) + 1;
+}
+
+/* Scrolls the window by a number of rows (up if negative), keeping to the rows of the file, and moves the editor's
+ * cursor along if it would be left outside of the window.
+ */
+static void scroll_rows(struct Window *window, int64_t rows) {
+	index_t top_line = window->top_line;
+	index_t top_row = window->top_row;
+	window_move_rows(window, &top_line, &top_row, rows);
+	if (top_line == window->top_line && top_row == window->top_row) return;
+	window_scroll(window, top_line, top_row, window->left_column);
+
+	// keep the cursor within the window
+	const index_t cursor_line = window->editor.cursor_line - 1;
+	const index_t cursor_row = window_cursor_row(window);
+	if (cursor_line < top_line || cursor_line == top_line && cursor_row < top_row) {
+		jump_to_row(window, top_line, top_row);
+	} else {
+		index_t bottom_line = top_line;
+		index_t bottom_row = top_row;
+		window_move_rows(window, &bottom_line, &bottom_row, window_rows(window) - 1);
+		if (cursor_line > bottom_line || cursor_line == bottom_line && cursor_row > bottom_row) {
+			jump_to_row(window, bottom_line, bottom_row);
+		}
+	}
+	window_scroll_to_cursor(window); // in case the column moved out of the window
+	window_draw(window, window->top_line);
+}
+
+/* Returns whether there is input that can be read without waiting. */
+static bool input_ready(void) {
+	struct pollfd input = {.fd = STDIN_FILENO, .events = POLLIN};
+	return read_ahead_start < read_ahead_end || poll(&input, 1, 0) > 0;
+}
+
+/* Puts the char just read back, to be read again next. */
+static void unread_char(int c) {
+	if (read_ahead_start == read_ahead_end) {
+		read_ahead_start = 1;
+		read_ahead_end = 1;
+	}
+	read_ahead_start--;
+	read_ahead[read_ahead_start] = c;
+}
+
+/* Empties the pipe written to by signal_handler(), which has no more to say than that a signal came. */
+static void drain_signals(void) {
+	char drained[64];
+	while (read(signal_fds[0], drained, sizeof(drained)) > 0);
+}
+
+/* Waits for a burst of terminal resizes to settle, since dragging the edge of a terminal (or of a tmux pane) resizes it
+ * dozens of times, and fitting the window to each would repaint the whole screen for sizes only passed through.
+ * Returns once no resize has come for RESIZE_SETTLE_US, or after RESIZE_WAIT_US in all so a long drag is still followed,
+ * or as soon as there is input, so typing is never held up.
+ */
+static void settle_resizes(void) {
+	struct pollfd inputs[2] = {
+		{.fd = STDIN_FILENO, .events = POLLIN},
+		{.fd = signal_fds[0], .events = POLLIN}
+	};
+	const uint64_t give_up = os_now_us() + RESIZE_WAIT_US;
+	while (1) {
+		drain_signals();
+		resized = 0;
+		if (interrupted) return; // asked whether to quit first
+
+		const uint64_t now = os_now_us();
+		if (now >= give_up) return;
+		const uint64_t wait = give_up - now < RESIZE_SETTLE_US ? give_up - now : RESIZE_SETTLE_US;
+		const int ready = poll(inputs, 2, (int) ((wait + 999) / 1000));
+		if (ready == 0 || ready > 0 && inputs[0].revents != 0) return;
+		// otherwise resized again (or interrupted by it), so the wait starts over
+	}
+}
+
+/* Waits for the next typed char, using the time the user is idle to defragment the file buffer
+ * and to sync its journal once enough time has passed since the last edit was journaled.
+ * Unless hl is NULL, returns KEY_HIGHLIGHTED instead if its worker lexes lines that were drawn before they were known
+ * (see highlight_take_results()), so they can be drawn again. If events is set, returns KEY_INTERRUPTED instead after
+ * Ctrl-C, KEY_RESIZED once the terminal is resized and any burst of resizes has settled (see settle_resizes()),
+ * or KEY_SEARCHED once a search running in the background is done.
+ */
+static int read_char(struct FileBuf *fb, struct Highlight *hl, bool events) {
+	if (read_ahead_start < read_ahead_end) {
+		read_ahead_start++;
+		return (unsigned char) read_ahead[read_ahead_start - 1];
+	}
+
+	screen_render(); // show everything drawn so far before waiting
+	terminal_flush();
+	struct pollfd inputs[4] = {
+		{.fd = STDIN_FILENO, .events = POLLIN},
+		{.fd = hl == NULL ? -1 : highlight_wake_fd(hl), .events = POLLIN}, // ignored by poll() if -1
+		{.fd = events ? signal_fds[0] : -1, .events = POLLIN},
+		{.fd = events ? search_task_wake_fd(&search_task) : -1, .events = POLLIN}
+	};
+	bool defragmenting = true;
+	while (1) {
+		int timeout = defragmenting || events && (resized || interrupted) ? 0 : journal_sync_timeout(&fb->journal);
+		const int ready = poll(inputs, 4, timeout);
+		if (ready > 0 && inputs[0].revents != 0) break; // input is ready
+		if (ready > 0 && inputs[2].revents != 0) {
+			drain_signals();
+		}
+		if (events && interrupted) {
+			interrupted = 0;
+			return KEY_INTERRUPTED;
+		}
+		if (events && resized) {
+			settle_resizes();
+			return KEY_RESIZED;
+		}
+		if (ready > 0 && inputs[3].revents != 0) return KEY_SEARCHED;
+		if (ready != 0) {
+			if (ready > 0 && inputs[1].revents != 0 && highlight_take_results(hl)) return KEY_HIGHLIGHTED;
+			continue; // or poll was interrupted by a signal, which is seen to once events are wanted
+		}
+
+		if (journal_sync_timeout(&fb->journal) == 0) {
+			journal_sync(&fb->journal);
+		}
+		if (defragmenting) {
+			defragmenting = filebuf_defragment_step(fb, IDLE_SLICE_US);
+		}
+	}
+	return getchar();
+}
+
+/* Asks whether to quit after Ctrl-C was pressed, exiting if so. Otherwise everything on screen is drawn again,
+ * as the question was drawn over it.
+ */
+static void confirm_quit(void) {
+	terminal_write_string("Are you sure you want to quit? [y/n] ");
+	terminal_flush();
+	int c;
+	if (read_ahead_start < read_ahead_end) {
+		read_ahead_start++;
+		c = (unsigned char) read_ahead[read_ahead_start - 1];
+	} else {
+		c = getchar();
+	}
 	if (c == 'y' || c == 'Y') {
 		exit(EXIT_SUCCESS);
-	} else {
-		signal(SIGINT, &interrupt_handler);
+	}
+	screen_redraw();
+}
+
+/* Moves the editor to the first occurrence of the string from the file index on, carrying on from the start of the file
+ * if there is none up to its end. Returns whether there is one anywhere.
+ */
+static bool jump_to_next(struct Window *window, const char *string, index_t from) {
+	struct FileBuf *fb = &window->filebuf; // alias
+	const index_t wrapped_end = strlen(string) - 1 < fb->length - from ? from + strlen(string) - 1 : fb->length; // for occurrences starting before from
+	index_t found;
+	if (!filebuf_index_of(fb, from, fb->length, string, &found) && !filebuf_index_of(fb, 0, wrapped_end, string, &found)) return false;
+	jump_to(window, found);
+	return true;
+}
+
+/* Starts searching for the query typed at the search prompt in the background, from the file index to the end of the
+ * file, or once wrapped, from the start of the file up to it. KEY_SEARCHED is read once it's done, so the input thread
+ * never waits on it, and typing more of the query cancels it for a search for the new one.
+ * Returns false if it couldn't be started, in which case the cursor is moved to the next occurrence (if any) right away.
+ */
+static bool start_search(struct Window *window, const char *query, index_t from, bool wrapped) {
+	struct FileBuf *fb = &window->filebuf; // alias
+	index_t start = from;
+	index_t end = fb->length;
+	if (wrapped) {
+		start = 0;
+		end = strlen(query) - 1 < fb->length - from ? from + strlen(query) - 1 : fb->length;
+	}
+	if (search_task_start(&search_task, fb, start, end, query, SEARCH_FIRST)) return true;
+	jump_to_next(window, query, from);
+	return false;
+}
+
+/* Fits the window to the terminal's size after it was resized, and draws all of it again. The terminal may have
+ * reflowed whatever was on it, so the whole screen is repainted (see screen_resize()), once per burst of resizes.
+ */
+static void fit_to_terminal(struct Window *window) {
+	uint32_t width = window->width;
+	uint32_t height = window->height;
+	terminal_get_size(&width, &height);
+	screen_resize(width, height);
+	window->width = width;
+	window->height = height;
+	window_scroll_to_cursor(window); // fewer rows may fit, and wrapped lines take up a different number of them
+	window_draw(window, window->top_line);
+}
+
+/* Reads the next key typed, like read_char(), but understands the escape sequences the terminal sends:
+ * returns KEY_PASTE when a bracketed paste starts, KEY_PAGE_UP and KEY_PAGE_DOWN for those keys, and skips any other
+ * sequence (e.g. arrow keys, which aren't bound yet).
+ * The escape key on its own is returned as '\033'.
+ */
+static int read_key(struct FileBuf *fb, struct Highlight *hl) {
+	while (1) {
+		int c = read_char(fb, hl, true);
+		if (c != '\033' || !input_ready()) return c; // a sequence arrives all at once, unlike keys typed after escape
+
+		c = read_char(fb, NULL, false);
+		if (c != '[') {
+			unread_char(c);
+			return '\033';
+		}
+
+		// control sequence: parameter chars up to a final char in @ to ~
+		char sequence[16];
+		size_t length = 0;
+		do {
+			c = read_char(fb, NULL, false);
+			if (length < sizeof(sequence)) {
+				sequence[length] = c;
+				length++;
+			}
+		} while (c != EOF && (c < '@' || c > '~'));
+		if (length == 4 && memcmp(sequence, "200~", 4) == 0) return KEY_PASTE;
+		if (length == 2 && memcmp(sequence, "5~", 2) == 0) return KEY_PAGE_UP;
+		if (length == 2 && memcmp(sequence, "6~", 2) == 0) return KEY_PAGE_DOWN;
 	}
 }
 
+/* Reads the text of a bracketed paste, up to the sequence that ends it, straight into the file buffer at the file index.
+ * The text is read in large blocks and inserted as a single change no matter how large it is.
+ * Returns the number of chars pasted.
+ */
+static index_t read_paste(struct FileBuf *fb, index_t file_index) {
+	static const char end_sequence[] = "\033[201~";
+	const size_t end_length = sizeof(end_sequence) - 1;
+
+	struct FileBufStream stream;
+	filebuf_stream_begin(fb, &stream, file_index);
+	size_t matched = 0; // chars of the end sequence matched at the end of the input read so far
+	while (matched < end_length) {
+		if (read_ahead_start == read_ahead_end) {
+			ssize_t read_count = read(STDIN_FILENO, read_ahead, READ_AHEAD_SIZE);
+			if (read_count < 0 && errno == EINTR) continue;
+			if (read_count <= 0) break; // input closed in the middle of the paste
+			read_ahead_start = 0;
+			read_ahead_end = read_count;
+		}
+
+		// write text up to the end sequence, leaving whatever follows it to be read as keys
+		size_t text_start = read_ahead_start;
+		size_t i = read_ahead_start;
+		while (i < read_ahead_end && matched < end_length) {
+			if (read_ahead[i] == end_sequence[matched]) {
+				if (matched == 0) {
+					filebuf_stream_write(fb, &stream, read_ahead + text_start, i - text_start);
+				}
+				matched++;
+				i++;
+				text_start = i;
+			} else if (matched > 0) {
+				// false start: the chars matched so far were text after all. check this char again
+				filebuf_stream_write(fb, &stream, end_sequence, matched);
+				matched = 0;
+			} else {
+				i++;
+			}
+		}
+		filebuf_stream_write(fb, &stream, read_ahead + text_start, i - text_start);
+		read_ahead_start = i;
+	}
+	filebuf_stream_end(fb, &stream);
+	return stream.length;
+}
+
+/* Pastes the text of a bracketed paste into the window's file buffer at the editor's file index, then moves past it.
+ * Only goes in at the editor's cursor: any extra cursors after it are just moved along with their text.
+ */
+static void paste(struct Window *window) {
+	const index_t paste_index = window->editor.file_index;
+	const index_t length = read_paste(&window->filebuf, paste_index);
+	for (uint32_t i = 0; i < window->editor.extra_cursor_count; i++) {
+		if (window->editor.extra_cursors[i] >= paste_index) {
+			window->editor.extra_cursors[i] += length;
+		}
+	}
+	jump_to_change(window, paste_index, paste_index + length);
+	window->editor.info_message = "PASTED";
+}
+
+/* Adds an extra cursor on each of the count lines below the lowest cursor (stopping at the end of the file),
+ * at the column the editor's cursor is at, or at the end of the line if it is shorter.
+ * Returns the number of cursors added.
+ */
+static uint32_t add_cursors_below(struct Window *window, uint32_t count) {
+	struct FileBuf *fb = &window->filebuf; // alias
+	struct Editor *editor = &window->editor; // alias
+	const index_t lowest = editor->extra_cursor_count > 0 ? editor->extra_cursors[editor->extra_cursor_count - 1] : editor->file_index;
+	index_t line = filebuf_offset_to_line(fb, lowest > editor->file_index ? lowest : editor->file_index);
+	index_t offset;
+	const size_t column = window_row_start(window, editor->cursor_line - 1, window_cursor_row(window), &offset) + editor->cursor_column_jump - 1;
+
+	uint32_t added = 0;
+	index_t line_start;
+	while (added < count && filebuf_line_to_offset(fb, line + 1, &line_start)) {
+		line++;
+		const index_t cursor_index = line_layout_index_at(&editor->layout, line_start, column);
+
+		if (editor->extra_cursor_count == editor->extra_cursor_size) {
+			editor->extra_cursor_size = editor->extra_cursor_size == 0 ? 64 : editor->extra_cursor_size * 2;
+			editor->extra_cursors = realloc(editor->extra_cursors, sizeof(index_t) * editor->extra_cursor_size);
+		}
+		editor->extra_cursors[editor->extra_cursor_count] = cursor_index; // below every cursor so far, so still sorted
+		editor->extra_cursor_count++;
+		added++;
+	}
+	return added;
+}
+
+/* Returns the (one-based) display column the cursor is at after the text typed so far in editor mode at the insert index.
+ * A char whose bytes haven't all been typed yet isn't counted.
+ */
+static index_t typed_column(struct Window *window, const char *text, index_t insert_index, index_t length) {
+	index_t line_start = length; // where the cursor's line starts within the typed text
+	while (line_start > 0 && text[line_start - 1] != '\n') {
+		line_start--;
+	}
+	struct Utf8Measure measure;
+	utf8_measure_init(&measure, line_start == 0 ? line_layout_column(&window->editor.layout, insert_index) : 0);
+	utf8_measure(&measure, text + line_start, length - line_start);
+	return measure.column + 1;
+}
+
+/* Returns where the last char of the text typed so far starts: the last byte that isn't a continuation byte,
+ * unless more continuation bytes follow it than any char has.
+ */
+static index_t typed_char_start(const char *text, index_t length) {
+	index_t char_start = length;
+	while (char_start > 0 && length - char_start < UTF8_MAX_LENGTH && (text[char_start - 1] & 0xC0) == 0x80) {
+		char_start--;
+	}
+	if (char_start == 0 || length - char_start == UTF8_MAX_LENGTH) return length - 1;
+	return char_start - 1;
+}
+
+/* Returns whether the text typed so far ends partway through a multibyte char, whose other bytes are yet to come. */
+static bool typed_partway(const char *text, index_t length) {
+	if (length == 0) return false;
+	const index_t char_start = typed_char_start(text, length);
+	uint32_t codepoint;
+	return utf8_decode(text + char_start, length - char_start, &codepoint) == 0;
+}
+
+/* Makes the edit typed in editor mode, where the text replaced delete_before_length chars before the insert index
+ * and delete_after_length chars after it. With extra cursors, the same edit is made at every one of them too,
+ * all at once as a single change, and each cursor is moved past the text it inserted.
+ */
+static void commit_typing(struct Window *window, char *text, index_t insert_index, index_t length, index_t delete_before_length, index_t delete_after_length) {
+	struct FileBuf *fb = &window->filebuf; // alias
+	struct Editor *editor = &window->editor; // alias
+	if (length == 0 && delete_before_length == 0 && delete_after_length == 0) return; // nothing typed
+	if (editor->extra_cursor_count == 0) {
+		filebuf_insert(fb, text, insert_index, length, delete_before_length, delete_after_length);
+		jump_to_change(window, insert_index - delete_before_length, editor->file_index); // drawn again in the colors of the text as it is now
+		return;
+	}
+
+	// one edit per cursor in file order, clipped so none overlap where cursors are closer together than what they delete
+	const uint32_t count = editor->extra_cursor_count + 1;
+	struct FileBufEdit *edits = malloc(sizeof(struct FileBufEdit) * count);
+	uint32_t editor_edit = count; // which of the edits is at the editor's own cursor
+	index_t edit_end = 0;
+	for (uint32_t i = 0, extra = 0; i < count; i++) {
+		index_t cursor_index;
+		if (editor_edit == count && (extra == editor->extra_cursor_count || insert_index <= editor->extra_cursors[extra])) {
+			editor_edit = i;
+			cursor_index = insert_index;
+		} else {
+			cursor_index = editor->extra_cursors[extra];
+			extra++;
+		}
+		if (cursor_index > fb->length) {
+			cursor_index = fb->length;
+		}
+
+		index_t start = cursor_index - (delete_before_length < cursor_index ? delete_before_length : cursor_index);
+		index_t end = delete_after_length < fb->length - cursor_index ? cursor_index + delete_after_length : fb->length;
+		if (start < edit_end) {
+			start = edit_end;
+		}
+		if (end < start) {
+			end = start;
+		}
+		edits[i].text = text; // the same text everywhere, so it is only stored once
+		edits[i].index = start;
+		edits[i].removed_length = end - start;
+		edits[i].length = length;
+		edit_end = end;
+	}
+	if (!filebuf_edit_batch(fb, edits, count)) { // the file would grow too large
+		free(edits);
+		return;
+	}
+
+	// move each cursor past its own edit, shifted by all of the edits before it in the same sweep
+	index_t editor_index = 0;
+	index_t shift = 0; // chars added minus chars removed by the edits so far
+	for (uint32_t i = 0, extra = 0; i < count; i++) {
+		const index_t cursor_index = edits[i].index + shift + edits[i].length;
+		if (i == editor_edit) {
+			editor_index = cursor_index;
+		} else {
+			editor->extra_cursors[extra] = cursor_index;
+			extra++;
+		}
+		shift += edits[i].length - edits[i].removed_length;
+	}
+	jump_to_change(window, edits[0].index, editor_index);
+	free(edits);
+}
+
 int main(int arg_count, char **args) {
 	struct Window root_window;
 	window_init(&root_window);
@@ -32,19 +520,31 @@ int main(int arg_count, char **args) {
 	}
 
 	struct Window *current_window = &root_window;
-	filebuf_init(&current_window->filebuf);
 	if (arg_count > 2) {
 		fprintf(stderr, "Opening multiple files at once not supported yet\n");
 		exit(EXIT_FAILURE);
 	} else if (arg_count == 2) {
-		filebuf_read(&current_window->filebuf, args[1]);
+		// checked while the file is read in (see filebuf_read()). bytes that aren't are shown as U+FFFD, but saved as they were
+		const bool valid_utf8 = !filebuf_read(&current_window->filebuf, args[1]) || current_window->filebuf.table.origin_utf8;
+		if (!valid_utf8) {
+			current_window->editor.info_message = "NOT VALID UTF-8";
+		}
 		current_window->filebuf.path = args[1];
+		highlight_set_language(&current_window->editor.highlight, highlight_language_for_path(args[1]));
+		if (filebuf_open_journal(&current_window->filebuf) > 0) {
+			current_window->editor.info_message = valid_utf8 ? "RECOVERED UNSAVED EDITS" : "RECOVERED UNSAVED EDITS, NOT VALID UTF-8";
+		}
 	}
 	
 	terminal_init();
-	terminal_clear();
-	terminal_cursor_home();
-	signal(SIGINT, &interrupt_handler);
+	screen_init(root_window.width, root_window.height);
+	window_draw(&root_window, 0);
+	if (pipe(signal_fds) == 0) {
+		fcntl(signal_fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(signal_fds[1], F_SETFL, O_NONBLOCK);
+	}
+	signal(SIGINT, &signal_handler); // without the pipe, poll() is still interrupted by them
+	signal(SIGWINCH, &signal_handler);
 
 	// for building temporary info messages for feedback and debugging
 	const size_t info_message_buf_size = 128;
@@ -52,15 +552,26 @@ int main(int arg_count, char **args) {
 	struct StringBuilder info_message_builder;
 	info_message_builder.buf = info_message_buf;
 	info_message_builder.size = info_message_buf_size;
+	info_message_builder.growable = false;
 	string_builder_reset(&info_message_builder);
 
 	bool selecting = false;
 	const size_t buf_insert_text_size = 8192;
-	char buf_insert_text[buf_insert_text_size]; // for typed-in characters. do NOT use when pasting text
+	char buf_insert_text[buf_insert_text_size]; // for typed-in characters. pasted text goes straight into the file buffer instead
 	index_t insert_length; // also the count for buf_insert_text
 	index_t insert_file_index;
 	index_t delete_before_length;
 	index_t delete_after_length;
+	index_t typing_line; // line typing is drawn onto the screen on, from typing_left up to typing_right (see window_cursor_row_bounds())
+	size_t typing_left;
+	size_t typing_right;
+	char search_query[SEARCH_QUERY_SIZE] = ""; // typed at the search prompt. searched for again by 'n'
+	size_t search_length = 0;
+	index_t search_from; // where the cursor was when the search prompt was opened, which it goes back to on escape
+	index_t search_after; // file index searching starts from, just after search_from
+	bool search_wrapped; // whether the search running carries on from the start of the file
+	const char *search_status = ""; // shown after the query, once it has been searched for
+	search_task_init(&search_task);
 
 	while (1) {
 		struct FileBuf *fb = &current_window->filebuf; // alias
@@ -68,89 +579,95 @@ int main(int arg_count, char **args) {
 		window_draw_info_line(current_window);
 
 		if (current_window->editor.mode == MODE_COMMAND) {
-			char c = getchar();
+			int c = read_key(fb, &current_window->editor.highlight);
 			switch (c) {
+			case KEY_HIGHLIGHTED:
+				window_draw(current_window, current_window->top_line);
+				break;
+			case KEY_RESIZED:
+				fit_to_terminal(current_window);
+				break;
+			case KEY_INTERRUPTED:
+				confirm_quit();
+				break;
 			case 'h': { // cursor left
-				if (current_window->editor.file_index <= 0 || current_window->editor.cursor_column <= 1) break;
+				filebuf_cursor_seek(&current_window->editor.cursor, current_window->editor.file_index);
+				int prev_char = filebuf_cursor_prev(&current_window->editor.cursor);
+				if (prev_char == FILEBUF_EOF || prev_char == '\n') break; // already at start of the line
 
-				terminal_cursor_left(1);
-				current_window->editor.cursor_column--;
-				current_window->editor.cursor_column_jump = current_window->editor.cursor_column;
-				current_window->editor.file_index--;
+				current_window->editor.file_index = line_layout_prev_char(&current_window->editor.layout, current_window->editor.file_index);
+				current_window->editor.cursor_column = line_layout_column(&current_window->editor.layout, current_window->editor.file_index) + 1;
+				window_keep_column(current_window);
+				if (window_scroll_to_cursor(current_window)) {
+					window_draw(current_window, current_window->top_line);
+				}
 				break; 
 			}
 			case 'l': { // cursor right
-				if (current_window->editor.file_index >= fb->length || filebuf_char_at(fb, current_window->editor.file_index) == '\n') break; // already at end of the line
+				filebuf_cursor_seek(&current_window->editor.cursor, current_window->editor.file_index);
+				int next_char = filebuf_cursor_peek(&current_window->editor.cursor);
+				if (next_char == FILEBUF_EOF || next_char == '\n') break; // already at end of the line
 
-				terminal_cursor_right(1);
-				current_window->editor.cursor_column++;
-				current_window->editor.cursor_column_jump = current_window->editor.cursor_column;
-				current_window->editor.file_index++;
+				current_window->editor.file_index = line_layout_next_char(&current_window->editor.layout, current_window->editor.file_index);
+				current_window->editor.cursor_column = line_layout_column(&current_window->editor.layout, current_window->editor.file_index) + 1;
+				window_keep_column(current_window);
+				if (window_scroll_to_cursor(current_window)) {
+					window_draw(current_window, current_window->top_line);
+				}
 				break;
 			}
 			case 'j': { // cursor down
-				index_t new_line_index;
-				bool found = filebuf_index_of(fb, current_window->editor.file_index, (index_t) -1, "\n", &new_line_index);
-				if (!found) break;
-
-				// determine line length for column number by finding the end index (marked by next new line)
-				index_t line_length; // not including new-line char
-				index_t next_new_line_index = fb->length; // default is length of file in case on last line of file
-				found = filebuf_index_of(fb, new_line_index + 1, (index_t) -1, "\n", &next_new_line_index);
-				if (found) {
-					line_length = next_new_line_index - new_line_index - 1;
-				} else {
-					line_length = fb->length - new_line_index - 1;
-				}
+				index_t line = current_window->editor.cursor_line - 1;
+				index_t row = window_cursor_row(current_window);
+				if (!window_next_row(current_window, &line, &row)) break; // already on last row
 
-				// reposition cursor column
-				if (current_window->editor.cursor_column_jump < line_length) {
-					// inserting at same relative column index
-					current_window->editor.cursor_column = current_window->editor.cursor_column_jump;
-					current_window->editor.file_index = new_line_index + current_window->editor.cursor_column - 1;
-				} else {
-					// inserting BEFORE the new-line char (at the end of the current line)
-					current_window->editor.cursor_column = line_length + 1;
-					current_window->editor.file_index = next_new_line_index;
+				jump_to_row(current_window, line, row);
+				if (window_scroll_to_cursor(current_window)) {
+					window_draw(current_window, current_window->top_line);
 				}
-				terminal_cursor_set_column(current_window->editor.cursor_column);
-
-				terminal_cursor_down(1);
-				current_window->editor.cursor_line++;
 				break;
 			}
 			case 'k': { // cursor up
-				index_t new_line_index;
-				bool found = filebuf_last_index_of(fb, 0, current_window->editor.file_index, "\n", &new_line_index);
-				if (!found) break;
-
-				// determine line length for column number by finding the start index (marked by next new line)
-				index_t line_length; // not including new-line char
-				index_t prev_new_line_index = 0; // default is 0 (start of file) in case we are on the first line of the file
-				found = filebuf_last_index_of(fb, 0, new_line_index, "\n", &prev_new_line_index);
-				if (found) {
-					line_length = new_line_index - prev_new_line_index - 1;
-				} else {
-					line_length = new_line_index;
-				}
+				index_t line = current_window->editor.cursor_line - 1;
+				index_t row = window_cursor_row(current_window);
+				if (!window_prev_row(current_window, &line, &row)) break; // already on first row
 
-				// reposition cursor column // TODO this doesn't account for line wrap
-				if (current_window->editor.cursor_column_jump < line_length) {
-					// inserting at same relative column index
-					current_window->editor.cursor_column = current_window->editor.cursor_column_jump;
-					current_window->editor.file_index = prev_new_line_index + current_window->editor.cursor_column - 1;
-				} else {
-					// inserting BEFORE the new-line char (at the end of the current line)
-					current_window->editor.cursor_column = line_length + 1;
-					current_window->editor.file_index = new_line_index;
+				jump_to_row(current_window, line, row);
+				if (window_scroll_to_cursor(current_window)) {
+					window_draw(current_window, current_window->top_line);
 				}
-				terminal_cursor_set_column(current_window->editor.cursor_column);
-
-				terminal_cursor_up(1);
-				current_window->editor.cursor_line--;
 				break;
 			}
 			
+			case KEY_PAGE_DOWN:
+			case KEY_CTRL('f'):
+				scroll_rows(current_window, window_rows(current_window));
+				break;
+			case KEY_PAGE_UP:
+			case KEY_CTRL('b'):
+				scroll_rows(current_window, -(int64_t) window_rows(current_window));
+				break;
+			case KEY_CTRL('e'): // scroll down a row
+				scroll_rows(current_window, 1);
+				break;
+			case KEY_CTRL('y'): // scroll up a row
+				scroll_rows(current_window, -1);
+				break;
+			case 'w': // wrap long lines, or scroll them sideways
+				current_window->wrap = !current_window->wrap;
+				current_window->top_row = 0;
+				current_window->left_column = 0;
+				window_keep_column(current_window);
+				window_scroll_to_cursor(current_window);
+				window_draw(current_window, current_window->top_line);
+				break;
+			case 'g': // start of file
+				jump_to(current_window, 0);
+				break;
+			case 'G': // end of file
+				jump_to(current_window, fb->length);
+				break;
+
 			case 'i': // FIXME
 				// terminal_cursor_right(word_len);
 				break;
@@ -159,12 +676,82 @@ int main(int arg_count, char **args) {
 				// terminal_cursor_left(word_len);
 				break;
 
+			case 'u': { // undo
+				index_t changed_index;
+				if (filebuf_undo(fb, &changed_index)) {
+					current_window->editor.extra_cursor_count = 0; // where they were no longer matches the text
+					jump_to_change(current_window, changed_index, changed_index);
+					current_window->editor.info_message = "UNDONE";
+				} else {
+					current_window->editor.info_message = "NOTHING TO UNDO";
+				}
+				break;
+			}
+			case 'U': { // redo
+				index_t changed_index;
+				if (filebuf_redo(fb, &changed_index)) {
+					current_window->editor.extra_cursor_count = 0;
+					jump_to_change(current_window, changed_index, changed_index);
+					current_window->editor.info_message = "REDONE";
+				} else {
+					current_window->editor.info_message = "NOTHING TO REDO";
+				}
+				break;
+			}
+
+			case 's': // save
+				if (filebuf_write(fb)) {
+					current_window->editor.info_message = "SAVED";
+				} else {
+					current_window->editor.info_message = "FAILED TO SAVE!";
+				}
+				break;
+
+			case KEY_PASTE:
+				paste(current_window);
+				break;
+
+			case '/': // search
+				current_window->editor.mode = MODE_SEARCH;
+				search_from = current_window->editor.file_index;
+				search_after = search_from < fb->length ? search_from + 1 : search_from;
+				search_length = 0;
+				search_query[0] = '\0';
+				search_status = "";
+				current_window->editor.info_message = "/";
+				break;
+			case 'n': // next occurrence of what was last searched for
+				if (search_length == 0) {
+					current_window->editor.info_message = "NOTHING SEARCHED FOR";
+				} else if (jump_to_next(current_window, search_query, current_window->editor.file_index < fb->length ? current_window->editor.file_index + 1 : fb->length)) {
+					current_window->editor.info_message = NULL;
+				} else {
+					current_window->editor.info_message = "NOT FOUND";
+				}
+				break;
+
+			case 'C': // add a cursor on the line below the lowest one
+			case 'A': { // add a cursor on every line below the lowest one
+				if (add_cursors_below(current_window, c == 'C' ? 1 : UINT32_MAX) == 0) {
+					current_window->editor.info_message = "NO LINES BELOW";
+				} else {
+					current_window->editor.info_message = NULL;
+				}
+				break;
+			}
+			case '\033': // escape drops the extra cursors
+				current_window->editor.extra_cursor_count = 0;
+				current_window->editor.info_message = NULL;
+				break;
+
 			case 'f': 
 				current_window->editor.mode = MODE_EDITOR;
 				insert_file_index = current_window->editor.file_index;
 				insert_length = 0;
 				delete_before_length = 0;
 				delete_after_length = 0;
+				typing_line = current_window->editor.cursor_line;
+				window_cursor_row_bounds(current_window, &typing_left, &typing_right);
 				break;
 
 			// TODO selection
@@ -177,40 +764,140 @@ int main(int arg_count, char **args) {
 			case 'L':
 				break;
 			}
+		} else if (current_window->editor.mode == MODE_SEARCH) {
+			// each char typed searches again for the query so far, moving the cursor to the next occurrence once found
+			int c = read_key(fb, &current_window->editor.highlight);
+			bool query_changed = false;
+			switch (c) {
+			case KEY_HIGHLIGHTED:
+				window_draw(current_window, current_window->top_line);
+				break;
+			case KEY_RESIZED:
+				fit_to_terminal(current_window);
+				break;
+			case KEY_INTERRUPTED:
+				confirm_quit();
+				break;
+
+			case KEY_SEARCHED: {
+				struct SearchResults results;
+				if (!search_task_take_results(&search_task, &results)) break;
+				if (results.count > 0) {
+					jump_to(current_window, results.indices[0]);
+					search_status = search_wrapped ? " (WRAPPED)" : "";
+				} else if (!search_wrapped && search_after > 0) {
+					search_wrapped = true;
+					start_search(current_window, search_query, search_after, true);
+				} else {
+					jump_to(current_window, search_from);
+					search_status = " (NOT FOUND)";
+				}
+				search_results_free(&results);
+				break; }
+
+			case 127:
+			case '\b': // backspace
+				if (search_length == 0) break;
+				search_length = typed_char_start(search_query, search_length); // a whole char
+				search_query[search_length] = '\0';
+				query_changed = true;
+				break;
+
+			case '\033': // escape, back to where the cursor was
+				search_task_stop(&search_task);
+				jump_to(current_window, search_from);
+				current_window->editor.info_message = NULL;
+				current_window->editor.mode = MODE_COMMAND;
+				break;
+
+			case '\r':
+			case '\n': // enter, leaving the cursor on the occurrence found
+				if (search_task_wake_fd(&search_task) != -1) {
+					search_task_stop(&search_task); // not done yet, so found now instead
+					if (search_length > 0 && !jump_to_next(current_window, search_query, search_after)) {
+						jump_to(current_window, search_from);
+					}
+				}
+				current_window->editor.info_message = NULL;
+				current_window->editor.mode = MODE_COMMAND;
+				break;
+
+			default:
+				if (c < ' ' && c != '\t' || search_length + 1 >= SEARCH_QUERY_SIZE) break; // other keys, or no more room
+				search_query[search_length] = c;
+				search_length++;
+				search_query[search_length] = '\0';
+				query_changed = true;
+				break;
+			}
+			if (current_window->editor.mode != MODE_SEARCH) continue;
+
+			if (query_changed) {
+				search_wrapped = false;
+				search_status = "";
+				if (search_length == 0) {
+					search_task_stop(&search_task);
+					jump_to(current_window, search_from);
+				} else {
+					start_search(current_window, search_query, search_after, false);
+				}
+			}
+			string_builder_reset(&info_message_builder);
+			string_builder_append_char(&info_message_builder, '/');
+			string_builder_append(&info_message_builder, search_query, search_length);
+			string_builder_append_string(&info_message_builder, search_status);
+			current_window->editor.info_message = info_message_buf;
 		} else if (current_window->editor.mode == MODE_EDITOR) {
 			// TODO delete any currently selected text if character other than escape is inserted
 			bool redraw_line = true;
-			char c = getchar();
+			int c = read_key(fb, NULL); // typed text is drawn over the window, so it isn't drawn again until typing ends
 			switch (c) {
 			case 127:
 			case '\b': { // backspace
 				current_window->editor.info_message = "BACKSPACE BTN PRESSED!";
-				if (insert_length == 0 || insert_file_index == 0) {
-					redraw_line = false;
+				if (insert_length == 0 && delete_before_length >= insert_file_index) {
+					redraw_line = false; // at the start of the file
 					break;
 				}
 
 				// can't move cursor unless deleting or typing in editor mode,
 				// so we only have to worry about counting number of characters deleted via backspace
+				// a whole char is deleted, not just its last byte
+				index_t deleted_length = 0;
 				if (insert_length > 0) {
-					insert_length--;
+					do {
+						insert_length--;
+						deleted_length++;
+					} while (insert_length > 0 && deleted_length < UTF8_MAX_LENGTH && (buf_insert_text[insert_length] & 0xC0) == 0x80);
 					if (buf_insert_text[insert_length] == '\n') {
 						current_window->editor.cursor_line--;
-					} else {
-						current_window->editor.cursor_column--;
 					}
 				} else if (insert_file_index > 0) {
-					delete_before_length++;
-					if (filebuf_char_at(fb, insert_file_index - delete_before_length) == '\n') {
+					deleted_length = insert_file_index - delete_before_length - line_layout_prev_char(&current_window->editor.layout, insert_file_index - delete_before_length);
+					delete_before_length += deleted_length;
+					filebuf_cursor_seek(&current_window->editor.cursor, insert_file_index - delete_before_length);
+					if (filebuf_cursor_peek(&current_window->editor.cursor) == '\n') {
 						current_window->editor.cursor_line--;
-					} else {
-						current_window->editor.cursor_column--;
 					}
 				}
-				current_window->editor.file_index--;
-				terminal_cursor_left(1);
-				window_draw_char(' ');
-				terminal_cursor_left(1);
+				current_window->editor.file_index -= deleted_length;
+				current_window->editor.cursor_column = typed_column(current_window, buf_insert_text, insert_file_index - delete_before_length, insert_length);
+				if (current_window->wrap && (current_window->editor.cursor_line != typing_line || current_window->editor.cursor_column - 1 < typing_left)
+					|| !window_cursor_visible(current_window)) {
+					// back onto the row before, whose wrapping is only laid out again from the file buffer (or the window
+					// has to scroll, and it is drawn from the file buffer too)
+					commit_typing(current_window, buf_insert_text, insert_file_index, insert_length, delete_before_length, delete_after_length);
+					insert_file_index = current_window->editor.file_index;
+					insert_length = 0;
+					delete_before_length = 0;
+					delete_after_length = 0;
+					typing_line = current_window->editor.cursor_line;
+					window_cursor_row_bounds(current_window, &typing_left, &typing_right);
+					redraw_line = false;
+					break;
+				}
+				window_place_cursor(current_window);
+				screen_clear_line_from_cursor();
 				break; }
 
 			/*case 127: { // delete
@@ -224,40 +911,104 @@ int main(int arg_count, char **args) {
 				break; }*/
 
 			case '\033': // escape
-				filebuf_insert(fb, buf_insert_text, insert_file_index, insert_length, delete_before_length, delete_after_length);
+				commit_typing(current_window, buf_insert_text, insert_file_index, insert_length, delete_before_length, delete_after_length);
 				current_window->editor.info_message = NULL;
 				current_window->editor.mode = MODE_COMMAND; 
 				redraw_line = false;
-				current_window->editor.cursor_column_jump = current_window->editor.cursor_column;
+				window_keep_column(current_window);
+				break;
+
+			case KEY_INTERRUPTED:
+				confirm_quit(); // what was typed is still on screen, so is drawn again along with the rest
+				redraw_line = false;
+				break;
+
+			case KEY_RESIZED:
+				// drawn again from the file buffer, so what was typed goes in first
+				commit_typing(current_window, buf_insert_text, insert_file_index, insert_length, delete_before_length, delete_after_length);
+				fit_to_terminal(current_window);
+				insert_file_index = current_window->editor.file_index;
+				insert_length = 0;
+				delete_before_length = 0;
+				delete_after_length = 0;
+				typing_line = current_window->editor.cursor_line;
+				window_cursor_row_bounds(current_window, &typing_left, &typing_right);
+				redraw_line = false;
+				break;
+
+			case KEY_PASTE:
+				// what was typed so far goes in first, then the paste as a change of its own
+				commit_typing(current_window, buf_insert_text, insert_file_index, insert_length, delete_before_length, delete_after_length);
+				paste(current_window);
+				insert_file_index = current_window->editor.file_index;
+				insert_length = 0;
+				delete_before_length = 0;
+				delete_after_length = 0;
+				typing_line = current_window->editor.cursor_line;
+				window_cursor_row_bounds(current_window, &typing_left, &typing_right);
+				redraw_line = false;
 				break;
 
 			default: 
 				if (insert_length >= buf_insert_text_size) {
-					// TODO probably just want to push the full buffer using filebuf_insert,
-					// clear it, then continue inserting anew.
-					// (rather than breaking here and preventing additional text entry)
-					break;
+					// push what was typed so far as its own change and carry on typing a new one
+					commit_typing(current_window, buf_insert_text, insert_file_index, insert_length, delete_before_length, delete_after_length);
+					insert_file_index = current_window->editor.file_index;
+					insert_length = 0;
+					delete_before_length = 0;
+					delete_after_length = 0;
+					typing_line = current_window->editor.cursor_line;
+					window_cursor_row_bounds(current_window, &typing_left, &typing_right);
 				}
 
 				buf_insert_text[insert_length] = c;
 				insert_length++;
 				current_window->editor.file_index++;
-				window_draw_char(c);
+				if (typed_partway(buf_insert_text, insert_length)) {
+					redraw_line = false; // drawn once the rest of its bytes are typed
+					break;
+				}
+
+				// draw the char, along with the start of one before it that was never finished
+				index_t draw_start = insert_length - 1;
+				if (typed_partway(buf_insert_text, draw_start)) {
+					draw_start = typed_char_start(buf_insert_text, draw_start);
+				}
+				const index_t typed_from_column = current_window->editor.cursor_column;
+				current_window->editor.cursor_column = typed_column(current_window, buf_insert_text, insert_file_index - delete_before_length, insert_length);
+				if (c == '\t') {
+					screen_write_spaces(current_window->editor.cursor_column - typed_from_column); // spaces up to the tab stop
+				} else {
+					screen_write(buf_insert_text + draw_start, insert_length - draw_start);
+				}
 
 				if (c == '\n') {
 					current_window->editor.cursor_line++;
-					current_window->editor.cursor_column = 1;
-				} else {
-					current_window->editor.cursor_column++;
+				}
+
+				// when wrapping, the rows after the one typed on aren't laid out again until what was typed goes in, so
+				// typing stays on that row
+				const bool left_row = current_window->wrap && (current_window->editor.cursor_line != typing_line
+					|| current_window->editor.cursor_column - 1 >= typing_right);
+				if (left_row || !window_cursor_visible(current_window)) {
+					// the window has to scroll, and it is drawn from the file buffer, so what was typed goes in first
+					commit_typing(current_window, buf_insert_text, insert_file_index, insert_length, delete_before_length, delete_after_length);
+					insert_file_index = current_window->editor.file_index;
+					insert_length = 0;
+					delete_before_length = 0;
+					delete_after_length = 0;
+					window_scroll_to_cursor(current_window);
+					window_draw(current_window, current_window->top_line);
+					typing_line = current_window->editor.cursor_line;
+					window_cursor_row_bounds(current_window, &typing_left, &typing_right);
+					redraw_line = false;
 				}
 				break;
 			} // end input char switch
 			if (redraw_line) {
-				window_draw_line(current_window, insert_file_index + delete_after_length);
+				window_draw_line(current_window, insert_file_index + delete_after_length, current_window->editor.cursor_column - 1, typing_left, typing_left + current_window->width);
 			}
 		}
-
-		// TODO detect terminal resize and update windows accordingly
 	}
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,44 @@
+/* os.c
+ * Small wrappers around system calls shared by the rest of the editor.
+ */
+
+#define _GNU_SOURCE // IOV_MAX
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "os.h"
+
+/* Returns the current time in microseconds, from a clock that never jumps (e.g. for time slicing and timeouts). */
+uint64_t os_now_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Writes out every byte referenced by the iovecs, retrying after partial writes. The iovecs are modified.
+ * Any number of iovecs may be given; they are written at most IOV_MAX at a time.
+ * Returns whether successful.
+ */
+bool os_write_iovecs(int fd, struct iovec *iovecs, int count) {
+	while (count > 0) {
+		ssize_t written = writev(fd, iovecs, count < IOV_MAX ? count : IOV_MAX);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+
+		// skip past whatever was fully written
+		while (count > 0 && (size_t) written >= iovecs->iov_len) {
+			written -= iovecs->iov_len;
+			iovecs++;
+			count--;
+		}
+		if (count > 0) {
+			iovecs->iov_base = (char *) iovecs->iov_base + written;
+			iovecs->iov_len -= written;
+		}
+	}
+	return true;
+}
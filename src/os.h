@@ -0,0 +1,15 @@
+/* os.h
+ * Small wrappers around system calls shared by the rest of the editor.
+ */
+
+#ifndef __OS_H__
+#define __OS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+uint64_t os_now_us(void);
+bool os_write_iovecs(int fd, struct iovec *iovecs, int count);
+
+#endif
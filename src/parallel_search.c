@@ -0,0 +1,390 @@
+/* parallel_search.c
+ * Literal search over a whole file buffer split across every core.
+ *
+ * The searched range is cut into byte ranges, which the threads of a shared worker pool claim one at a time.
+ * Each range only reports occurrences starting within it, but may read up to the pattern's length past its end,
+ * so that occurrences crossing into the next range are found exactly once.
+ * The text searched is a snapshot of the file buffer (see filebuf_snapshot()), so a search can run on a thread of its own
+ * (see search_task_start()) while the input thread carries on editing, and be cancelled from there when it's no longer wanted.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "parallel_search.h"
+#include "worker_pool.h"
+#include "search.h"
+
+#ifndef MIN_RANGE_LENGTH
+#define MIN_RANGE_LENGTH (1 << 20) // smaller ranges cost more in coordination than they save (made smaller by 'make check')
+#endif
+#define RANGES_PER_THREAD 8 // more ranges than threads evens out the work when some ranges end early
+
+// occurrences found within one range
+struct RangeResults {
+	index_t *indices;
+	index_t count;
+	index_t size;
+};
+
+// a search being run by the worker pool
+struct ParallelSearch {
+	const struct FileBufSnapshot *snapshot;
+	index_t *span_starts; // file index of the first char of each of the snapshot's spans
+	const char *string;
+	struct SearchCancel *cancel;
+	struct RangeResults *range_results;
+	index_t start_index;
+	index_t end_index;
+	index_t range_length;
+	index_t string_length;
+	atomic_uint next_range; // next range to be claimed by a thread
+	atomic_uint first_found_range; // lowest range with an occurrence (SEARCH_FIRST), ranges after it need not be searched
+	unsigned int range_count;
+	int mode; // see search_modes enum
+};
+
+static void pool_init();
+static void range_results_add(struct RangeResults *results, index_t file_index);
+static uint32_t span_at(const struct ParallelSearch *search, index_t file_index);
+static bool matches_at(const struct ParallelSearch *search, uint32_t span, index_t file_index, index_t end_index);
+static bool find_in_range(const struct ParallelSearch *search, index_t from, index_t range_end, index_t read_end, index_t *found_index);
+static void search_ranges(void *arg);
+static void *run_task(void *arg);
+
+static struct WorkerPool pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* Starts the shared worker pool with a thread for each core (besides the one searching). */
+static void pool_init() {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	worker_pool_init(&pool, cores > 1 ? cores - 1 : 0);
+}
+
+/* Resets the token, so that a search given it runs until finished. */
+void search_cancel_init(struct SearchCancel *cancel) {
+	atomic_store(&cancel->cancelled, false);
+}
+
+/* Asks every search given the token to stop as soon as possible. Safe to call from any thread. */
+void search_cancel(struct SearchCancel *cancel) {
+	atomic_store(&cancel->cancelled, true);
+}
+
+void search_results_init(struct SearchResults *results) {
+	results->indices = NULL;
+	results->count = 0;
+	results->size = 0;
+}
+
+void search_results_free(struct SearchResults *results) {
+	free(results->indices);
+	search_results_init(results);
+}
+
+/* Adds an occurrence to the results of a range. */
+static void range_results_add(struct RangeResults *results, index_t file_index) {
+	if (results->count == results->size) {
+		results->size = results->size == 0 ? 64 : results->size * 2;
+		results->indices = realloc(results->indices, sizeof(index_t) * results->size);
+	}
+	results->indices[results->count] = file_index;
+	results->count++;
+}
+
+/* Returns the snapshot's span containing the file index, by binary search. */
+static uint32_t span_at(const struct ParallelSearch *search, index_t file_index) {
+	uint32_t low = 0;
+	uint32_t high = search->snapshot->span_count;
+	while (high - low > 1) {
+		const uint32_t middle = low + (high - low) / 2;
+		if (search->span_starts[middle] <= file_index) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+/* Returns whether the search's string occurs at the file index (within the span), reading no further than end_index.
+ * The string may carry on across any number of the spans after it.
+ */
+static bool matches_at(const struct ParallelSearch *search, uint32_t span, index_t file_index, index_t end_index) {
+	if (end_index - file_index < search->string_length) return false;
+	const struct FileBufSnapshot *snapshot = search->snapshot; // alias
+	index_t offset = file_index - search->span_starts[span];
+	for (index_t i = 0; i < search->string_length; i++) {
+		while (offset == snapshot->spans[span].length) {
+			span++;
+			offset = 0;
+		}
+		if (snapshot->spans[span].text[offset] != search->string[i]) return false;
+		offset++;
+	}
+	return true;
+}
+
+/* Sets found_index to the first occurrence starting from 'from' up to range_end, reading no further than read_end.
+ * Each span's text is searched as a whole (see search.h); occurrences split between spans are checked at the end of each.
+ * Returns whether there is one.
+ */
+static bool find_in_range(const struct ParallelSearch *search, index_t from, index_t range_end, index_t read_end, index_t *found_index) {
+	const struct FileBufSnapshot *snapshot = search->snapshot; // alias
+	uint32_t span = span_at(search, from);
+	while (span < snapshot->span_count && search->span_starts[span] < range_end) {
+		const index_t span_start = search->span_starts[span];
+		const index_t offset = from > span_start ? from - span_start : 0;
+		const char *text = snapshot->spans[span].text + offset;
+		index_t length = snapshot->spans[span].length - offset;
+		if (length > read_end - (span_start + offset)) {
+			length = read_end - (span_start + offset);
+		}
+
+		// occurrences fully within this span, which all start before any crossing into the next
+		const char *found = search_find(text, length, search->string, search->string_length);
+		if (found != NULL) {
+			*found_index = span_start + offset + (found - text);
+			return *found_index < range_end;
+		}
+
+		// occurrences starting near the end of this span and continuing into the next ones
+		index_t i = length < search->string_length ? 0 : length - search->string_length + 1;
+		for (; i < length; i++) {
+			if (text[i] == search->string[0] && matches_at(search, span, span_start + offset + i, read_end)) {
+				*found_index = span_start + offset + i;
+				return *found_index < range_end;
+			}
+		}
+		span++;
+	}
+	return false;
+}
+
+/* Work for each thread: claims and searches ranges until there are none left. */
+static void search_ranges(void *arg) {
+	struct ParallelSearch *search = arg;
+	while (!atomic_load_explicit(&search->cancel->cancelled, memory_order_relaxed)) {
+		unsigned int range = atomic_fetch_add(&search->next_range, 1);
+		if (range >= search->range_count) return;
+		if (search->mode == SEARCH_FIRST && range > atomic_load(&search->first_found_range)) return; // an earlier one already has it
+
+		index_t range_start = search->start_index + (uint64_t) range * search->range_length;
+		index_t range_end = range == search->range_count - 1 ? search->end_index : range_start + search->range_length;
+		// read past the end of the range for occurrences starting in it
+		index_t read_end = range_end + search->string_length - 1;
+		if (read_end > search->end_index || read_end < range_end) {
+			read_end = search->end_index;
+		}
+
+		struct RangeResults *results = &search->range_results[range];
+		index_t found_index;
+		index_t from = range_start;
+		while (from < range_end && find_in_range(search, from, range_end, read_end, &found_index)) {
+			range_results_add(results, found_index);
+			if (search->mode == SEARCH_FIRST) {
+				unsigned int first = atomic_load(&search->first_found_range);
+				while (range < first && !atomic_compare_exchange_weak(&search->first_found_range, &first, range));
+				break;
+			}
+			if (atomic_load_explicit(&search->cancel->cancelled, memory_order_relaxed)) return;
+			from = found_index + 1; // occurrences may overlap
+		}
+	}
+}
+
+/* Searches for the character sequence using every core, between start_index (inclusive) and end_index (exclusive).
+ * Occurrences are appended to 'results' in file order: all of them for SEARCH_ALL, or just the first for SEARCH_FIRST.
+ * The file buffer must not be modified until this returns (see search_task_start() to search while it is).
+ * string - must be a valid, non-empty null-terminated string.
+ * cancel - may be NULL. if cancelled (by another thread) the search stops early, and the results are incomplete.
+ * Returns whether the search ran to completion (i.e. was not cancelled).
+ */
+bool filebuf_search_parallel(struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, int mode, struct SearchCancel *cancel, struct SearchResults *results) {
+	struct FileBufSnapshot snapshot;
+	filebuf_snapshot(fb, &snapshot);
+	const bool completed = search_snapshot(&snapshot, start_index, end_index, string, mode, cancel, results);
+	filebuf_snapshot_release(&snapshot);
+	return completed;
+}
+
+/* Searches the snapshot's text, like filebuf_search_parallel(). */
+bool search_snapshot(const struct FileBufSnapshot *snapshot, index_t start_index, index_t end_index, const char *string, int mode, struct SearchCancel *cancel, struct SearchResults *results) {
+	if (end_index > snapshot->length) {
+		end_index = snapshot->length;
+	}
+	if (end_index <= start_index || string[0] == '\0') return true;
+
+	struct SearchCancel never_cancelled;
+	if (cancel == NULL) {
+		search_cancel_init(&never_cancelled);
+		cancel = &never_cancelled;
+	}
+	pthread_once(&pool_once, &pool_init);
+
+	struct ParallelSearch search;
+	search.snapshot = snapshot;
+	search.span_starts = malloc(sizeof(index_t) * (snapshot->span_count == 0 ? 1 : snapshot->span_count));
+	index_t span_start = 0;
+	for (uint32_t i = 0; i < snapshot->span_count; i++) {
+		search.span_starts[i] = span_start;
+		span_start += snapshot->spans[i].length;
+	}
+	search.string = string;
+	search.string_length = strlen(string);
+	search.cancel = cancel;
+	search.mode = mode;
+	search.start_index = start_index;
+	search.end_index = end_index;
+
+	// in 64 bits, as rounding up could wrap a 32 bit index_t for text within a range's length of 4 GB
+	const uint64_t total_length = end_index - start_index;
+	const uint64_t range_count = (uint64_t) (pool.thread_count + 1) * RANGES_PER_THREAD;
+	search.range_length = total_length / range_count + 1;
+	if (search.range_length < MIN_RANGE_LENGTH) {
+		search.range_length = MIN_RANGE_LENGTH;
+	}
+	search.range_count = (total_length + search.range_length - 1) / search.range_length;
+	if (search.range_count == 0) {
+		search.range_count = 1;
+	}
+	search.range_results = calloc(search.range_count, sizeof(struct RangeResults));
+	atomic_init(&search.next_range, 0);
+	atomic_init(&search.first_found_range, search.range_count);
+
+	if (search.range_count == 1) {
+		search_ranges(&search); // not worth waking any threads for
+	} else {
+		worker_pool_run(&pool, &search_ranges, &search);
+	}
+
+	// gather up results in file order
+	for (unsigned int i = 0; i < search.range_count; i++) {
+		struct RangeResults *range = &search.range_results[i];
+		if (mode == SEARCH_FIRST && range->count > 0 && results->count > 0) {
+			range->count = 0; // only the first one counts
+		}
+		if (range->count > 0) {
+			if (results->count + range->count > results->size) {
+				results->size = (results->count + range->count) * 2;
+				results->indices = realloc(results->indices, sizeof(index_t) * results->size);
+			}
+			memcpy(results->indices + results->count, range->indices, sizeof(index_t) * range->count);
+			results->count += range->count;
+		}
+		free(range->indices);
+	}
+	free(search.range_results);
+	free(search.span_starts);
+	return !atomic_load(&cancel->cancelled);
+}
+
+void search_task_init(struct SearchTask *task) {
+	task->wake_fds[0] = -1;
+	task->wake_fds[1] = -1;
+	task->string = NULL;
+	task->running = false;
+	search_results_init(&task->results);
+}
+
+void search_task_free(struct SearchTask *task) {
+	search_task_stop(task);
+	if (task->wake_fds[0] != -1) {
+		close(task->wake_fds[0]);
+		close(task->wake_fds[1]);
+		task->wake_fds[0] = -1;
+		task->wake_fds[1] = -1;
+	}
+}
+
+/* Starts searching a snapshot of the file buffer's text on a thread of its own, like filebuf_search_parallel(), cancelling
+ * whichever search the task was running. The file buffer can be edited meanwhile. Its results are taken once the wake fd
+ * is readable (see search_task_take_results()). Returns whether the thread could be started.
+ */
+bool search_task_start(struct SearchTask *task, struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, int mode) {
+	search_task_stop(task);
+	if (task->wake_fds[0] == -1) {
+		if (pipe(task->wake_fds) != 0) {
+			task->wake_fds[0] = -1;
+			return false;
+		}
+		fcntl(task->wake_fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(task->wake_fds[1], F_SETFL, O_NONBLOCK);
+	}
+	filebuf_snapshot(fb, &task->snapshot);
+	task->string = strdup(string);
+	task->start_index = start_index;
+	task->end_index = end_index;
+	task->mode = mode;
+	search_cancel_init(&task->cancel);
+	atomic_store(&task->done, false);
+
+	// signals are left to the input thread, whose poll() their handlers wake
+	sigset_t all_signals;
+	sigset_t signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &signals);
+	const bool created = pthread_create(&task->thread, NULL, &run_task, task) == 0;
+	pthread_sigmask(SIG_SETMASK, &signals, NULL);
+	if (!created) {
+		filebuf_snapshot_release(&task->snapshot);
+		free(task->string);
+		task->string = NULL;
+		return false;
+	}
+	task->running = true;
+	return true;
+}
+
+/* Cancels the task's search, if it is running, waiting only for its threads to notice. Its results are dropped. */
+void search_task_stop(struct SearchTask *task) {
+	if (!task->running) return;
+	search_cancel(&task->cancel);
+	pthread_join(task->thread, NULL);
+	task->running = false;
+	char wakes[64];
+	while (read(task->wake_fds[0], wakes, sizeof(wakes)) > 0);
+	filebuf_snapshot_release(&task->snapshot);
+	free(task->string);
+	task->string = NULL;
+	search_results_free(&task->results);
+}
+
+/* Takes the results of the task's search once it is done, moving them into 'results' (which must be empty).
+ * Returns false if it is still running (or none was started).
+ */
+bool search_task_take_results(struct SearchTask *task, struct SearchResults *results) {
+	if (!task->running || !atomic_load(&task->done)) return false;
+	pthread_join(task->thread, NULL);
+	task->running = false;
+	char wakes[64];
+	while (read(task->wake_fds[0], wakes, sizeof(wakes)) > 0);
+	filebuf_snapshot_release(&task->snapshot);
+	free(task->string);
+	task->string = NULL;
+	*results = task->results;
+	search_results_init(&task->results);
+	return true;
+}
+
+/* Returns the fd that becomes readable once the task's search is done (see search_task_take_results()), for polling
+ * along with input. -1 if no search is running.
+ */
+int search_task_wake_fd(struct SearchTask *task) {
+	return task->running ? task->wake_fds[0] : -1;
+}
+
+/* Thread body: runs the task's search, then wakes the thread that started it, unless it was cancelled. */
+static void *run_task(void *arg) {
+	struct SearchTask *task = arg;
+	if (!search_snapshot(&task->snapshot, task->start_index, task->end_index, task->string, task->mode, &task->cancel, &task->results)) return NULL;
+	atomic_store(&task->done, true);
+	const char wake = 1;
+	if (write(task->wake_fds[1], &wake, 1) < 0) {
+		// only if the pipe is full, so it will wake anyway
+	}
+	return NULL;
+}
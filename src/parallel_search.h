@@ -0,0 +1,64 @@
+/* parallel_search.h
+ * Literal search over a whole file buffer split across every core, either waited on or run in the background
+ * while the file buffer carries on being edited.
+ */
+
+#ifndef __PARALLEL_SEARCH_H__
+#define __PARALLEL_SEARCH_H__
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "filebuf.h"
+
+enum search_modes {
+	SEARCH_FIRST, // only the first occurrence
+	SEARCH_ALL // every occurrence (e.g. for counting or highlighting them all)
+};
+
+// lets another thread stop a search in progress, e.g. once the query being searched for has changed
+struct SearchCancel {
+	atomic_bool cancelled;
+};
+
+// file indices of the occurrences found, in file order
+struct SearchResults {
+	index_t *indices;
+	index_t count;
+	index_t size;
+};
+
+// a search run on a thread of its own over a snapshot of the text, so the input thread never waits on it.
+// starting another search cancels the one in progress
+struct SearchTask {
+	pthread_t thread;
+	struct FileBufSnapshot snapshot; // text being searched
+	struct SearchCancel cancel;
+	struct SearchResults results; // filled in by the thread, taken once done
+	char *string; // copy of the string searched for
+	index_t start_index;
+	index_t end_index;
+	int mode; // see search_modes enum
+	int wake_fds[2]; // pipe written to once the search is done, for the input thread to poll (see search_task_wake_fd())
+	atomic_bool done; // whether the search ran to completion
+	bool running; // whether the thread was started and not yet joined
+};
+
+void search_cancel_init(struct SearchCancel *cancel);
+void search_cancel(struct SearchCancel *cancel);
+
+void search_results_init(struct SearchResults *results);
+void search_results_free(struct SearchResults *results);
+
+bool filebuf_search_parallel(struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, int mode, struct SearchCancel *cancel, struct SearchResults *results);
+bool search_snapshot(const struct FileBufSnapshot *snapshot, index_t start_index, index_t end_index, const char *string, int mode, struct SearchCancel *cancel, struct SearchResults *results);
+
+void search_task_init(struct SearchTask *task);
+void search_task_free(struct SearchTask *task);
+bool search_task_start(struct SearchTask *task, struct FileBuf *fb, index_t start_index, index_t end_index, const char *string, int mode);
+void search_task_stop(struct SearchTask *task);
+bool search_task_take_results(struct SearchTask *task, struct SearchResults *results);
+int search_task_wake_fd(struct SearchTask *task);
+
+#endif
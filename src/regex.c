@@ -0,0 +1,865 @@
+/* regex.c
+ * Regular expression search over a file buffer's piece table.
+ *
+ * A pattern is parsed into a syntax tree, then compiled twice into NFA programs: once as written and once reversed.
+ * Searching runs a DFA whose states are built on demand from the NFA and cached, so each char of text costs
+ * a table lookup once the states it passes through exist.
+ *
+ * Finding the first match scans forward with the pattern (leftmost-first priority) to find where the match ends,
+ * then backward from there with the reversed pattern to find where it starts.
+ * Finding the last match scans backward with the reversed pattern to find the last start, then forward from there for the end.
+ * Either way only the text between the search bound and the match is read, directly from the entries' text.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+
+#define MAX_INSTS 100000 // limits the size of expanded repetitions
+#define MAX_REPEAT 1000
+#define MAX_STATES 4096 // DFA cache is flushed when it grows past this
+#define STATES_HASH_SIZE 8192
+
+enum node_types {
+	NODE_EMPTY,
+	NODE_CLASS, // a: class index
+	NODE_CONCAT, // a then b
+	NODE_ALT, // a or b
+	NODE_REPEAT, // a, min to max times (max -1 is unbounded)
+	NODE_BOL,
+	NODE_EOL
+};
+
+struct Node {
+	int type; // see node_types enum
+	int a;
+	int b;
+	int min;
+	int max;
+	bool greedy;
+};
+
+struct Parser {
+	struct Regex *re;
+	struct Node *nodes;
+	const char *at; // current position in the pattern
+	int node_count;
+	int node_size;
+	bool failed;
+};
+
+static int parse_alt(struct Parser *p);
+
+static void program_init(struct RegexProgram *prog, struct Regex *re);
+static void program_free(struct RegexProgram *prog);
+static void flush_states(struct RegexProgram *prog);
+
+/* Sets bit c of the char set. */
+static inline void class_set(uint64_t *class, int c) {
+	class[c >> 6] |= (uint64_t) 1 << (c & 63);
+}
+
+/* Returns whether bit c of the char set is set. */
+static inline bool class_has(const uint64_t *class, int c) {
+	return (class[c >> 6] >> (c & 63)) & 1;
+}
+
+/* Sets every char in the range (inclusive) in the char set. */
+static void class_set_range(uint64_t *class, int from, int to) {
+	for (int c = from; c <= to; c++) {
+		class_set(class, c);
+	}
+}
+
+/* Adds a char set to the regex and returns its index. */
+static int add_class(struct Regex *re, const uint64_t *class) {
+	if (re->class_count == re->class_size) {
+		re->class_size *= 2;
+		re->classes = realloc(re->classes, sizeof(uint64_t[4]) * re->class_size);
+	}
+	memcpy(re->classes[re->class_count], class, sizeof(uint64_t[4]));
+	re->class_count++;
+	return re->class_count - 1;
+}
+
+/* Adds a syntax tree node and returns its index. */
+static int add_node(struct Parser *p, int type, int a, int b) {
+	if (p->node_count == p->node_size) {
+		p->node_size *= 2;
+		p->nodes = realloc(p->nodes, sizeof(struct Node) * p->node_size);
+	}
+	struct Node *node = &p->nodes[p->node_count];
+	node->type = type;
+	node->a = a;
+	node->b = b;
+	node->min = 0;
+	node->max = 0;
+	node->greedy = true;
+	p->node_count++;
+	return p->node_count - 1;
+}
+
+/* Returns the value of a hex digit, or -1 if it is not one. */
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/* Parses the escape sequence after a backslash, adding the chars it stands for to the char set.
+ * Returns whether it was valid.
+ */
+static bool parse_escape(struct Parser *p, uint64_t *class) {
+	char c = *p->at;
+	if (c == '\0') return false;
+	p->at++;
+
+	uint64_t set[4] = {0};
+	bool negate = false;
+	switch (c) {
+	case 'D': negate = true; // fall through
+	case 'd': class_set_range(set, '0', '9'); break;
+	case 'W': negate = true; // fall through
+	case 'w':
+		class_set_range(set, 'a', 'z');
+		class_set_range(set, 'A', 'Z');
+		class_set_range(set, '0', '9');
+		class_set(set, '_');
+		break;
+	case 'S': negate = true; // fall through
+	case 's':
+		class_set(set, ' ');
+		class_set_range(set, '\t', '\r'); // \t \n \v \f \r
+		break;
+	case 'n': class_set(set, '\n'); break;
+	case 't': class_set(set, '\t'); break;
+	case 'r': class_set(set, '\r'); break;
+	case 'f': class_set(set, '\f'); break;
+	case 'v': class_set(set, '\v'); break;
+	case 'x': {
+		int high = hex_value(p->at[0]);
+		int low = high < 0 ? -1 : hex_value(p->at[1]);
+		if (low < 0) return false;
+		p->at += 2;
+		class_set(set, high * 16 + low);
+		break;
+	}
+	default:
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return false; // unknown escape
+		class_set(set, (unsigned char) c); // escaped punctuation stands for itself
+		break;
+	}
+	for (int i = 0; i < 4; i++) {
+		class[i] |= negate ? ~set[i] : set[i];
+	}
+	return true;
+}
+
+/* Parses a bracketed char set, after the opening '['. */
+static int parse_class(struct Parser *p) {
+	uint64_t class[4] = {0};
+	bool negate = false;
+	if (*p->at == '^') {
+		negate = true;
+		p->at++;
+	}
+
+	bool first = true;
+	while (*p->at != ']' || first) {
+		first = false;
+		unsigned char c = *p->at;
+		if (c == '\0') {
+			p->failed = true;
+			return -1;
+		}
+		p->at++;
+
+		if (c == '\\') {
+			uint64_t escaped[4] = {0};
+			if (!parse_escape(p, escaped)) {
+				p->failed = true;
+				return -1;
+			}
+			// a single escaped char may still start a range
+			int count = 0;
+			int single = 0;
+			for (int i = 0; i < 256; i++) {
+				if (class_has(escaped, i)) {
+					count++;
+					single = i;
+				}
+			}
+			if (count != 1) {
+				for (int i = 0; i < 4; i++) {
+					class[i] |= escaped[i];
+				}
+				continue;
+			}
+			c = single;
+		}
+
+		if (p->at[0] == '-' && p->at[1] != ']' && p->at[1] != '\0') {
+			p->at++;
+			unsigned char to = *p->at;
+			p->at++;
+			if (to == '\\') {
+				uint64_t escaped[4] = {0};
+				if (!parse_escape(p, escaped)) {
+					p->failed = true;
+					return -1;
+				}
+				for (to = 0; !class_has(escaped, to) && to < 255; to++);
+			}
+			if (to < c) {
+				p->failed = true;
+				return -1;
+			}
+			class_set_range(class, c, to);
+		} else {
+			class_set(class, c);
+		}
+	}
+	p->at++; // ']'
+
+	if (negate) {
+		for (int i = 0; i < 4; i++) {
+			class[i] = ~class[i];
+		}
+	}
+	return add_node(p, NODE_CLASS, add_class(p->re, class), 0);
+}
+
+/* Parses a decimal number for a counted repetition. Returns -1 if there is none. */
+static int parse_count(struct Parser *p) {
+	if (*p->at < '0' || *p->at > '9') return -1;
+	int value = 0;
+	while (*p->at >= '0' && *p->at <= '9') {
+		value = value * 10 + (*p->at - '0');
+		if (value > MAX_REPEAT) {
+			p->failed = true;
+			return -1;
+		}
+		p->at++;
+	}
+	return value;
+}
+
+/* Parses a single char, class, group or anchor. */
+static int parse_atom(struct Parser *p) {
+	char c = *p->at;
+	p->at++;
+
+	uint64_t class[4] = {0};
+	switch (c) {
+	case '(': {
+		if (p->at[0] == '?' && p->at[1] == ':') {
+			p->at += 2; // groups never capture anyway
+		}
+		int node = parse_alt(p);
+		if (*p->at != ')') {
+			p->failed = true;
+			return -1;
+		}
+		p->at++;
+		return node;
+	}
+	case '[':
+		return parse_class(p);
+	case '.':
+		class_set_range(class, 0, 255);
+		class[0] &= ~((uint64_t) 1 << '\n');
+		return add_node(p, NODE_CLASS, add_class(p->re, class), 0);
+	case '^':
+		return add_node(p, NODE_BOL, 0, 0);
+	case '$':
+		return add_node(p, NODE_EOL, 0, 0);
+	case '\\':
+		if (!parse_escape(p, class)) {
+			p->failed = true;
+			return -1;
+		}
+		return add_node(p, NODE_CLASS, add_class(p->re, class), 0);
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+		p->failed = true; // nothing to repeat
+		return -1;
+	default:
+		class_set(class, (unsigned char) c);
+		return add_node(p, NODE_CLASS, add_class(p->re, class), 0);
+	}
+}
+
+/* Parses an atom followed by any number of repetition operators. */
+static int parse_repeat(struct Parser *p) {
+	int node = parse_atom(p);
+	while (!p->failed) {
+		int min, max;
+		char c = *p->at;
+		if (c == '*') {
+			min = 0;
+			max = -1;
+		} else if (c == '+') {
+			min = 1;
+			max = -1;
+		} else if (c == '?') {
+			min = 0;
+			max = 1;
+		} else if (c == '{') {
+			p->at++;
+			min = parse_count(p);
+			max = min;
+			if (*p->at == ',') {
+				p->at++;
+				max = *p->at == '}' ? -1 : parse_count(p);
+				if (max != -1 && max < min) {
+					p->failed = true;
+				}
+			}
+			if (min < 0 || *p->at != '}') {
+				p->failed = true;
+				return -1;
+			}
+		} else {
+			break;
+		}
+		p->at++;
+
+		node = add_node(p, NODE_REPEAT, node, 0);
+		p->nodes[node].min = min;
+		p->nodes[node].max = max;
+		if (*p->at == '?') {
+			p->nodes[node].greedy = false;
+			p->at++;
+		}
+	}
+	return node;
+}
+
+/* Parses a sequence of repeated atoms, up to the end of the pattern, group or alternative. */
+static int parse_concat(struct Parser *p) {
+	int node = -1;
+	while (!p->failed && *p->at != '\0' && *p->at != '|' && *p->at != ')') {
+		int next = parse_repeat(p);
+		node = node == -1 ? next : add_node(p, NODE_CONCAT, node, next);
+	}
+	return node == -1 ? add_node(p, NODE_EMPTY, 0, 0) : node;
+}
+
+/* Parses alternatives separated by '|'. */
+static int parse_alt(struct Parser *p) {
+	int node = parse_concat(p);
+	while (!p->failed && *p->at == '|') {
+		p->at++;
+		node = add_node(p, NODE_ALT, node, parse_concat(p));
+	}
+	return node;
+}
+
+/* Appends an instruction to the program and returns its index. */
+static int emit(struct RegexProgram *prog, int op, int x, int y) {
+	if (prog->count >= MAX_INSTS) return -1;
+	prog->insts[prog->count].op = op;
+	prog->insts[prog->count].x = x;
+	prog->insts[prog->count].y = y;
+	prog->count++;
+	return prog->count - 1;
+}
+
+/* Emits the instructions matching the syntax tree node, either as written or reversed (right to left).
+ * Returns whether the program still fits within MAX_INSTS.
+ */
+static bool compile_node(struct RegexProgram *prog, struct Node *nodes, int index, bool reverse) {
+	struct Node *node = &nodes[index];
+	switch (node->type) {
+	case NODE_EMPTY:
+		return true;
+	case NODE_CLASS:
+		return emit(prog, REGEX_OP_CLASS, prog->count + 1, node->a) >= 0;
+	case NODE_BOL:
+		return emit(prog, reverse ? REGEX_OP_NEXT_NL : REGEX_OP_PREV_NL, prog->count + 1, 0) >= 0;
+	case NODE_EOL:
+		return emit(prog, reverse ? REGEX_OP_PREV_NL : REGEX_OP_NEXT_NL, prog->count + 1, 0) >= 0;
+	case NODE_CONCAT:
+		if (reverse) {
+			return compile_node(prog, nodes, node->b, reverse) && compile_node(prog, nodes, node->a, reverse);
+		}
+		return compile_node(prog, nodes, node->a, reverse) && compile_node(prog, nodes, node->b, reverse);
+	case NODE_ALT: {
+		int split = emit(prog, REGEX_OP_SPLIT, prog->count + 1, 0);
+		if (split < 0 || !compile_node(prog, nodes, node->a, reverse)) return false;
+		int jump = emit(prog, REGEX_OP_JUMP, 0, 0);
+		if (jump < 0) return false;
+		prog->insts[split].y = prog->count;
+		if (!compile_node(prog, nodes, node->b, reverse)) return false;
+		prog->insts[jump].x = prog->count;
+		return true;
+	}
+	case NODE_REPEAT: {
+		for (int i = 0; i < node->min; i++) {
+			if (!compile_node(prog, nodes, node->a, reverse)) return false;
+		}
+		if (node->max == -1) {
+			int split = emit(prog, REGEX_OP_SPLIT, 0, 0);
+			if (split < 0 || !compile_node(prog, nodes, node->a, reverse)) return false;
+			if (emit(prog, REGEX_OP_JUMP, split, 0) < 0) return false;
+			prog->insts[split].x = node->greedy ? split + 1 : prog->count;
+			prog->insts[split].y = node->greedy ? prog->count : split + 1;
+			return true;
+		}
+
+		// each optional copy can skip straight past all of the remaining ones
+		int optional_count = node->max - node->min;
+		if (optional_count == 0) return true;
+		int splits[optional_count];
+		for (int i = 0; i < optional_count; i++) {
+			splits[i] = emit(prog, REGEX_OP_SPLIT, 0, 0);
+			if (splits[i] < 0 || !compile_node(prog, nodes, node->a, reverse)) return false;
+		}
+		for (int i = 0; i < optional_count; i++) {
+			prog->insts[splits[i]].x = node->greedy ? splits[i] + 1 : prog->count;
+			prog->insts[splits[i]].y = node->greedy ? prog->count : splits[i] + 1;
+		}
+		return true;
+	}
+	}
+	return false;
+}
+
+/* Compiles the syntax tree into the program, with the instructions for unanchored searching in front.
+ * any_class - index of the class containing every char
+ */
+static bool compile_program(struct RegexProgram *prog, struct Node *nodes, int root, bool reverse, int any_class) {
+	prog->insts = malloc(sizeof(struct RegexInst) * MAX_INSTS);
+	prog->count = 0;
+
+	// unanchored: lazily skip any chars before the match, i.e. the pattern prefixed by (?s:.)*?
+	prog->unanchored_start = emit(prog, REGEX_OP_SPLIT, 2, 1);
+	emit(prog, REGEX_OP_CLASS, prog->unanchored_start, any_class);
+	prog->anchored_start = prog->count;
+	if (!compile_node(prog, nodes, root, reverse)) return false;
+	if (emit(prog, REGEX_OP_MATCH, 0, 0) < 0) return false;
+
+	prog->insts = realloc(prog->insts, sizeof(struct RegexInst) * prog->count);
+	return true;
+}
+
+/* Prepares an empty DFA cache and scratch memory for the compiled program. */
+static void program_init(struct RegexProgram *prog, struct Regex *re) {
+	prog->classes = re->classes;
+	prog->states = calloc(STATES_HASH_SIZE, sizeof(struct RegexState *));
+	prog->state_count = 0;
+	for (int i = 0; i < 4; i++) {
+		prog->start_states[i] = NULL;
+	}
+	prog->closure_stack = malloc(sizeof(int) * (prog->count * 2 + 1));
+	prog->closure = malloc(sizeof(int) * prog->count);
+	prog->stepped = malloc(sizeof(int) * prog->count);
+	prog->visited = calloc(prog->count, sizeof(uint32_t));
+	prog->visit_generation = 0;
+}
+
+/* Frees every cached DFA state. */
+static void flush_states(struct RegexProgram *prog) {
+	for (int i = 0; i < STATES_HASH_SIZE; i++) {
+		struct RegexState *state = prog->states[i];
+		while (state != NULL) {
+			struct RegexState *next = state->hash_next;
+			free(state);
+			state = next;
+		}
+		prog->states[i] = NULL;
+	}
+	for (int i = 0; i < 4; i++) {
+		prog->start_states[i] = NULL;
+	}
+	prog->state_count = 0;
+}
+
+/* Frees all memory used by the program. */
+static void program_free(struct RegexProgram *prog) {
+	if (prog->states != NULL) {
+		flush_states(prog);
+	}
+	free(prog->states);
+	free(prog->insts);
+	free(prog->closure_stack);
+	free(prog->closure);
+	free(prog->stepped);
+	free(prog->visited);
+	prog->states = NULL;
+	prog->insts = NULL;
+	prog->closure_stack = NULL;
+	prog->closure = NULL;
+	prog->stepped = NULL;
+	prog->visited = NULL;
+}
+
+/* Compiles the pattern into the regex (see regex.h for the supported syntax).
+ * Returns whether successful. False if the pattern is invalid or too large; the regex is then left empty and need not be freed.
+ */
+bool regex_compile(struct Regex *re, const char *pattern) {
+	re->class_count = 0;
+	re->class_size = 16;
+	re->classes = malloc(sizeof(uint64_t[4]) * re->class_size);
+	re->forward.insts = NULL;
+	re->forward.states = NULL;
+	re->reverse.insts = NULL;
+	re->reverse.states = NULL;
+
+	struct Parser p;
+	p.re = re;
+	p.at = pattern;
+	p.failed = false;
+	p.node_count = 0;
+	p.node_size = 64;
+	p.nodes = malloc(sizeof(struct Node) * p.node_size);
+	int root = parse_alt(&p);
+	if (*p.at != '\0') {
+		p.failed = true; // unbalanced ')'
+	}
+
+	uint64_t any[4] = {~0ull, ~0ull, ~0ull, ~0ull};
+	int any_class = add_class(re, any);
+	bool compiled = !p.failed
+		&& compile_program(&re->forward, p.nodes, root, false, any_class)
+		&& compile_program(&re->reverse, p.nodes, root, true, any_class);
+	free(p.nodes);
+	if (!compiled) {
+		free(re->forward.insts);
+		free(re->reverse.insts);
+		free(re->classes);
+		re->forward.insts = NULL;
+		re->reverse.insts = NULL;
+		re->classes = NULL;
+		return false;
+	}
+
+	program_init(&re->forward, re);
+	re->forward.longest = false;
+	program_init(&re->reverse, re);
+	re->reverse.longest = true; // the reverse scans look for the furthest start, not a preferred one
+	return true;
+}
+
+/* Frees all memory used by the compiled regex. */
+void regex_free(struct Regex *re) {
+	program_free(&re->forward);
+	program_free(&re->reverse);
+	free(re->classes);
+	re->classes = NULL;
+}
+
+/* Returns the cached DFA state for the ordered instruction list, creating it if needed. */
+static struct RegexState *intern_state(struct RegexProgram *prog, int *insts, int count, bool prev_nl) {
+	uint32_t hash = 2166136261u ^ prev_nl; // FNV-1a
+	for (int i = 0; i < count; i++) {
+		hash = (hash ^ (uint32_t) insts[i]) * 16777619u;
+	}
+
+	struct RegexState **bucket = &prog->states[hash % STATES_HASH_SIZE];
+	for (struct RegexState *state = *bucket; state != NULL; state = state->hash_next) {
+		if (state->hash == hash && state->count == count && state->prev_nl == prev_nl
+			&& memcmp(state->insts, insts, sizeof(int) * count) == 0) {
+			return state;
+		}
+	}
+
+	struct RegexState *state = malloc(sizeof(struct RegexState) + sizeof(int) * count);
+	memset(state->next, 0, sizeof(state->next));
+	memset(state->matched, 0, sizeof(state->matched));
+	memcpy(state->insts, insts, sizeof(int) * count);
+	state->count = count;
+	state->prev_nl = prev_nl;
+	state->hash = hash;
+	state->hash_next = *bucket;
+	*bucket = state;
+	prog->state_count++;
+	return state;
+}
+
+/* Starts a new pass over the instructions, so that none count as visited. */
+static void next_visit(struct RegexProgram *prog) {
+	prog->visit_generation++;
+	if (prog->visit_generation == 0) {
+		memset(prog->visited, 0, sizeof(uint32_t) * prog->count);
+		prog->visit_generation = 1;
+	}
+}
+
+/* Appends to prog->closure every char-consuming (or match) instruction reachable from inst without consuming a char,
+ * in priority order. Returns the new closure count.
+ */
+static int add_closure(struct RegexProgram *prog, int inst, int closure_count, bool prev_nl, bool next_nl) {
+	int stack_count = 0;
+	prog->closure_stack[stack_count++] = inst;
+	while (stack_count > 0) {
+		int at = prog->closure_stack[--stack_count];
+		if (prog->visited[at] == prog->visit_generation) continue;
+		prog->visited[at] = prog->visit_generation;
+
+		struct RegexInst *i = &prog->insts[at];
+		switch (i->op) {
+		case REGEX_OP_SPLIT:
+			// y is pushed first so that all of x is handled before it
+			prog->closure_stack[stack_count++] = i->y;
+			prog->closure_stack[stack_count++] = i->x;
+			break;
+		case REGEX_OP_JUMP:
+			prog->closure_stack[stack_count++] = i->x;
+			break;
+		case REGEX_OP_PREV_NL:
+			if (prev_nl) {
+				prog->closure_stack[stack_count++] = i->x;
+			}
+			break;
+		case REGEX_OP_NEXT_NL:
+			if (next_nl) {
+				prog->closure_stack[stack_count++] = i->x;
+			}
+			break;
+		default: // REGEX_OP_CLASS, REGEX_OP_MATCH
+			prog->closure[closure_count++] = at;
+			break;
+		}
+	}
+	return closure_count;
+}
+
+/* Computes and caches the transition out of the state on the char (or REGEX_EOT).
+ * May flush the DFA cache, so the given state must not be used afterwards; use the returned one.
+ * matched - set to whether a match ends right before the char
+ */
+static struct RegexState *compute_next(struct RegexProgram *prog, struct RegexState *state, int c, bool *matched) {
+	const bool next_nl = c == '\n' || c == REGEX_EOT;
+
+	// follow everything not consuming a char, now that both sides of the current position are known
+	next_visit(prog);
+	int closure_count = 0;
+	for (int i = 0; i < state->count; i++) {
+		closure_count = add_closure(prog, state->insts[i], closure_count, state->prev_nl, next_nl);
+	}
+
+	// consume the char
+	next_visit(prog);
+	*matched = false;
+	int stepped_count = 0;
+	for (int i = 0; i < closure_count; i++) {
+		struct RegexInst *inst = &prog->insts[prog->closure[i]];
+		if (inst->op == REGEX_OP_MATCH) {
+			*matched = true;
+			if (!prog->longest) break; // anything after this has lower priority than the match found
+		} else if (c != REGEX_EOT && class_has(prog->classes[inst->y], c) && prog->visited[inst->x] != prog->visit_generation) {
+			prog->visited[inst->x] = prog->visit_generation;
+			prog->stepped[stepped_count++] = inst->x;
+		}
+	}
+
+	if (prog->state_count >= MAX_STATES) {
+		// the current state is gone after this, but the transition was already worked out from it
+		flush_states(prog);
+		return intern_state(prog, prog->stepped, stepped_count, c == '\n');
+	}
+	struct RegexState *next = intern_state(prog, prog->stepped, stepped_count, c == '\n');
+	state->next[c] = next;
+	if (*matched) {
+		state->matched[c >> 5] |= 1u << (c & 31);
+	}
+	return next;
+}
+
+/* Returns the state after consuming the char (or REGEX_EOT), from the cache when possible.
+ * matched - set to whether a match ends right before the char
+ */
+static inline struct RegexState *step(struct RegexProgram *prog, struct RegexState *state, int c, bool *matched) {
+	struct RegexState *next = state->next[c];
+	if (next == NULL) return compute_next(prog, state, c, matched);
+	*matched = (state->matched[c >> 5] >> (c & 31)) & 1;
+	return next;
+}
+
+/* Returns the state to begin a scan with. */
+static struct RegexState *start_state(struct RegexProgram *prog, bool anchored, bool prev_nl) {
+	int index = (anchored ? 2 : 0) + prev_nl;
+	if (prog->start_states[index] == NULL) {
+		if (prog->state_count >= MAX_STATES) {
+			flush_states(prog);
+		}
+		int inst = anchored ? prog->anchored_start : prog->unanchored_start;
+		prog->start_states[index] = intern_state(prog, &inst, 1, prev_nl);
+	}
+	return prog->start_states[index];
+}
+
+/* Returns the char read from the cursor as the regex sees it, i.e. REGEX_EOT if the cursor was at the edge of the file. */
+static inline int context_char(int c) {
+	return c == FILEBUF_EOF ? REGEX_EOT : c;
+}
+
+/* Scans forward from start_index with the pattern, stopping at end_index or once no further match is possible.
+ * Sets 'match_end' to where the highest priority match found ends.
+ * Returns whether any match was found.
+ */
+static bool scan_forward(struct Regex *re, struct FileBuf *fb, index_t start_index, index_t end_index, bool anchored, index_t *match_end) {
+	struct RegexProgram *prog = &re->forward;
+	struct FileBufCursor cursor;
+	filebuf_cursor_init(&cursor, fb, start_index);
+	int before = context_char(filebuf_cursor_prev(&cursor));
+	if (before != REGEX_EOT) {
+		filebuf_cursor_next(&cursor);
+	}
+	struct RegexState *state = start_state(prog, anchored, before == '\n' || before == REGEX_EOT);
+	bool found = false;
+	bool matched;
+
+	index_t file_index = start_index;
+	index_t span_length;
+	const unsigned char *text;
+	while (file_index < end_index && (text = (const unsigned char *) filebuf_cursor_next_span(&cursor, &span_length)) != NULL) {
+		if (span_length > end_index - file_index) {
+			span_length = end_index - file_index;
+		}
+		for (index_t i = 0; i < span_length; i++) {
+			state = step(prog, state, text[i], &matched);
+			if (matched) {
+				found = true;
+				*match_end = file_index + i;
+			}
+			if (state->count == 0) return found;
+		}
+		file_index += span_length;
+	}
+
+	// a match may also end right at end_index, depending on what comes after it
+	filebuf_cursor_seek(&cursor, end_index);
+	step(prog, state, context_char(filebuf_cursor_peek(&cursor)), &matched);
+	if (matched) {
+		found = true;
+		*match_end = end_index;
+	}
+	return found;
+}
+
+/* Scans backward from end_index with the reversed pattern, stopping at start_index or once no further match is possible.
+ * Sets 'match_start' to where the furthest match found so far starts, or the first one found if first_only.
+ * Returns whether any match was found.
+ */
+static bool scan_backward(struct Regex *re, struct FileBuf *fb, index_t start_index, index_t end_index, bool anchored, bool first_only, index_t *match_start) {
+	struct RegexProgram *prog = &re->reverse;
+	struct FileBufCursor cursor;
+	filebuf_cursor_init(&cursor, fb, end_index);
+	int after = context_char(filebuf_cursor_peek(&cursor));
+	struct RegexState *state = start_state(prog, anchored, after == '\n' || after == REGEX_EOT);
+	bool found = false;
+	bool matched;
+
+	index_t file_index = end_index; // everything from here on has been scanned
+	index_t span_length;
+	const unsigned char *text;
+	while (file_index > start_index && (text = (const unsigned char *) filebuf_cursor_prev_span(&cursor, &span_length)) != NULL) {
+		text += span_length - 1; // scanned from its last char
+		if (span_length > file_index - start_index) {
+			span_length = file_index - start_index;
+		}
+		for (index_t i = 0; i < span_length; i++) {
+			state = step(prog, state, *(text - i), &matched);
+			if (matched) {
+				found = true;
+				*match_start = file_index - i;
+				if (first_only) return true;
+			}
+			if (state->count == 0) return found;
+		}
+		file_index -= span_length;
+	}
+
+	// a match may also start right at start_index, depending on what comes before it
+	filebuf_cursor_seek(&cursor, start_index);
+	step(prog, state, context_char(filebuf_cursor_prev(&cursor)), &matched);
+	if (matched) {
+		found = true;
+		*match_start = start_index;
+	}
+	return found;
+}
+
+/* Sets 'result_index' and 'result_length' to the first match of the regex in the file,
+ * search constrained between start_index (inclusive) and end_index (exclusive), i.e. the whole match must be within that range.
+ * Matches may be empty (result_length 0) if the pattern allows it.
+ * Returns whether successful. False if no match found (or invalid range).
+ */
+bool regex_index_of(struct Regex *re, struct FileBuf *fb, index_t start_index, index_t end_index, index_t *result_index, index_t *result_length) {
+	if (end_index > fb->length) {
+		end_index = fb->length;
+	}
+	if (end_index < start_index) return false;
+
+	index_t match_end;
+	if (!scan_forward(re, fb, start_index, end_index, false, &match_end)) return false;
+
+	// the leftmost match ending there is the one found, since leftmost-first prefers earlier starts
+	index_t match_start = match_end;
+	scan_backward(re, fb, start_index, match_end, true, false, &match_start);
+	*result_index = match_start;
+	*result_length = match_end - match_start;
+	return true;
+}
+
+/* Sets 'result_index' and 'result_length' to the match of the regex starting last in the file,
+ * search constrained between start_index (inclusive) and end_index (exclusive), i.e. the whole match must be within that range.
+ * Will not modify them if fails.
+ * Returns whether successful. False if no match found (or invalid range).
+ */
+bool regex_last_index_of(struct Regex *re, struct FileBuf *fb, index_t start_index, index_t end_index, index_t *result_index, index_t *result_length) {
+	if (end_index > fb->length) {
+		end_index = fb->length;
+	}
+	if (end_index < start_index) return false;
+
+	index_t match_start;
+	if (!scan_backward(re, fb, start_index, end_index, false, true, &match_start)) return false;
+
+	index_t match_end = match_start;
+	scan_forward(re, fb, match_start, end_index, true, &match_end);
+	*result_index = match_start;
+	*result_length = match_end - match_start;
+	return true;
+}
+
+/* Replaces every match of the regex in the file with the replacement, as a single change (see filebuf_replace_ranges()).
+ * Matches are found from left to right without overlapping, in a single pass over the file.
+ * An empty match is replaced too, and the search then continues from the next char.
+ * replacement - must be a valid, null-terminated string.
+ * Returns the number of matches replaced.
+ */
+index_t regex_replace_all(struct Regex *re, struct FileBuf *fb, const char *replacement) {
+	struct FileBufRange *ranges = NULL;
+	index_t count = 0;
+	index_t size = 0;
+	index_t index = 0;
+	index_t match_index;
+	index_t match_length;
+	while (index <= fb->length && regex_index_of(re, fb, index, fb->length, &match_index, &match_length)) {
+		if (count == size) {
+			size = size == 0 ? 64 : size * 2;
+			ranges = realloc(ranges, sizeof(struct FileBufRange) * size);
+		}
+		ranges[count].index = match_index;
+		ranges[count].length = match_length;
+		count++;
+		index = match_index + match_length;
+		if (match_length == 0) {
+			if (index == fb->length) break;
+			index++;
+		}
+	}
+
+	if (count > 0 && !filebuf_replace_ranges(fb, ranges, count, replacement, strlen(replacement))) {
+		count = 0;
+	}
+	free(ranges);
+	return count;
+}
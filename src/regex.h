@@ -0,0 +1,81 @@
+/* regex.h
+ * Regular expression search over a file buffer's piece table.
+ * Patterns are compiled to an NFA program, which is then lazily turned into a cached DFA while searching,
+ * so matching is linear in the amount of text scanned (no backtracking).
+ *
+ * Supported syntax: literals, ., [...] and [^...] classes, \d \w \s (and negations), \n \t \r \f \v \xHH,
+ * ^ and $ (line anchors), grouping (...) and (?:...), alternation |, and the repetitions * + ? {m} {m,} {m,n},
+ * each optionally lazy by appending ?. Matching is leftmost-first (like Perl/vim).
+ */
+
+#ifndef __REGEX_H__
+#define __REGEX_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "filebuf.h"
+
+#define REGEX_EOT 256 // pseudo char before the start or after the end of the text
+#define REGEX_ALPHABET 257 // every byte, plus REGEX_EOT
+
+enum regex_ops {
+	REGEX_OP_CLASS, // consume a char within class y, then go to x
+	REGEX_OP_SPLIT, // go to both x and y, x having priority
+	REGEX_OP_JUMP, // go to x
+	REGEX_OP_PREV_NL, // go to x if the previously consumed char was a new-line (or there was none)
+	REGEX_OP_NEXT_NL, // go to x if the next char is a new-line (or there is none)
+	REGEX_OP_MATCH
+};
+
+struct RegexInst {
+	int op; // see regex_ops enum
+	int x;
+	int y;
+};
+
+// a DFA state: the ordered set of NFA instructions reached so far, plus transitions computed from it
+struct RegexState {
+	struct RegexState *next[REGEX_ALPHABET]; // state after consuming each char. NULL until first needed
+	uint32_t matched[(REGEX_ALPHABET + 31) / 32]; // bit per char: whether a match ends right before it (valid once next[] is set)
+	struct RegexState *hash_next; // next state in the same hash table bucket
+	uint32_t hash;
+	int count; // number of instructions. 0 is the dead state; nothing can match anymore
+	bool prev_nl; // whether the char consumed to get here was a new-line
+	int insts[];
+};
+
+// an NFA program along with its lazily built DFA
+struct RegexProgram {
+	struct RegexInst *insts;
+	uint64_t (*classes)[4]; // char sets used by REGEX_OP_CLASS, a bit per char (shared by both of a regex's programs)
+	struct RegexState **states; // hash table of every DFA state built so far
+	struct RegexState *start_states[4]; // indexed by (anchored ? 2 : 0) + prev_nl
+	int *closure_stack; // scratch memory for computing transitions
+	int *closure; // ...
+	int *stepped; // ...
+	uint32_t *visited; // ...
+	uint32_t visit_generation; // instruction i was visited in the current pass if visited[i] equals this
+	int count;
+	int anchored_start; // instruction where an anchored match begins
+	int unanchored_start; // instruction where a match beginning anywhere later in the text begins
+	int state_count;
+	bool longest; // whether matches of lower priority keep going after a match is found (vs. leftmost-first)
+};
+
+struct Regex {
+	struct RegexProgram forward; // matches the pattern from left to right
+	struct RegexProgram reverse; // matches the reversed pattern from right to left
+	uint64_t (*classes)[4];
+	int class_count;
+	int class_size;
+};
+
+bool regex_compile(struct Regex *re, const char *pattern);
+void regex_free(struct Regex *re);
+
+bool regex_index_of(struct Regex *re, struct FileBuf *fb, index_t start_index, index_t end_index, index_t *result_index, index_t *result_length);
+bool regex_last_index_of(struct Regex *re, struct FileBuf *fb, index_t start_index, index_t end_index, index_t *result_index, index_t *result_length);
+index_t regex_replace_all(struct Regex *re, struct FileBuf *fb, const char *replacement);
+
+#endif
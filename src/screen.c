@@ -0,0 +1,394 @@
+/* screen.c
+ * Double buffered model of the terminal screen, sent to the terminal as the difference between frames.
+ *
+ * Rendering compares each line of the back buffer with the front buffer, skipping lines that didn't change with a
+ * single memcmp(). Within a changed line, cells are sent in runs: a run carries on over a few unchanged cells rather
+ * than moving the cursor past them, since a cursor move costs more bytes than those cells do.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "screen.h"
+#include "terminal.h"
+
+#define RUN_GAP_MAX 4 // unchanged cells a run of changed cells carries on over, rather than ending and moving the cursor
+#define CONTROL_CHAR '?' // drawn in place of control chars, which the terminal would act on rather than show
+
+static const char replacement_text[] = "\xEF\xBF\xBD"; // UTF8_REPLACEMENT, drawn in place of bytes that aren't valid UTF-8
+static const char control_text[] = {CONTROL_CHAR};
+
+static struct Screen screen;
+
+static inline struct ScreenCell *back_cell(uint32_t line, uint32_t column);
+static void blank_cells(struct ScreenCell *cells, uint32_t count);
+static void set_cell(uint32_t column, const char *text, uint8_t length, bool wide);
+static void put_char(const char *text, size_t length, uint32_t codepoint);
+static void end_write(void);
+static void move_terminal_cursor(uint32_t line, uint32_t column);
+static void render_line(uint32_t line);
+
+/* Sets up the screen at the terminal's size. Its first render clears the terminal. */
+void screen_init(uint32_t width, uint32_t height) {
+	screen.front = NULL;
+	screen.back = NULL;
+	screen.width = 0;
+	screen.height = 0;
+	screen.cursor_line = 1;
+	screen.cursor_column = 1;
+	screen.color = SCREEN_COLOR_DEFAULT;
+	screen.partial_length = 0;
+	screen_resize(width, height);
+}
+
+/* Changes the size of the screen (e.g. after the terminal is resized), blanking everything on it.
+ * The next render repaints the whole terminal.
+ */
+void screen_resize(uint32_t width, uint32_t height) {
+	screen.width = width;
+	screen.height = height;
+	screen.front = realloc(screen.front, sizeof(struct ScreenCell) * width * height);
+	screen.back = realloc(screen.back, sizeof(struct ScreenCell) * width * height);
+	blank_cells(screen.back, width * height);
+	if (screen.cursor_line > height) {
+		screen.cursor_line = height == 0 ? 1 : height;
+	}
+	if (screen.cursor_column > width) {
+		screen.cursor_column = width == 0 ? 1 : width;
+	}
+	screen_redraw();
+}
+
+/* Makes the next render repaint the whole terminal, for when something besides the screen drew over it. */
+void screen_redraw() {
+	screen.repaint = true;
+}
+
+static inline struct ScreenCell *back_cell(uint32_t line, uint32_t column) {
+	return &screen.back[(size_t) (line - 1) * screen.width + (column - 1)];
+}
+
+static void blank_cells(struct ScreenCell *cells, uint32_t count) {
+	memset(cells, 0, sizeof(struct ScreenCell) * count);
+	for (uint32_t i = 0; i < count; i++) {
+		cells[i].text[0] = ' ';
+		cells[i].length = 1;
+	}
+}
+
+/* Sends the terminal whatever differs between the back and front buffers, and moves its cursor to the screen's cursor.
+ * Everything is only appended to the terminal's frame, written out by terminal_flush().
+ */
+void screen_render() {
+	end_write();
+	if (screen.repaint) {
+		terminal_write_string("\033[0m\033[2J");
+		blank_cells(screen.front, screen.width * screen.height);
+		screen.terminal_line = 0;
+		screen.terminal_color = SCREEN_COLOR_DEFAULT;
+		screen.repaint = false;
+	}
+
+	for (uint32_t line = 1; line <= screen.height; line++) {
+		const size_t offset = (size_t) (line - 1) * screen.width;
+		if (memcmp(screen.front + offset, screen.back + offset, sizeof(struct ScreenCell) * screen.width) != 0) {
+			render_line(line);
+		}
+	}
+	if (screen.height > 0 && screen.width > 0) {
+		move_terminal_cursor(screen.cursor_line, screen.cursor_column);
+	}
+}
+
+/* Sends the changed runs of cells in the line, copying them into the front buffer. */
+static void render_line(uint32_t line) {
+	struct ScreenCell *front = screen.front + (size_t) (line - 1) * screen.width; // alias
+	struct ScreenCell *back = screen.back + (size_t) (line - 1) * screen.width; // alias
+	uint32_t column = 0; // 0-based within the line
+	while (column < screen.width) {
+		if (memcmp(&front[column], &back[column], sizeof(struct ScreenCell)) == 0) {
+			column++;
+			continue;
+		}
+
+		// a wide char is drawn whole, and drawing over half of one on the terminal erases all of it
+		uint32_t start = column;
+		while (start > 0 && (back[start].length == 0 || front[start].length == 0)) {
+			start--;
+		}
+		uint32_t end = column + 1;
+		for (uint32_t at = end; at < screen.width && at - end < RUN_GAP_MAX; at++) {
+			if (memcmp(&front[at], &back[at], sizeof(struct ScreenCell)) != 0) {
+				end = at + 1;
+			}
+		}
+		while (end < screen.width && (back[end].length == 0 || front[end].length == 0)) {
+			end++;
+		}
+
+		move_terminal_cursor(line, start + 1);
+		for (uint32_t at = start; at < end; at++) {
+			if (back[at].length == 0) continue; // covered by the wide char before it
+			if (back[at].color != screen.terminal_color) {
+				terminal_write_string("\033[");
+				terminal_write_uint32(back[at].color == SCREEN_COLOR_DEFAULT ? 39 : back[at].color);
+				terminal_write_char('m');
+				screen.terminal_color = back[at].color;
+			}
+			terminal_write(back[at].text, back[at].length);
+		}
+		memcpy(&front[start], &back[start], sizeof(struct ScreenCell) * (end - start));
+		screen.terminal_column = end + 1;
+		if (end == screen.width) {
+			screen.terminal_line = 0; // the terminal may or may not have wrapped to the next line
+		}
+		column = end;
+	}
+}
+
+/* Moves the terminal's cursor with the shortest sequence that gets it there, if it isn't there already. */
+static void move_terminal_cursor(uint32_t line, uint32_t column) {
+	if (screen.terminal_line == line && screen.terminal_column == column) return;
+	if (screen.terminal_line == line) {
+		terminal_cursor_set_column(column);
+	} else {
+		terminal_cursor_set(line, column);
+	}
+	screen.terminal_line = line;
+	screen.terminal_column = column;
+}
+
+/* Blanks the whole back buffer. */
+void screen_clear() {
+	end_write();
+	blank_cells(screen.back, screen.width * screen.height);
+}
+
+/* Blanks the line the cursor is on. */
+void screen_clear_line() {
+	end_write();
+	if (screen.width == 0 || screen.height == 0) return;
+	blank_cells(back_cell(screen.cursor_line, 1), screen.width);
+}
+
+/* Blanks the line the cursor is on from the cursor to the end of the line. */
+void screen_clear_line_from_cursor() {
+	end_write();
+	if (screen.cursor_column > screen.width || screen.height == 0) return;
+	if (screen.cursor_column > 1 && back_cell(screen.cursor_line, screen.cursor_column)->length == 0) {
+		blank_cells(back_cell(screen.cursor_line, screen.cursor_column - 1), 1); // a wide char cut in half
+	}
+	blank_cells(back_cell(screen.cursor_line, screen.cursor_column), screen.width - screen.cursor_column + 1);
+}
+
+/* Moves the cursor where drawing happens. Like the terminal's, lines and columns start at 1, and the cursor is kept on screen. */
+void screen_cursor_set(uint32_t line, uint32_t column) {
+	end_write();
+	screen.cursor_line = line < 1 ? 1 : line > screen.height ? screen.height : line;
+	screen.cursor_column = column < 1 ? 1 : column > screen.width ? screen.width : column;
+}
+
+void screen_cursor_set_column(uint32_t column) {
+	screen_cursor_set(screen.cursor_line, column);
+}
+
+void screen_cursor_up(uint32_t n) {
+	screen_cursor_set(screen.cursor_line > n ? screen.cursor_line - n : 1, screen.cursor_column);
+}
+
+void screen_cursor_down(uint32_t n) {
+	screen_cursor_set(screen.cursor_line + n, screen.cursor_column);
+}
+
+/* Scrolls the lines from top to bottom (inclusive), moving what is on them up by 'lines' (down if negative) and
+ * blanking the lines uncovered. The terminal is scrolled the same way right away, using a scroll region, so
+ * what was already on it doesn't have to be sent again.
+ */
+void screen_scroll(uint32_t top, uint32_t bottom, int32_t lines) {
+	end_write();
+	if (bottom > screen.height) {
+		bottom = screen.height;
+	}
+	if (top < 1 || top > bottom || lines == 0) return;
+	const uint32_t region = bottom - top + 1;
+	const uint32_t distance = lines < 0 ? -(uint32_t) lines : (uint32_t) lines;
+	const size_t width = screen.width;
+	struct ScreenCell *back = screen.back + (top - 1) * width; // alias
+	struct ScreenCell *front = screen.front + (top - 1) * width; // alias
+	if (distance >= region) {
+		blank_cells(back, region * width); // nothing left to scroll. redrawn as it differs instead
+		return;
+	}
+
+	const uint32_t kept = region - distance;
+	if (lines > 0) {
+		memmove(back, back + distance * width, sizeof(struct ScreenCell) * kept * width);
+		memmove(front, front + distance * width, sizeof(struct ScreenCell) * kept * width);
+		blank_cells(back + kept * width, distance * width);
+		blank_cells(front + kept * width, distance * width);
+	} else {
+		memmove(back + distance * width, back, sizeof(struct ScreenCell) * kept * width);
+		memmove(front + distance * width, front, sizeof(struct ScreenCell) * kept * width);
+		blank_cells(back, distance * width);
+		blank_cells(front, distance * width);
+	}
+
+	if (screen.repaint) return; // everything is sent again anyway
+	terminal_write_string("\033[");
+	terminal_write_uint32(top);
+	terminal_write_char(';');
+	terminal_write_uint32(bottom);
+	terminal_write_char('r'); // scroll region
+	terminal_write_string("\033[");
+	terminal_write_uint32(distance);
+	terminal_write_char(lines > 0 ? 'S' : 'T');
+	terminal_write_string("\033[r"); // back to the whole screen. this also moves the cursor home
+	screen.terminal_line = 0;
+}
+
+/* Sets the color that chars drawn from now on are drawn in. See SCREEN_COLOR_DEFAULT. */
+void screen_set_color(uint8_t color) {
+	screen.color = color;
+}
+
+/* Sets the cell at the column of the cursor's line, first blanking whatever is left of a wide char it draws over.
+ * A wide char also covers the cell after it.
+ */
+static void set_cell(uint32_t column, const char *text, uint8_t length, bool wide) {
+	struct ScreenCell *cells = back_cell(screen.cursor_line, 1); // alias
+	const uint32_t at = column - 1;
+	const uint32_t last = wide ? at + 1 : at; // last cell covered
+	if (at > 0 && cells[at].length == 0) {
+		blank_cells(&cells[at - 1], 1);
+	}
+	if (last + 1 < screen.width && cells[last + 1].length == 0) {
+		blank_cells(&cells[last + 1], 1);
+	}
+
+	memset(&cells[at], 0, sizeof(struct ScreenCell));
+	memcpy(cells[at].text, text, length);
+	cells[at].length = length;
+	cells[at].color = screen.color;
+	if (wide) {
+		memset(&cells[at + 1], 0, sizeof(struct ScreenCell));
+		cells[at + 1].color = screen.color;
+	}
+}
+
+/* Draws a single decoded char at the cursor and moves the cursor past it. Chars past the end of the line are cut off. */
+static void put_char(const char *text, size_t length, uint32_t codepoint) {
+	if (screen.width == 0 || screen.height == 0) return;
+	if (codepoint == '\n') {
+		screen.cursor_column = 1;
+		if (screen.cursor_line < screen.height) {
+			screen.cursor_line++;
+		}
+		return;
+	}
+	if (codepoint == '\t') {
+		const size_t next_column = utf8_next_column(codepoint, screen.cursor_column - 1) + 1;
+		while (screen.cursor_column < next_column) {
+			put_char(" ", 1, ' ');
+		}
+		return;
+	}
+	if (codepoint == UTF8_REPLACEMENT && length == 1) {
+		// not valid UTF-8
+		text = replacement_text;
+		length = sizeof(replacement_text) - 1;
+	} else if (codepoint < 0x20 || (codepoint >= 0x7F && codepoint < 0xA0)) {
+		text = control_text;
+		length = sizeof(control_text);
+	}
+
+	const int width = utf8_width(codepoint);
+	if (width == 0) {
+		// joins the char before it, if there is room in its cell
+		if (screen.cursor_column == 1 || screen.cursor_column > screen.width + 1) return;
+		struct ScreenCell *cell = back_cell(screen.cursor_line, screen.cursor_column - 1);
+		if (cell->length == 0 && screen.cursor_column > 2) {
+			cell--;
+		}
+		if (cell->length > 0 && cell->length + length <= SCREEN_CELL_TEXT) {
+			memcpy(cell->text + cell->length, text, length);
+			cell->length += length;
+		}
+		return;
+	}
+
+	if (screen.cursor_column + width - 1 <= screen.width) {
+		set_cell(screen.cursor_column, text, length, width == 2);
+	} else if (screen.cursor_column <= screen.width) {
+		set_cell(screen.cursor_column, " ", 1, false); // only half of a wide char would fit
+	}
+	screen.cursor_column += width;
+}
+
+/* Draws the chars of 'length' bytes of UTF-8 text at the cursor, moving the cursor past them (a new-line char moves it
+ * to the start of the next line). A char cut off at the end of the text is finished by the next text written.
+ */
+void screen_write(const char *text, size_t length) {
+	size_t i = 0;
+	if (screen.partial_length > 0 && length > 0) {
+		// finish the char cut off at the end of the last text
+		char joined[2 * UTF8_MAX_LENGTH];
+		const size_t partial_length = screen.partial_length;
+		const size_t taken = length < UTF8_MAX_LENGTH ? length : UTF8_MAX_LENGTH;
+		memcpy(joined, screen.partial, partial_length);
+		memcpy(joined + partial_length, text, taken);
+
+		uint32_t codepoint;
+		const size_t char_length = utf8_decode(joined, partial_length + taken, &codepoint);
+		if (char_length == 0) {
+			memcpy(screen.partial + partial_length, text, length);
+			screen.partial_length += length;
+			return;
+		}
+		screen.partial_length = 0;
+		put_char(joined, char_length, codepoint);
+		if (char_length < partial_length) {
+			// it was invalid after all: the rest of its bytes are continuation bytes, each invalid on its own
+			for (size_t k = char_length; k < partial_length; k++) {
+				put_char(joined + k, 1, UTF8_REPLACEMENT);
+			}
+		} else {
+			i = char_length - partial_length;
+		}
+	}
+
+	while (i < length) {
+		uint32_t codepoint;
+		const size_t char_length = utf8_decode(text + i, length - i, &codepoint);
+		if (char_length == 0) {
+			memcpy(screen.partial, text + i, length - i);
+			screen.partial_length = length - i;
+			return;
+		}
+		put_char(text + i, char_length, codepoint);
+		i += char_length;
+	}
+}
+
+/* Draws whatever is left of a char cut off at the end of the last text written, which is never finished now. */
+static void end_write(void) {
+	const uint8_t partial_length = screen.partial_length;
+	screen.partial_length = 0;
+	for (uint8_t i = 0; i < partial_length; i++) {
+		put_char((const char *) screen.partial + i, 1, UTF8_REPLACEMENT);
+	}
+}
+
+void screen_write_char(char c) {
+	screen_write(&c, 1);
+}
+
+void screen_write_string(const char *string) {
+	screen_write(string, strlen(string));
+}
+
+void screen_write_spaces(uint32_t count) {
+	end_write();
+	for (uint32_t i = 0; i < count; i++) {
+		put_char(" ", 1, ' ');
+	}
+}
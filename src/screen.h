@@ -0,0 +1,64 @@
+/* screen.h
+ * A model of what is on the terminal screen, as a grid of cells (a char and its color each).
+ * Drawing only changes the back buffer, which is what the screen should show. screen_render() then compares it with
+ * the front buffer (what the terminal is showing) and sends the terminal just the cells that differ, so that a
+ * keystroke costs bytes for what it changed on screen rather than for everything redrawn around it.
+ */
+
+#ifndef __SCREEN_H__
+#define __SCREEN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "utf8.h"
+
+#define SCREEN_CELL_TEXT 6 // bytes of UTF-8 a cell holds: a char and any zero width chars after it that fit
+#define SCREEN_COLOR_DEFAULT 0 // the terminal's own foreground color. any other color is an SGR code (e.g. 31 for red)
+
+// one column of one line on screen. zeroed before being set, so cells can be compared with memcmp()
+struct ScreenCell {
+	char text[SCREEN_CELL_TEXT]; // not null-terminated
+	uint8_t length; // bytes of text. 0 for the second column of a wide char, which the cell before it covers
+	uint8_t color; // see SCREEN_COLOR_DEFAULT
+};
+
+// the terminal screen. there is only one, so it is kept within screen.c
+struct Screen {
+	struct ScreenCell *front; // what the terminal is showing, line by line
+	struct ScreenCell *back; // what it should show after the next render
+	uint32_t width;
+	uint32_t height;
+	uint32_t cursor_line; // where drawing into the back buffer happens (1-based, like the terminal's cursor)
+	uint32_t cursor_column;
+	uint32_t terminal_line; // where the terminal's cursor is. 0 if not known
+	uint32_t terminal_column;
+	uint8_t color; // for chars drawn next
+	uint8_t terminal_color; // color the terminal draws chars in
+	unsigned char partial[UTF8_MAX_LENGTH]; // start of a char cut off at the end of the last text written, finished by the next
+	uint8_t partial_length;
+	bool repaint; // whether the terminal's contents are unknown, so it is cleared and everything is drawn again
+};
+
+void screen_init(uint32_t width, uint32_t height);
+void screen_resize(uint32_t width, uint32_t height);
+void screen_redraw();
+void screen_render();
+
+void screen_clear();
+void screen_clear_line();
+void screen_clear_line_from_cursor();
+void screen_cursor_set(uint32_t line, uint32_t column);
+void screen_cursor_set_column(uint32_t column);
+void screen_cursor_up(uint32_t n);
+void screen_cursor_down(uint32_t n);
+void screen_scroll(uint32_t top, uint32_t bottom, int32_t lines);
+void screen_set_color(uint8_t color);
+
+void screen_write(const char *text, size_t length);
+void screen_write_char(char c);
+void screen_write_string(const char *string);
+void screen_write_spaces(uint32_t count);
+
+#endif
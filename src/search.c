@@ -0,0 +1,168 @@
+/* search.c
+ * Substring search kernels over a single contiguous span of text.
+ *
+ * Multi-char patterns use a first/last char filter: a whole vector of candidate positions is compared
+ * against the pattern's first and last chars at once, and only positions where both match are verified
+ * with memcmp(). Single chars go straight to memchr()/memrchr().
+ */
+
+#define _GNU_SOURCE // memmem(), memrchr()
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "search.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+static const char *find_scalar(const char *text, size_t length, const char *pattern, size_t pattern_length);
+static const char *find_last_scalar(const char *text, size_t length, const char *pattern, size_t pattern_length);
+
+/* Returns whether the pattern's middle chars (all but first and last) match at the candidate. */
+static inline bool verify(const char *candidate, const char *pattern, size_t pattern_length) {
+	return pattern_length <= 2 || memcmp(candidate + 1, pattern + 1, pattern_length - 2) == 0;
+}
+
+#ifdef SEARCH_X86
+
+/* SSE2 forward kernel. Checks 16 candidate positions per iteration. */
+__attribute__((target("sse2")))
+static const char *find_sse2(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+	const __m128i first = _mm_set1_epi8(pattern[0]);
+	const __m128i last = _mm_set1_epi8(pattern[pattern_length - 1]);
+	const size_t candidates = length - pattern_length + 1;
+
+	size_t i = 0;
+	for (; i + 16 <= candidates; i += 16) {
+		__m128i block_first = _mm_loadu_si128((const __m128i *) (text + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *) (text + i + pattern_length - 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+		while (mask != 0) {
+			int bit = __builtin_ctz(mask);
+			if (verify(text + i + bit, pattern, pattern_length)) return text + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return find_scalar(text + i, length - i, pattern, pattern_length);
+}
+
+/* SSE2 backward kernel. Checks 16 candidate positions per iteration, from the end of the text. */
+__attribute__((target("sse2")))
+static const char *find_last_sse2(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+	const __m128i first = _mm_set1_epi8(pattern[0]);
+	const __m128i last = _mm_set1_epi8(pattern[pattern_length - 1]);
+	size_t candidates = length - pattern_length + 1; // candidates still to check are [0, candidates)
+
+	while (candidates >= 16) {
+		size_t i = candidates - 16;
+		__m128i block_first = _mm_loadu_si128((const __m128i *) (text + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *) (text + i + pattern_length - 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+		while (mask != 0) {
+			int bit = 31 - __builtin_clz(mask);
+			if (verify(text + i + bit, pattern, pattern_length)) return text + i + bit;
+			mask &= ~(1u << bit);
+		}
+		candidates = i;
+	}
+	return find_last_scalar(text, candidates + pattern_length - 1, pattern, pattern_length);
+}
+
+/* AVX2 forward kernel. Checks 32 candidate positions per iteration. */
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+	const __m256i first = _mm256_set1_epi8(pattern[0]);
+	const __m256i last = _mm256_set1_epi8(pattern[pattern_length - 1]);
+	const size_t candidates = length - pattern_length + 1;
+
+	size_t i = 0;
+	for (; i + 32 <= candidates; i += 32) {
+		__m256i block_first = _mm256_loadu_si256((const __m256i *) (text + i));
+		__m256i block_last = _mm256_loadu_si256((const __m256i *) (text + i + pattern_length - 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+		while (mask != 0) {
+			int bit = __builtin_ctz(mask);
+			if (verify(text + i + bit, pattern, pattern_length)) return text + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return find_scalar(text + i, length - i, pattern, pattern_length);
+}
+
+/* AVX2 backward kernel. Checks 32 candidate positions per iteration, from the end of the text. */
+__attribute__((target("avx2")))
+static const char *find_last_avx2(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+	const __m256i first = _mm256_set1_epi8(pattern[0]);
+	const __m256i last = _mm256_set1_epi8(pattern[pattern_length - 1]);
+	size_t candidates = length - pattern_length + 1;
+
+	while (candidates >= 32) {
+		size_t i = candidates - 32;
+		__m256i block_first = _mm256_loadu_si256((const __m256i *) (text + i));
+		__m256i block_last = _mm256_loadu_si256((const __m256i *) (text + i + pattern_length - 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+		while (mask != 0) {
+			int bit = 31 - __builtin_clz(mask);
+			if (verify(text + i + bit, pattern, pattern_length)) return text + i + bit;
+			mask &= ~(1u << bit);
+		}
+		candidates = i;
+	}
+	return find_last_sse2(text, candidates + pattern_length - 1, pattern, pattern_length);
+}
+
+#endif // SEARCH_X86
+
+/* Portable forward search. glibc's memmem() is a Two-Way search, so stays linear for any pattern. */
+static const char *find_scalar(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+	if (length < pattern_length) return NULL;
+	return memmem(text, length, pattern, pattern_length);
+}
+
+/* Portable backward search, using the same first/last char filter as the vector kernels. */
+static const char *find_last_scalar(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+	if (length < pattern_length) return NULL;
+
+	const char first = pattern[0];
+	const char last = pattern[pattern_length - 1];
+	size_t i = length - pattern_length + 1;
+	while (i > 0) {
+		i--;
+		if (text[i] == first && text[i + pattern_length - 1] == last && verify(text + i, pattern, pattern_length)) {
+			return text + i;
+		}
+	}
+	return NULL;
+}
+
+/* Returns a pointer to the first occurrence of the pattern within the text, or NULL if there is none.
+ * Overlapping occurrences are all considered, e.g. "aab" is found in "aaab".
+ * pattern_length - must be at least 1
+ */
+const char *search_find(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+	if (length < pattern_length) return NULL;
+	if (pattern_length == 1) return memchr(text, pattern[0], length);
+
+	#ifdef SEARCH_X86
+		if (__builtin_cpu_supports("avx2")) return find_avx2(text, length, pattern, pattern_length);
+		if (__builtin_cpu_supports("sse2")) return find_sse2(text, length, pattern, pattern_length);
+	#endif
+	return find_scalar(text, length, pattern, pattern_length);
+}
+
+/* Returns a pointer to the last occurrence of the pattern within the text, or NULL if there is none.
+ * pattern_length - must be at least 1
+ */
+const char *search_find_last(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+	if (length < pattern_length) return NULL;
+	if (pattern_length == 1) return memrchr(text, pattern[0], length);
+
+	#ifdef SEARCH_X86
+		if (__builtin_cpu_supports("avx2")) return find_last_avx2(text, length, pattern, pattern_length);
+		if (__builtin_cpu_supports("sse2")) return find_last_sse2(text, length, pattern, pattern_length);
+	#endif
+	return find_last_scalar(text, length, pattern, pattern_length);
+}
@@ -0,0 +1,14 @@
+/* search.h
+ * Substring search kernels over a single contiguous span of text.
+ * Vectorized with SSE2/AVX2 where the CPU supports it (checked at runtime), with a portable fallback.
+ */
+
+#ifndef __SEARCH_H__
+#define __SEARCH_H__
+
+#include <stddef.h>
+
+const char *search_find(const char *text, size_t length, const char *pattern, size_t pattern_length);
+const char *search_find_last(const char *text, size_t length, const char *pattern, size_t pattern_length);
+
+#endif
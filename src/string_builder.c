@@ -2,8 +2,41 @@
  * author: Andrew Klinge
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "string_builder.h"
 
+#define GROWABLE_MIN_SIZE 64 // first size of a growable buffer that starts out empty
+
+static bool make_room(struct StringBuilder *sb, uint32_t length);
+
+// "00" to "99", for formatting integers two digits at a time
+static const char digit_pairs[201] =
+	"0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+	"5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+/* Sets up a string builder whose buffer is allocated here (starting at 'size' chars) and grows as needed.
+ * Free it with string_builder_free().
+ */
+void string_builder_init(struct StringBuilder *sb, uint32_t size) {
+	sb->buf = size == 0 ? NULL : malloc(size);
+	sb->size = size;
+	sb->growable = true;
+	string_builder_reset(sb);
+	if (sb->buf != NULL) {
+		sb->buf[0] = '\0';
+	}
+}
+
+/* Frees the buffer of a string builder set up with string_builder_init(). */
+void string_builder_free(struct StringBuilder *sb) {
+	free(sb->buf);
+	sb->buf = NULL;
+	sb->size = 0;
+	string_builder_reset(sb);
+}
+
 /* Resets the string builder to write at the beginning of its buffer. 
  * Should be called before initially using a string builder with this module's procedures.
  */
@@ -12,6 +45,65 @@ void string_builder_reset(struct StringBuilder *sb) {
 	sb->remaining = sb->size;
 }
 
+/* Returns the number of chars appended since the last reset, not including the null-terminator. */
+uint32_t string_builder_length(struct StringBuilder *sb) {
+	return sb->ptr - sb->buf;
+}
+
+/* Makes sure there is room for 'length' more chars plus the null-terminator, growing the buffer if the string builder
+ * is growable. Returns whether there is room for all of them (otherwise what is appended gets cut off).
+ */
+static bool make_room(struct StringBuilder *sb, uint32_t length) {
+	if (length < sb->remaining) return true;
+	if (!sb->growable) return false;
+
+	const uint32_t used = sb->ptr - sb->buf;
+	uint32_t size = sb->size == 0 ? GROWABLE_MIN_SIZE : sb->size;
+	while (size - used <= length) {
+		size *= 2;
+	}
+	sb->buf = realloc(sb->buf, size);
+	sb->ptr = sb->buf + used;
+	sb->remaining = size - used;
+	sb->size = size;
+	return true;
+}
+
+/* Appends 'length' chars of 'append' (which needn't be null-terminated), keeping the built string null-terminated.
+ * Anything that doesn't fit in a buffer that isn't growable is cut off.
+ */
+void string_builder_append(struct StringBuilder *sb, const char *append, uint32_t length) {
+	if (!make_room(sb, length)) {
+		if (sb->remaining == 0) return;
+		length = sb->remaining - 1;
+	}
+	memcpy(sb->ptr, append, length);
+	sb->ptr[length] = '\0';
+	sb->remaining -= length;
+	sb->ptr = sb->ptr + length;
+}
+
+/* See string_builder_append(). The same but appends a single char. */
+void string_builder_append_char(struct StringBuilder *sb, char append) {
+	if (!make_room(sb, 1)) return;
+	sb->ptr[0] = append;
+	sb->ptr[1] = '\0';
+	sb->remaining--;
+	sb->ptr++;
+}
+
+/* See string_builder_append(). The same but appends the char 'count' times. */
+void string_builder_append_repeated(struct StringBuilder *sb, char append, uint32_t count) {
+	if (!make_room(sb, count)) {
+		if (sb->remaining == 0) return;
+		count = sb->remaining - 1;
+	}
+	memset(sb->ptr, append, count);
+	sb->ptr[count] = '\0';
+	sb->remaining -= count;
+	sb->ptr = sb->ptr + count;
+}
+
 /* Appends the Writes the string's chars to the memory pointed to by buf. Writes no more than in buf_remaining.
  * Used for quickly building a string in a char buffer by appending.
  * Returns the pointer to the null-terminator of the newly written string in buf.
@@ -20,25 +112,28 @@ void string_builder_reset(struct StringBuilder *sb) {
  * buf_remaining - a pointer to a counter to track how many characters are left in buf. Must not be NULL.
  * append - null-terminated string.
  */
-void string_builder_append_string(struct StringBuilder *sb, char *append) {
-	if (sb->remaining == 0) return;
-
-	uint32_t remaining = sb->remaining - 1;
-	uint32_t i;
-	for (i = 0; i < remaining && append[i] != '\0'; i++) {
-		sb->ptr[i] = append[i];
-	}
-	sb->ptr[i] = '\0';
-	sb->remaining -= i;
-	sb->ptr = sb->ptr + i;
+void string_builder_append_string(struct StringBuilder *sb, const char *append) {
+	string_builder_append(sb, append, strlen(append));
 }
 
-/* See string_builder_append_string(). The same but writes an unsigned int. */
+/* See string_builder_append_string(). The same but writes an unsigned int, in decimal. */
 void string_builder_append_uint32(struct StringBuilder *sb, uint32_t append) {
-	if (sb->remaining == 0) return;
+	char digits[10]; // 0 .. 2^32 - 1 is at most 10 digits
+	char *start = digits + sizeof(digits);
 
-	const uint32_t tmp_buf_size = 11;
-	char tmp_buf[11]; // 0 .. 2^32 - 1 is at most 10 digits, +1 for null term
-	snprintf(tmp_buf, tmp_buf_size, "%u", append);
-	string_builder_append_string(sb, tmp_buf);
+	// two digits at a time from the end, saving most of the divisions
+	while (append >= 100) {
+		const uint32_t pair = append % 100;
+		append /= 100;
+		start -= 2;
+		memcpy(start, &digit_pairs[pair * 2], 2);
+	}
+	if (append >= 10) {
+		start -= 2;
+		memcpy(start, &digit_pairs[append * 2], 2);
+	} else {
+		start--;
+		*start = '0' + append;
+	}
+	string_builder_append(sb, start, digits + sizeof(digits) - start);
 }
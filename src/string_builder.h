@@ -8,17 +8,26 @@
 #define __STRING_BUILDER_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // make sure to call string_builder_reset() before first using this in any procedures
+// (or string_builder_init() for one that grows as needed)
 struct StringBuilder {
 	char *buf; // the char buffer to build a string in. (initialized by user)
 	char *ptr; // current pointer into buf, to track where to append.
 	uint32_t remaining; // remaining number of characters in buf that can be written to buf.
 	uint32_t size; // number of available characters in buf. (initializd by user)
+	bool growable; // whether buf is heap memory that is grown to fit whatever is appended, instead of cutting it off. (initialized by user)
 };
 
+void string_builder_init(struct StringBuilder *sb, uint32_t size);
+void string_builder_free(struct StringBuilder *sb);
 void string_builder_reset(struct StringBuilder *sb);
-void string_builder_append_string(struct StringBuilder *sb, char *append);
+uint32_t string_builder_length(struct StringBuilder *sb);
+void string_builder_append(struct StringBuilder *sb, const char *append, uint32_t length);
+void string_builder_append_char(struct StringBuilder *sb, char append);
+void string_builder_append_repeated(struct StringBuilder *sb, char append, uint32_t count);
+void string_builder_append_string(struct StringBuilder *sb, const char *append);
 void string_builder_append_uint32(struct StringBuilder *sb, uint32_t append);
 
 #endif
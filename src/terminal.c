@@ -3,67 +3,140 @@
  * 
  * Functions for drawing to the terminal window.
  * See https://en.wikipedia.org/wiki/ANSI_escape_code#DL
+ *
+ * Nothing is written to the terminal right away: everything drawn is appended to a frame buffer, which
+ * terminal_flush() writes out with a single write() once the frame is complete (e.g. before waiting for input).
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <termios.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 
 #include "terminal.h"
+#include "string_builder.h"
 
 static struct termios terminal;
+static struct termios original_terminal;
+static struct StringBuilder frame = {.growable = true}; // everything drawn since the last flush. grows to fit a whole frame
+
+static void terminal_restore(void);
+static void write_sequence(uint32_t n, char final);
 
 void terminal_init() {
 	// disable automatic echoing of input characters to terminal and let us read them as they are typed (not waiting for user to press enter)
 	tcgetattr(STDIN_FILENO, &terminal);
+	original_terminal = terminal;
 	terminal.c_lflag &= ~(ICANON | ECHO);
 	tcsetattr(STDIN_FILENO, TCSANOW, &terminal);
+
+	// don't let stdio read ahead, so that poll() on stdin sees every char not yet read
+	setvbuf(stdin, NULL, _IONBF, 0);
+
+	// have pasted text arrive between \033[200~ and \033[201~, so it can be told apart from typing
+	terminal_write_string("\033[?2004h");
+	atexit(&terminal_restore);
+}
+
+/* Puts the terminal back the way it was before terminal_init(). */
+static void terminal_restore(void) {
+	terminal_write_string("\033[?2004l");
+	terminal_flush();
+	tcsetattr(STDIN_FILENO, TCSANOW, &original_terminal);
+}
+
+/* Writes everything drawn since the last flush to the terminal, all at once. */
+void terminal_flush() {
+	const char *text = frame.buf;
+	size_t length = string_builder_length(&frame);
+	while (length > 0) {
+		const ssize_t written = write(STDOUT_FILENO, text, length);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			break; // the terminal is gone. nothing more can be shown
+		}
+		text += written;
+		length -= written;
+	}
+	string_builder_reset(&frame);
+}
+
+/* Draws 'length' chars of text at the cursor. */
+void terminal_write(const char *text, size_t length) {
+	string_builder_append(&frame, text, length);
+}
+
+void terminal_write_char(char c) {
+	string_builder_append_char(&frame, c);
+}
+
+void terminal_write_string(const char *string) {
+	string_builder_append_string(&frame, string);
+}
+
+void terminal_write_uint32(uint32_t n) {
+	string_builder_append_uint32(&frame, n);
+}
+
+void terminal_write_spaces(uint32_t count) {
+	string_builder_append_repeated(&frame, ' ', count);
+}
+
+/* Appends the control sequence with a single parameter, e.g. \033[5A. */
+static void write_sequence(uint32_t n, char final) {
+	string_builder_append(&frame, "\033[", 2);
+	string_builder_append_uint32(&frame, n);
+	string_builder_append_char(&frame, final);
 }
 
 void terminal_clear() {
-	printf("\033[2J");
+	terminal_write_string("\033[2J");
 }
 
 void terminal_clear_line() {
-	printf("\033[2K");
+	terminal_write_string("\033[2K");
 }
 
 void terminal_clear_line_from_cursor() {
-	printf("\033[0K");
+	terminal_write_string("\033[0K");
 }
 
 void terminal_cursor_home() {
-	printf("\033[H");
+	terminal_write_string("\033[H");
 }
 
 void terminal_cursor_set(uint32_t line, uint32_t column) {
-	printf("\033[%u;%uH", line, column);
+	write_sequence(line, ';');
+	string_builder_append_uint32(&frame, column);
+	string_builder_append_char(&frame, 'H');
 }
 
 void terminal_cursor_set_line(uint32_t line) {
-	printf("\033[%u;0H", line);
+	write_sequence(line, ';');
+	string_builder_append(&frame, "0H", 2);
 }
 
 void terminal_cursor_set_column(uint32_t column) {
-	printf("\033[%uG", column);
+	write_sequence(column, 'G');
 }
 
 void terminal_cursor_up(uint32_t n) {
-	printf("\033[%uA", n);
+	write_sequence(n, 'A');
 }
 
 void terminal_cursor_down(uint32_t n) {
-	printf("\033[%uB", n);
+	write_sequence(n, 'B');
 }
 
 void terminal_cursor_right(uint32_t n) {
-	printf("\033[%uC", n);
+	write_sequence(n, 'C');
 }
 
 void terminal_cursor_left(uint32_t n) {
-	printf("\033[%uD", n);
+	write_sequence(n, 'D');
 }
 
 /* Attempts to get the current window size.
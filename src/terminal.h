@@ -5,9 +5,17 @@
 #ifndef __TERMINAL_H__
 #define __TERMINAL_H__
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 void terminal_init();
+void terminal_flush();
+void terminal_write(const char *text, size_t length);
+void terminal_write_char(char c);
+void terminal_write_string(const char *string);
+void terminal_write_uint32(uint32_t n);
+void terminal_write_spaces(uint32_t count);
 void terminal_clear();
 void terminal_clear_line();
 void terminal_clear_line_from_cursor();
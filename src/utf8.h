@@ -0,0 +1,35 @@
+/* utf8.h
+ * UTF-8 kernels over a single contiguous span of text: validating and measuring display columns.
+ * Runs of ASCII, by far the most common text, are handled a whole vector at a time with SSE2/AVX2 where the CPU
+ * supports it (checked at runtime), with a portable fallback.
+ */
+
+#ifndef __UTF8_H__
+#define __UTF8_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define UTF8_MAX_LENGTH 4 // longest encoding of a code point, in bytes
+#define UTF8_REPLACEMENT 0xFFFD // code point decoded in place of bytes that aren't valid UTF-8
+
+// progress of measuring the display columns of text given in pieces (e.g. the spans of a piece table),
+// where a char may be cut off at the end of one piece and continue in the next
+struct Utf8Measure {
+	size_t column; // display column after the text measured so far (0-based), not counting a cut off char
+	unsigned char partial[UTF8_MAX_LENGTH]; // start of a char cut off at the end of the last piece
+	uint8_t partial_length;
+	bool plain; // whether every char so far was ASCII other than a tab, so each byte is exactly one column
+};
+
+bool utf8_validate(const char *text, size_t length);
+size_t utf8_decode(const char *text, size_t length, uint32_t *codepoint);
+int utf8_width(uint32_t codepoint);
+size_t utf8_next_column(uint32_t codepoint, size_t column);
+
+void utf8_measure_init(struct Utf8Measure *measure, size_t column);
+void utf8_measure(struct Utf8Measure *measure, const char *text, size_t length);
+size_t utf8_measure_finish(struct Utf8Measure *measure);
+
+#endif
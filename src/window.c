@@ -7,7 +7,12 @@
 #include <string.h>
 
 #include "window.h"
-#include "terminal.h"
+#include "screen.h"
+#include "utf8.h"
+#include "config.h"
+
+static index_t rows_between(struct Window *window, index_t line, index_t row, index_t to_line, index_t to_row, index_t limit);
+static void keep_top_row(struct Window *window);
 
 void window_init(struct Window *window) {
 	window->above = NULL;
@@ -18,70 +23,413 @@ void window_init(struct Window *window) {
 	window->y = 0;
 	window->width = 0;
 	window->height = 0;
+	window->top_line = 0;
+	window->top_row = 0;
+	window->left_column = 0;
+	window->wrap = WRAP_LINES;
+	filebuf_init(&window->filebuf);
 
-	struct Editor editor;
-	editor.mode = MODE_COMMAND;
-	editor.info_message = NULL;
-	editor.file_index = 0;
-	editor.cursor_line = 1;
-	editor.cursor_column = 1;
-	window->editor = editor;
+	// set up in place, since the highlighting and wrapping hand the file buffer their own changes to record edits into
+	struct Editor *editor = &window->editor; // alias
+	editor->mode = MODE_COMMAND;
+	editor->info_message = NULL;
+	editor->file_index = 0;
+	editor->cursor_line = 1;
+	editor->cursor_column = 1;
+	editor->cursor_column_jump = 1;
+	filebuf_cursor_init(&editor->cursor, &window->filebuf, 0);
+	line_layout_init(&editor->layout, &window->filebuf);
+	wrap_layout_init(&editor->wrap, &window->filebuf);
+	highlight_init(&editor->highlight, &window->filebuf);
+	editor->extra_cursors = NULL;
+	editor->extra_cursor_count = 0;
+	editor->extra_cursor_size = 0;
 }
 
 /* Simply draws the character to the screen at the current cursor position.
  * Does not move the cursor.
  */
 inline void window_draw_char(char c) {
-	printf("%c", c);
+	screen_write_char(c);
 }
 
 /* Draws 'length' number of characters starting at the index in the file and
  * at the current cursor position in the given window.
  */
 void window_draw_chars(struct Window *window, index_t file_index, index_t length) {
-	struct FileBuf *fb = &window->filebuf; // alias
-	index_t relative_index;
-	struct PieceTableEntry *at = filebuf_entry_at(fb, file_index, &relative_index);
-	if (at == NULL) return; // empty filebuf
-	char *text = filebuf_get_text(fb, at);
-	for (int count = 0; count < length; count++) {
-		if (relative_index >= at->length) {
-			if (at->next == NULL) break;
-
-			relative_index = 0;
-			at = at->next;
-			text = filebuf_get_text(fb, at);
+	struct FileBufCursor cursor = window->editor.cursor; // starting from the editor's position keeps the seek short
+	filebuf_cursor_seek(&cursor, file_index);
+	index_t span_length;
+	const char *span;
+	while (length > 0 && (span = filebuf_cursor_next_span(&cursor, &span_length)) != NULL) {
+		if (span_length > length) {
+			span_length = length;
 		}
-
-		window_draw_char(text[relative_index]);
-		terminal_cursor_right(1);
+		screen_write(span, span_length);
+		length -= span_length;
 	}
 }
 
 /* Draws characters starting at the file index until either a new line character is
  * encountered or the end of the file is, whichever comes first.
- * This is done at the current cursor position in the given window.
+ * This is done on the screen line the cursor is on, with the char at the file index at the (zero-based) display column
+ * given within its line. Only the display columns from left up to right are drawn, at the window's left edge on, and no
+ * more of the line is looked at than is needed to draw that, however long the line is. Where that ends before the
+ * window's right edge (a wrapped row cut short by a char that didn't fit, see window_row_start()), the rest is cleared.
+ * Tabs are drawn as the spaces up to the next tab stop, so they line up the same as the editor measures them.
+ * Each token is drawn in its syntax highlighting color.
+ */
+void window_draw_line(struct Window *window, index_t file_index, size_t column, size_t left, size_t right) {
+	if (column >= right) return;
+	screen_cursor_set_column(column < left ? 1 : column - left + 1);
+
+	struct FileBufCursor cursor = window->editor.cursor; // starting from the editor's position keeps the seek short
+	filebuf_cursor_seek(&cursor, file_index);
+	struct Utf8Measure measure;
+	utf8_measure_init(&measure, column);
+	bool visible = column >= left; // whether the chars reached are within the window
+	index_t index = file_index; // of the char at run
+	struct HighlightLexer lexer;
+	highlight_lexer_init(&lexer, &window->editor.highlight, file_index);
+	index_t token_end = lexer.index; // the color set is that of the chars up to here
+	index_t span_length;
+	const char *span;
+	while (measure.column < right && (span = filebuf_cursor_next_span(&cursor, &span_length)) != NULL) {
+		const char *run = span;
+		const char *end = span + span_length;
+		while (run < end && measure.column < right) {
+			size_t length = end - run;
+			if (!visible) {
+				// left of the window, so only measured. no char takes more columns than a tab, so measuring this many
+				// chars can't skip past any that are within the window
+				size_t skipped = left > measure.column ? (left - measure.column) / TAB_WIDTH : 0;
+				if (skipped == 0) {
+					skipped = 1;
+				}
+				if (skipped < length) {
+					length = skipped;
+				}
+				if (memchr(run, '\n', length) != NULL) goto __window_draw_line_cleanup__; // the line ends before the window
+				utf8_measure(&measure, run, length);
+				run += length;
+				index += length;
+				if (measure.column >= left && measure.partial_length == 0) {
+					visible = true;
+					screen_write_spaces(measure.column - left); // what is within the window of a wide char or tab cut off by it
+				}
+				continue;
+			}
+
+			// runs within a token between tabs are drawn as they are
+			if (index >= token_end) {
+				uint8_t color = HIGHLIGHT_COLOR_DEFAULT;
+				while (index >= token_end && !highlight_lexer_at_end(&lexer)) {
+					color = highlight_lexer_next(&lexer);
+					token_end = lexer.index;
+				}
+				if (index >= token_end) {
+					token_end = (index_t) -1; // past the end of the line
+				}
+				window_set_char_color(color);
+			}
+			if (length > token_end - index) {
+				length = token_end - index;
+			}
+			if (length > (right - measure.column) * UTF8_MAX_LENGTH) {
+				length = (right - measure.column) * UTF8_MAX_LENGTH; // more than could fit
+			}
+			const char *newline = memchr(run, '\n', length);
+			const char *run_end = newline == NULL ? run + length : newline;
+			const char *tab = memchr(run, '\t', run_end - run);
+			if (tab != NULL) {
+				run_end = tab;
+			}
+			screen_write(run, run_end - run);
+			utf8_measure(&measure, run, run_end - run);
+			index += run_end - run;
+			run = run_end;
+			if (run == newline) goto __window_draw_line_cleanup__;
+			if (run == tab) {
+				const size_t tab_column = measure.column;
+				utf8_measure(&measure, tab, 1);
+				screen_write_spaces(measure.column - tab_column);
+				run++;
+				index++;
+			}
+		}
+	}
+
+__window_draw_line_cleanup__:
+	window_set_char_color(SCREEN_COLOR_DEFAULT); // for whatever is drawn next, e.g. typed text
+	if (right - left < window->width) {
+		// runs are drawn whole, so chars past right may have been drawn where the row leaves a gap
+		screen_cursor_set_column(right - left + 1);
+		screen_clear_line_from_cursor();
+	}
+}
+
+/* Redraws the lines of the file within the window from the (zero-based) line given down to the bottom of the window.
+ * Only the lines within the window are looked at, so this costs the same anywhere in a file of any size.
  */
-void window_draw_line(struct Window *window, index_t file_index) {
+void window_draw(struct Window *window, index_t from_line) {
 	struct FileBuf *fb = &window->filebuf; // alias
-	index_t relative_index;
-	struct PieceTableEntry *at = filebuf_entry_at(fb, file_index, &relative_index);
-	if (at == NULL) return; // empty filebuf
-	char *text = filebuf_get_text(fb, at);
-	while (1) {
-		if (relative_index >= at->length) {
-			if (at->next == NULL) break;
-
-			relative_index = 0;
-			at = at->next;
-			text = filebuf_get_text(fb, at);
+	const uint32_t rows = window_rows(window);
+	keep_top_row(window);
+	index_t line = window->top_line;
+	index_t row = window->top_row;
+	uint32_t screen_row = 0;
+	if (from_line > line) {
+		screen_row = rows_between(window, line, row, from_line, 0, rows);
+		line = from_line;
+		row = 0;
+	}
+	index_t line_start;
+	bool in_file = filebuf_line_to_offset(fb, line, &line_start);
+	for (; screen_row < rows; screen_row++) {
+		screen_cursor_set(window->y + screen_row + 1, 1);
+		screen_clear_line();
+		if (!in_file) continue;
+		if (window->wrap) {
+			index_t offset;
+			const size_t left = window_row_start(window, line, row, &offset);
+			index_t next_offset;
+			const size_t right = row + 1 < window_line_rows(window, line) ? window_row_start(window, line, row + 1, &next_offset) : left + window->width;
+			window_draw_line(window, line_start + offset, left, left, right);
+		} else {
+			window_draw_line(window, line_start, 0, window->left_column, window->left_column + window->width);
+		}
+		if (!window_next_row(window, &line, &row)) {
+			in_file = false;
+		} else if (row == 0) {
+			filebuf_line_to_offset(fb, line, &line_start);
+		}
+	}
+}
+
+/* Returns the number of rows of the file the window shows (all of it but the info line). */
+uint32_t window_rows(struct Window *window) {
+	return window->height > 1 ? window->height - 1 : 1;
+}
+
+/* Returns the number of rows the (zero-based) line takes up in the window: 1, unless the window wraps lines. */
+index_t window_line_rows(struct Window *window, index_t line) {
+	if (!window->wrap) return 1;
+	return wrap_layout_rows(&window->editor.wrap, line, window->width);
+}
+
+/* Returns the display column the row of the (zero-based) line starts at, and sets offset to the chars from the start
+ * of the line to the row's first char. The start of the line, unless the window wraps lines.
+ * A wrapped row holds the chars that fit within the window's width whole, so it may end a little short of it.
+ */
+size_t window_row_start(struct Window *window, index_t line, index_t row, index_t *offset) {
+	if (!window->wrap) {
+		*offset = 0;
+		return 0;
+	}
+	return wrap_layout_row_start(&window->editor.wrap, line, window->width, row, offset);
+}
+
+/* Moves the (zero-based) line and row to the row below it in the window. Returns false if it is the last row of the file. */
+bool window_next_row(struct Window *window, index_t *line, index_t *row) {
+	if (*row + 1 < window_line_rows(window, *line)) {
+		(*row)++;
+		return true;
+	}
+	if (*line + 1 >= filebuf_line_count(&window->filebuf)) return false;
+	(*line)++;
+	*row = 0;
+	return true;
+}
+
+/* Moves the (zero-based) line and row to the row above it in the window. Returns false if it is the first row of the file. */
+bool window_prev_row(struct Window *window, index_t *line, index_t *row) {
+	if (*row > 0) {
+		(*row)--;
+		return true;
+	}
+	if (*line == 0) return false;
+	(*line)--;
+	*row = window_line_rows(window, *line) - 1;
+	return true;
+}
+
+/* Moves the (zero-based) line and row by count rows (up if negative), stopping at the first or last row of the file.
+ * Lines are stepped over whole, so this costs a lookup per line passed, however many rows each takes.
+ */
+void window_move_rows(struct Window *window, index_t *line, index_t *row, int64_t count) {
+	const index_t line_count = filebuf_line_count(&window->filebuf);
+	if (!window->wrap) {
+		if (count < 0) {
+			*line = (uint64_t) -count > *line ? 0 : *line - (index_t) -count;
+		} else {
+			*line = (uint64_t) count > line_count - 1 - *line ? line_count - 1 : *line + (index_t) count;
+		}
+		*row = 0;
+		return;
+	}
+
+	while (count > 0) {
+		const index_t rows_left = window_line_rows(window, *line) - 1 - *row; // below the row within its line
+		if ((uint64_t) count <= rows_left || *line + 1 >= line_count) {
+			*row += (uint64_t) count < rows_left ? (index_t) count : rows_left;
+			return;
+		}
+		count -= rows_left + 1;
+		(*line)++;
+		*row = 0;
+	}
+	while (count < 0) {
+		if ((uint64_t) -count <= *row || *line == 0) {
+			*row -= (uint64_t) -count < *row ? (index_t) -count : *row;
+			return;
+		}
+		count += *row + 1;
+		(*line)--;
+		*row = window_line_rows(window, *line) - 1;
+	}
+}
+
+/* Returns the file index of the char at the display column within the row (both zero-based) of the line starting at
+ * the file index line_start, or of the row's last char if it is shorter (or the end of the line, for its last row).
+ */
+index_t window_index_in_row(struct Window *window, index_t line_start, index_t line, index_t row, size_t column) {
+	struct LineLayout *layout = &window->editor.layout; // alias
+	index_t offset;
+	const size_t row_column = window_row_start(window, line, row, &offset);
+	if (row + 1 < window_line_rows(window, line)) {
+		index_t next_offset;
+		const size_t next_column = window_row_start(window, line, row + 1, &next_offset);
+		if (row_column + column >= next_column) return line_layout_prev_char(layout, line_start + next_offset);
+	}
+	return line_layout_index_at(layout, line_start, row_column + column);
+}
+
+/* Returns the row of its line the editor's cursor is on (zero-based). Always 0, unless the window wraps lines. */
+index_t window_cursor_row(struct Window *window) {
+	if (!window->wrap) return 0;
+	return wrap_layout_row_at(&window->editor.wrap, window->editor.cursor_line - 1, window->width, window->editor.cursor_column - 1);
+}
+
+/* Sets the display columns of the cursor's line that are shown on the row the cursor is on: from left up to right.
+ * While typing in editor mode, what is typed can be drawn straight onto the screen for as long as the cursor stays within them.
+ */
+void window_cursor_row_bounds(struct Window *window, size_t *left, size_t *right) {
+	if (!window->wrap) {
+		*left = window->left_column;
+		*right = window->left_column + window->width;
+		return;
+	}
+	const index_t line = window->editor.cursor_line - 1;
+	const index_t row = window_cursor_row(window);
+	index_t offset;
+	*left = window_row_start(window, line, row, &offset);
+	*right = row + 1 < window_line_rows(window, line) ? window_row_start(window, line, row + 1, &offset) : *left + window->width;
+}
+
+/* Keeps the display column the cursor is at within its row as the one to go back to when moving up or down
+ * (see Editor.cursor_column_jump).
+ */
+void window_keep_column(struct Window *window) {
+	struct Editor *editor = &window->editor; // alias
+	index_t offset;
+	editor->cursor_column_jump = editor->cursor_column - window_row_start(window, editor->cursor_line - 1, window_cursor_row(window), &offset);
+}
+
+/* Returns whether the editor's cursor is within the part of the file the window shows. */
+bool window_cursor_visible(struct Window *window) {
+	const index_t line = window->editor.cursor_line - 1;
+	const index_t row = window_cursor_row(window);
+	const uint32_t rows = window_rows(window);
+	keep_top_row(window);
+	if (line < window->top_line || line == window->top_line && row < window->top_row) return false;
+	if (rows_between(window, window->top_line, window->top_row, line, row, rows) >= rows) return false;
+	if (window->wrap) return true; // every column is on one row or another
+
+	const size_t column = window->editor.cursor_column - 1;
+	return column >= window->left_column && column - window->left_column < window->width;
+}
+
+/* Scrolls the window to show the editor's cursor, if it isn't within it already. Vertically it scrolls just far enough,
+ * horizontally by half the window's width at a time. The rows still shown are scrolled on screen rather than drawn again.
+ * Returns whether the window scrolled, in which case the caller redraws it (see window_draw()).
+ */
+bool window_scroll_to_cursor(struct Window *window) {
+	if (window_cursor_visible(window)) return false;
+	const uint32_t rows = window_rows(window);
+	const index_t line = window->editor.cursor_line - 1;
+	const index_t row = window_cursor_row(window);
+	const size_t column = window->editor.cursor_column - 1;
+
+	index_t top_line = window->top_line;
+	index_t top_row = window->top_row;
+	if (line < top_line || line == top_line && row < top_row) {
+		top_line = line;
+		top_row = row;
+	} else if (rows_between(window, top_line, top_row, line, row, rows) >= rows) {
+		top_line = line;
+		top_row = row;
+		window_move_rows(window, &top_line, &top_row, -(int64_t) (rows - 1));
+	}
+	size_t left_column = window->left_column;
+	if (!window->wrap && (column < left_column || column - left_column >= window->width)) {
+		left_column = column > window->width / 2 ? column - window->width / 2 : 0;
+	}
+	window_scroll(window, top_line, top_row, left_column);
+	return true;
+}
+
+/* Shows the part of the file from the (zero-based) line, row within it and display column given at the top left of the window.
+ * When only the row changes, by less than the window's height, what is on screen is scrolled to match,
+ * so only the rows uncovered differ once the window is redrawn.
+ */
+void window_scroll(struct Window *window, index_t top_line, index_t top_row, size_t left_column) {
+	const uint32_t rows = window_rows(window);
+	keep_top_row(window);
+	if (left_column == window->left_column && (top_line != window->top_line || top_row != window->top_row)) {
+		const bool down = top_line > window->top_line || top_line == window->top_line && top_row > window->top_row;
+		const index_t distance = down ? rows_between(window, window->top_line, window->top_row, top_line, top_row, rows)
+			: rows_between(window, top_line, top_row, window->top_line, window->top_row, rows);
+		if (distance < rows) {
+			screen_scroll(window->y + 1, window->y + rows, down ? (int32_t) distance : -(int32_t) distance);
 		}
+	}
+	window->top_line = top_line;
+	window->top_row = top_row;
+	window->left_column = left_column;
+}
+
+/* Moves the screen's cursor to where the editor's cursor is within the window. */
+void window_place_cursor(struct Window *window) {
+	const index_t line = window->editor.cursor_line - 1;
+	const index_t row = window_cursor_row(window);
+	index_t offset;
+	const size_t left = window->wrap ? window_row_start(window, line, row, &offset) : window->left_column;
+	keep_top_row(window);
+	const index_t screen_row = rows_between(window, window->top_line, window->top_row, line, row, window_rows(window));
+	screen_cursor_set(window->y + screen_row + 1, window->editor.cursor_column - left);
+}
 
-		char c = text[relative_index];
-		if (c == '\n') return;
-		window_draw_char(c);
-		//terminal_cursor_right(1);
-		relative_index++;
+/* Returns how many rows down the window the second (zero-based) line and row are from the first, counting no further
+ * than limit. 0 if the second is above the first.
+ */
+static index_t rows_between(struct Window *window, index_t line, index_t row, index_t to_line, index_t to_row, index_t limit) {
+	index_t count = 0;
+	while (line < to_line) {
+		count += window_line_rows(window, line) - row;
+		if (count >= limit) return limit;
+		line++;
+		row = 0;
+	}
+	if (line > to_line || to_row < row) return 0;
+	count += to_row - row;
+	return count < limit ? count : limit;
+}
+
+/* Keeps the window's top row within the rows of its top line, which an edit or a change of width may have left it past. */
+static void keep_top_row(struct Window *window) {
+	const index_t rows = window_line_rows(window, window->top_line);
+	if (window->top_row >= rows) {
+		window->top_row = rows - 1;
 	}
 }
 
@@ -97,7 +445,7 @@ void window_draw_info_line(struct Window *window) {
 	int written_chars;
 
 	// cursor position
-	written_chars = snprintf(buf, chars_remaining, "%u,%u (%u)", 
+	written_chars = snprintf(buf, chars_remaining, "%" PRI_INDEX ",%" PRI_INDEX " (%" PRI_INDEX ")", 
 		window->editor.cursor_line, window->editor.cursor_column, window->editor.file_index);
 	if (written_chars > chars_remaining) goto __window_draw_info_line_cleanup__;
 	chars_remaining -= written_chars;
@@ -111,6 +459,14 @@ void window_draw_info_line(struct Window *window) {
 		chars_count += written_chars;
 	}
 
+	// number of cursors, if there are several
+	if (window->editor.extra_cursor_count > 0) {
+		written_chars = snprintf(buf + chars_count, chars_remaining, " [%" PRIu32 " CURSORS]", window->editor.extra_cursor_count + 1);
+		if (written_chars > chars_remaining) goto __window_draw_info_line_cleanup__;
+		chars_remaining -= written_chars;
+		chars_count += written_chars;
+	}
+
 	// any info message
 	if (window->editor.info_message != NULL) {
 		snprintf(buf + chars_count, chars_remaining, " %s", window->editor.info_message);
@@ -118,18 +474,17 @@ void window_draw_info_line(struct Window *window) {
 
 __window_draw_info_line_cleanup__:
 	// print whatever text we can display to the line and clear the rest of it
-	terminal_cursor_set(window->height, 0);
-	printf("%s", buf);
-	terminal_clear_line_from_cursor();
+	screen_cursor_set(window->height, 0);
+	screen_write_string(buf);
+	screen_clear_line_from_cursor();
 
 	// restore user cursor position
-	terminal_cursor_set(window->editor.cursor_line, window->editor.cursor_column); 
+	window_place_cursor(window);
 }
 
-/* Sets the color for any characters drawn to the terminal later. */
-inline void window_set_char_color(int color) {
-	// FIXME only sets color to red currently
-	printf("\033[0;31m");
+/* Sets the color for any characters drawn to the terminal later (see SCREEN_COLOR_DEFAULT). */
+inline void window_set_char_color(uint8_t color) {
+	screen_set_color(color);
 }
 
 /* Splits the window evenly and adds a new window below the current window.
@@ -6,19 +6,30 @@
 #define __WINDOW_H__
 
 #include "filebuf.h"
+#include "line_layout.h"
+#include "wrap_layout.h"
+#include "highlight.h"
 
 enum editor_modes {
 	MODE_COMMAND,
-	MODE_EDITOR
+	MODE_EDITOR,
+	MODE_SEARCH // typing what to search for on the info line
 };
 
 // editor and display data for a currently edited file and window
 struct Editor {
 	char *info_message; // current message being displayed on info line. NULL means no message.
 	index_t file_index; // current position in file
-	uint32_t cursor_line; // cursor x within terminal
-	uint32_t cursor_column; // cursor y within terminal 
-	uint32_t cursor_column_jump; // when moving to a line that has less columns, jump to it's last char, but save the char position here for jumping back to same char position on lines that have enough columns
+	index_t cursor_line; // line of the file the cursor is on (1-based). see Window.top_line for where that is on screen
+	index_t cursor_column; // display column within the line (1-based), so wide chars and tabs count for more than one
+	index_t cursor_column_jump; // display column within its row (1-based) the cursor is kept to when moving up or down (see window_keep_column()). when moving to a row that has less columns, jump to it's last char, but save the column here for jumping back to it on rows that have enough columns
+	struct FileBufCursor cursor; // kept around file_index, so reading the text near it doesn't start from the root of the table
+	struct LineLayout layout; // display columns of the lines the cursor was on lately
+	struct WrapLayout wrap; // rows long lines are wrapped onto, when the window wraps them
+	struct Highlight highlight; // colors of the file's text
+	index_t *extra_cursors; // file indices of any cursors besides the one at file_index, sorted. whatever is typed goes in at each of them too
+	uint32_t extra_cursor_count;
+	uint32_t extra_cursor_size;
 	int8_t mode; // current editor mode
 };
 
@@ -33,6 +44,10 @@ struct Window {
 	uint32_t y;
 	uint32_t width; // number of columns 
 	uint32_t height; // number of lines
+	index_t top_line; // first line of the file shown (0-based). only the lines that fit below it are ever drawn
+	index_t top_row; // first row of top_line shown, when it is wrapped onto several (0-based)
+	size_t left_column; // first display column shown, when long lines are scrolled to the side
+	bool wrap; // whether lines wider than the window carry on over the rows below, rather than being scrolled to the side
 };
 
 void window_init(struct Window *window);
@@ -41,9 +56,25 @@ void window_split_horizontally(struct Window *window, struct Window *new_window)
 
 void window_draw_char(char c);
 void window_draw_chars(struct Window *window, index_t file_index, index_t length);
-void window_draw_line(struct Window *window, index_t file_index);
+void window_draw_line(struct Window *window, index_t file_index, size_t column, size_t left, size_t right);
+void window_draw(struct Window *window, index_t from_line);
 void window_draw_info_line(struct Window *window);
 
-void window_set_char_color(int color);
+uint32_t window_rows(struct Window *window);
+index_t window_line_rows(struct Window *window, index_t line);
+size_t window_row_start(struct Window *window, index_t line, index_t row, index_t *offset);
+bool window_next_row(struct Window *window, index_t *line, index_t *row);
+bool window_prev_row(struct Window *window, index_t *line, index_t *row);
+void window_move_rows(struct Window *window, index_t *line, index_t *row, int64_t count);
+index_t window_index_in_row(struct Window *window, index_t line_start, index_t line, index_t row, size_t column);
+index_t window_cursor_row(struct Window *window);
+void window_cursor_row_bounds(struct Window *window, size_t *left, size_t *right);
+void window_keep_column(struct Window *window);
+bool window_cursor_visible(struct Window *window);
+bool window_scroll_to_cursor(struct Window *window);
+void window_scroll(struct Window *window, index_t top_line, index_t top_row, size_t left_column);
+void window_place_cursor(struct Window *window);
+
+void window_set_char_color(uint8_t color);
 
 #endif
@@ -0,0 +1,100 @@
+/* worker_pool.c
+ * A fixed set of threads that all run the same piece of work together (a parallel for).
+ * Work is expected to divide itself up, e.g. by having each thread claim chunks from a shared atomic counter.
+ */
+
+#include <stdlib.h>
+#include <signal.h>
+
+#include "worker_pool.h"
+
+/* Thread body: waits for each new piece of work and runs it. */
+static void *worker_main(void *arg) {
+	struct WorkerPool *pool = arg;
+	uint64_t seen_generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->stopping && pool->generation == seen_generation) {
+			pthread_cond_wait(&pool->work_ready, &pool->lock);
+		}
+		if (pool->stopping) break;
+		seen_generation = pool->generation;
+		void (*work)(void *) = pool->work;
+		void *work_arg = pool->work_arg;
+		pthread_mutex_unlock(&pool->lock);
+
+		work(work_arg);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->busy_count--;
+		if (pool->busy_count == 0) {
+			pthread_cond_signal(&pool->work_done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Starts the pool's threads.
+ * thread_count - number of threads besides the calling one, which also takes part in worker_pool_run(). may be 0.
+ */
+void worker_pool_init(struct WorkerPool *pool, int thread_count) {
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_ready, NULL);
+	pthread_cond_init(&pool->work_done, NULL);
+	pool->work = NULL;
+	pool->work_arg = NULL;
+	pool->generation = 0;
+	pool->busy_count = 0;
+	pool->stopping = false;
+	pool->threads = malloc(sizeof(pthread_t) * (thread_count > 0 ? thread_count : 1));
+	pool->thread_count = 0;
+
+	// signals are left to the input thread, whose poll() their handlers wake
+	sigset_t all_signals;
+	sigset_t signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &signals);
+	for (int i = 0; i < thread_count; i++) {
+		if (pthread_create(&pool->threads[i], NULL, &worker_main, pool) != 0) break;
+		pool->thread_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &signals, NULL);
+}
+
+/* Stops and joins the pool's threads. Must not be called while work is running. */
+void worker_pool_free(struct WorkerPool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->thread_count; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(pool->threads);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_ready);
+	pthread_cond_destroy(&pool->work_done);
+}
+
+/* Runs work(arg) on every thread of the pool and on the calling thread, returning once all of them have returned.
+ * Only one thread may run work on a pool at a time.
+ */
+void worker_pool_run(struct WorkerPool *pool, void (*work)(void *arg), void *arg) {
+	pthread_mutex_lock(&pool->lock);
+	pool->work = work;
+	pool->work_arg = arg;
+	pool->busy_count = pool->thread_count;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	work(arg);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy_count > 0) {
+		pthread_cond_wait(&pool->work_done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,30 @@
+/* worker_pool.h
+ * A fixed set of threads that all run the same piece of work together (a parallel for),
+ * for splitting large jobs like searching a whole file across every core.
+ */
+
+#ifndef __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct WorkerPool {
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready; // signalled when new work is handed out
+	pthread_cond_t work_done; // signalled when the last worker finishes the current work
+	void (*work)(void *arg); // current work, run by every worker
+	void *work_arg;
+	uint64_t generation; // incremented each time work is handed out
+	int thread_count;
+	int busy_count; // workers still running the current work
+	bool stopping;
+};
+
+void worker_pool_init(struct WorkerPool *pool, int thread_count);
+void worker_pool_free(struct WorkerPool *pool);
+void worker_pool_run(struct WorkerPool *pool, void (*work)(void *arg), void *arg);
+
+#endif
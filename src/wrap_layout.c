@@ -0,0 +1,243 @@
+/* wrap_layout.c
+ * The rows long lines of a file buffer are wrapped onto, cached per line.
+ *
+ * A line is laid out the first time any of its rows is needed at a width: a row is filled with chars for as long as
+ * the next one fits within it whole, so a wide char or tab that would be cut off by the end of a row starts the next one
+ * instead. The start of each row is kept as a break, looked up by binary search, so moving through the rows of a line
+ * costs the same however long it is. Plain lines (only ASCII, no tabs) keep no breaks, as their rows are found by
+ * division.
+ *
+ * Edits are taken from the file buffer (see filebuf_watch_changes()) as a range of changed text: only the lines within it
+ * are dropped, and the lines after it move along with their line numbers. A line laid out for another width (e.g. after
+ * the window is resized) is laid out again when it is next looked up, so only the lines looked at are ever laid out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wrap_layout.h"
+#include "utf8.h"
+
+static struct WrapLine *find_line(struct WrapLayout *layout, index_t line, uint32_t width);
+static void lay_out_line(struct WrapLayout *layout, struct WrapLine *wrapped, index_t line, uint32_t width);
+static void add_break(struct WrapLine *wrapped, index_t offset, size_t column);
+static void take_change(struct WrapLayout *layout);
+
+void wrap_layout_init(struct WrapLayout *layout, struct FileBuf *fb) {
+	layout->fb = fb;
+	layout->line_count = filebuf_line_count(fb);
+	for (uint32_t i = 0; i < WRAP_LAYOUT_LINES; i++) {
+		layout->lines[i].breaks = NULL;
+		layout->lines[i].break_count = 0;
+		layout->lines[i].break_size = 0;
+		layout->lines[i].width = 0;
+	}
+	if (!filebuf_watch_changes(fb, &layout->change)) {
+		fprintf(stderr, "Out of room for watching the file's edits!\n"); // the cached lines would never be brought up to date
+		exit(EXIT_FAILURE);
+	}
+}
+
+void wrap_layout_free(struct WrapLayout *layout) {
+	filebuf_unwatch_changes(layout->fb, &layout->change);
+	for (uint32_t i = 0; i < WRAP_LAYOUT_LINES; i++) {
+		free(layout->lines[i].breaks);
+		layout->lines[i].breaks = NULL;
+		layout->lines[i].break_size = 0;
+		layout->lines[i].width = 0;
+	}
+}
+
+/* Returns the number of rows the (zero-based) line takes up when wrapped to fit within the width. At least 1. */
+index_t wrap_layout_rows(struct WrapLayout *layout, index_t line, uint32_t width) {
+	const struct WrapLine *wrapped = find_line(layout, line, width);
+	if (wrapped->plain) return wrapped->columns / wrapped->width + 1;
+	return wrapped->break_count + 1;
+}
+
+/* Returns which row of the (zero-based) line the display column within it is on, when wrapped to fit within the width.
+ * Columns past the end of the line are on its last row.
+ */
+index_t wrap_layout_row_at(struct WrapLayout *layout, index_t line, uint32_t width, size_t column) {
+	const struct WrapLine *wrapped = find_line(layout, line, width);
+	if (wrapped->plain) {
+		return (column < wrapped->columns ? column : wrapped->columns) / wrapped->width;
+	}
+
+	// the number of breaks at or before the column
+	index_t low = 0;
+	index_t high = wrapped->break_count;
+	while (low < high) {
+		const index_t middle = low + (high - low) / 2;
+		if (wrapped->breaks[middle].column <= column) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+/* Returns the display column the row of the (zero-based) line starts at, when wrapped to fit within the width,
+ * and sets offset to the chars from the start of the line to the row's first char. Rows past the last are taken as the last.
+ */
+size_t wrap_layout_row_start(struct WrapLayout *layout, index_t line, uint32_t width, index_t row, index_t *offset) {
+	const struct WrapLine *wrapped = find_line(layout, line, width);
+	if (wrapped->plain) {
+		const index_t last_row = wrapped->columns / wrapped->width;
+		*offset = (row < last_row ? row : last_row) * wrapped->width;
+		return *offset;
+	}
+	if (row == 0 || wrapped->break_count == 0) {
+		*offset = 0;
+		return 0;
+	}
+	const struct WrapBreak *row_break = &wrapped->breaks[(row < wrapped->break_count ? row : wrapped->break_count) - 1]; // alias
+	*offset = row_break->offset;
+	return row_break->column;
+}
+
+/* Returns the line's entry laid out for the width, laying it out in place of whichever line shared its entry if it isn't. */
+static struct WrapLine *find_line(struct WrapLayout *layout, index_t line, uint32_t width) {
+	take_change(layout);
+	if (width == 0) {
+		width = 1;
+	}
+	struct WrapLine *wrapped = &layout->lines[line % WRAP_LAYOUT_LINES]; // alias
+	if (wrapped->width != width || wrapped->line != line) {
+		lay_out_line(layout, wrapped, line, width);
+	}
+	return wrapped;
+}
+
+/* Lays out the rows of the whole line into the entry, going through it a char at a time. */
+static void lay_out_line(struct WrapLayout *layout, struct WrapLine *wrapped, index_t line, uint32_t width) {
+	struct FileBuf *fb = layout->fb; // alias
+	index_t start;
+	index_t end; // file index of the line's new-line char, or the end of the file
+	filebuf_line_to_offset(fb, line, &start);
+	if (filebuf_line_to_offset(fb, line + 1, &end)) {
+		end--;
+	} else {
+		end = fb->length;
+	}
+	wrapped->line = line;
+	wrapped->width = width;
+	wrapped->break_count = 0;
+	wrapped->plain = true;
+
+	size_t column = 0;
+	size_t row_end = width; // display column the row being filled ends at
+	index_t skipped = 0; // bytes at the start of the next span that belong to a char cut off at the end of the last one
+	struct FileBufCursor cursor;
+	filebuf_cursor_init(&cursor, fb, start);
+	index_t index = start; // of the start of the span
+	index_t span_length;
+	const char *span;
+	while (index < end && (span = filebuf_cursor_next_span(&cursor, &span_length)) != NULL) {
+		if (span_length > end - index) {
+			span_length = end - index;
+		}
+		index_t i = skipped < span_length ? skipped : span_length;
+		skipped -= i;
+		while (i < span_length) {
+			const unsigned char c = span[i];
+			size_t next_column;
+			size_t char_length = 1;
+			if (c < 0x80 && c != '\t') {
+				next_column = column + 1;
+			} else {
+				wrapped->plain = false;
+				uint32_t codepoint;
+				char_length = utf8_decode(span + i, span_length - i, &codepoint);
+				if (char_length == 0) {
+					// cut off by the end of the span, so finished with the start of the spans after it
+					char joined[UTF8_MAX_LENGTH];
+					size_t joined_length = span_length - i;
+					memcpy(joined, span + i, joined_length);
+					struct FileBufCursor ahead = cursor;
+					int next_char;
+					while (joined_length < UTF8_MAX_LENGTH && index + i + joined_length < end && (next_char = filebuf_cursor_next(&ahead)) != FILEBUF_EOF) {
+						joined[joined_length] = (char) next_char;
+						joined_length++;
+					}
+					char_length = utf8_decode(joined, joined_length, &codepoint);
+					if (char_length == 0) {
+						codepoint = UTF8_REPLACEMENT; // cut off by the end of the line
+						char_length = 1;
+					}
+				}
+				next_column = utf8_next_column(codepoint, column);
+			}
+
+			if (next_column > row_end && column > row_end - width) {
+				// doesn't fit in what is left of the row, so starts the next one
+				add_break(wrapped, index + i - start, column);
+				row_end = column + width;
+			}
+			column = next_column;
+			if (char_length > span_length - i) {
+				skipped = char_length - (span_length - i);
+				i = span_length;
+			} else {
+				i += char_length;
+			}
+		}
+		index += span_length;
+	}
+	if (column >= row_end) {
+		add_break(wrapped, end - start, column); // the row is full, so the cursor at the end of the line goes on a row of its own
+	}
+	wrapped->columns = column;
+	if (wrapped->plain) {
+		wrapped->break_count = 0; // found by division instead
+	}
+}
+
+/* Adds a break to the end of the line's breaks. */
+static void add_break(struct WrapLine *wrapped, index_t offset, size_t column) {
+	if (wrapped->break_count == wrapped->break_size) {
+		wrapped->break_size = wrapped->break_size == 0 ? 16 : wrapped->break_size * 2;
+		wrapped->breaks = realloc(wrapped->breaks, sizeof(struct WrapBreak) * wrapped->break_size);
+	}
+	wrapped->breaks[wrapped->break_count].offset = offset;
+	wrapped->breaks[wrapped->break_count].column = column;
+	wrapped->break_count++;
+}
+
+/* Brings the cached lines up to date with the text changed since the last change was taken from the file buffer:
+ * the lines changed are dropped, and the lines after them are moved to their new line numbers.
+ */
+static void take_change(struct WrapLayout *layout) {
+	struct FileBufChange change;
+	if (!filebuf_take_change(&layout->change, &change)) return;
+	const index_t old_line_count = layout->line_count;
+	layout->line_count = filebuf_line_count(layout->fb);
+
+	index_t first, last, old_last;
+	filebuf_change_lines(layout->fb, &change, old_line_count, &first, &last, &old_last);
+
+	// lines after the change are taken out, then put back at their new line numbers
+	struct WrapLine moved[WRAP_LAYOUT_LINES];
+	uint32_t moved_count = 0;
+	for (uint32_t i = 0; i < WRAP_LAYOUT_LINES; i++) {
+		struct WrapLine *wrapped = &layout->lines[i]; // alias
+		if (wrapped->width == 0 || wrapped->line < first) continue;
+		if (wrapped->line <= old_last) {
+			wrapped->width = 0; // its breaks are kept for whichever line is laid out here next
+		} else if (last != old_last) {
+			moved[moved_count] = *wrapped;
+			moved[moved_count].line = wrapped->line - (old_last + 1) + (last + 1);
+			moved_count++;
+			wrapped->breaks = NULL;
+			wrapped->break_size = 0;
+			wrapped->width = 0;
+		}
+	}
+	for (uint32_t i = 0; i < moved_count; i++) {
+		struct WrapLine *wrapped = &layout->lines[moved[i].line % WRAP_LAYOUT_LINES]; // alias
+		free(wrapped->breaks); // whichever line was here is dropped in its favor
+		*wrapped = moved[i];
+	}
+}
@@ -0,0 +1,51 @@
+/* wrap_layout.h
+ * Soft wrapping: the rows a line of a file buffer takes up on screen when it is wider than the window, carrying on
+ * over the rows below instead of being scrolled to the side. Where each row starts is laid out once per line and width
+ * and cached, so moving through the rows of a long line doesn't measure it again.
+ */
+
+#ifndef __WRAP_LAYOUT_H__
+#define __WRAP_LAYOUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "filebuf.h"
+
+#define WRAP_LAYOUT_LINES 256 // lines whose rows are cached at once. more than are ever on screen
+
+// where a row of a wrapped line starts, for every row but the first
+struct WrapBreak {
+	index_t offset; // chars from the start of the line to the row's first char
+	size_t column; // display column of the row's first char within the line
+};
+
+// the rows of a single line, laid out to fit within a width. plain lines (only ASCII, no tabs) keep no breaks,
+// since each row of them is exactly width chars. a line exactly filling its last row gets an empty row after it,
+// for the cursor at its end
+struct WrapLine {
+	struct WrapBreak *breaks; // in line order
+	index_t break_count;
+	index_t break_size;
+	index_t line; // (zero-based) line of the file laid out
+	size_t columns; // display width of the whole line
+	uint32_t width; // display columns each row fits within. 0 if the entry holds no line
+	bool plain;
+};
+
+// the rows of the lines of a file buffer looked up lately
+struct WrapLayout {
+	struct FileBuf *fb;
+	struct WrapLine lines[WRAP_LAYOUT_LINES]; // each line is kept at lines[line % WRAP_LAYOUT_LINES]
+	struct FileBufChange change; // edits to the text since the cached lines were last brought up to date with it
+	index_t line_count; // lines in the file as of the last change taken from it
+};
+
+void wrap_layout_init(struct WrapLayout *layout, struct FileBuf *fb);
+void wrap_layout_free(struct WrapLayout *layout);
+index_t wrap_layout_rows(struct WrapLayout *layout, index_t line, uint32_t width);
+index_t wrap_layout_row_at(struct WrapLayout *layout, index_t line, uint32_t width, size_t column);
+size_t wrap_layout_row_start(struct WrapLayout *layout, index_t line, uint32_t width, index_t row, index_t *offset);
+
+#endif